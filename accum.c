@@ -0,0 +1,121 @@
+/* accum.c
+
+	Multi-frame averaging and summing into 32-bit accumulators,
+	with the vector kernels of pixkern.c. See accum.h.
+
+*/
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "pixkern.h"
+#include "accum.h"
+
+
+
+/* Add one frame. The first frame after acc_reset() fixes size and depth;
+	later frames must match. Returns 0 or -1. */
+
+int acc_add (accumulator *a, const char *img, int width, int height, int bps, int bits)
+{
+long n;
+
+
+	if (bps != 1 && bps != 2) return -1;
+	n = (long)width * height;
+
+	if (a->frames == 0)
+	{
+		if (!a->sum || (long)a->width * a->height < n)
+		{
+			free (a->sum);
+			a->sum = malloc (n * sizeof (unsigned int));
+			if (!a->sum) return -1;
+		}
+		memset (a->sum, 0, n * sizeof (unsigned int));
+		a->width = width;
+		a->height = height;
+		a->bps = bps;
+		a->bits = (bits > 0 && bits <= 8*bps) ? bits : 8*bps;
+	}
+	else if (width != a->width || height != a->height || bps != a->bps)
+	{
+		fprintf (stderr, "Accumulator: frame of %dx%d, %d bytes/pixel does not match %dx%d, %d\n",
+			width, height, bps, a->width, a->height, a->bps);
+		return -1;
+	}
+	if (a->frames >= ACC_MAX_FRAMES) return -1;
+
+	if (bps == 2)
+		px_acc16 (a->sum, (const unsigned short*)img, n);
+	else
+		px_acc8 (a->sum, (const unsigned char*)img, n);
+	a->frames++;
+
+	return 0;
+}
+
+
+
+/* The result as a new image of out_bps (ACC_OUT_16 or ACC_OUT_FLOAT) bytes
+	per pixel, for the caller to free. *scale is set to the factor between
+	the saved values and the mean of the frames. NULL if nothing was added. */
+
+char *acc_result (accumulator *a, int mode, int out_bps, double *scale)
+{
+unsigned long long top;
+unsigned int divisor;
+long n;
+char *out;
+
+
+	if (a->frames == 0) return NULL;
+	n = (long)a->width * a->height;
+	out = malloc (n * out_bps);
+	if (!out) return NULL;
+
+	if (out_bps == ACC_OUT_FLOAT)
+	{
+		*scale = (mode == ACC_SUM) ? a->frames : 1.0;
+		px_acc_finish_float ((float*)out, a->sum, n, (mode == ACC_SUM) ? 1.0f : 1.0f / a->frames);
+	}
+	else
+	{
+		divisor = a->frames;
+		if (mode == ACC_SUM)
+		{
+			top = (unsigned long long)a->frames * ((1u << a->bits) - 1);
+			for (divisor=1; top / divisor > 65535; divisor*=2)
+				;
+		}
+		*scale = (double)a->frames / divisor;
+		px_acc_finish16 ((unsigned short*)out, a->sum, n, divisor);
+	}
+
+	return out;
+}
+
+
+
+void acc_reset (accumulator *a)
+{
+	a->frames = 0;
+}
+
+
+void acc_free (accumulator *a)
+{
+	free (a->sum);
+	memset (a, 0, sizeof (accumulator));
+}
+
+
+
+int acc_parse_format (const char *name)
+{
+	if (!strcmp (name, "16") || !strcmp (name, "u16")) return ACC_OUT_16;
+	if (!strcmp (name, "float") || !strcmp (name, "32")) return ACC_OUT_FLOAT;
+	return -1;
+}
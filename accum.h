@@ -0,0 +1,39 @@
+#ifndef __ACCUM_H
+#define __ACCUM_H
+
+
+/* Multi-frame accumulation. Frames (8 or 16 bits per pixel, already
+	unpacked and reframed) are added into 32-bit sums as they arrive;
+	only the result is saved. The result is either the mean or the sum,
+	as 16-bit integers or as 32-bit floats (TIFF only). A 16-bit sum that
+	would overflow is divided by the smallest power of two that avoids it.
+	framemeta.scale tells how the saved values relate to the mean.
+*/
+
+#define ACC_MEAN			0
+#define ACC_SUM				1
+
+#define ACC_OUT_16			2		/* Output bytes per pixel, as bps for the writers */
+#define ACC_OUT_FLOAT		4
+
+#define ACC_MAX_FRAMES		32768	/* Sums of 16-bit frames stay below 2^31 */
+
+
+typedef struct
+{
+	unsigned int *sum;
+	int width, height;
+	int bps;					/* Of the frames added */
+	int bits;					/* Significant bits of the frames added */
+	int frames;
+} accumulator;
+
+
+int acc_add (accumulator *a, const char *img, int width, int height, int bps, int bits);
+char *acc_result (accumulator *a, int mode, int out_bps, double *scale);
+void acc_reset (accumulator *a);
+void acc_free (accumulator *a);
+int acc_parse_format (const char *name);
+
+
+#endif
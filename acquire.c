@@ -18,283 +18,2066 @@ https://aravisproject.github.io/docs/aravis-0.8/ArvCamera.html
 */
 
 
-#include <png.h>
 #include <assert.h>
 #include <arv.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
 #include <pigpiod_if2.h>
+#include <tiffio.h>
+
+#include "acquire.h"
+#include "camera.h"
+#include "pipeline.h"
+#include "framemeta.h"
+#include "rawlog.h"
+#include "tlapse.h"
+#include "dio.h"
+#include "preview.h"
+#include "demosaic.h"
+#include "imgview.h"
+#include "tiffstuff.h"
+#include "pixkern.h"
+#include "strobe.h"
+#include "sequence.h"
+#include "accum.h"
+#include "calib.h"
+#include "stats.h"
+#include "autoexp.h"
+#include "timing.h"
+#include "trace.h"
+#include "daemon.h"
+
+
+int debuglevel;			/* Can be used to fprintf() debug messages */
+double exposure;							/* -e, microseconds, or SEQ_AUTO_EXPOSURE */
+double gain;								/* -g, dB */
+char savefile[1024];
+char sequence[255];
+int trigger_mode = CAM_TRIGGER_SOFTWARE;	/* How a camera session obtains its frames */
+int n_buffers = CAM_DEFAULT_BUFFERS;		/* Stream buffers per camera session */
+int n_writers = 0;							/* Writer threads, 0 saves in the acquisition thread */
+int pipe_policy = PIPE_BLOCK;				/* What to do when the writers fall behind */
+char stackfile[1024];						/* Multi-page TIFF for sequences, empty for one file per step */
+int force_bigtiff = 0;
+tiffstack *stack = NULL;
+char rawlogfile[1024];						/* Raw frame log, takes precedence over TIFF output */
+double rawlog_size = 1024;					/* Raw log capacity in MB */
+rawlog *frame_log = NULL;
+char timelapsefile[1024];					/* Time-lapse archive, keyframes and residuals */
+int key_interval = 0;						/* Frames per keyframe, 0 for the archive's own */
+tlapse *archive = NULL;
+const img_writer *file_writers[IMG_MAX_WRITERS];	/* Formats of single files, written side by side */
+int n_file_writers = 0;						/* 0 until the options are read: by -o, else TIFF */
+int png_output = 0;							/* The first format is PNG, previews follow it */
+int preview_level = 0;						/* Pyramid level of the 8-bit preview: 1, 2, 3 for 2x, 4x, 8x; 0 for none */
+int tiff_pyramid = 0;						/* 2x, 4x, 8x levels as SubIFDs of the TIFFs */
+int packed_pixels = 0;						/* Ask the camera for packed 10/12-bit data */
+geometry roi;								/* Region, binning, decimation for all frames */
+int strobe_mode = STROBE_STEADY;			/* How the LEDs are switched for sequence steps */
+int trigger_pin = STROBE_TRIGGER_PIN;		/* GPIO to the camera trigger input, --strobe wave */
+int strobe_lead = STROBE_LEAD;
+char strobe_line[64] = "Line1";				/* Camera output for ExposureActive, --strobe camera */
+int rt_priority = SEQ_RT_PRIORITY;			/* SCHED_FIFO priority of the sequence thread, 0 for none */
+int acc_frames = 1;							/* Frames averaged or summed per image */
+int acc_mode = ACC_MEAN;
+int acc_format = ACC_OUT_16;				/* 16-bit or float result */
+accumulator acc;
+char calibfile[1024];						/* Calibration store, --calib */
+calib_store *calib = NULL;					/* Applied to saved frames if open */
+int capture_kind = 0;						/* --capture-dark or --capture-flat: CALIB_DARK or CALIB_FLAT */
+char capture_spec[255];						/* LED and duty cycle of a flat */
+char statsfile[1024];						/* --stats, CSV or JSON lines */
+stats *frame_stats = NULL;
+char stats_regions[STATS_MAX_REGIONS][64];	/* --stats-roi, added when statsfile is opened */
+int n_stats_regions = 0;
+int index_mode = INDEX_NONE;				/* White/blue index maps, --index */
+int stats_only = 0;							/* Only statistics, no images */
+ae_params ae;								/* Auto-exposure controller settings */
+ae_cache ae_store;							/* Converged settings per LED and duty cycle */
+char ae_cachefile[1024];
+int ae_loaded = 0;
+char camera_ids[MAX_CAMERAS][CAM_ID_LEN];	/* --camera, once per camera; none for the first one found */
+int n_cameras = 0;
+tiffstack *camera_stacks[MAX_CAMERAS];		/* --stack of a multi-camera run, one per camera */
+char timingfile[1024];						/* --timing, per-stage latency samples */
+char tracefile[1024];						/* --trace, Chrome trace JSON */
+char socketpath[108] = DAEMON_SOCKET;		/* --socket, of --daemon and --submit */
+daemon_job *current_job = NULL;				/* The daemon job being run, it hears of every saved image */
+
+#define DEFAULT_EXPOSURE_TIME	15000.0		/* in microseconds */
+#define DEFAULT_GAIN			12.0
+
+
+
+
+/*****************************************************
+
+	An important help for debugging. dp (debug-print)
+	is equivalent to fprintf (stderr, ...), but
+	only prints if the priority level pri of the message
+	exceeds the currently selected debug level.
+	If debuglevel == 0, no messages are printed.
+	For timing what happens per frame, use the
+	TRACE_ points of trace.h instead.
+*/
+
+
+
+void dp (int pri, char *format,...)
+{
+va_list args;
+
+	if (pri > debuglevel) return;
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+}
+
+
+
+void show_error (GError **error)
+{
+	if ((error != NULL) && (*error != NULL))
+		dp (0, "Error message: %s\n", (*error)->message);
+	g_clear_error (error);
+}
+
+
+
+/* Crop, bin and decimate an image as described by sw (camera output pixels,
+	see framemeta.h). Returns a new image, and its size in *width, *height,
+	or NULL if there is nothing to do or no memory. */
+
+char *apply_geometry (const char *img, int *width, int *height, int bps, const geometry *sw)
+{
+const char *src;
+char *binned, *out;
+int x, y, w, h, bw, bh, y0;
+
+
+	if (geometry_is_identity (sw)) return NULL;
+	if (sw->binning > 1 && bps > 2)
+	{
+		dp (0, "Software binning needs 8 or 16 bit mono data\n");
+		return NULL;
+	}
+
+	x = y = 0;
+	w = *width;
+	h = *height;
+	if (sw->width > 0)
+	{
+		x = (sw->x < w) ? sw->x : 0;
+		y = (sw->y < h) ? sw->y : 0;
+		w = (x + sw->width <= w) ? sw->width : w - x;
+		h = (y + sw->height <= h) ? sw->height : h - y;
+	}
+	src = img + ((long)y * *width + x) * bps;
+
+	bw = w / sw->binning;
+	bh = h / sw->binning;
+	out = malloc ((long)bw * bh * bps);
+	if (!out) return NULL;
+	if (sw->binning > 1 && bps == 2)
+		px_bin16 ((unsigned short*)out, (const unsigned short*)src, w, h, *width, sw->binning);
+	else if (sw->binning > 1)
+		px_bin8 ((unsigned char*)out, (const unsigned char*)src, w, h, *width, sw->binning);
+	else
+		for (y0=0; y0<h; y0++)
+			memcpy (out + (long)y0*w*bps, src + (long)y0 * *width * bps, (long)w*bps);
+
+	if (sw->decimation > 1)
+	{
+		binned = out;
+		out = malloc ((long)(bw / sw->decimation) * (bh / sw->decimation) * bps);
+		if (out)
+			px_decimate (out, binned, bw, bh, bw, bps, sw->decimation);
+		free (binned);
+		if (!out) return NULL;
+		bw /= sw->decimation;
+		bh /= sw->decimation;
+	}
+
+	*width = bw;
+	*height = bh;
+	return out;
+}
+
+
+
+/* Significant bits of a pixel format, e.g. 12 for Mono12 or BayerRG12 in
+	16-bit words */
+
+int pixel_bits (ArvPixelFormat pixelformat)
+{
+	switch (dm_mono_format (pixelformat))
+	{
+		case ARV_PIXEL_FORMAT_MONO_10:
+		case ARV_PIXEL_FORMAT_MONO_10_P:
+			return 10;
+		case ARV_PIXEL_FORMAT_MONO_12:
+		case ARV_PIXEL_FORMAT_MONO_12_P:
+		case ARV_PIXEL_FORMAT_MONO_12_PACKED:
+			return 12;
+		case ARV_PIXEL_FORMAT_MONO_14:
+			return 14;
+		default:
+			return ARV_PIXEL_FORMAT_BIT_PER_PIXEL(pixelformat);
+	}
+}
+
+
+
+/* The pixels of a buffer as a view for the image writers (imgview.h): 8 or
+	16 bits per sample, with the software part of the geometry in meta (may
+	be NULL) applied. Packed 10/12-bit data are unpacked. 16-bit data are
+	corrected with the calibration store, if one is open, and meta->calib
+	records it; this is done in a copy, so that the buffer keeps the frame
+	as the camera sent it, for the raw log and for the next call. A crop
+	without binning or decimation is a view into the buffer (or the copy),
+	rows of the full width apart; otherwise, if a new array is made, it is
+	also returned in *owned for the caller to free. Returns v->data, or
+	NULL if the format is not understood. */
+
+const char *frame_view (ArvBuffer *buffer, framemeta *meta, imgview *v, char **owned)
+{
+size_t buffer_size;
+char *buffer_data, *data, *reframed;
+ArvPixelFormat pixelformat;
+int bit_depth, packing, width, height, bps, x, y;
+long n;
+
+
+	/* First of all, verify that we are really received an *image* before attempting to save it */
+
+	assert (arv_buffer_get_payload_type(buffer) == ARV_BUFFER_PAYLOAD_TYPE_IMAGE);
+
+	buffer_data = (char*)arv_buffer_get_data (buffer, &buffer_size); 				// raw data
+	arv_buffer_get_image_region(buffer, NULL, NULL, &width, &height); 				// get width/height
+	pixelformat = arv_buffer_get_image_pixel_format (buffer);
+	bit_depth = ARV_PIXEL_FORMAT_BIT_PER_PIXEL(pixelformat); 						// bit(s) per pixel
+	*owned = NULL;
+	data = buffer_data;
+	bps = bit_depth / 8;				/* Bytes per sample, bytes per pixel */
+
+	/* Packed 10 or 12 bits. Unpacking happens only here, i.e. in whichever
+		thread saves the frame. */
+
+	if (bit_depth % 8)
+	{
+		packing = px_packing (dm_mono_format (pixelformat));		/* Bayer data are packed as mono */
+		n = (long)width * height;
+		if (packing == PX_PACK_NONE || (size_t)px_packed_size (packing, n) > buffer_size)
+		{
+			dp (0, "Cannot convert pixel format %08x\n", pixelformat);
+			return NULL;
+		}
+		*owned = malloc (n * sizeof (unsigned short));
+		if (!*owned) return NULL;
+		px_unpack ((unsigned short*)*owned, buffer_data, n, packing);
+		data = *owned;
+		bps = 2;
+	}
+
+	/* Calibration maps are in camera output pixels, so before the software
+		geometry. This runs in the writer threads when there are any. */
+
+	if (calib && meta && bps == 2)
+	{
+		if (!*owned)
+		{
+			n = (long)width * height;
+			if ((size_t)n * 2 > buffer_size || !(*owned = malloc (n * 2)))
+				return NULL;
+			memcpy (*owned, buffer_data, n * 2);
+			data = *owned;
+		}
+		TRACE_BEGIN (2, "calibrate");
+		meta->calib = calib_apply (calib, (unsigned short*)data, width, height, meta);
+		TRACE_END (2, "calibrate");
+	}
+
+	imgview_init (v, data, width, height, bps);
+	v->bits = pixel_bits (pixelformat);
+	if (meta && !geometry_is_identity (&meta->sw))
+	{
+		if (meta->sw.binning <= 1 && meta->sw.decimation <= 1)
+		{
+			x = y = 0;						/* As apply_geometry() crops */
+			if (meta->sw.width > 0)
+			{
+				x = (meta->sw.x < width) ? meta->sw.x : 0;
+				y = (meta->sw.y < height) ? meta->sw.y : 0;
+				v->width = (x + meta->sw.width <= width) ? meta->sw.width : width - x;
+				v->height = (y + meta->sw.height <= height) ? meta->sw.height : height - y;
+			}
+			v->data = data + (long)y * v->stride + (long)x * bps;
+			return v->data;
+		}
+		reframed = apply_geometry (data, &width, &height, bps, &meta->sw);
+		free (*owned);
+		*owned = reframed;
+		imgview_init (v, reframed, width, height, bps);
+		v->bits = pixel_bits (pixelformat);
+	}
+
+	return v->data;
+}
+
+
+/* The pixels of a buffer as frame_view() makes them, as one contiguous
+	array, for the code that takes nothing else (statistics, averaging,
+	logs). A crop is copied here. */
+
+char *frame_pixels (ArvBuffer *buffer, framemeta *meta, int *width, int *height, int *bps, char **owned)
+{
+const char *data;
+char *copy;
+imgview v;
+
+
+	if (!frame_view (buffer, meta, &v, owned)) return NULL;
+	data = imgview_pixels (&v, &copy);
+	if (copy)
+	{
+		free (*owned);
+		*owned = copy;
+	}
+	*width = v.width;
+	*height = v.height;
+	*bps = v.bps;
+
+	return (char*)data;
+}
+
+
+
+/* The Bayer pattern of the pixels that frame_pixels() makes of buffer, or
+	-1 if they are not a colour mosaic: mono data, or a mosaic that software
+	binning has mixed or even decimation reduced to one colour. Cropping at
+	an odd row or column moves the pattern. */
+
+int frame_bayer (ArvBuffer *buffer, const framemeta *meta)
+{
+int pattern, width, height, x, y;
+
+
+	pattern = dm_pattern (arv_buffer_get_image_pixel_format (buffer));
+	if (pattern < 0 || !meta || geometry_is_identity (&meta->sw)) return pattern;
+	if (meta->sw.binning > 1 || meta->sw.decimation % 2 == 0) return -1;
+
+	if (meta->sw.width > 0)				/* As apply_geometry() crops */
+	{
+		arv_buffer_get_image_region (buffer, NULL, NULL, &width, &height);
+		x = (meta->sw.x < width) ? meta->sw.x : 0;
+		y = (meta->sw.y < height) ? meta->sw.y : 0;
+		pattern = dm_crop_pattern (pattern, x, y);
+	}
+	return pattern;
+}
+
+
+
+/* Bayer data from frame_pixels() as interleaved RGB for the TIFF and PNG
+	writers, 8 or 16 bits per channel (*bps 3 or 6), with the method and
+	threads in dmopts. The RGB image replaces *owned. Mono data, and all
+	data with --demosaic none, are returned as they are; so is the mosaic
+	if it cannot be demosaiced. */
+
+char *frame_colour (ArvBuffer *buffer, const framemeta *meta, char *data, int width, int height,
+			int *bps, char **owned)
+{
+char *rgb;
+int pattern;
+
+
+	pattern = frame_bayer (buffer, meta);
+	if (pattern < 0 || dmopts.method == DM_NONE || *bps > 2) return data;
+
+	TRACE_BEGIN (2, "demosaic");
+	rgb = malloc ((long)width * height * 3 * *bps);
+	if (!rgb || demosaic (rgb, data, width, height, *bps, pattern, &dmopts) < 0)
+	{
+		dp (0, "Could not demosaic %s data, saving the mosaic\n", dm_pattern_name (pattern));
+		free (rgb);
+		TRACE_END (2, "demosaic");
+		return data;
+	}
+	TRACE_END (2, "demosaic");
+
+	free (*owned);
+	*owned = rgb;
+	*bps *= 3;
+	return rgb;
+}
+
+
+
+/* The pyramid of an image about to be saved, if --preview or --pyramid
+	want one, and the preview made from it, next to fname. Returns p for
+	the TIFF writers if --pyramid asked for the levels, else NULL; either
+	way p is to be freed with pyramid_free(). */
+
+pyramid *save_preview (const char *img, int width, int height, int bps, const char *fname, pyramid *p)
+{
+char name[1100];
+unsigned char *pv;
+int l, err;
+
+
+	memset (p, 0, sizeof (pyramid));
+	if ((!preview_level && !tiff_pyramid) || bps > 2) return NULL;
+
+	TRACE_BEGIN (2, "preview");
+	if (pyramid_build (p, img, width, height, bps, tiff_pyramid ? PYRAMID_LEVELS : preview_level) < 0)
+	{
+		dp (0, "No preview of %s\n", fname);
+		TRACE_END (2, "preview");
+		return NULL;
+	}
+	l = preview_level - 1;
+	if (l >= 0 && l < p->levels)
+	{
+		pv = preview_tonemap (p->level[l], p->width[l], p->height[l], bps, PREVIEW_LOW, PREVIEW_HIGH, PREVIEW_GAMMA);
+		preview_name (name, sizeof (name), fname, png_output ? ".png" : ".pgm");
+		if (png_output)
+			err = !pv || pngwrite (name, (char*)pv, p->width[l], p->height[l], 1) < 0;
+		else
+			err = !pv || pnm_write_8 (name, pv, p->width[l], p->height[l]) < 0;
+		if (err)
+			dp (0, "Could not write preview %s\n", name);
+		free (pv);
+	}
+	TRACE_END (2, "preview");
+
+	return tiff_pyramid ? p : NULL;
+}
+
+
+
+/* Can all formats of single files hold this pixel type? */
+
+int files_accept (int bps)
+{
+int i;
+
+	for (i=0; i<n_file_writers; i++)
+		if (!writer_accepts (file_writers[i], bps)) return 0;
+	return 1;
+}
+
+
+/* Save a view as single files, one per format in file_writers, written at
+	the same time (writers_write()): fname with the extension of each
+	format, or as it is for the first if its extension is none of ours. */
+
+int save_files (const imgview *v, const char *fname)
+{
+char names[IMG_MAX_WRITERS][1100];
+const char *fnames[IMG_MAX_WRITERS];
+const img_writer *list[IMG_MAX_WRITERS];
+int i, n;
+
+
+	n = 0;
+	for (i=0; i<n_file_writers; i++)
+	{
+		if (!writer_accepts (file_writers[i], v->bps))
+		{
+			dp (0, "%s cannot hold %d-byte pixels, not written\n", file_writers[i]->name, v->bps);
+			continue;
+		}
+		if (i == 0 && !writer_for_file (fname))
+			snprintf (names[n], sizeof (names[n]), "%s", fname);
+		else
+			writer_file_name (names[n], sizeof (names[n]), fname, file_writers[i]);
+		fnames[n] = names[n];
+		list[n++] = file_writers[i];
+	}
+
+	return n ? writers_write (list, n, fnames, v) : -1;
+}
+
+
+
+/* A frame as it is saved to files or a stack: the view of frame_view(),
+	with a preview and pyramid next to fname if they are asked for, and
+	demosaiced if it is a colour frame. Only these need the pixels
+	contiguous; otherwise the view is straight from the buffer. The
+	pyramid levels are v->levels if --pyramid asked for them; levels and
+	*owned are to be freed by the caller either way. Returns 0 or -1. */
+
+int frame_output (ArvBuffer *buffer, framemeta *meta, const char *fname, imgview *v, char **owned, pyramid *levels)
+{
+const char *data;
+char *pixels, *rgb;
+int bps, bits;
+
+
+	memset (levels, 0, sizeof (pyramid));
+	if (!frame_view (buffer, meta, v, owned)) return -1;
+	if (!preview_level && !tiff_pyramid && (frame_bayer (buffer, meta) < 0 || dmopts.method == DM_NONE))
+		return 0;
+
+	data = imgview_pixels (v, &pixels);
+	if (!data) return -1;
+	if (pixels)
+	{
+		free (*owned);
+		*owned = pixels;
+	}
+	bits = v->bits;
+	imgview_init (v, data, v->width, v->height, v->bps);
+	v->bits = bits;
+
+	/* The levels of a colour frame would be of its mosaic, so it has none */
+
+	v->levels = save_preview (data, v->width, v->height, v->bps, fname, levels);
+	bps = v->bps;
+	rgb = frame_colour (buffer, meta, (char*)data, v->width, v->height, &bps, owned);
+	if (rgb != data)
+	{
+		imgview_init (v, rgb, v->width, v->height, bps);
+		v->bits = bits;
+	}
+
+	return 0;
+}
+
+
+
+/* Save a frame as single files in the formats of file_writers: TIFF with
+	the options in tiffopts, PNG with those in pngopts, PNM or raw. 16-bit
+	data are in host byte order; the TIFF is marked accordingly, PNG and
+	PNM are swapped by their encoders. The TIFF's description is meta. */
+
+void arv_save_files (ArvBuffer *buffer, const char *filename, framemeta *meta)
+{
+char *owned, desc[512];
+pyramid levels;
+imgview v;
+int err;
+
+
+	err = frame_output (buffer, meta, filename, &v, &owned, &levels);
+	if (!err && meta)
+	{
+		framemeta_format (meta, desc, sizeof (desc));
+		v.comment = desc;
+		v.meta = meta;
+	}
+	if (err || save_files (&v, filename) < 0)
+		dp (0, "Could not write %s\n", filename);
+	pyramid_free (&levels);
+	free (owned);
+}
+
+
+
+
+void save_pixels (char *img, int width, int height, int bps, const char *fname, const framemeta *meta);
+
+
+/* The camera to open for a single camera run: the first --camera, or
+	NULL for the first one found */
+
+const char *first_camera ()
+{
+	return n_cameras ? camera_ids[0] : NULL;
+}
+
+
+/* name for the given camera of a multi-camera run (-1 for a single camera),
+	with _c0, _c1, ... before the extension if there is one */
+
+void camera_name (char *out, int size, const char *name, int camera)
+{
+const char *dot, *slash;
+
+
+	if (camera < 0)
+	{
+		snprintf (out, size, "%s", name);
+		return;
+	}
+	dot = strrchr (name, '.');
+	slash = strrchr (name, '/');
+	if (!dot || (slash && dot < slash))
+		snprintf (out, size, "%s_c%d", name, camera);
+	else
+		snprintf (out, size, "%.*s_c%d%s", (int)(dot - name), name, camera, dot);
+}
+
+
+/* The stack a frame goes into: its camera's in a multi-camera run, else
+	the one of the sequence. NULL for files of their own. */
+
+tiffstack *frame_stack (const framemeta *meta)
+{
+	if (meta && meta->camera >= 0 && meta->camera < MAX_CAMERAS)
+		return camera_stacks[meta->camera];
+	return stack;
+}
+
+
+/* Tell the client of a daemon job that an image was saved, and where */
+
+void report_frame (const char *fname, const framemeta *meta)
+{
+char desc[512];
+
+
+	if (!current_job || stats_only) return;
+	desc[0] = 0;
+	if (meta)
+		framemeta_format (meta, desc, sizeof (desc));
+	daemon_send (current_job, "frame %s %s", frame_log ? rawlogfile : archive ? timelapsefile : frame_stack (meta) ? stackfile : fname, desc);
+}
+
+
+/* Statistics of a saved image (--stats). Once a white and a blue frame
+	have come together, their index map is saved next to them, as name_ratio
+	or name_ndi. */
+
+void analyse_pixels (const char *img, int width, int height, int bps, int bits, const framemeta *meta,
+			const char *fname)
+{
+framemeta single, index_meta;
+char mapname[1100];
+float *map;
+
+
+	if (!meta)
+	{
+		framemeta_init (&single);
+		meta = &single;
+	}
+	TRACE_BEGIN (2, "stats");
+	map = stats_frame (frame_stats, img, width, height, bps, bits, meta, fname, &index_meta);
+	TRACE_END (2, "stats");
+	if (!map) return;
+	if (!stats_only)
+	{
+		snprintf (mapname, sizeof (mapname), "%s_%s", fname, stats_index_name (frame_stats));
+		save_pixels ((char*)map, width, height, 4, mapname, &index_meta);
+		report_frame (mapname, &index_meta);
+	}
+	free (map);
+}
+
+
+
+/* Save a frame: unencoded into the raw log if one is open, into the
+	time-lapse archive if one is open, as the next page of the sequence
+	stack if one is open, otherwise as a file in each format of --format
+	(see save_files()), written side by side. Packed data go into the raw
+	log as they are, unless software binning or cropping must be done
+	first; calibration is then left to rawconv -c as well. With --stats,
+	the statistics are taken here too, so that they run in the writer
+	threads. This is also the pipeline's save function. */
+
+void save_frame (ArvBuffer *buffer, const char *fname, const framemeta *frame)
+{
+size_t buffer_size, frame_size;
+char *buffer_data, *owned;
+int width, height, bits, bps, raw, err;
+ArvPixelFormat pixelformat;
+framemeta copy, *meta;
+tiffstack *pages;
+pyramid levels;
+imgview view;
+double t0;
+
+
+	t0 = timing_start ();
+	TRACE_BEGIN (1, "save");
+	meta = NULL;
+	if (frame)
+	{
+		copy = *frame;					/* frame_pixels() records the calibration in it */
+		meta = &copy;
+	}
+	raw = frame_log && (!meta || geometry_is_identity (&meta->sw));
+
+	if (frame_stats)
+	{
+		buffer_data = frame_pixels (buffer, meta, &width, &height, &bps, &owned);
+		if (!buffer_data)
+			dp (0, "No statistics for frame %s\n", fname);
+		else
+		{
+			analyse_pixels (buffer_data, width, height, bps,
+				pixel_bits (arv_buffer_get_image_pixel_format (buffer)), meta, fname);
+			if (!stats_only && !raw && !frame_log && !archive)		/* Logs keep the mosaic */
+				buffer_data = frame_colour (buffer, meta, buffer_data, width, height, &bps, &owned);
+			if (!stats_only && !raw)
+				save_pixels (buffer_data, width, height, bps, fname, meta);
+		}
+		free (owned);
+		if (stats_only || !raw)
+		{
+			report_frame (fname, meta);
+			TRACE_END (1, "save");
+			timing_stop (TM_SAVE, t0);
+			return;
+		}
+	}
+
+	if (raw)
+	{
+		buffer_data = (char*)arv_buffer_get_data (buffer, &buffer_size);
+		arv_buffer_get_image_region (buffer, NULL, NULL, &width, &height);
+		pixelformat = arv_buffer_get_image_pixel_format (buffer);
+		bits = ARV_PIXEL_FORMAT_BIT_PER_PIXEL(pixelformat);
+		frame_size = ((size_t)width * height * bits + 7) / 8;	/* The buffer may be larger */
+		if (frame_size > buffer_size) frame_size = buffer_size;
+		if (meta) meta->calib = 0;		/* Logged as the camera sent it, for rawconv -c */
+		if (rawlog_append (frame_log, buffer_data, frame_size, pixelformat, bits, width, height, meta) < 0)
+			dp (0, "Raw log full, frame %s lost\n", fname);
+		if (preview_level && (buffer_data = frame_pixels (buffer, meta, &width, &height, &bps, &owned)) != NULL)
+		{
+			save_preview (buffer_data, width, height, bps, fname, &levels);
+			pyramid_free (&levels);
+			free (owned);
+		}
+	}
+	else if (frame_log)
+	{
+		buffer_data = frame_pixels (buffer, meta, &width, &height, &bps, &owned);
+		pixelformat = (bps == 1) ? ARV_PIXEL_FORMAT_MONO_8 : ARV_PIXEL_FORMAT_MONO_16;
+		if (!buffer_data || bps > 2
+				|| rawlog_append (frame_log, buffer_data, (size_t)width*height*bps, pixelformat, 8*bps,
+					width, height, meta) < 0)
+			dp (0, "Could not log frame %s\n", fname);
+		if (buffer_data && preview_level)
+		{
+			save_preview (buffer_data, width, height, bps, fname, &levels);
+			pyramid_free (&levels);
+		}
+		free (owned);
+	}
+	else if (archive)
+	{
+		buffer_data = frame_pixels (buffer, meta, &width, &height, &bps, &owned);
+		if (!buffer_data || tlapse_append (archive, buffer_data, width, height, bps, meta) < 0)
+			dp (0, "Could not archive frame %s\n", fname);
+		if (buffer_data && preview_level)
+		{
+			save_preview (buffer_data, width, height, bps, fname, &levels);
+			pyramid_free (&levels);
+		}
+		free (owned);
+	}
+	else if ((pages = frame_stack (meta)) != NULL)
+	{
+		err = frame_output (buffer, meta, fname, &view, &owned, &levels);
+		view.meta = meta;
+		if (err || tiffstack_append_view (pages, &view) < 0)
+			dp (0, "Could not append frame %s to the stack\n", fname);
+		pyramid_free (&levels);
+		free (owned);
+	}
+	else
+		arv_save_files (buffer, fname, meta);
+	report_frame (fname, meta);
+	TRACE_END (1, "save");
+	timing_stop (TM_SAVE, t0);
+}
+
+
+
+/* Save an image that is not a camera buffer (e.g. accumulated frames) the
+	way save_frame() would. bps 4 (float) can only go to TIFF. */
+
+void save_pixels (char *img, int width, int height, int bps, const char *fname, const framemeta *meta)
+{
+char desc[512];
+pyramid levels, *pl;
+imgview v;
+int err;
+
+
+	pl = save_preview (img, width, height, bps, fname, &levels);
+	if (frame_log)
+		err = (bps > 2) ? -1 : rawlog_append (frame_log, img, (size_t)width*height*bps,
+			(bps == 1) ? ARV_PIXEL_FORMAT_MONO_8 : ARV_PIXEL_FORMAT_MONO_16, 8*bps, width, height, meta);
+	else if (archive)
+		err = (bps > 2) ? -1 : tlapse_append (archive, img, width, height, bps, meta);
+	else if (frame_stack (meta))
+		err = tiffstack_append_levels (frame_stack (meta), img, width, height, bps, meta, pl);
+	else
+	{
+		imgview_init (&v, img, width, height, bps);
+		v.meta = meta;
+		v.levels = pl;
+		if (meta)
+		{
+			framemeta_format (meta, desc, sizeof (desc));
+			v.comment = desc;
+		}
+		err = save_files (&v, fname);
+	}
+	pyramid_free (&levels);
+	if (err < 0)
+		dp (0, "Could not save image %s\n", fname);
+}
+
+
+
+/* Take one frame from an open camera session, save it under fname and
+	return the buffer to the stream pool. If a pipeline p is given, the
+	frame is only queued, and a writer thread saves and returns it.
+	meta (may be NULL) describes the illumination; exposure, gain,
+	geometry and timestamps are filled in here. */
+
+int session_frame (camsession *cs, pipeline *p, const char *fname, framemeta *meta)
+{
+ArvBuffer *buffer;
+framemeta single;
+double t0;
+
+
+	if (!meta)
+	{
+		framemeta_init (&single);
+		meta = &single;
+	}
+
+	t0 = timing_start ();
+	buffer = cam_snap (cs);
+	timing_stop (TM_ACQUIRE, t0);
+	if (!ARV_IS_BUFFER (buffer))
+	{
+		dp (0, "Failed to acquire a single image\n");
+		return -1;
+	}
+
+	meta->exposure = cs->exposure;
+	meta->gain = cs->gain;
+	meta->timestamp = arv_buffer_get_timestamp (buffer);
+	meta->systime = arv_buffer_get_system_timestamp (buffer);
+	meta->geom = cs->applied;
+	meta->sw = cs->sw;
+
+	if (p)
+		return pipe_submit (p, buffer, fname, meta) ? -1 : 0;
+
+	save_frame (buffer, fname, meta);
+//	printf ("Image successfully acquired. Now saving as a PNG file.\n");
+//	arv_save_png (buffer, "test.png", meta);
+	cam_requeue (cs, buffer);
+
+	return 0;
+}
+
+
+
+/* Like session_frame(), but frames (more than one) are captured and added
+	up as they arrive, and only their mean or sum (acc_mode, acc_format) is
+	saved, always from this thread, using the accumulator a. With st, the
+	LEDs are switched on for every frame (once for steady PWM, every frame
+	for waves); switching them off is left to the caller. */
+
+int session_average (camsession *cs, strobe *st, accumulator *a, int frames, const char *fname, framemeta *meta)
+{
+ArvBuffer *buffer;
+char *data, *owned, *result;
+int width, height, bps, bits, out_bps, k, err;
+double scale, t0;
+
+
+	out_bps = acc_format;
+	if (out_bps == ACC_OUT_FLOAT && (frame_log || archive || (!files_accept (4) && !frame_stack (meta))))
+	{
+		dp (1, "Float images only go to TIFF and raw files, saving 16 bits\n");
+		out_bps = ACC_OUT_16;
+	}
+
+	acc_reset (a);
+	err = 0;
+	for (k=0; k<frames && !err; k++)
+	{
+		if (st && strobe_on (st, meta->led, meta->dutycycle, cs->exposure) < 0)
+			dp (0, "Could not switch the LEDs for frame %d of %s\n", k, fname);
+		t0 = timing_start ();
+		buffer = cam_snap (cs);
+		timing_stop (TM_ACQUIRE, t0);
+		if (!ARV_IS_BUFFER (buffer))
+		{
+			dp (0, "Failed to acquire frame %d of %d\n", k, frames);
+			return -1;
+		}
+		if (k == 0)
+		{
+			meta->exposure = cs->exposure;
+			meta->gain = cs->gain;
+			meta->timestamp = arv_buffer_get_timestamp (buffer);
+			meta->systime = arv_buffer_get_system_timestamp (buffer);
+			meta->geom = cs->applied;
+			meta->sw = cs->sw;
+		}
+
+		bits = ARV_PIXEL_FORMAT_BIT_PER_PIXEL(arv_buffer_get_image_pixel_format (buffer));
+		TRACE_BEGIN (2, "accumulate");
+		data = frame_pixels (buffer, meta, &width, &height, &bps, &owned);
+		if (!data || acc_add (a, data, width, height, bps, bits) < 0)
+			err = -1;
+		TRACE_END (2, "accumulate");
+		free (owned);
+		cam_requeue (cs, buffer);
+	}
+	if (err) return -1;
+
+	result = acc_result (a, acc_mode, out_bps, &scale);
+	if (!result) return -1;
+	meta->frames = a->frames;
+	meta->scale = scale;
+	dp (1, "%d frames accumulated. Now saving %s\n", a->frames, fname);
+	if (frame_stats)
+		analyse_pixels (result, a->width, a->height, out_bps, (acc_mode == ACC_MEAN) ? a->bits : 16, meta, fname);
+	t0 = timing_start ();
+	TRACE_BEGIN (1, "save");
+	if (!frame_stats || !stats_only)
+		save_pixels (result, a->width, a->height, out_bps, fname, meta);
+	report_frame (fname, meta);
+	TRACE_END (1, "save");
+	timing_stop (TM_SAVE, t0);
+	free (result);
+
+	return 0;
+}
+
+
+
+/* Find exposure and gain for led (-1 for none) at dutycycle with decimated
+	preview frames of geometry geom. The search starts from the cached
+	settings if there are any, else from *exposure and *gain, and the result
+	is returned there and cached. The camera is left at the preview
+	geometry. Returns 0, or -1 if no frames could be taken. */
+
+int auto_expose (camsession *cs, strobe *st, const geometry *geom, int led, int dutycycle,
+			double *exposure, double *gain)
+{
+unsigned int hist[PX_HIST_BINS];
+ArvBuffer *buffer;
+framemeta meta;
+geometry preview;
+px_moments m;
+ae_entry *cached;
+char *data, *owned;
+double e, g, mean;
+int width, height, bps, bits, k, res;
+
+
+	if (!ae_loaded)
+	{
+		ae_cache_load (&ae_store, ae_cachefile);
+		ae_loaded = 1;
+	}
+	cached = ae_cache_find (&ae_store, led, dutycycle);
+	e = cached ? cached->exposure : (*exposure > 0) ? *exposure : DEFAULT_EXPOSURE_TIME;
+	g = cached ? cached->gain : *gain;
+
+	/* Decimation keeps the brightness of a pixel, binning may not */
+
+	preview = *geom;
+	preview.decimation = (geom->decimation > 0 ? geom->decimation : 1) * AE_PREVIEW_DECIMATION;
+	if (cam_set_geometry (cs, &preview) < 0)
+		return -1;
+
+	res = AE_CONTINUE;
+	for (k=0; k<ae.max_frames && res == AE_CONTINUE; k++)
+	{
+		if (cam_configure (cs, e, g) < 0)
+			break;
+		if (st && strobe_on (st, led, dutycycle, cs->exposure) < 0)
+			dp (0, "Could not switch the LEDs for auto-exposure\n");
+		buffer = cam_snap (cs);
+		if (!ARV_IS_BUFFER (buffer))
+		{
+			dp (0, "Failed to acquire a preview frame\n");
+			if (st) strobe_off (st);
+			return -1;
+		}
+
+		framemeta_init (&meta);
+		meta.sw = cs->sw;
+		bits = pixel_bits (arv_buffer_get_image_pixel_format (buffer));
+		width = height = bps = 0;
+		data = frame_pixels (buffer, &meta, &width, &height, &bps, &owned);
+		if (!data)
+			dp (0, "Cannot read auto-exposure frame %d\n", k);
+		memset (hist, 0, sizeof (hist));
+		px_moments_init (&m);
+		if (data && bps == 2)
+			px_stats16 ((unsigned short*)data, (long)width * height, (bits > 8) ? bits - 8 : 0, hist, &m);
+		else if (data && bps == 1)
+			px_stats8 ((unsigned char*)data, (long)width * height, hist, &m);
+		free (owned);
+		cam_requeue (cs, buffer);
+
+		/* What the camera made of the request */
+
+		e = cs->exposure;
+		g = cs->gain;
+		res = ae_update (&ae, hist, PX_HIST_BINS, &e, &g);
+		mean = (data && width > 0 && height > 0) ? (double)m.sum / ((long)width * height) : 0;
+		dp (2, "Auto-exposure frame %d: %g us, %g dB, mean %.0f -> %s\n", k, cs->exposure, cs->gain,
+			mean, res == AE_CONTINUE ? "again" : "done");
+	}
+	if (st) strobe_off (st);
+
+	if (res == AE_LIMIT)
+		dp (0, "Auto-exposure for %s at %d: target not reached within the exposure and gain limits\n",
+			led_name (led), dutycycle);
+	else if (res != AE_CONVERGED)
+		dp (0, "Auto-exposure for %s at %d did not converge in %d frames\n", led_name (led), dutycycle, k);
+
+	*exposure = e;
+	*gain = g;
+	ae_cache_store (&ae_store, led, dutycycle, e, g);
+	if (ae_cache_save (&ae_store, ae_cachefile) < 0)
+		dp (0, "Could not write the exposure cache %s\n", ae_cachefile);
+	dp (1, "Auto-exposure for %s at %d: %g us, %g dB after %d frames\n", led_name (led), dutycycle, e, g, k);
+
+	return 0;
+}
+
+
+
+/* Resolve the /e=auto steps of a schedule, once per LED and duty cycle,
+	before the run starts */
+
+void resolve_auto_exposure (camsession *cs, strobe *st, seq_schedule *sched)
+{
+seq_entry *e, *f;
+double ex, g;
+int i, j;
+
+
+	for (i=0; i<sched->n; i++)
+	{
+		e = &sched->entries[i];
+		if (e->exposure != SEQ_AUTO_EXPOSURE) continue;
+		ex = DEFAULT_EXPOSURE_TIME;
+		g = e->gain;
+		if (auto_expose (cs, st, &e->geom, e->led, e->dutycycle, &ex, &g) < 0)
+			dp (0, "Auto-exposure failed, step %d uses %g us\n", i, ex);
+		for (j=i; j<sched->n; j++)
+		{
+			f = &sched->entries[j];
+			if (f->exposure == SEQ_AUTO_EXPOSURE && f->led == e->led && f->dutycycle == e->dutycycle)
+			{
+				f->exposure = ex;
+				f->gain = g;
+			}
+		}
+	}
+}
+
+
+
+/* One frame (or the mean of acc_frames) with the LEDs off, at -e, -g and
+	-r, from an open camera session, saved as fname. Returns 0 or -1. */
+
+int capture_frame (camsession *cs, const char *fname)
+{
+framemeta meta;
+double e, g, t0;
+int err;
+
+
+	e = exposure;
+	g = gain;
+	err = 0;
+	if (e == SEQ_AUTO_EXPOSURE)
+		err = auto_expose (cs, NULL, &roi, -1, 0, &e, &g);
+	t0 = timing_start ();
+	TRACE_BEGIN (1, "configure");
+	if (!err)
+		err = cam_set_geometry (cs, &roi);
+	if (!err)
+		err = cam_configure (cs, e, g);
+	TRACE_END (1, "configure");
+	timing_stop (TM_CONFIGURE, t0);
+	if (!err && acc_frames > 1)
+	{
+		framemeta_init (&meta);
+		err = session_average (cs, NULL, &acc, acc_frames, fname, &meta);
+	}
+	else if (!err)
+		err = session_frame (cs, NULL, fname, NULL);
+
+	return err ? -1 : 0;
+}
+
+
+
+int acquire_frame()
+{
+camsession cs;
+int err;
+
+
+	if (cam_open (&cs, first_camera (), 1, trigger_mode, packed_pixels) < 0)
+		return -1;
+	err = capture_frame (&cs, savefile);
+	cam_close (&cs);
+	acc_free (&acc);
+
+	return err ? -1 : EXIT_SUCCESS;
+}
+
+/* Record a master dark (kind CALIB_DARK, LEDs off) or flat (CALIB_FLAT,
+	LED and duty cycle from capture_spec) for the current exposure, gain and
+	geometry, as the mean of acc_frames frames (16 if not set), into the
+	calibration store calibfile. A flat has the matching dark of the store
+	subtracted before it is made into a gain map, so capture the darks first.
+	Frames are taken uncalibrated and before any software geometry. */
+
+int capture_calibration (int kind)
+{
+camsession cs;
+framemeta meta;
+seq_schedule sched;
+seq_entry defaults;
+calib_map map;
+calib_store *store;
+const calib_map *dark;
+unsigned short *gainmap;
+ArvBuffer *buffer;
+char *data, *owned, *mean;
+int pi, frames, width, height, bps, bits, k, err;
+double scale;
+strobe st;
+
+
+	memset (&defaults, 0, sizeof (defaults));
+	defaults.exposure = exposure;
+	defaults.gain = gain;
+	defaults.frames = (acc_frames > 1) ? acc_frames : 16;
+	defaults.geom = roi;
+	defaults.led = -1;
+	if (kind == CALIB_FLAT)
+	{
+		if (seq_compile (capture_spec, &defaults, &sched) < 0)
+			return -1;
+		defaults = sched.entries[0];
+		seq_free (&sched);
+	}
+	frames = defaults.frames;
+	if (kind == CALIB_DARK && defaults.exposure == SEQ_AUTO_EXPOSURE)
+	{
+		fprintf (stderr, "Darks need a fixed exposure, -e\n");
+		return -1;
+	}
+
+	/* The LEDs are switched off for darks too, in case they were left on */
+
+	pi = pigpio_start (NULL, NULL);
+	if (pi < 0 && kind == CALIB_FLAT)
+	{
+		fprintf (stderr, "Connection to pigpio daemon failed");
+		return -1;
+	}
+	if (pi >= 0 && strobe_open (&st, pi, STROBE_STEADY, trigger_pin, strobe_lead) < 0)
+	{
+		pigpio_stop (pi);
+		return -1;
+	}
+
+	err = cam_open (&cs, first_camera (), 1, trigger_mode, packed_pixels);
+	if (!err && defaults.exposure == SEQ_AUTO_EXPOSURE)
+		err = auto_expose (&cs, (pi >= 0) ? &st : NULL, &defaults.geom, defaults.led, defaults.dutycycle,
+			&defaults.exposure, &defaults.gain);
+	if (!err)
+		err = cam_set_geometry (&cs, &defaults.geom);
+	if (!err)
+		err = cam_configure (&cs, defaults.exposure, defaults.gain);
+	if (!err && pi >= 0)
+		err = (kind == CALIB_FLAT) ? strobe_on (&st, defaults.led, defaults.dutycycle, cs.exposure)
+			: strobe_off (&st);
+
+	framemeta_init (&meta);
+	acc_reset (&acc);
+	for (k=0; k<frames && !err; k++)
+	{
+		buffer = cam_snap (&cs);
+		if (!ARV_IS_BUFFER (buffer))
+		{
+			dp (0, "Failed to acquire frame %d of %d\n", k, frames);
+			err = -1;
+			break;
+		}
+		if (k == 0)
+		{
+			meta.led = (kind == CALIB_FLAT) ? defaults.led : -1;
+			meta.dutycycle = defaults.dutycycle;
+			meta.exposure = cs.exposure;
+			meta.gain = cs.gain;
+			meta.geom = cs.applied;
+		}
+		bits = ARV_PIXEL_FORMAT_BIT_PER_PIXEL(arv_buffer_get_image_pixel_format (buffer));
+		data = frame_pixels (buffer, NULL, &width, &height, &bps, &owned);
+		if (!data || bps != 2 || acc_add (&acc, data, width, height, bps, bits) < 0)
+		{
+			dp (0, "Calibration needs 16-bit (or packed 10/12-bit) frames\n");
+			err = -1;
+		}
+		free (owned);
+		cam_requeue (&cs, buffer);
+	}
+
+	if (pi >= 0)
+	{
+		strobe_close (&st);
+		pigpio_stop (pi);
+	}
+	cam_close (&cs);
+	if (err)
+	{
+		acc_free (&acc);
+		return -1;
+	}
+
+	mean = acc_result (&acc, ACC_MEAN, ACC_OUT_16, &scale);
+	acc_free (&acc);
+	if (!mean) return -1;
+
+	calib_map_init (&map, kind, width, height, &meta);
+	map.frames = frames;
+	if (kind == CALIB_FLAT)
+	{
+		store = calib_open (calibfile);
+		dark = calib_find (store, CALIB_DARK, width, height, &meta);
+		if (!dark)
+			dp (0, "No dark for %g us, %g dB in %s, the flat includes the dark signal\n",
+				meta.exposure, meta.gain, calibfile);
+		gainmap = malloc ((long)width * height * sizeof (unsigned short));
+		if (gainmap)
+		{
+			calib_make_flat (gainmap, (unsigned short*)mean, dark ? calib_data (store, dark) : NULL,
+				(long)width * height);
+			free (mean);
+			mean = (char*)gainmap;
+		}
+		calib_close (store);
+		if (!gainmap)
+		{
+			free (mean);
+			return -1;
+		}
+	}
+
+	err = calib_add (calibfile, &map, (unsigned short*)mean);
+	free (mean);
+	if (!err)
+		dp (1, "%s of %d frames, %dx%d, added to %s\n", (kind == CALIB_DARK) ? "Dark" : "Flat",
+			frames, width, height, calibfile);
+
+	return err ? -1 : EXIT_SUCCESS;
+}
+
+
+
+// estimated size of a stack of all frames of sched from camera session cs
+long long stack_bytes(camsession *cs, seq_schedule *sched)
+{
+    long long framebytes, expected;
+    int i;
+
+    // packed frames are stored unpacked, at 16 bits per pixel
+    framebytes = (long long)cs->payload;
+    if (ARV_PIXEL_FORMAT_BIT_PER_PIXEL(cs->pixelformat) % 8)
+        framebytes = framebytes * 16 / ARV_PIXEL_FORMAT_BIT_PER_PIXEL(cs->pixelformat);
+    // accumulated float images take twice that
+    expected = 0;
+    for (i = 0; i < sched->n; i++)
+        expected += (sched->entries[i].frames > 1 && acc_format == ACC_OUT_FLOAT) ? 2 * framebytes : framebytes;
+    // a float index map for at most every other step
+    if (frame_stats && index_mode != INDEX_NONE)
+        expected += sched->n * framebytes;
+
+    return expected;
+}
+
+// what a sequence step needs besides its schedule entry
+typedef struct
+{
+    camsession *cs;
+    strobe *st;
+    pipeline *pipe;
+    const char *name;       // frames are saved as name + step index
+    int numbered;           // 0: all under name itself (a single capture)
+} step_context;
+
+// one step of a sequence, called by the sequence thread at the step's deadline
+int run_step(void *ctx, const seq_entry *e, int index)
+{
+    step_context *sc = (step_context*)ctx;
+    framemeta meta;
+    double t0, t1;
+    int err;
+
+    // stage timestamps for --timing, 0 when it is off
+    t0 = timing_start();
+    TRACE_BEGIN(1, "step");
+    TRACE_INSTANT(1, "index", index);
+    t1 = timing_start();
+    TRACE_BEGIN(1, "configure");
+    if (cam_set_geometry(sc->cs, &e->geom) < 0)
+        dp (0, "Could not set the geometry of step %d\n", index);
+    if (cam_configure(sc->cs, e->exposure, e->gain) < 0)
+        dp (0, "Could not set exposure and gain of step %d\n", index);
+    TRACE_END(1, "configure");
+    timing_stop(TM_CONFIGURE, t1);
+
+    //create unique filename for each image
+    if (sc->numbered)
+        snprintf(savefile, sizeof(savefile), "%s%d", sc->name, index);
+    else
+        snprintf(savefile, sizeof(savefile), "%s", sc->name);
+    framemeta_init(&meta);
+    meta.step = index;
+    meta.led = e->led;
+    meta.dutycycle = e->dutycycle;
+
+    // LEDs on (with --strobe wave this also triggers the camera), frame, LEDs off
+    if (e->frames <= 1)
+    {
+        t1 = timing_start();
+        if (strobe_on(sc->st, e->led, e->dutycycle, sc->cs->exposure) < 0)
+            dp (0, "Could not switch the LEDs for step %d\n", index);
+        timing_stop(TM_LED, t1);
+    }
+    if (e->frames > 1)
+        err = session_average(sc->cs, sc->st, &acc, e->frames, savefile, &meta);
+    else
+        err = session_frame(sc->cs, sc->pipe, savefile, &meta);
+    t1 = timing_start();
+    strobe_off(sc->st);
+    timing_stop(TM_LED, t1);
+    TRACE_END(1, "step");
+    timing_stop(TM_STEP, t0);
+
+    return err;
+}
+
+// the per-step settings a sequence starts from: -e, -g, --average and -r
+void sequence_defaults(seq_entry *defaults)
+{
+    memset(defaults, 0, sizeof(*defaults));
+    defaults->exposure = exposure;
+    defaults->gain = gain;
+    defaults->frames = acc_frames;
+    defaults->geom = roi;
+}
+
+// run a compiled sequence on an open camera and LEDs, frames saved as name0, name1, ...
+// (or all as name if not numbered), into the stack if stackfile is set
+int run_sequence(camsession *cs, strobe *st, seq_schedule *sched, const char *name, int numbered)
+{
+    pipeline *pipe = NULL;
+    pipe_stats stats;
+    seq_report report;
+    step_context sc;
+    int err, n;
+
+    // /e=auto steps get their exposure now, so that the run itself keeps its timing
+    resolve_auto_exposure(cs, st, sched);
+    cam_set_geometry(cs, &sched->entries[0].geom);
+    cam_configure(cs, sched->entries[0].exposure, sched->entries[0].gain);
+
+    // all frames into one multi-page TIFF, sized from the number of steps
+    if (stackfile[0] && !frame_log && !archive)
+    {
+        stack = tiffstack_open(stackfile, force_bigtiff ? -1 : stack_bytes(cs, sched), &tiffopts);
+        if (!stack)
+            dp (0, "Could not open %s, saving one file per step\n", stackfile);
+    }
+    // stack pages and archive frames are appended one at a time, so more writers would only shuffle their order
+    if (n_writers > 0)
+        pipe = pipe_start(cs, (stack || archive) ? 1 : n_writers, cs->n_buffers - 1, pipe_policy, save_frame);
+
+    sc.cs = cs;
+    sc.st = st;
+    sc.pipe = pipe;
+    sc.name = name;
+    sc.numbered = numbered;
+    err = seq_run(sched, run_step, &sc, rt_priority, &report);
+    if (err == 0)
+    {
+        seq_report_print(&report);
+        if (report.all.failed)
+            err = -1;
+        seq_report_free(&report);
+    }
+
+    if (pipe)
+    {
+        pipe_finish(pipe, &stats);
+        dp ((stats.dropped || stats.stalls) ? 0 : 1,
+            "Pipeline: %lu frames, %lu written, %lu dropped, %lu stalls (%.3f s), max queue %d\n",
+            stats.submitted, stats.written, stats.dropped, stats.stalls, stats.stall_time, stats.max_depth);
+    }
+    if (stack)
+    {
+        n = tiffstack_close(stack);
+        if (n < 0)
+        {
+            dp (0, "Failed to complete %s\n", stackfile);
+            err = -1;
+        }
+        else
+            dp (1, "%d frames written to %s\n", n, stackfile);
+        stack = NULL;
+    }
+    acc_free(&acc);
+
+    return err ? -1 : 0;
+}
+
+/********************************************************************/
+
 
-#include "tiffstuff.h"
+/* Several cameras (--camera given more than once) run together, each in
+	a thread of its own with its own stream, buffer pool, accumulator and
+	writer thread, so that saving on one camera never holds up the capture
+	on another. Per step, the camera threads and the step thread meet at a
+	barrier four times: the step starts and the cameras are configured; all
+	are configured and the LEDs go on; the cameras capture; all frames are
+	taken and the LEDs go off. So every camera exposes under the same LED
+	state. Frames and stacks are named per camera, see camera_name(). */
 
+typedef struct camgroup camgroup;
 
-int debuglevel;			/* Can be used to fprintf() debug messages */
-double exposure;
-char savefile[1024];
-char sequence[255];
-enum led_color{White, Blue, White_and_blue};
+typedef struct
+{
+	int index;
+	camsession cs;
+	pipeline *pipe;
+	accumulator acc;
+	pthread_t thread;
+	camgroup *group;
+	int err;						/* Of the current step */
+} camunit;
+
+struct camgroup
+{
+	int n_open;						/* Cameras open */
+	int n;							/* Camera threads running */
+	camunit cam[MAX_CAMERAS];
+	pthread_mutex_t gate;			/* Held until the barrier is set up */
+	pthread_barrier_t barrier;		/* The camera threads and the step thread */
+	const seq_entry *entry;			/* The step being taken, NULL to stop */
+	int index;
+	strobe *st;						/* NULL for LEDs off */
+	const char *name;				/* As in step_context */
+	int numbered;
+};
 
-#define WHITE_LED_PIN 15
-#define BLUE_LED_PIN 14
+static const char *camera_thread_names[MAX_CAMERAS] =
+	{ "camera0", "camera1", "camera2", "camera3", "camera4", "camera5", "camera6", "camera7" };
 
 
+/* A camera's thread: one frame (or one averaged image) per step */
+
+static void *camera_thread (void *arg)
+{
+camunit *cu = (camunit*)arg;
+camgroup *g = cu->group;
+const seq_entry *e;
+char base[1100], fname[1100];
+framemeta meta;
+double t0;
+int err;
 
 
-/*****************************************************
+	trace_thread_name (camera_thread_names[cu->index]);
+	pthread_mutex_lock (&g->gate);
+	pthread_mutex_unlock (&g->gate);
 
-	An important help for debugging. dp (debug-print)
-	is equivalent to fprintf (stderr, ...), but
-	only prints if the priority level pri of the message
-	exceeds the currently selected debug level.
-	If debuglevel == 0, no messages are printed.
-*/
+	for (;;)
+	{
+		pthread_barrier_wait (&g->barrier);		/* The step starts */
+		e = g->entry;
+		if (!e) break;
+
+		t0 = timing_start ();
+		TRACE_BEGIN (1, "configure");
+		cu->err = 0;
+		if (cam_set_geometry (&cu->cs, &e->geom) < 0 || cam_configure (&cu->cs, e->exposure, e->gain) < 0)
+		{
+			dp (0, "Could not configure camera %d for step %d\n", cu->index, g->index);
+			cu->err = -1;
+		}
+		TRACE_END (1, "configure");
+		timing_stop (TM_CONFIGURE, t0);
+		pthread_barrier_wait (&g->barrier);		/* All configured, the LEDs go on */
+		pthread_barrier_wait (&g->barrier);
+
+		if (g->numbered)
+			snprintf (base, sizeof (base), "%s%d", g->name, g->index);
+		else
+			snprintf (base, sizeof (base), "%s", g->name);
+		camera_name (fname, sizeof (fname), base, cu->index);
+		framemeta_init (&meta);
+		meta.step = g->index;
+		meta.led = e->led;
+		meta.dutycycle = e->dutycycle;
+		meta.camera = cu->index;
+		if (e->frames > 1)
+			err = session_average (&cu->cs, NULL, &cu->acc, e->frames, fname, &meta);
+		else
+			err = session_frame (&cu->cs, cu->pipe, fname, &meta);
+		if (err) cu->err = -1;
+		pthread_barrier_wait (&g->barrier);		/* All frames taken, the LEDs go off */
+	}
 
+	return NULL;
+}
 
 
-void dp (int pri, char *format,...)
+/* One step on all cameras; the seq_step_fn of a multi-camera sequence */
+
+int group_step (void *ctx, const seq_entry *e, int index)
 {
-va_list args;
-char buf[1024];
+camgroup *g = (camgroup*)ctx;
+double t0, t1, longest;
+int i, err;
+
+
+	t0 = timing_start ();
+	TRACE_BEGIN (1, "step");
+	TRACE_INSTANT (1, "index", index);
+	g->entry = e;
+	g->index = index;
+	pthread_barrier_wait (&g->barrier);
+	pthread_barrier_wait (&g->barrier);
+
+	/* A wave lights the LEDs for the longest exposure of all cameras */
+
+	longest = 0;
+	for (i=0; i<g->n; i++)
+		if (g->cam[i].cs.exposure > longest)
+			longest = g->cam[i].cs.exposure;
+	t1 = timing_start ();
+	if (g->st && strobe_on (g->st, e->led, e->dutycycle, longest) < 0)
+		dp (0, "Could not switch the LEDs for step %d\n", index);
+	timing_stop (TM_LED, t1);
+	pthread_barrier_wait (&g->barrier);
+	pthread_barrier_wait (&g->barrier);
+
+	t1 = timing_start ();
+	if (g->st)
+		strobe_off (g->st);
+	timing_stop (TM_LED, t1);
+
+	err = 0;
+	for (i=0; i<g->n; i++)
+		if (g->cam[i].err) err = -1;
+	TRACE_END (1, "step");
+	timing_stop (TM_STEP, t0);
+
+	return err;
+}
 
-	if (pri > debuglevel) return;
-    va_start(args, format);
-    vsprintf(buf,format,args);
-    fprintf (stderr,"%s", buf);
+
+void group_close (camgroup *g)
+{
+int i;
+
+
+	for (i=0; i<g->n_open; i++)
+	{
+		cam_close (&g->cam[i].cs);
+		acc_free (&g->cam[i].acc);
+	}
+	g->n_open = 0;
 }
 
 
+/* Open the cameras of --camera, for a run with the LEDs of st (NULL for
+	none). Returns 0, or -1 with all of them closed again. */
 
-void show_error (GError **error)
+int group_open (camgroup *g, strobe *st)
 {
-	if ((error != NULL) && (*error != NULL))
-		dp (0, "Error message: %s\n", (*error)->message);
-	g_clear_error (error);
+int i;
+
+
+	memset (g, 0, sizeof (camgroup));
+	g->st = st;
+	for (i=0; i<n_cameras; i++)
+	{
+		g->cam[i].index = i;
+		g->cam[i].group = g;
+		if (cam_open (&g->cam[i].cs, camera_ids[i], n_buffers, trigger_mode, packed_pixels) < 0)
+		{
+			dp (0, "Could not open camera %d, %s\n", i, camera_ids[i]);
+			group_close (g);
+			return -1;
+		}
+		g->n_open++;
+		if (st && strobe_mode == STROBE_CAMERA && cam_strobe_output (&g->cam[i].cs, strobe_line) < 0)
+			dp (0, "LEDs are not gated by camera %d, they stay on between frames\n", i);
+	}
+
+	return 0;
 }
 
 
+/* Run sched on the open cameras of g. Frames are saved as name0_c0,
+	name0_c1, ..., by the sequence thread; or, if not numbered, sched is a
+	single step and taken right here, as name_c0, name_c1, ... With
+	stackfile set, every camera has a stack of its own. Returns 0 or -1. */
 
-void arv_save_png (ArvBuffer *buffer, const char *filename)
+int run_group (camgroup *g, seq_schedule *sched, const char *name, int numbered)
 {
-size_t buffer_size;
-char *buffer_data;
-int i, width, height;
-int bit_depth, arv_row_stride, color_type;
+char fname[1100];
+pipe_stats stats;
+seq_report report;
+camunit *cu;
+int i, n, err;
 
 
-	/* First of all, verify that we are really received an *image* to save as png */
+	/* Averaging needs a wave per frame, which all cameras would have to share */
 
-	assert (arv_buffer_get_payload_type(buffer) == ARV_BUFFER_PAYLOAD_TYPE_IMAGE);
+	for (i=0; i<sched->n; i++)
+		if (g->st && strobe_mode == STROBE_WAVE && sched->entries[i].frames > 1)
+		{
+			dp (0, "With several cameras, --strobe wave cannot average frames\n");
+			return -1;
+		}
 
-	/* Next, get the image metainformation and the pointer to th epixel buffer */
+	/* Auto-exposure is found on the first camera and used for all */
 
-	buffer_data = (char*)arv_buffer_get_data (buffer, &buffer_size); 				// raw data
-	arv_buffer_get_image_region(buffer, NULL, NULL, &width, &height); 				// get width/height
-	bit_depth = ARV_PIXEL_FORMAT_BIT_PER_PIXEL(arv_buffer_get_image_pixel_format(buffer)); // bit(s) per pixel
-	arv_row_stride = width * bit_depth/8; // bytes per row, for constructing row pointers
-	color_type = PNG_COLOR_TYPE_GRAY;
+	resolve_auto_exposure (&g->cam[0].cs, g->st, sched);
+	g->name = name;
+	g->numbered = numbered;
+	for (i=0; i<g->n_open; i++)
+	{
+		cu = &g->cam[i];
+		cam_set_geometry (&cu->cs, &sched->entries[0].geom);
+		cam_configure (&cu->cs, sched->entries[0].exposure, sched->entries[0].gain);
+		if (stackfile[0] && !frame_log && !archive)
+		{
+			camera_name (fname, sizeof (fname), stackfile, i);
+			camera_stacks[i] = tiffstack_open (fname, force_bigtiff ? -1 : stack_bytes (&cu->cs, sched), &tiffopts);
+			if (!camera_stacks[i])
+				dp (0, "Could not open %s, camera %d saves one file per step\n", fname, i);
+		}
+
+		/* At least one writer per camera (one for a stack, see run_sequence()) */
+
+		cu->pipe = pipe_start (&cu->cs, (camera_stacks[i] || archive || n_writers < 1) ? 1 : n_writers,
+			cu->cs.n_buffers - 1, pipe_policy, save_frame);
+	}
 
-	png_structp png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-	png_infop info_ptr = png_create_info_struct(png_ptr);
-	FILE * f = fopen(filename, "wb");
-	png_init_io (png_ptr, f);
-	png_set_IHDR (png_ptr, info_ptr, width, height, bit_depth, color_type,
-			PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
-	png_write_info (png_ptr, info_ptr);
+	pthread_mutex_init (&g->gate, NULL);
+	pthread_mutex_lock (&g->gate);
+	for (g->n=0; g->n<g->n_open; g->n++)
+		if (pthread_create (&g->cam[g->n].thread, NULL, camera_thread, &g->cam[g->n]))
+			break;
+	pthread_barrier_init (&g->barrier, NULL, g->n + 1);
+	pthread_mutex_unlock (&g->gate);
+
+	err = -1;
+	if (g->n < g->n_open)
+		dp (0, "Could not start the thread of camera %d\n", g->n);
+	else if (!numbered)
+		err = group_step (g, &sched->entries[0], -1);
+	else if ((err = seq_run (sched, group_step, g, rt_priority, &report)) == 0)
+	{
+		seq_report_print (&report);
+		if (report.all.failed)
+			err = -1;
+		seq_report_free (&report);
+	}
 
-	png_bytepp rows = (png_bytepp)(png_malloc(png_ptr, height*sizeof(png_bytep)));
+	g->entry = NULL;
+	pthread_barrier_wait (&g->barrier);
+	for (i=0; i<g->n; i++)
+		pthread_join (g->cam[i].thread, NULL);
+	pthread_barrier_destroy (&g->barrier);
+	pthread_mutex_destroy (&g->gate);
+
+	for (i=0; i<g->n_open; i++)
+	{
+		cu = &g->cam[i];
+		if (cu->pipe)
+		{
+			pipe_finish (cu->pipe, &stats);
+			cu->pipe = NULL;
+			dp ((stats.dropped || stats.stalls) ? 0 : 1,
+				"Camera %d: %lu frames, %lu written, %lu dropped, %lu stalls (%.3f s), max queue %d\n",
+				i, stats.submitted, stats.written, stats.dropped, stats.stalls, stats.stall_time, stats.max_depth);
+		}
+		if (camera_stacks[i])
+		{
+			n = tiffstack_close (camera_stacks[i]);
+			if (n < 0)
+			{
+				dp (0, "Failed to complete the stack of camera %d\n", i);
+				err = -1;
+			}
+			else
+				dp (1, "%d frames of camera %d written to its stack\n", n, i);
+			camera_stacks[i] = NULL;
+		}
+	}
 
-	for (i = 0; i < height; ++i)
-			rows[i] = (png_bytep)(buffer_data + (height - i)*arv_row_stride);
-	
-	png_write_image(png_ptr, rows);
-	png_write_end(png_ptr, NULL); 
-	png_free(png_ptr, rows);
-	png_destroy_write_struct(&png_ptr, &info_ptr);
-	fclose(f);
+	return err ? -1 : 0;
 }
 
 
+/* A sequence on all cameras of --camera, with the LEDs of st */
+
+int group_sequence (strobe *st, seq_schedule *sched)
+{
+camgroup g;
+int err;
+
+
+	if (group_open (&g, st) < 0)
+		return -1;
+	err = run_group (&g, sched, "sequence", 1);
+	group_close (&g);
+
+	return err;
+}
+
 
+/* -o with several cameras: a frame from each at the same time, with the
+	LEDs off, at -e, -g and -r, saved as name_c0.tif, name_c1.tif, ... */
 
-void arv_save_tiff (ArvBuffer *buffer, const char *filename)
+int acquire_group_frame ()
 {
-size_t buffer_size;
-char *buffer_data;
-int i, width, height;
-int bit_depth, arv_row_stride, color_type, bps;
+camgroup g;
+seq_schedule sched;
+seq_entry e;
+int err;
 
 
-	/* First of all, verify that we are really received an *image* before attempting to save it */
+	sequence_defaults (&e);
+	e.led = -1;
+	sched.n = 1;
+	sched.n_src = 1;
+	sched.entries = &e;
+	if (group_open (&g, NULL) < 0)
+		return -1;
+	err = run_group (&g, &sched, savefile, 0);
+	group_close (&g);
 
-	assert (arv_buffer_get_payload_type(buffer) == ARV_BUFFER_PAYLOAD_TYPE_IMAGE);
+	return err ? -1 : EXIT_SUCCESS;
+}
 
-	/* Next, get the image metainformation and the pointer to the pixel buffer */
-	/* CAUTION: What format does the camera use for anything > 8 bits per pixel?
-		If it is 16 bits, make sure we have MSB first.
-		If it is 12 bits, make sure it is expanded to 16 bits; packed 12 bits are not acceptable 
-	*/
 
-	buffer_data = (char*)arv_buffer_get_data (buffer, &buffer_size); 				// raw data
-	arv_buffer_get_image_region(buffer, NULL, NULL, &width, &height); 				// get width/height
-	bit_depth = ARV_PIXEL_FORMAT_BIT_PER_PIXEL(arv_buffer_get_image_pixel_format(buffer)); // bit(s) per pixel
-	bps = bit_depth / 8;					/* Bytes per sample, bytes per pixel */
-	arv_row_stride = width * bps; // bytes per row, for constructing row pointers
 
-	/* bps should tell the whole story, save the data now */
+void do_sequence(char *sequence)
+{
+
+    camsession cs;
+    seq_schedule sched;
+    seq_entry defaults;
+    int pi;
+    strobe st;
+
+    // the whole sequence is checked before any hardware is touched
+    sequence_defaults(&defaults);
+    if (seq_compile(sequence, &defaults, &sched) < 0)
+        return;
+
+    pi = pigpio_start(NULL, NULL);
+    if (pi < 0)
+    {
+        fprintf (stderr, "Connection to pigpio daemon failed");
+        seq_free(&sched);
+        return;
+    }
+    
+    // with waves, the Pi triggers the camera as part of each step
+    if (strobe_mode == STROBE_WAVE)
+        trigger_mode = CAM_TRIGGER_HARDWARE;
+    if (strobe_open(&st, pi, strobe_mode, trigger_pin, strobe_lead) < 0)
+    {
+        fprintf (stderr, "Could not set up the LED pins\n");
+        pigpio_stop(pi);
+        seq_free(&sched);
+        return;
+    }
+
+    // several cameras: a thread each, all under the same LED steps
+    if (n_cameras > 1)
+    {
+        group_sequence(&st, &sched);
+        seq_free(&sched);
+        strobe_close(&st);
+        pigpio_stop(pi);
+        return;
+    }
+
+    // open and configure the camera once for the whole sequence
+    // with writer threads, the pool needs room for queued frames plus the one being captured
+    if (n_writers > 0 && n_buffers < 2)
+        n_buffers = 2;
+    if (cam_open(&cs, first_camera(), n_buffers, trigger_mode, packed_pixels) < 0)
+    {
+        strobe_close(&st);
+        pigpio_stop(pi);
+        seq_free(&sched);
+        return;
+    }
+    if (strobe_mode == STROBE_CAMERA && cam_strobe_output(&cs, strobe_line) < 0)
+        dp (0, "LEDs are not gated by the camera, they stay on between frames\n");
 
-	tiffwrite (filename, buffer_data, width, height, bps, NULL );
+    run_sequence(&cs, &st, &sched, "sequence", 1);
+    seq_free(&sched);
 
+    strobe_close(&st);
+    pigpio_stop(pi);
+    cam_close(&cs);
 }
 
 
 
+/* Run one daemon job (see daemon.h) on the open camera, with the LEDs of
+	st (NULL without pigpiod). Returns NULL if it went well, else the reason. */
 
-int acquire_frame()
+const char *run_job (camsession *cs, strobe *st, char *line)
 {
-ArvCamera *camera;
-ArvBuffer *buffer;
-GError *error = NULL;
-double exposure_time, exp_time_dummy;
-double gain = 12;
-double gain_min, gain_max;
-const gchar *cam_vendor, *cam_model;
-ArvPixelFormat pixelformat;
+seq_schedule sched;
+seq_entry defaults;
+char *words[4], *name, *stackname, *opt;
+char oldstack[1024];
+int n, k, err;
+
 
+	n = 0;
+	for (opt = strtok (line, " \t"); opt && n < 4; opt = strtok (NULL, " \t"))
+		words[n++] = opt;
+	if (opt || n < 2)
+		return "bad request";
 
-	exposure_time = 15000; 					/* in microseconds */
-	camera = arv_camera_new (NULL, &error);
-	if (!camera)
+	sequence_defaults (&defaults);
+
+	if (!strcmp (words[0], "capture"))
 	{
-		dp (0, "Error opening the camera object\n");
-		show_error (&error);
-		return -1;
+		if (n > 3) return "bad request";
+		snprintf (savefile, sizeof (savefile), "%s", words[1]);
+		if (n == 2)
+		{
+			if (cs->trigger_mode == CAM_TRIGGER_HARDWARE)
+				return "captures need a step with --strobe wave";
+			return capture_frame (cs, savefile) ? "capture failed" : NULL;
+		}
+		if (!st) return "no LEDs without pigpiod";
+		if (seq_compile (words[2], &defaults, &sched) < 0)
+			return "bad step";
+		if (sched.n != 1)
+		{
+			seq_free (&sched);
+			return "a capture is a single step";
+		}
+		err = run_sequence (cs, st, &sched, words[1], 0);
+		seq_free (&sched);
+		return err ? "capture failed" : NULL;
 	}
 
-	cam_vendor = arv_camera_get_vendor_name (camera, &error);
-	cam_model = arv_camera_get_model_name (camera, &error);
-	show_error (&error);
-	dp (1, "Found: Vendor %s, model %s\n", cam_vendor, cam_model);
+	if (!strcmp (words[0], "sequence"))
+	{
+		if (!st) return "no LEDs without pigpiod";
+		name = "sequence";
+		stackname = NULL;
+		for (k=2; k<n; k++)
+			if (!strncmp (words[k], "stack=", 6))
+				stackname = words[k] + 6;
+			else if (!strncmp (words[k], "name=", 5))
+				name = words[k] + 5;
+			else
+				return "bad request";
+
+		strcpy (oldstack, stackfile);
+		if (stackname)
+			snprintf (stackfile, sizeof (stackfile), "%s", stackname);
+		err = -1;
+		if (seq_compile (words[1], &defaults, &sched) == 0)
+		{
+			err = run_sequence (cs, st, &sched, name, 1);
+			seq_free (&sched);
+		}
+		strcpy (stackfile, oldstack);
+		return err ? "sequence failed" : NULL;
+	}
+
+	return "unknown request";
+}
+
+
 
-	arv_camera_set_exposure_time_auto (camera, ARV_AUTO_OFF, &error);
-	arv_camera_set_exposure_time (camera, exposure_time, &error);
-	arv_camera_get_gain_bounds(camera, &gain_min, &gain_max, &error);
-	arv_camera_set_gain_auto (camera, ARV_AUTO_OFF, &error);
-	arv_camera_set_gain (camera, gain, &error);
-	exp_time_dummy = arv_camera_get_exposure_time (camera, &error);
-	show_error (&error);
+/* --daemon: open pigpiod and the camera once, then run the jobs that come
+	in over the socket until one asks for a shutdown. Without pigpiod, only
+	captures without LEDs can be done. Returns 0 or -1. */
 
-	arv_camera_set_pixel_format (camera, ARV_PIXEL_FORMAT_MONO_16, &error);
-	pixelformat = arv_camera_get_pixel_format (camera, &error);
-	show_error (&error);
-	if (pixelformat != ARV_PIXEL_FORMAT_MONO_16)
+int run_daemon ()
+{
+jobserver *js;
+daemon_job *job;
+camsession cs;
+strobe st, *leds;
+const char *error;
+char line[DAEMON_MAX_LINE];
+int pi;
+
+
+	js = daemon_open (socketpath);
+	if (!js) return -1;
+	if (n_cameras > 1)
+		dp (0, "The daemon runs the first camera only, %s\n", camera_ids[0]);
+
+	leds = NULL;
+	pi = pigpio_start (NULL, NULL);
+	if (pi < 0)
+		dp (0, "No pigpio daemon, captures without LEDs only\n");
+	else
 	{
-		dp (1, "Warning: Unable to set 12-bit mono pixel format. Have %08H instead\n", pixelformat);
+		if (strobe_mode == STROBE_WAVE)
+			trigger_mode = CAM_TRIGGER_HARDWARE;
+		if (strobe_open (&st, pi, strobe_mode, trigger_pin, strobe_lead) < 0)
+			dp (0, "Could not set up the LED pins, captures without LEDs only\n");
+		else
+			leds = &st;
 	}
 
+	if (n_writers > 0 && n_buffers < 2)
+		n_buffers = 2;
+	if (cam_open (&cs, first_camera (), n_buffers, trigger_mode, packed_pixels) < 0)
+	{
+		if (leds) strobe_close (leds);
+		if (pi >= 0) pigpio_stop (pi);
+		daemon_close (js);
+		return -1;
+	}
+	if (leds && strobe_mode == STROBE_CAMERA && cam_strobe_output (&cs, strobe_line) < 0)
+		dp (0, "LEDs are not gated by the camera, they stay on between frames\n");
 
-	buffer = arv_camera_acquisition (camera, 0, &error);
-	show_error (&error);
-	if (ARV_IS_BUFFER (buffer))
+	dp (1, "Waiting for jobs on %s\n", socketpath);
+	while ((job = daemon_next_job (js)) != NULL)
 	{
-		dp (1, "Image successfully acquired. Now saving as a TIFF file.\n");
-		arv_save_tiff (buffer, savefile);
-//		printf ("Image successfully acquired. Now saving as a PNG file.\n");
-//		arv_save_png (buffer, "test.png");
+		dp (1, "Job %d: %s\n", job->id, job->line);
+		strcpy (line, job->line);
+		current_job = job;
+		error = run_job (&cs, leds, line);
+		current_job = NULL;
+		daemon_job_done (js, job, error);
 	}
-	else
+	dp (1, "Daemon shut down\n");
+
+	cam_close (&cs);
+	acc_free (&acc);
+	if (leds) strobe_close (leds);
+	if (pi >= 0) pigpio_stop (pi);
+	daemon_close (js);
+
+	return 0;
+}
+
+
+
+/* Raw log around a run: created before the first frame if --rawlog was given,
+	cut to its used size afterwards. Returns -1 if it was requested but cannot
+	be created. */
+
+int open_rawlog()
+{
+	if (!rawlogfile[0]) return 0;
+
+	frame_log = rawlog_create (rawlogfile, (unsigned long long)(rawlog_size * 1048576.0));
+	if (!frame_log)
 	{
-		dp (0, "Failed to acquire a single image\n");
+		dp (0, "Could not create the raw log %s\n", rawlogfile);
+		return -1;
 	}
-	
-	g_object_unref (camera);
-	g_object_unref (buffer);
+	return 0;
+}
 
-	return EXIT_SUCCESS;
+
+void close_rawlog()
+{
+	if (frame_log) rawlog_close (frame_log);
+	frame_log = NULL;
 }
 
-void do_sequence(char *sequence)
+
+
+/* The same for the time-lapse archive, --timelapse. An existing archive
+	is appended to. */
+
+int open_timelapse()
 {
+	if (!timelapsefile[0]) return 0;
 
-    const char delims[3] = "-,";
-    char *saveptr = sequence;
-    char *token, *temp;
-    char scount[2]; //could cause memory leaks? research malloc()?
-    int dutycycle, count, err;
-    enum led_color Led_color;
-    
-    count = 0;
-    int pi;
-    pi = pigpio_start(NULL, NULL);
-    if (pi < 0)
-    {
-        fprintf (stderr, "Connection to pigpio daemon failed");
-        return -1;
-    }
-    
-    err = set_mode(pi, WHITE_LED_PIN, PI_OUTPUT);
-    err = set_mode(pi, BLUE_LED_PIN, PI_OUTPUT);
-    
-    err = set_PWM_frequency(pi, WHITE_LED_PIN, 8000);
-    err = set_PWM_frequency(pi, BLUE_LED_PIN, 8000);
+	archive = tlapse_create (timelapsefile, key_interval);
+	if (!archive)
+	{
+		dp (0, "Could not open the time-lapse archive %s\n", timelapsefile);
+		return -1;
+	}
+	return 0;
+}
 
-    
-    while ((token = strtok_r(saveptr, delims, &saveptr)))
-    {
-        //parse command line input into substrings
-        printf("letter: %s\n", token);
-        
-        if (!strcmp(token, "b"))
-        {
-            Led_color = Blue;
-        }
-        else if (!strcmp(token, "w"))
-        {
-            Led_color = White;
-        }
-        else if (!strcmp(token, "bw"))
-        {
-            Led_color = White_and_blue;
-        }
-        else
-        {
-            dp (1, "Could not parse sequence");
-            return;
-        }
-        
-        token = strtok_r(saveptr, delims, &saveptr);
-        
-        dutycycle = atoi(token); //must be value from 0 to 255
-        
-        //create unique filename for each image
-        char filename[64]; //May have to come back to this - could cause memory leaks I think?
-        strcpy(filename, "sequence");
-        sprintf(scount, "%d", count);
-        strcat(filename, scount);
-        strcpy(savefile, filename);
-        
-        if (Led_color == Blue)
-        {
-            err = set_PWM_dutycycle(pi, BLUE_LED_PIN, dutycycle);
-            acquire_frame();
-            err = set_PWM_dutycycle(pi, BLUE_LED_PIN, 0);
-        }
-        else if (Led_color == White)
-        {
-            err = set_PWM_dutycycle(pi, WHITE_LED_PIN, dutycycle);
-            acquire_frame();
-            err = set_PWM_dutycycle(pi, WHITE_LED_PIN, 0);
-        }
-        else if (Led_color == White_and_blue)
-        {
-            err = set_PWM_dutycycle(pi, BLUE_LED_PIN, dutycycle);
-            err = set_PWM_dutycycle(pi, WHITE_LED_PIN, dutycycle);
-            acquire_frame();
-            err = set_PWM_dutycycle(pi, BLUE_LED_PIN, 0);
-            err = set_PWM_dutycycle(pi, WHITE_LED_PIN, 0);
-        }
 
-        count++;
-       }
+void close_timelapse()
+{
+	if (archive && tlapse_close (archive) < 0)
+		dp (0, "Could not finish the time-lapse archive %s\n", timelapsefile);
+	archive = NULL;
+}
+
+
+
+/* The same for the statistics file, --stats */
+
+int open_stats()
+{
+int i;
+
+
+	if (!statsfile[0]) return 0;
+
+	frame_stats = stats_open (statsfile, index_mode);
+	if (!frame_stats)
+	{
+		dp (0, "Could not create the statistics file %s\n", statsfile);
+		return -1;
+	}
+	for (i=0; i<n_stats_regions; i++)
+		if (stats_add_region (frame_stats, stats_regions[i]) < 0)
+			dp (0, "Bad statistics region %s, not used\n", stats_regions[i]);
+	return 0;
+}
+
+
+void close_stats()
+{
+	if (frame_stats && stats_close (frame_stats) < 0)
+		dp (0, "Could not write the statistics file %s\n", statsfile);
+	frame_stats = NULL;
+}
+
+
+
+/* Stage timings of the run, --timing: appended, so that the runs of a
+	benchmark can share one file. And the trace, --trace. */
+
+void write_profile()
+{
+	if (timingfile[0] && timing_write (timingfile) < 0)
+		dp (0, "Could not write the timings to %s\n", timingfile);
+	if (tracefile[0] && trace_write (tracefile) < 0)
+		dp (0, "Could not write the trace to %s\n", tracefile);
 }
 
 
@@ -314,10 +2097,87 @@ void prhelp()
 	fprintf (stderr, "valid options are:\n");
 	fprintf (stderr, "-h --help         print this help text\n");
 	fprintf (stderr, "-v --verbose      enable debug message output\n");
-	fprintf (stderr, "-o                save output to file, -o 'name'\n");
-	fprintf (stderr, "-e --exposure     set exposure time in microseconds, -e 1000.0\n");
-	fprintf (stderr, "-s --sequence     acquire a sequence of images with PWM controlled LEDs at a specified duty cycle (see documentation)\n");
-	fprintf (stderr, "-g --gain         set gain");
+	fprintf (stderr, "-o                save output to file, -o 'name'; .tif, .png, .pnm or .raw picks the format\n");
+	fprintf (stderr, "--camera          camera to open, default the first one found; Fake_1 is Aravis'\n");
+	fprintf (stderr, "                  simulated camera, --camera Fake_1. Give it again for more cameras\n");
+	fprintf (stderr, "                  (up to %d, or 'all'), run in parallel under the same LEDs and saved\n", MAX_CAMERAS);
+	fprintf (stderr, "                  as name_c0, name_c1, ... (also the stacks)\n");
+	fprintf (stderr, "--list-cameras    print the cameras found\n");
+	fprintf (stderr, "--timing          append per-stage latencies (us) to a file, for make bench, --timing t.txt\n");
+	fprintf (stderr, "--daemon          keep the camera and pigpiod open and take capture jobs over a UNIX\n");
+	fprintf (stderr, "                  socket (see daemon.h), e.g. 'capture /data/a.tif w-128/e=5000'\n");
+	fprintf (stderr, "--socket          socket of --daemon and --submit, default %s\n", DAEMON_SOCKET);
+	fprintf (stderr, "--submit          send one job to the daemon and print its answers, --submit 'sequence w-128,b-64'\n");
+	fprintf (stderr, "--trace           record acquire/encode/write/LED spans per thread, written as Chrome\n");
+	fprintf (stderr, "                  trace JSON at the end (chrome://tracing), --trace run.json\n");
+	fprintf (stderr, "-e --exposure     set exposure time in microseconds, -e 15000.0, or auto: found from\n");
+	fprintf (stderr, "                  decimated preview frames per LED and duty cycle (per step: /e=auto)\n");
+	fprintf (stderr, "--ae-target       auto-exposure level of the 99th percentile, fraction of full scale, 0.8\n");
+	fprintf (stderr, "--ae-max-exposure longest exposure before auto-exposure raises the gain, us, 200000\n");
+	fprintf (stderr, "--ae-cache        file of the converged settings, default ~/.acquire_exposure\n");
+	fprintf (stderr, "-s --sequence     acquire a sequence of images with PWM controlled LEDs at a specified duty cycle,\n");
+	fprintf (stderr, "                  -s b-128,w-64. Steps take options /e=exposure_us /g=gain /n=repeats\n");
+	fprintf (stderr, "                  /p=period_ms; wait=ms pauses, N*(...) repeats a part (see sequence.h)\n");
+	fprintf (stderr, "--average         save the mean of N frames per image (per step: /a=N), --average 16\n");
+	fprintf (stderr, "--sum             save the sum of N frames per image, scaled down to 16 bits if needed\n");
+	fprintf (stderr, "--acc-format      result of --average/--sum as 16 (default) or float (32-bit float TIFF)\n");
+	fprintf (stderr, "--calib           correct 16-bit frames with the darks and flats of this store, --calib cal.dat\n");
+	fprintf (stderr, "--capture-dark    with --calib, add a dark for the current -r/exposure/gain (mean of\n");
+	fprintf (stderr, "                  --average N frames, default 16) to the store\n");
+	fprintf (stderr, "--capture-flat    with --calib, add a flat field for an LED, --capture-flat w-128/e=5000\n");
+	fprintf (stderr, "--stats           per-frame mean, variance, min, max and histogram to a CSV file, or\n");
+	fprintf (stderr, "                  JSON lines if it ends in .json, --stats run.csv\n");
+	fprintf (stderr, "--stats-roi       also for this region of the saved image (up to %d), --stats-roi 200x200+100+50\n",
+		STATS_MAX_REGIONS);
+	fprintf (stderr, "--index           with --stats, combine each white and blue frame into a float map,\n");
+	fprintf (stderr, "                  ratio (blue/white) or ndi ((white-blue)/(white+blue)), per exposure and duty\n");
+	fprintf (stderr, "--stats-only      with --stats, save no images, only the statistics\n");
+	fprintf (stderr, "--rt-priority     SCHED_FIFO priority of the sequence thread, 0 for none, --rt-priority 50\n");
+	fprintf (stderr, "-g --gain         set gain in dB, -g 12\n");
+	fprintf (stderr, "-t --trigger      how a sequence obtains frames, -t software (default), continuous or hardware\n");
+	fprintf (stderr, "--strobe          how LEDs are lit per step: steady (default, PWM around the capture),\n");
+	fprintf (stderr, "                  camera (gated by the camera's ExposureActive output) or wave\n");
+	fprintf (stderr, "                  (a pigpio wave triggers the camera and lights the LEDs for the exposure)\n");
+	fprintf (stderr, "--strobe-line     camera output wired to the LED drivers, --strobe-line Line1\n");
+	fprintf (stderr, "--trigger-pin     GPIO wired to the camera trigger input, --trigger-pin 18\n");
+	fprintf (stderr, "--strobe-lead     microseconds from trigger to LEDs on, --strobe-lead 20\n");
+	fprintf (stderr, "-b --buffers      number of pre-allocated stream buffers, -b 4\n");
+	fprintf (stderr, "-p --packed       transfer packed Mono12p/Mono12Packed/Mono10p if the camera has it\n");
+	fprintf (stderr, "-r --roi          region of interest in sensor pixels, optionally with binning and\n");
+	fprintf (stderr, "                  decimation, -r 1024x768+512+256:bin2:dec1. A sequence step\n");
+	fprintf (stderr, "                  can have its own, -s b-100@800x600+0+0,w-50@full\n");
+	fprintf (stderr, "--binning         average N x N pixels, in the camera or else in software, --binning 2\n");
+	fprintf (stderr, "--decimation      keep every N-th pixel and row, --decimation 2\n");
+	fprintf (stderr, "-w --writers      save sequence frames in N background writer threads, -w 2\n");
+	fprintf (stderr, "--drop            with -w, drop frames instead of waiting when the writers fall behind\n");
+	fprintf (stderr, "-j --tiff-threads compress TIFF strips with N threads, -j 4\n");
+	fprintf (stderr, "--strip-rows      rows per TIFF strip, default one strip (64 with -j)\n");
+	fprintf (stderr, "-c --compression  TIFF compression none, lzw (default), deflate, zstd or lzma,\n");
+	fprintf (stderr, "                  optionally with a level, -c deflate:6\n");
+	fprintf (stderr, "--predictor       use the TIFF horizontal difference predictor\n");
+	fprintf (stderr, "--stack           save all frames of a sequence as pages of one TIFF, --stack run.tif\n");
+	fprintf (stderr, "--bigtiff         with --stack, always write BigTIFF\n");
+	fprintf (stderr, "--preview         also save an 8-bit preview of each image, reduced 2, 4 or 8 times and\n");
+	fprintf (stderr, "                  contrast stretched, as NAME_preview.pgm (.png for PNG files), --preview 4\n");
+	fprintf (stderr, "--pyramid         add 2x, 4x and 8x reductions to TIFF output as SubIFDs\n");
+	fprintf (stderr, "--demosaic        Bayer frames of colour cameras to RGB TIFF/PNG: bilinear (default),\n");
+	fprintf (stderr, "                  gradient (gradient-corrected, fewer colour fringes) or none\n");
+	fprintf (stderr, "--demosaic-threads demosaic bands of rows with N threads, --demosaic-threads 4\n");
+	fprintf (stderr, "--direct-io       write TIFF, PNM and raw log output with O_DIRECT through io_uring,\n");
+	fprintf (stderr, "                  bypassing the page cache\n");
+	fprintf (stderr, "--io-depth        with --direct-io, 1 MB writes in flight per file, --io-depth 4\n");
+	fprintf (stderr, "--rawlog          append unencoded frames to a raw frame log, --rawlog run.raw\n");
+	fprintf (stderr, "--rawlog-size     raw log capacity in MB, allocated up front, --rawlog-size 1024\n");
+	fprintf (stderr, "--timelapse       add frames to a time-lapse archive (created or appended to): lossless\n");
+	fprintf (stderr, "                  residuals against keyframes, rawconv extracts them, --timelapse trays.tla\n");
+	fprintf (stderr, "--key-interval    frames per keyframe in the archive, default %d\n", TLAPSE_KEY_INTERVAL);
+	fprintf (stderr, "--png             save PNG instead of TIFF files, as --format png\n");
+	fprintf (stderr, "--format          formats of single files, tiff, png, pnm or raw (samples only), several\n");
+	fprintf (stderr, "                  written side by side, --format tiff,png; default by the -o extension\n");
+	fprintf (stderr, "--png-level       PNG zlib level 0-9, default 6, --png-level 1\n");
+	fprintf (stderr, "--png-filter      PNG row filter none, sub, up, avg, paeth or adaptive (default)\n");
+	fprintf (stderr, "--png-strategy    PNG zlib strategy default, filtered, huffman, rle or fixed\n");
+	fprintf (stderr, "--png-threads     compress PNG row bands with N threads, --png-threads 4\n");
  
 }
 
@@ -325,37 +2185,340 @@ void prhelp()
 
 int main (int argc, char **argv)
 {
-int err;
+int err, run_as_daemon = 0;
 
 	debuglevel = 0;
-	exposure = 1000.0;
+	exposure = DEFAULT_EXPOSURE_TIME;
+	gain = DEFAULT_GAIN;
+	ae_defaults (&ae);
+	if (getenv ("HOME"))
+		snprintf (ae_cachefile, sizeof (ae_cachefile), "%s/.acquire_exposure", getenv ("HOME"));
+	else
+		strcpy (ae_cachefile, ".acquire_exposure");
+	geometry_init (&roi);
 	strcpy (savefile, "test.tif");
-	char *sequence;
+	char *sequence = NULL;
 
     while (--argc && **++argv=='-') 
 	{
 		if (!strcmp(argv[0], "-o"))
 			strcpy (savefile, nextargs);
+		else if (!strcmp(argv[0],"--camera"))
+		{
+			if (!strcmp (nextargs, "all"))
+				n_cameras += cam_enumerate (camera_ids + n_cameras, MAX_CAMERAS - n_cameras, 0);
+			else if (n_cameras < MAX_CAMERAS)
+				snprintf (camera_ids[n_cameras++], CAM_ID_LEN, "%s", argv[0]);
+			else
+			{
+				fprintf (stderr, "At most %d cameras\n", MAX_CAMERAS);
+				return -1;
+			}
+		}
+		else if (!strcmp(argv[0],"--list-cameras"))
+			return cam_enumerate (camera_ids, MAX_CAMERAS, 1) ? 0 : 1;
+		else if (!strcmp(argv[0],"--daemon"))
+			run_as_daemon = 1;
+		else if (!strcmp(argv[0],"--socket"))
+			snprintf (socketpath, sizeof (socketpath), "%s", nextargs);
+		else if (!strcmp(argv[0],"--submit"))
+			return daemon_submit (socketpath, nextargs) ? 1 : 0;
+		else if (!strcmp(argv[0],"--trace"))
+		{
+			snprintf (tracefile, sizeof (tracefile), "%s", nextargs);
+			trace_start ();
+		}
+		else if (!strcmp(argv[0],"--timing"))
+		{
+			snprintf (timingfile, sizeof (timingfile), "%s", nextargs);
+			if (timing_enable () < 0)
+			{
+				fprintf (stderr, "Out of memory for timings\n");
+				return -1;
+			}
+		}
 		else if (!strcmp(argv[0],"-v") || !strcmp(argv[0],"--verbose"))
 		{
 			debuglevel++;
 			dp (2, "Verbosity level raised to %d\n", debuglevel);
 		}
 		else if (!strcmp(argv[0], "-e") || !strcmp(argv[0],"--exposure"))
-			exposure = nextargf;
+		{
+			exposure = strcmp (nextargs, "auto") ? atof (argv[0]) : SEQ_AUTO_EXPOSURE;
+			if (exposure <= 0 && exposure != SEQ_AUTO_EXPOSURE)
+			{
+				fprintf (stderr, "Exposure must be positive or auto\n");
+				return -1;
+			}
+		}
+		else if (!strcmp(argv[0], "-g") || !strcmp(argv[0],"--gain"))
+			gain = nextargf;
+		else if (!strcmp(argv[0],"--ae-target"))
+			ae.target = nextargf;
+		else if (!strcmp(argv[0],"--ae-max-exposure"))
+			ae.max_exposure = nextargf;
+		else if (!strcmp(argv[0],"--ae-cache"))
+			snprintf (ae_cachefile, sizeof (ae_cachefile), "%s", nextargs);
 		else if (!strcmp(argv[0],"-h") || !strcmp(argv[0],"--help"))
 		{
 			prhelp();
 			return 0;
 		}
-		else if (!strcmp(argv[0],"-s") || !strcmp(argv[0],"--sequence"))
+		else if (!strcmp(argv[0], "-t") || !strcmp(argv[0],"--trigger"))
+		{
+			char *mode = nextargs;
+			if (!strcmp(mode, "continuous"))
+				trigger_mode = CAM_TRIGGER_CONTINUOUS;
+			else if (!strcmp(mode, "hardware"))
+				trigger_mode = CAM_TRIGGER_HARDWARE;
+			else
+				trigger_mode = CAM_TRIGGER_SOFTWARE;
+		}
+		else if (!strcmp(argv[0],"--strobe"))
+		{
+			strobe_mode = strobe_parse_mode (nextargs);
+			if (strobe_mode < 0)
+			{
+				fprintf (stderr, "Unknown strobe mode %s\n", argv[0]);
+				return -1;
+			}
+		}
+		else if (!strcmp(argv[0],"--average") || !strcmp(argv[0],"--sum"))
+		{
+			acc_mode = strcmp(argv[0],"--sum") ? ACC_MEAN : ACC_SUM;
+			acc_frames = nextargi;
+			if (acc_frames < 1 || acc_frames > ACC_MAX_FRAMES)
+			{
+				fprintf (stderr, "Frame count must be 1 to %d\n", ACC_MAX_FRAMES);
+				return -1;
+			}
+		}
+		else if (!strcmp(argv[0],"--acc-format"))
+		{
+			acc_format = acc_parse_format (nextargs);
+			if (acc_format < 0)
+			{
+				fprintf (stderr, "Unknown accumulator format %s\n", argv[0]);
+				return -1;
+			}
+		}
+		else if (!strcmp(argv[0],"--calib"))
+		{
+			snprintf (calibfile, sizeof (calibfile), "%s", nextargs);
+			calib_close (calib);
+			calib = NULL;
+			if (access (calibfile, F_OK) == 0)
+			{
+				calib = calib_open (calibfile);
+				if (!calib)
+					return -1;
+				dp (1, "Calibration store %s, generation %u\n", calibfile, calib_generation (calib));
+			}
+		}
+		else if (!strcmp(argv[0],"--capture-dark"))
+			capture_kind = CALIB_DARK;
+		else if (!strcmp(argv[0],"--capture-flat"))
+		{
+			capture_kind = CALIB_FLAT;
+			snprintf (capture_spec, sizeof (capture_spec), "%s", nextargs);
+		}
+		else if (!strcmp(argv[0],"--stats"))
+			snprintf (statsfile, sizeof (statsfile), "%s", nextargs);
+		else if (!strcmp(argv[0],"--stats-roi"))
+		{
+			if (n_stats_regions >= STATS_MAX_REGIONS)
+			{
+				fprintf (stderr, "At most %d statistics regions\n", STATS_MAX_REGIONS);
+				return -1;
+			}
+			snprintf (stats_regions[n_stats_regions++], sizeof (stats_regions[0]), "%s", nextargs);
+		}
+		else if (!strcmp(argv[0],"--index"))
+		{
+			index_mode = stats_parse_index (nextargs);
+			if (index_mode < 0)
+			{
+				fprintf (stderr, "Unknown index %s\n", argv[0]);
+				return -1;
+			}
+		}
+		else if (!strcmp(argv[0],"--stats-only"))
+			stats_only = 1;
+		else if (!strcmp(argv[0],"--rt-priority"))
+			rt_priority = nextargi;
+		else if (!strcmp(argv[0],"--strobe-line"))
+			snprintf (strobe_line, sizeof (strobe_line), "%s", nextargs);
+		else if (!strcmp(argv[0],"--trigger-pin"))
+			trigger_pin = nextargi;
+		else if (!strcmp(argv[0],"--strobe-lead"))
+			strobe_lead = nextargi;
+		else if (!strcmp(argv[0], "-b") || !strcmp(argv[0],"--buffers"))
+			n_buffers = nextargi;
+		else if (!strcmp(argv[0], "-p") || !strcmp(argv[0],"--packed"))
+			packed_pixels = 1;
+		else if (!strcmp(argv[0], "-r") || !strcmp(argv[0],"--roi"))
 		{
-            sequence = nextargs;
-            do_sequence(sequence);
-            return 0;
+			if (geometry_parse (nextargs, &roi) < 0)
+			{
+				fprintf (stderr, "Cannot parse geometry %s\n", argv[0]);
+				return -1;
+			}
 		}
+		else if (!strcmp(argv[0],"--binning"))
+			roi.binning = nextargi;
+		else if (!strcmp(argv[0],"--decimation"))
+			roi.decimation = nextargi;
+		else if (!strcmp(argv[0], "-w") || !strcmp(argv[0],"--writers"))
+			n_writers = nextargi;
+		else if (!strcmp(argv[0],"--drop"))
+			pipe_policy = PIPE_DROP;
+		else if (!strcmp(argv[0], "-j") || !strcmp(argv[0],"--tiff-threads"))
+		{
+			tiffopts.threads = nextargi;
+			if (tiffopts.threads > 1 && tiffopts.rows_per_strip == 0)
+				tiffopts.rows_per_strip = 64;
+		}
+		else if (!strcmp(argv[0],"--strip-rows"))
+			tiffopts.rows_per_strip = nextargi;
+		else if (!strcmp(argv[0], "-c") || !strcmp(argv[0],"--compression"))
+		{
+			if (tiff_parse_compression (nextargs, &tiffopts) < 0)
+			{
+				fprintf (stderr, "Unknown compression %s\n", argv[0]);
+				return -1;
+			}
+		}
+		else if (!strcmp(argv[0],"--predictor"))
+			tiffopts.predictor = PREDICTOR_HORIZONTAL;
+		else if (!strcmp(argv[0],"--stack"))
+			strcpy (stackfile, nextargs);
+		else if (!strcmp(argv[0],"--bigtiff"))
+			force_bigtiff = 1;
+		else if (!strcmp(argv[0],"--preview"))
+		{
+			preview_level = nextargi;			/* Reduction 2, 4 or 8 to pyramid level */
+			preview_level = (preview_level >= 8) ? 3 : (preview_level >= 4) ? 2 : 1;
+		}
+		else if (!strcmp(argv[0],"--pyramid"))
+			tiff_pyramid = 1;
+		else if (!strcmp(argv[0],"--demosaic"))
+		{
+			if (dm_parse_method (nextargs, &dmopts) < 0)
+			{
+				fprintf (stderr, "Unknown demosaic method %s\n", argv[0]);
+				return -1;
+			}
+		}
+		else if (!strcmp(argv[0],"--demosaic-threads"))
+			dmopts.threads = nextargi;
+		else if (!strcmp(argv[0],"--direct-io"))
+			dioopts.enabled = 1;
+		else if (!strcmp(argv[0],"--io-depth"))
+			dioopts.depth = nextargi;
+		else if (!strcmp(argv[0],"--rawlog"))
+			strcpy (rawlogfile, nextargs);
+		else if (!strcmp(argv[0],"--rawlog-size"))
+			rawlog_size = nextargf;
+		else if (!strcmp(argv[0],"--timelapse"))
+			snprintf (timelapsefile, sizeof (timelapsefile), "%s", nextargs);
+		else if (!strcmp(argv[0],"--key-interval"))
+			key_interval = nextargi;
+		else if (!strcmp(argv[0],"--png"))
+		{
+			file_writers[0] = writer_find ("png");
+			n_file_writers = 1;
+		}
+		else if (!strcmp(argv[0],"--format"))
+		{
+			n_file_writers = writer_parse_list (nextargs, file_writers, IMG_MAX_WRITERS);
+			if (n_file_writers <= 0)
+			{
+				fprintf (stderr, "Unknown format in %s\n", argv[0]);
+				return -1;
+			}
+		}
+		else if (!strcmp(argv[0],"--png-level"))
+			pngopts.level = nextargi;
+		else if (!strcmp(argv[0],"--png-filter"))
+		{
+			if (png_parse_filter (nextargs, &pngopts) < 0)
+			{
+				fprintf (stderr, "Unknown PNG filter %s\n", argv[0]);
+				return -1;
+			}
+		}
+		else if (!strcmp(argv[0],"--png-strategy"))
+		{
+			if (png_parse_strategy (nextargs, &pngopts) < 0)
+			{
+				fprintf (stderr, "Unknown PNG strategy %s\n", argv[0]);
+				return -1;
+			}
+		}
+		else if (!strcmp(argv[0],"--png-threads"))
+			pngopts.threads = nextargi;
+		else if (!strcmp(argv[0],"-s") || !strcmp(argv[0],"--sequence"))
+			sequence = nextargs;
+	}
+
+	/* The file formats, before anything is saved: by --format, else by the
+		extension of -o, else TIFF */
+
+	if (!n_file_writers)
+	{
+		file_writers[0] = writer_for_file (savefile);
+		if (!file_writers[0]) file_writers[0] = writer_find ("tiff");
+		n_file_writers = 1;
+	}
+	if (!strcmp (savefile, "test.tif"))
+		writer_file_name (savefile, sizeof (savefile), "test.tif", file_writers[0]);
+	png_output = (file_writers[0] == writer_find ("png"));
+
+	if (sequence)
+	{
+		if (open_rawlog() < 0 || open_timelapse() < 0 || open_stats() < 0)
+			return -1;
+		do_sequence(sequence);
+		close_rawlog();
+		close_timelapse();
+		close_stats();
+		write_profile();
+		calib_close(calib);
+		return 0;
 	}
 
-	acquire_frame();
+	if (run_as_daemon)
+	{
+		if (open_rawlog() < 0 || open_timelapse() < 0 || open_stats() < 0)
+			return -1;
+		err = run_daemon();
+		close_rawlog();
+		close_timelapse();
+		close_stats();
+		write_profile();
+		calib_close (calib);
+		return err;
+	}
+
+	if (capture_kind)
+	{
+		if (!calibfile[0])
+		{
+			fprintf (stderr, "--capture-dark and --capture-flat need --calib\n");
+			return -1;
+		}
+		calib_close (calib);
+		return capture_calibration (capture_kind);
+	}
 
+	if (open_rawlog() < 0 || open_timelapse() < 0 || open_stats() < 0)
+		return -1;
+	err = (n_cameras > 1) ? acquire_group_frame() : acquire_frame();
+	close_rawlog();
+	close_timelapse();
+	close_stats();
+	write_profile();
+	calib_close (calib);
+
+	return err;
 }
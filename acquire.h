@@ -0,0 +1,21 @@
+#ifndef __ACQUIRE_H
+#define __ACQUIRE_H
+
+/* Declarations shared between acquire.c and its helper modules */
+
+#include <arv.h>
+
+
+extern int debuglevel;
+
+enum led_color{White, Blue, White_and_blue};
+
+#define WHITE_LED_PIN 15
+#define BLUE_LED_PIN 14
+
+
+void dp (int pri, char *format,...);
+void show_error (GError **error);
+
+
+#endif
@@ -0,0 +1,187 @@
+/* autoexp.c
+
+	Histogram-based auto-exposure and the per-LED exposure cache.
+	See autoexp.h; the capture loop is auto_expose() in acquire.c.
+
+*/
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+
+#include "autoexp.h"
+
+
+#define AE_MAX_STEP			16.0		/* Largest change of brightness per frame */
+
+
+
+void ae_defaults (ae_params *p)
+{
+	p->target = 0.8;
+	p->percentile = 0.99;
+	p->tolerance = 0.05;
+	p->min_exposure = 20;
+	p->max_exposure = 200000;
+	p->max_gain = 24;
+	p->max_frames = 8;
+}
+
+
+
+/* One step of the controller: from the histogram (bins bins over the full
+	scale) of a frame taken with *exposure and *gain, the settings for the
+	next one. Returns AE_CONVERGED if the frame was good as it was, AE_LIMIT
+	if it was not but the settings cannot move any further, AE_CONTINUE
+	otherwise, or -1 for an empty histogram. */
+
+int ae_update (const ae_params *p, const unsigned int *hist, int bins, double *exposure, double *gain)
+{
+unsigned long long total, cum;
+double level, ratio, brightness, e, g;
+int k;
+
+
+	total = 0;
+	for (k=0; k<bins; k++)
+		total += hist[k];
+	if (total == 0) return -1;
+
+	cum = 0;
+	for (k=0; k<bins-1; k++)
+	{
+		cum += hist[k];
+		if (cum >= p->percentile * total) break;
+	}
+
+	/* In the top bin the level is not known, only that it is too high */
+
+	if (k == bins-1)
+		ratio = (hist[bins-1] > 0.9 * total) ? 1 / AE_MAX_STEP : (hist[bins-1] > total / 2) ? 0.25 : 0.5;
+	else
+	{
+		level = (k + 0.5) / bins;
+		ratio = p->target / level;
+		if (ratio > AE_MAX_STEP) ratio = AE_MAX_STEP;
+		if (ratio < 1 / AE_MAX_STEP) ratio = 1 / AE_MAX_STEP;
+	}
+	if (fabs (ratio - 1) <= p->tolerance)
+		return AE_CONVERGED;
+
+	/* Brightness is exposure times linear gain; fill up exposure first */
+
+	brightness = *exposure * pow (10, *gain / 20) * ratio;
+	if (brightness <= p->max_exposure)
+	{
+		e = (brightness < p->min_exposure) ? p->min_exposure : brightness;
+		g = 0;
+	}
+	else
+	{
+		e = p->max_exposure;
+		g = 20 * log10 (brightness / p->max_exposure);
+		if (g > p->max_gain) g = p->max_gain;
+	}
+
+	if (fabs (e - *exposure) <= 0.001 * *exposure && fabs (g - *gain) < 0.01)
+		return AE_LIMIT;
+	*exposure = e;
+	*gain = g;
+	return AE_CONTINUE;
+}
+
+
+
+/********************************************************************/
+
+
+/* Read the cache. A missing file is an empty cache. Returns 0 or -1. */
+
+int ae_cache_load (ae_cache *c, const char *fname)
+{
+FILE *fp;
+char line[256];
+ae_entry e;
+
+
+	memset (c, 0, sizeof (ae_cache));
+	fp = fopen (fname, "r");
+	if (!fp) return 0;
+
+	while (fgets (line, sizeof (line), fp) && c->n < AE_CACHE_MAX)
+		if (line[0] != '#' && sscanf (line, "%d %d %lf %lf", &e.led, &e.dutycycle, &e.exposure, &e.gain) == 4
+				&& e.exposure > 0)
+			c->e[c->n++] = e;
+	fclose (fp);
+
+	return 0;
+}
+
+
+/* Write the cache back if anything changed, via a temporary file so that
+	concurrent runs never see half of it. Returns 0 or -1. */
+
+int ae_cache_save (ae_cache *c, const char *fname)
+{
+char tmpname[1100];
+FILE *fp;
+int i, err;
+
+
+	if (!c->changed) return 0;
+
+	snprintf (tmpname, sizeof (tmpname), "%s.tmp", fname);
+	fp = fopen (tmpname, "w");
+	if (!fp) return -1;
+	fprintf (fp, "# led duty exposure_us gain_db\n");
+	for (i=0; i<c->n; i++)
+		fprintf (fp, "%d %d %.1f %.2f\n", c->e[i].led, c->e[i].dutycycle, c->e[i].exposure, c->e[i].gain);
+	err = fclose (fp) != 0;
+	if (!err) err = rename (tmpname, fname) != 0;
+	if (err)
+	{
+		unlink (tmpname);
+		return -1;
+	}
+	c->changed = 0;
+
+	return 0;
+}
+
+
+ae_entry *ae_cache_find (ae_cache *c, int led, int dutycycle)
+{
+int i;
+
+
+	for (i=0; i<c->n; i++)
+		if (c->e[i].led == led && c->e[i].dutycycle == dutycycle)
+			return &c->e[i];
+	return NULL;
+}
+
+
+/* Remember exposure and gain for led at dutycycle. When the cache is full,
+	the oldest entry goes. */
+
+void ae_cache_store (ae_cache *c, int led, int dutycycle, double exposure, double gain)
+{
+ae_entry *e;
+
+
+	e = ae_cache_find (c, led, dutycycle);
+	if (!e)
+	{
+		if (c->n == AE_CACHE_MAX)
+			memmove (&c->e[0], &c->e[1], --c->n * sizeof (ae_entry));
+		e = &c->e[c->n++];
+		e->led = led;
+		e->dutycycle = dutycycle;
+	}
+	e->exposure = exposure;
+	e->gain = gain;
+	c->changed = 1;
+}
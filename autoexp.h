@@ -0,0 +1,61 @@
+#ifndef __AUTOEXP_H
+#define __AUTOEXP_H
+
+
+/* Auto-exposure (-e auto, or /e=auto per sequence step). The controller
+	looks at the histogram of a decimated preview frame and scales the
+	exposure so that a high percentile of the pixels lands at a target
+	level. The sensor is linear, so this converges in one or two frames
+	unless the image is saturated, in which case the exposure is halved
+	until it is not. Exposure is raised first and gain only beyond the
+	longest exposure allowed; on the way down, gain goes first.
+
+	Converged settings are kept per LED and duty cycle in a small cache
+	file, one line "led duty exposure gain" each, and later runs start
+	from there.
+*/
+
+#define AE_CONTINUE			0			/* ae_update(): take another frame */
+#define AE_CONVERGED		1
+#define AE_LIMIT			2			/* Exposure and gain at their limits */
+
+#define AE_PREVIEW_DECIMATION	4		/* Preview frames keep every 4th pixel and row */
+#define AE_CACHE_MAX		64
+
+typedef struct
+{
+	double target;					/* Level of the percentile, as a fraction of full scale */
+	double percentile;				/* Fraction of the pixels at or below the target */
+	double tolerance;				/* Relative, for convergence */
+	double min_exposure;			/* Microseconds */
+	double max_exposure;
+	double max_gain;				/* dB */
+	int max_frames;					/* Preview frames before giving up */
+} ae_params;
+
+typedef struct
+{
+	int led;						/* enum led_color, -1 for LEDs off */
+	int dutycycle;
+	double exposure;
+	double gain;
+} ae_entry;
+
+typedef struct
+{
+	int n;
+	int changed;
+	ae_entry e[AE_CACHE_MAX];
+} ae_cache;
+
+
+void ae_defaults (ae_params *p);
+int ae_update (const ae_params *p, const unsigned int *hist, int bins, double *exposure, double *gain);
+
+int ae_cache_load (ae_cache *c, const char *fname);
+int ae_cache_save (ae_cache *c, const char *fname);
+ae_entry *ae_cache_find (ae_cache *c, int led, int dutycycle);
+void ae_cache_store (ae_cache *c, int led, int dutycycle, double exposure, double gain);
+
+
+#endif
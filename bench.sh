@@ -0,0 +1,129 @@
+#!/bin/sh
+#
+#	bench.sh
+#
+#	End-to-end benchmark of acquire against Aravis' simulated camera and
+#	mockpigpiod, so that it runs on any machine. For every frame size,
+#	acquire is run
+#
+#		single		N times for one TIFF each (a process per frame)
+#		sequence	once for N white/blue steps into a TIFF stack
+#		rawlog		the same into a raw frame log (no encoding)
+#		multi		the sequence on BENCH_MULTI cameras at once, a stack each
+#
+#	with --timing, and the per-stage latencies are reduced to percentiles.
+#	The difference between the save stages of sequence and rawlog is
+#	the cost of the TIFF encoding.
+#
+#	Usage: ./bench.sh [N] > bench.json		(or make bench)
+#
+#	BENCH_SIZES		frame sizes, default "512x512 1024x1024 2048x2048"
+#	BENCH_CAMERA	camera id. By default the fake GigE camera
+#					(arv-fake-gv-camera-0.8) is started on the loopback
+#					interface if it is installed, otherwise Aravis'
+#					in-process Fake_1 is used.
+#	BENCH_PORT		port for mockpigpiod, default 8889
+#	BENCH_MULTI		cameras of the multi run, default 2: BENCH_CAMERA and
+#					Fake_1s (each opening of Fake_1 is a camera of its
+#					own); 0 skips it
+#	BENCH_ARGS		further acquire options, e.g. "-w 2 -c none"
+#
+#	Output, times in microseconds:
+#	{"camera":..., "iterations":N, "runs":[{"mode":"single","size":"512x512",
+#	  "stages":{"discover":{"n":..,"mean":..,"p50":..,"p90":..,"p99":..,"max":..}, ...}}, ...]}
+
+N=${1:-20}
+SIZES=${BENCH_SIZES:-"512x512 1024x1024 2048x2048"}
+PORT=${BENCH_PORT:-8889}
+MULTI=${BENCH_MULTI:-2}
+FAKEGV=arv-fake-gv-camera-0.8
+
+WORK=$(mktemp -d /tmp/acqbench.XXXXXX) || exit 1
+MOCK=
+GV=
+trap 'kill $MOCK $GV 2>/dev/null; rm -rf "$WORK"' EXIT INT TERM
+
+if [ -n "$BENCH_CAMERA" ]; then
+	CAMERA=$BENCH_CAMERA
+elif command -v $FAKEGV >/dev/null 2>&1; then
+	$FAKEGV -i 127.0.0.1 >/dev/null 2>&1 &
+	GV=$!
+	CAMERA=Aravis-GV01
+	sleep 1
+else
+	CAMERA=Fake_1
+fi
+
+./mockpigpiod -p $PORT -o "$WORK/pins.log" 2>/dev/null &
+MOCK=$!
+PIGPIO_ADDR=127.0.0.1
+PIGPIO_PORT=$PORT
+export PIGPIO_ADDR PIGPIO_PORT
+sleep 1
+
+ACQUIRE="./acquire --camera $CAMERA -e 1000 -g 0 $BENCH_ARGS"
+CAMERAS=
+i=1
+while [ $i -lt $MULTI ]; do
+	CAMERAS="$CAMERAS --camera Fake_1"
+	i=$((i+1))
+done
+
+
+# Percentiles (nearest rank) of the samples in a timing file, as the
+# members of a JSON object
+
+summarise ()
+{
+	sort -k1,1 -k2,2g "$1" | awk '
+	function rank(p,   k) { k = p * n; return v[(k == int(k)) ? k - 1 : int(k)] }
+	function flush() {
+		if (!n) return
+		printf "%s\"%s\":{\"n\":%d,\"mean\":%.1f,\"p50\":%.1f,\"p90\":%.1f,\"p99\":%.1f,\"max\":%.1f}",
+			sep, stage, n, sum / n, rank(0.5), rank(0.9), rank(0.99), v[n-1]
+		sep = ","
+	}
+	$1 != stage { flush(); stage = $1; n = 0; sum = 0 }
+	{ v[n++] = $2; sum += $2 }
+	END { flush() }'
+}
+
+run ()		# mode size
+{
+	printf '%s{"mode":"%s","size":"%s","stages":{' "$SEP" "$1" "$2"
+	[ -f "$WORK/$1-$2.txt" ] && summarise "$WORK/$1-$2.txt"
+	printf '}}'
+	SEP=",
+"
+}
+
+
+printf '{"camera":"%s","iterations":%d,"unit":"us","runs":[\n' "$CAMERA" "$N"
+SEP=
+for SIZE in $SIZES; do
+	T=$WORK/single-$SIZE.txt
+	i=0
+	while [ $i -lt $N ]; do
+		$ACQUIRE -r $SIZE+0+0 --timing "$T" -o "$WORK/single.tif" || echo "acquire failed ($SIZE)" >&2
+		i=$((i+1))
+	done
+	run single $SIZE
+
+	$ACQUIRE -r $SIZE+0+0 --timing "$WORK/sequence-$SIZE.txt" --stack "$WORK/seq.tif" \
+		-s "$N*(w-128,b-64)" || echo "sequence failed ($SIZE)" >&2
+	run sequence $SIZE
+	rm -f "$WORK/seq.tif"
+
+	$ACQUIRE -r $SIZE+0+0 --timing "$WORK/rawlog-$SIZE.txt" --rawlog "$WORK/seq.raw" \
+		-s "$N*(w-128,b-64)" || echo "rawlog sequence failed ($SIZE)" >&2
+	run rawlog $SIZE
+	rm -f "$WORK/seq.raw"
+
+	if [ $MULTI -gt 1 ]; then
+		$ACQUIRE $CAMERAS -r $SIZE+0+0 --timing "$WORK/multi-$SIZE.txt" --stack "$WORK/seq.tif" \
+			-s "$N*(w-128,b-64)" || echo "multi-camera sequence failed ($SIZE)" >&2
+		run multi $SIZE
+		rm -f "$WORK"/seq_c*.tif
+	fi
+done
+printf '\n]}\n'
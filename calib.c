@@ -0,0 +1,353 @@
+/* calib.c
+
+	Dark-frame and flat-field calibration: the map store and the
+	correction of frames with px_calibrate16(). See calib.h.
+
+*/
+
+
+#define _FILE_OFFSET_BITS 64			/* A store of many maps outgrows 2 GB on the 32-bit Pi */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "framemeta.h"
+#include "pixkern.h"
+#include "calib.h"
+
+
+#define CALIB_TOLERANCE		0.005			/* Relative, for exposure and gain of darks */
+
+struct calib_store
+{
+	int fd;
+	unsigned char *map;
+	size_t mapsize;
+	const calib_header *hdr;
+	const calib_map *maps;
+};
+
+
+#define ALIGN_UP(x)		(((x) + CALIB_ALIGN - 1) & ~(uint64_t)(CALIB_ALIGN - 1))
+
+
+
+/* Map a store read-only, with all pages read in now rather than on the
+	first frame. NULL if the file is missing or not a valid store. */
+
+calib_store *calib_open (const char *fname)
+{
+calib_store *cs;
+struct stat st;
+uint32_t i;
+
+
+	cs = calloc (1, sizeof (calib_store));
+	if (!cs) return NULL;
+
+	cs->fd = open (fname, O_RDONLY);
+	if (cs->fd < 0 || fstat (cs->fd, &st) || st.st_size < (off_t)sizeof (calib_header))
+		goto fail;
+
+	cs->mapsize = (size_t)st.st_size;
+	cs->map = mmap (NULL, cs->mapsize, PROT_READ, MAP_SHARED | MAP_POPULATE, cs->fd, 0);
+	if (cs->map == MAP_FAILED)
+	{
+		cs->map = NULL;
+		goto fail;
+	}
+
+	cs->hdr = (const calib_header*)cs->map;
+	cs->maps = (const calib_map*)(cs->map + sizeof (calib_header));
+	if (memcmp (cs->hdr->magic, CALIB_MAGIC, 8) || cs->hdr->nmaps > CALIB_MAX_MAPS
+			|| sizeof (calib_header) + cs->hdr->nmaps * sizeof (calib_map) > cs->mapsize)
+	{
+		fprintf (stderr, "%s is not a calibration store\n", fname);
+		goto fail;
+	}
+	for (i=0; i<cs->hdr->nmaps; i++)
+		if (cs->maps[i].size != (uint64_t)cs->maps[i].width * cs->maps[i].height
+				|| cs->maps[i].offset % CALIB_ALIGN
+				|| cs->maps[i].offset + cs->maps[i].size * 2 > cs->mapsize)
+		{
+			fprintf (stderr, "%s: map %u is damaged\n", fname, i);
+			goto fail;
+		}
+
+	return cs;
+
+fail:
+	calib_close (cs);
+	return NULL;
+}
+
+
+void calib_close (calib_store *cs)
+{
+	if (!cs) return;
+	if (cs->map) munmap (cs->map, cs->mapsize);
+	if (cs->fd >= 0) close (cs->fd);
+	free (cs);
+}
+
+
+unsigned int calib_generation (calib_store *cs)
+{
+	return cs ? cs->hdr->generation : 0;
+}
+
+
+const unsigned short *calib_data (calib_store *cs, const calib_map *m)
+{
+	return (const unsigned short*)(cs->map + m->offset);
+}
+
+
+
+/********************************************************************/
+
+
+static int close_enough (double a, double b)
+{
+	return fabs (a - b) <= CALIB_TOLERANCE * fmax (fabs (a), fabs (b)) + 1e-9;
+}
+
+
+/* Maps apply to the same frames: same kind, size and geometry, and for
+	darks the same exposure and gain, for flats the same LED */
+
+static int same_conditions (const calib_map *a, const calib_map *b)
+{
+	if (a->kind != b->kind || a->width != b->width || a->height != b->height
+			|| a->roi_x != b->roi_x || a->roi_y != b->roi_y
+			|| a->binning != b->binning || a->decimation != b->decimation)
+		return 0;
+	if (a->kind == CALIB_DARK)
+		return close_enough (a->exposure, b->exposure) && close_enough (a->gain, b->gain);
+	return a->led == b->led;
+}
+
+
+/* Describe frames of width x height with metadata meta as a map; the
+	key of calib_find() and the start of a new map for calib_add() */
+
+void calib_map_init (calib_map *map, int kind, int width, int height, const framemeta *meta)
+{
+	memset (map, 0, sizeof (calib_map));
+	map->kind = kind;
+	map->led = meta->led;
+	map->width = width;
+	map->height = height;
+	map->roi_x = meta->geom.x;
+	map->roi_y = meta->geom.y;
+	map->binning = meta->geom.binning > 0 ? meta->geom.binning : 1;
+	map->decimation = meta->geom.decimation > 0 ? meta->geom.decimation : 1;
+	map->exposure = meta->exposure;
+	map->gain = meta->gain;
+}
+
+
+
+/* The map of kind for frames of width x height taken under meta, or NULL.
+	Needs no locking; any number of threads may look up and apply at once. */
+
+const calib_map *calib_find (calib_store *cs, int kind, int width, int height, const framemeta *meta)
+{
+calib_map key;
+uint32_t i;
+
+
+	if (!cs) return NULL;
+	calib_map_init (&key, kind, width, height, meta);
+	for (i=0; i<cs->hdr->nmaps; i++)
+		if (same_conditions (&cs->maps[i], &key))
+			return &cs->maps[i];
+
+	return NULL;
+}
+
+
+
+/* Correct a 16-bit frame in place with the matching dark and flat, where
+	there are any. Returns the store generation if anything was applied,
+	0 if not. */
+
+int calib_apply (calib_store *cs, unsigned short *img, int width, int height, const framemeta *meta)
+{
+const calib_map *dark, *flat;
+
+
+	if (!cs) return 0;
+	dark = calib_find (cs, CALIB_DARK, width, height, meta);
+	flat = (meta->led >= 0) ? calib_find (cs, CALIB_FLAT, width, height, meta) : NULL;
+	if (!dark && !flat) return 0;
+
+	px_calibrate16 (img, img, dark ? calib_data (cs, dark) : NULL, flat ? calib_data (cs, flat) : NULL,
+		(long)width * height);
+
+	return (int)cs->hdr->generation;
+}
+
+
+
+/* Gain map from a mean flat frame and its dark: mean (flat - dark) over
+	(flat - dark), per pixel. Dead pixels keep a gain of one. */
+
+void calib_make_flat (unsigned short *gain, const unsigned short *flat, const unsigned short *dark, long n)
+{
+double sum, mean, g;
+long i, v;
+
+
+	sum = 0;
+	for (i=0; i<n; i++)
+	{
+		v = (long)flat[i] - (dark ? dark[i] : 0);
+		if (v > 0) sum += v;
+	}
+	mean = n > 0 ? sum / n : 0;
+
+	for (i=0; i<n; i++)
+	{
+		v = (long)flat[i] - (dark ? dark[i] : 0);
+		if (v <= 0)
+		{
+			gain[i] = PX_GAIN_ONE;
+			continue;
+		}
+		g = mean * PX_GAIN_ONE / v + 0.5;
+		gain[i] = (g > 65535) ? 65535 : (unsigned short)g;
+	}
+}
+
+
+
+/********************************************************************/
+
+
+/* Add map with its width * height values of data to the store fname,
+	replacing a map for the same conditions. The store is written anew under
+	a temporary name and renamed, so that a running acquisition that has the
+	old one mapped is not disturbed. Returns 0 or -1. */
+
+int calib_add (const char *fname, const calib_map *map, const unsigned short *data)
+{
+calib_store *old;
+calib_header hdr;
+calib_map *maps;
+const unsigned short **src;
+char tmpname[1100];
+uint64_t offset;
+uint32_t i, n;
+FILE *fp;
+int err;
+
+
+	old = NULL;
+	if (access (fname, F_OK) == 0)
+	{
+		old = calib_open (fname);
+		if (!old) return -1;
+	}
+
+	maps = calloc (CALIB_MAX_MAPS, sizeof (calib_map));
+	src = calloc (CALIB_MAX_MAPS, sizeof (unsigned short*));
+	if (!maps || !src)
+	{
+		calib_close (old);
+		free (maps);
+		free (src);
+		return -1;
+	}
+
+	n = 0;
+	if (old)
+		for (i=0; i<old->hdr->nmaps; i++)
+			if (!same_conditions (&old->maps[i], map))
+			{
+				src[n] = calib_data (old, &old->maps[i]);
+				maps[n++] = old->maps[i];
+			}
+	if (n >= CALIB_MAX_MAPS)
+	{
+		fprintf (stderr, "%s: no room for another map\n", fname);
+		calib_close (old);
+		free (maps);
+		free (src);
+		return -1;
+	}
+	src[n] = data;
+	maps[n] = *map;
+	maps[n].size = (uint64_t)map->width * map->height;
+	if (!maps[n].created) maps[n].created = (uint64_t)time (NULL);
+	n++;
+
+	memset (&hdr, 0, sizeof (hdr));
+	memcpy (hdr.magic, CALIB_MAGIC, 8);
+	hdr.generation = old ? old->hdr->generation + 1 : 1;
+	hdr.nmaps = n;
+	hdr.created = (uint64_t)time (NULL);
+
+	offset = ALIGN_UP (sizeof (calib_header) + n * sizeof (calib_map));
+	for (i=0; i<n; i++)
+	{
+		maps[i].offset = offset;
+		offset = ALIGN_UP (offset + maps[i].size * 2);
+	}
+
+	snprintf (tmpname, sizeof (tmpname), "%s.tmp", fname);
+	fp = fopen (tmpname, "wb");
+	if (!fp)
+	{
+		calib_close (old);
+		free (maps);
+		free (src);
+		return -1;
+	}
+
+	err = fwrite (&hdr, sizeof (hdr), 1, fp) != 1 || fwrite (maps, sizeof (calib_map), n, fp) != n;
+	for (i=0; i<n && !err; i++)
+		err = fseeko (fp, (off_t)maps[i].offset, SEEK_SET) || fwrite (src[i], 2, maps[i].size, fp) != maps[i].size;
+	if (fclose (fp)) err = 1;
+	if (!err) err = rename (tmpname, fname) != 0;
+	if (err)
+	{
+		fprintf (stderr, "Cannot write %s\n", fname);
+		unlink (tmpname);
+	}
+
+	calib_close (old);
+	free (maps);
+	free (src);
+	return err ? -1 : 0;
+}
+
+
+
+void calib_list (calib_store *cs, FILE *fp)
+{
+const calib_map *m;
+uint32_t i;
+
+
+	fprintf (fp, "generation %u, %u maps\n", cs->hdr->generation, cs->hdr->nmaps);
+	for (i=0; i<cs->hdr->nmaps; i++)
+	{
+		m = &cs->maps[i];
+		fprintf (fp, "%u %s %ux%u roi=+%d+%d bin=%d dec=%d ", i, m->kind == CALIB_DARK ? "dark" : "flat",
+			m->width, m->height, m->roi_x, m->roi_y, m->binning, m->decimation);
+		if (m->kind == CALIB_DARK)
+			fprintf (fp, "exposure=%g gain=%g", m->exposure, m->gain);
+		else
+			fprintf (fp, "led=%s", led_name (m->led));
+		fprintf (fp, " frames=%u\n", m->frames);
+	}
+}
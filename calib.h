@@ -0,0 +1,69 @@
+#ifndef __CALIB_H
+#define __CALIB_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "framemeta.h"
+
+
+/* Calibration store: master dark frames (per exposure, gain and geometry)
+	and flat-field gain maps (per LED and geometry) in one file. The file is
+	mapped once and stays mapped, so applying a calibration costs no I/O.
+	Every change writes a new file with the generation counter incremented;
+	the generation is what frames record as their calibration version.
+
+	Calibrated pixel = (raw - dark) * gain, where gain is the flat field
+	normalized to its mean, stored as 16-bit fixed point (PX_GAIN_ONE = 1.0).
+	Maps are in camera output pixels, i.e. before software binning and
+	cropping, and only 16-bit data are calibrated.
+*/
+
+#define CALIB_MAGIC			"ACQCAL1"
+#define CALIB_ALIGN			64				/* Map data alignment, for the vector kernels */
+#define CALIB_MAX_MAPS		256
+
+#define CALIB_DARK			1
+#define CALIB_FLAT			2
+
+typedef struct
+{
+	char magic[8];
+	uint32_t generation;			/* Incremented by every change */
+	uint32_t nmaps;
+	uint64_t created;				/* Seconds since the epoch, of this generation */
+	uint64_t reserved[4];
+} calib_header;
+
+typedef struct
+{
+	uint32_t kind;					/* CALIB_DARK or CALIB_FLAT */
+	int32_t led;					/* Flats: enum led_color */
+	uint32_t width, height;			/* Camera output pixels */
+	int32_t roi_x, roi_y;			/* Geometry of the frames, as in framemeta.geom */
+	int32_t binning, decimation;
+	double exposure;				/* Darks: microseconds */
+	double gain;					/* Darks: dB */
+	uint32_t frames;				/* Frames averaged into the map */
+	uint32_t reserved0;
+	uint64_t created;
+	uint64_t offset;				/* Of the data in the file */
+	uint64_t size;					/* width * height 16-bit values */
+} calib_map;
+
+typedef struct calib_store calib_store;
+
+
+calib_store *calib_open (const char *fname);
+void calib_close (calib_store *cs);
+unsigned int calib_generation (calib_store *cs);
+const unsigned short *calib_data (calib_store *cs, const calib_map *map);
+void calib_map_init (calib_map *map, int kind, int width, int height, const framemeta *meta);
+int calib_add (const char *fname, const calib_map *map, const unsigned short *data);
+const calib_map *calib_find (calib_store *cs, int kind, int width, int height, const framemeta *meta);
+int calib_apply (calib_store *cs, unsigned short *img, int width, int height, const framemeta *meta);
+void calib_make_flat (unsigned short *gain, const unsigned short *flat, const unsigned short *dark, long n);
+void calib_list (calib_store *cs, FILE *fp);
+
+
+#endif
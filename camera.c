@@ -0,0 +1,580 @@
+/*************************************************
+
+	camera.c
+
+	Persistent camera session. The camera is opened
+	and configured once, a stream with a fixed pool
+	of buffers is set up, and frames are then
+	obtained by software trigger (or from a
+	free-running camera) without any further setup.
+
+**************************************************/
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <arv.h>
+
+#include "acquire.h"
+#include "camera.h"
+#include "demosaic.h"
+#include "timing.h"
+#include "trace.h"
+
+
+
+/* Packed pixel formats, in order of preference. They carry the same
+	10 or 12 bits as Mono16 in fewer bytes per frame. */
+
+static const ArvPixelFormat packed_formats[] =
+{
+	ARV_PIXEL_FORMAT_MONO_12_P,
+	ARV_PIXEL_FORMAT_MONO_12_PACKED,
+	ARV_PIXEL_FORMAT_MONO_10_P,
+	0
+};
+
+
+/* The first entry of packed_formats that the camera offers, or 0 */
+
+static ArvPixelFormat find_packed_format (ArvCamera *camera)
+{
+GError *error = NULL;
+gint64 *formats;
+guint n, i, k;
+ArvPixelFormat found = 0;
+
+
+	formats = arv_camera_dup_available_pixel_formats (camera, &n, &error);
+	show_error (&error);
+	if (!formats) return 0;
+
+	for (k=0; packed_formats[k] && !found; k++)
+		for (i=0; i<n; i++)
+			if ((ArvPixelFormat)formats[i] == packed_formats[k])
+			{
+				found = packed_formats[k];
+				break;
+			}
+	g_free (formats);
+
+	return found;
+}
+
+
+
+/* Binning and decimation, n for both directions. Each returns the factor the
+	camera actually uses, 1 if it has no such feature or cannot do n. */
+
+static int set_binning (ArvCamera *camera, int n)
+{
+GError *error = NULL;
+gint bx, by;
+
+
+	if (!arv_camera_is_binning_available (camera, &error))
+	{
+		show_error (&error);
+		return 1;
+	}
+	arv_camera_set_binning (camera, n, n, &error);
+	show_error (&error);
+	arv_camera_get_binning (camera, &bx, &by, &error);
+	show_error (&error);
+	if (bx != by || bx < 1 || n % bx)
+	{
+		arv_camera_set_binning (camera, 1, 1, &error);
+		show_error (&error);
+		return 1;
+	}
+	return bx;
+}
+
+
+static int set_decimation (ArvCamera *camera, int n)
+{
+GError *error = NULL;
+gint64 dh, dv;
+
+
+	if (!arv_camera_is_feature_available (camera, "DecimationHorizontal", &error)
+			|| !arv_camera_is_feature_available (camera, "DecimationVertical", &error))
+	{
+		show_error (&error);
+		return 1;
+	}
+	arv_camera_set_integer (camera, "DecimationHorizontal", n, &error);
+	arv_camera_set_integer (camera, "DecimationVertical", n, &error);
+	show_error (&error);
+	dh = arv_camera_get_integer (camera, "DecimationHorizontal", &error);
+	dv = arv_camera_get_integer (camera, "DecimationVertical", &error);
+	show_error (&error);
+	if (dh != dv || dh < 1 || n % dh)
+	{
+		arv_camera_set_integer (camera, "DecimationHorizontal", 1, &error);
+		arv_camera_set_integer (camera, "DecimationVertical", 1, &error);
+		show_error (&error);
+		return 1;
+	}
+	return (int)dh;
+}
+
+
+
+/* Find the cameras Aravis can see, and copy the ids of up to max of them
+	into ids. With verbose, they are also listed on stdout with vendor and
+	model. Aravis' simulated camera is not among them unless the Fake
+	interface was enabled. Returns their number. */
+
+int cam_enumerate (char ids[][CAM_ID_LEN], int max, int verbose)
+{
+unsigned int i, n;
+const char *id, *vendor, *model;
+int k;
+
+
+	arv_update_device_list ();
+	n = arv_get_n_devices ();
+	k = 0;
+	for (i=0; i<n; i++)
+	{
+		id = arv_get_device_id (i);
+		if (!id) continue;
+		if (verbose)
+		{
+			vendor = arv_get_device_vendor (i);
+			model = arv_get_device_model (i);
+			printf ("%s\t%s %s\n", id, vendor ? vendor : "", model ? model : "");
+		}
+		if (k < max)
+			snprintf (ids[k++], CAM_ID_LEN, "%s", id);
+	}
+
+	return k;
+}
+
+
+
+/* Open the camera cam_id (NULL for the first one found, Fake_1 for Aravis'
+	simulated camera), set the fixed parameters (pixel format, trigger) and
+	allocate n_buffers stream buffers. With packed set, a packed 10/12-bit
+	format is used if the camera has one, otherwise Mono16. Acquisition is
+	started right away, so that cam_snap() only needs to trigger and wait.
+	Returns 0 on success, -1 on error. On error, the session is closed again
+	and may be discarded.
+*/
+
+int cam_open (camsession *cs, const char *cam_id, int n_buffers, int trigger_mode, int packed)
+{
+GError *error = NULL;
+const gchar *cam_vendor, *cam_model;
+ArvPixelFormat format;
+double t0;
+int i;
+
+
+	memset (cs, 0, sizeof (camsession));
+	cs->exposure = -1;
+	cs->gain = -1;
+	cs->req_exposure = -1;
+	cs->req_gain = -1;
+	cs->timeout = 2000000;
+	cs->n_buffers = (n_buffers > 0) ? n_buffers : CAM_DEFAULT_BUFFERS;
+	cs->trigger_mode = trigger_mode;
+
+	/* Aravis' simulated camera (Fake_1 etc.) is on an interface that is
+		not searched unless asked for */
+
+	if (cam_id && !strncmp (cam_id, "Fake", 4))
+		arv_enable_interface ("Fake");
+
+	t0 = timing_start ();
+	cs->camera = arv_camera_new (cam_id, &error);
+	if (!cs->camera)
+	{
+		dp (0, "Error opening the camera object\n");
+		show_error (&error);
+		return -1;
+	}
+	timing_stop (TM_DISCOVER, t0);
+	t0 = timing_start ();
+
+	cam_vendor = arv_camera_get_vendor_name (cs->camera, &error);
+	cam_model = arv_camera_get_model_name (cs->camera, &error);
+	show_error (&error);
+	dp (1, "Found: Vendor %s, model %s\n", cam_vendor, cam_model);
+
+	arv_camera_set_exposure_time_auto (cs->camera, ARV_AUTO_OFF, &error);
+	arv_camera_set_gain_auto (cs->camera, ARV_AUTO_OFF, &error);
+	show_error (&error);
+
+	/* The pixel format cannot be changed while the stream is running,
+		so it is set once here */
+
+	format = ARV_PIXEL_FORMAT_MONO_16;
+	if (packed)
+	{
+		format = find_packed_format (cs->camera);
+		if (!format)
+		{
+			dp (1, "Camera has no packed mono format, using Mono16\n");
+			format = ARV_PIXEL_FORMAT_MONO_16;
+		}
+	}
+	arv_camera_set_pixel_format (cs->camera, format, &error);
+	cs->pixelformat = arv_camera_get_pixel_format (cs->camera, &error);
+	show_error (&error);
+	if (cs->pixelformat != format && dm_pattern (cs->pixelformat) >= 0)
+		dp (1, "Colour camera: Bayer %s, pixel format %08x\n",
+			dm_pattern_name (dm_pattern (cs->pixelformat)), cs->pixelformat);
+	else if (cs->pixelformat != format)
+	{
+		dp (1, "Warning: Unable to set pixel format %08x. Have %08x instead\n", format, cs->pixelformat);
+	}
+	else
+		dp (2, "Pixel format %08x, %d bits per pixel\n", format, ARV_PIXEL_FORMAT_BIT_PER_PIXEL(format));
+
+	/* Whole sensor, no binning or decimation. The stream buffers are sized
+		for this, the largest frame, so cam_set_geometry() never needs new ones. */
+
+	arv_camera_get_sensor_size (cs->camera, &cs->sensor_width, &cs->sensor_height, &error);
+	show_error (&error);
+	set_binning (cs->camera, 1);
+	set_decimation (cs->camera, 1);
+	arv_camera_set_region (cs->camera, 0, 0, cs->sensor_width, cs->sensor_height, &error);
+	show_error (&error);
+	geometry_init (&cs->sw);
+	geometry_init (&cs->applied);
+	cs->applied.width = cs->sensor_width;
+	cs->applied.height = cs->sensor_height;
+	cs->geom = cs->applied;
+
+	/* Software trigger if the camera can do it, otherwise let it run freely */
+
+	if (cs->trigger_mode == CAM_TRIGGER_SOFTWARE
+			&& !arv_camera_is_software_trigger_supported (cs->camera, &error))
+	{
+		show_error (&error);
+		dp (1, "Camera has no software trigger, using continuous mode\n");
+		cs->trigger_mode = CAM_TRIGGER_CONTINUOUS;
+	}
+
+	arv_camera_set_acquisition_mode (cs->camera, ARV_ACQUISITION_MODE_CONTINUOUS, &error);
+	if (cs->trigger_mode == CAM_TRIGGER_SOFTWARE)
+		arv_camera_set_trigger (cs->camera, "Software", &error);
+	else if (cs->trigger_mode == CAM_TRIGGER_HARDWARE)
+		arv_camera_set_trigger (cs->camera, "Line0", &error);
+	else
+		arv_camera_clear_triggers (cs->camera, &error);
+	show_error (&error);
+
+	/* Stream and buffer pool */
+
+	cs->stream = arv_camera_create_stream (cs->camera, NULL, NULL, &error);
+	if (!cs->stream)
+	{
+		dp (0, "Error creating the camera stream\n");
+		show_error (&error);
+		cam_close (cs);
+		return -1;
+	}
+
+	cs->payload = arv_camera_get_payload (cs->camera, &error);
+	show_error (&error);
+	for (i=0; i<cs->n_buffers; i++)
+		arv_stream_push_buffer (cs->stream, arv_buffer_new (cs->payload, NULL));
+	dp (2, "Stream set up with %d buffers of %lu bytes\n", cs->n_buffers, (unsigned long)cs->payload);
+
+	arv_camera_start_acquisition (cs->camera, &error);
+	if (error)
+	{
+		dp (0, "Error starting the acquisition\n");
+		show_error (&error);
+		cam_close (cs);
+		return -1;
+	}
+	timing_stop (TM_OPEN, t0);
+
+	return 0;
+}
+
+
+
+/* Apply exposure time (microseconds) and gain. Only those values that
+	differ from the ones last asked for are sent, because every feature
+	write is a round trip over the link. The camera may round or clamp
+	them, so cs->exposure and cs->gain, what it applied, are not compared.
+*/
+
+int cam_configure (camsession *cs, double exposure, double gain)
+{
+GError *error = NULL;
+double gain_min, gain_max;
+
+
+	if (exposure != cs->req_exposure)
+	{
+		arv_camera_set_exposure_time (cs->camera, exposure, &error);
+		if (error)
+		{
+			show_error (&error);
+			return -1;
+		}
+		cs->req_exposure = exposure;
+		cs->exposure = arv_camera_get_exposure_time (cs->camera, &error);
+		show_error (&error);
+		cs->timeout = 2000000 + 2*(guint64)cs->exposure;
+		dp (2, "Exposure time set to %g us\n", cs->exposure);
+	}
+
+	if (gain != cs->req_gain)
+	{
+		arv_camera_get_gain_bounds (cs->camera, &gain_min, &gain_max, &error);
+		show_error (&error);
+		cs->gain = gain;
+		if (cs->gain < gain_min) cs->gain = gain_min;
+		if (cs->gain > gain_max) cs->gain = gain_max;
+		arv_camera_set_gain (cs->camera, cs->gain, &error);
+		if (error)
+		{
+			show_error (&error);
+			cs->gain = -1;
+			return -1;
+		}
+		cs->req_gain = gain;
+		dp (2, "Gain set to %g\n", cs->gain);
+	}
+
+	return 0;
+}
+
+
+
+/* Set region, binning and decimation (in sensor pixels, see framemeta.h).
+	The camera does as much of it as it can; what it cannot do exactly is
+	left to software, described by cs->sw, and done when a frame is saved.
+	cs->applied is the resulting geometry. Nothing is sent if g is what was
+	set last. The acquisition is stopped for the change, so frames still
+	in the pool are lost. Returns 0, or -1 if the camera refused. A
+	geometry whose frames would not fit the stream buffers is refused, and
+	the previous one (which did) is set again, so the camera keeps running.
+*/
+
+int cam_set_geometry (camsession *cs, const geometry *g)
+{
+GError *error = NULL;
+geometry want, previous;
+gint rx, ry, rw, rh;
+int hwbin, hwdec, s, cx, cy, cw, ch;
+guint payload;
+
+
+	/* Requests are compared after clipping to the sensor */
+
+	want = *g;
+	if (want.binning < 1) want.binning = 1;
+	if (want.decimation < 1) want.decimation = 1;
+	if (want.x >= cs->sensor_width) want.x = 0;
+	if (want.y >= cs->sensor_height) want.y = 0;
+	if (want.width <= 0 || want.x + want.width > cs->sensor_width) want.width = cs->sensor_width - want.x;
+	if (want.height <= 0 || want.y + want.height > cs->sensor_height) want.height = cs->sensor_height - want.y;
+	if (!memcmp (&want, &cs->geom, sizeof (geometry)))
+		return 0;
+	previous = cs->geom;
+
+	arv_camera_stop_acquisition (cs->camera, &error);
+	show_error (&error);
+
+	/* Binning and decimation first: the region is given in their units */
+
+	hwbin = set_binning (cs->camera, want.binning);
+	hwdec = set_decimation (cs->camera, want.decimation);
+	s = hwbin * hwdec;
+
+	cx = want.x / s;
+	cy = want.y / s;
+	cw = want.width / s;
+	ch = want.height / s;
+	arv_camera_set_region (cs->camera, cx, cy, cw, ch, &error);
+	show_error (&error);
+	arv_camera_get_region (cs->camera, &rx, &ry, &rw, &rh, &error);
+	show_error (&error);
+
+	/* A camera may round the region to its increments. If the result does
+		not hold the requested one, use the whole sensor and crop in software. */
+
+	if (cx < rx || cy < ry || cx + cw > rx + rw || cy + ch > ry + rh)
+	{
+		arv_camera_set_region (cs->camera, 0, 0, cs->sensor_width / s, cs->sensor_height / s, &error);
+		show_error (&error);
+		arv_camera_get_region (cs->camera, &rx, &ry, &rw, &rh, &error);
+		show_error (&error);
+		if (cx + cw > rx + rw) cw = rx + rw - cx;
+		if (cy + ch > ry + rh) ch = ry + rh - cy;
+	}
+
+	geometry_init (&cs->sw);
+	cs->sw.binning = want.binning / hwbin;
+	cs->sw.decimation = want.decimation / hwdec;
+	if (cx != rx || cy != ry || cw != rw || ch != rh)
+	{
+		cs->sw.x = cx - rx;
+		cs->sw.y = cy - ry;
+		cs->sw.width = cw;
+		cs->sw.height = ch;
+	}
+
+	cs->applied.x = cx * s;
+	cs->applied.y = cy * s;
+	cs->applied.width = cw * s;
+	cs->applied.height = ch * s;
+	cs->applied.binning = want.binning;
+	cs->applied.decimation = want.decimation;
+	cs->geom = want;
+
+	dp (1, "Geometry %dx%d+%d+%d bin %d dec %d: camera %dx%d+%d+%d bin %d dec %d, software bin %d dec %d%s\n",
+		want.width, want.height, want.x, want.y, want.binning, want.decimation,
+		rw, rh, rx, ry, hwbin, hwdec, cs->sw.binning, cs->sw.decimation, cs->sw.width ? " crop" : "");
+
+	payload = arv_camera_get_payload (cs->camera, &error);
+	show_error (&error);
+	if (payload > cs->payload)
+	{
+		dp (0, "Frame of %u bytes does not fit the stream buffers\n", payload);
+		cs->geom.binning = 0;			/* Never what was asked for, so it is set again */
+		cam_set_geometry (cs, &previous);
+		return -1;
+	}
+
+	arv_camera_start_acquisition (cs->camera, &error);
+	if (error)
+	{
+		dp (0, "Error restarting the acquisition\n");
+		show_error (&error);
+		return -1;
+	}
+
+	return 0;
+}
+
+
+
+/* Drive the camera's digital output line (e.g. "Line1") with its
+	ExposureActive signal, so that it can gate the LED drivers: the
+	LEDs then only light while the sensor integrates. Returns 0, or -1
+	if the camera has no such line or source.
+*/
+
+int cam_strobe_output (camsession *cs, const char *line)
+{
+GError *error = NULL;
+
+
+	if (!arv_camera_is_feature_available (cs->camera, "LineSource", &error))
+	{
+		show_error (&error);
+		dp (0, "Camera has no selectable output line source\n");
+		return -1;
+	}
+
+	arv_camera_set_string (cs->camera, "LineSelector", line, &error);
+	if (!error && arv_camera_is_feature_available (cs->camera, "LineMode", NULL))
+		arv_camera_set_string (cs->camera, "LineMode", "Output", &error);
+	if (!error)
+		arv_camera_set_string (cs->camera, "LineSource", "ExposureActive", &error);
+	if (error)
+	{
+		dp (0, "Could not route ExposureActive to %s\n", line);
+		show_error (&error);
+		return -1;
+	}
+	dp (1, "Exposure signal on %s\n", line);
+
+	return 0;
+}
+
+
+
+/* Get one frame that was exposed entirely after this call was made.
+	The returned buffer belongs to the stream pool and must be given
+	back with cam_requeue() once the caller is done with it.
+	Returns NULL if no valid frame arrived within the timeout.
+*/
+
+ArvBuffer *cam_snap (camsession *cs)
+{
+GError *error = NULL;
+ArvBuffer *buffer;
+
+
+	TRACE_BEGIN (1, "acquire");
+	if (cs->trigger_mode == CAM_TRIGGER_SOFTWARE)
+	{
+		arv_camera_software_trigger (cs->camera, &error);
+		if (error)
+		{
+			show_error (&error);
+			TRACE_END (1, "acquire");
+			return NULL;
+		}
+	}
+	else if (cs->trigger_mode == CAM_TRIGGER_CONTINUOUS)
+	{
+		/* Free-running: throw away what is queued, and also the next frame,
+			because its exposure may have started before the caller changed
+			the illumination */
+
+		while ((buffer = arv_stream_try_pop_buffer (cs->stream)) != NULL)
+			arv_stream_push_buffer (cs->stream, buffer);
+		buffer = arv_stream_timeout_pop_buffer (cs->stream, cs->timeout);
+		if (buffer) arv_stream_push_buffer (cs->stream, buffer);
+	}
+
+	buffer = arv_stream_timeout_pop_buffer (cs->stream, cs->timeout);
+	if (!buffer)
+	{
+		dp (0, "Timeout waiting for a frame\n");
+		TRACE_END (1, "acquire");
+		return NULL;
+	}
+	if (arv_buffer_get_status (buffer) != ARV_BUFFER_STATUS_SUCCESS)
+	{
+		dp (0, "Incomplete frame received (status %d)\n", arv_buffer_get_status (buffer));
+		arv_stream_push_buffer (cs->stream, buffer);
+		TRACE_END (1, "acquire");
+		return NULL;
+	}
+	TRACE_END (1, "acquire");
+
+	return buffer;
+}
+
+
+
+/* Hand a buffer obtained from cam_snap() back to the stream pool */
+
+void cam_requeue (camsession *cs, ArvBuffer *buffer)
+{
+	if (buffer) arv_stream_push_buffer (cs->stream, buffer);
+}
+
+
+
+/* Stop the acquisition and release stream, buffers and camera */
+
+void cam_close (camsession *cs)
+{
+GError *error = NULL;
+
+
+	if (cs->camera && cs->stream)
+	{
+		arv_camera_stop_acquisition (cs->camera, &error);
+		show_error (&error);
+	}
+	if (cs->stream) g_object_unref (cs->stream);		/* Also frees the pooled buffers */
+	if (cs->camera) g_object_unref (cs->camera);
+	cs->stream = NULL;
+	cs->camera = NULL;
+}
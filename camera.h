@@ -0,0 +1,53 @@
+#ifndef __CAMERA_H
+#define __CAMERA_H
+
+#include <arv.h>
+
+#include "framemeta.h"
+
+
+/* A camera session keeps the camera open and configured across several
+	captures. The stream and its buffer pool are allocated once in cam_open(),
+	and each capture only costs a trigger plus the frame readout.
+*/
+
+#define CAM_TRIGGER_SOFTWARE	0		/* One software trigger per frame (preferred) */
+#define CAM_TRIGGER_CONTINUOUS	1		/* Free-running camera, stale frames are discarded */
+#define CAM_TRIGGER_HARDWARE	2		/* Edge on Line0, sent by someone else (see strobe.c) */
+
+#define CAM_DEFAULT_BUFFERS		4
+#define CAM_ID_LEN				128
+
+
+typedef struct
+{
+	ArvCamera *camera;
+	ArvStream *stream;
+	int n_buffers;				/* Number of buffers in the stream pool */
+	size_t payload;				/* Bytes per buffer */
+	int trigger_mode;			/* CAM_TRIGGER_SOFTWARE, _CONTINUOUS or _HARDWARE */
+	double exposure;			/* Currently applied values, in microseconds and dB. */
+	double gain;				/* Negative means "not yet sent to the camera" */
+	double req_exposure;		/* As last asked for, before the camera rounded */
+	double req_gain;			/* or clamped them; what cam_configure() compares */
+	ArvPixelFormat pixelformat;
+	guint64 timeout;			/* How long to wait for a frame, in microseconds */
+	int sensor_width;
+	int sensor_height;
+	geometry geom;				/* As last requested, in sensor pixels */
+	geometry applied;			/* What frames get, camera and software together */
+	geometry sw;				/* The software part, see framemeta.h */
+} camsession;
+
+
+int cam_enumerate (char ids[][CAM_ID_LEN], int max, int verbose);
+int cam_open (camsession *cs, const char *cam_id, int n_buffers, int trigger_mode, int packed);
+int cam_configure (camsession *cs, double exposure, double gain);
+int cam_set_geometry (camsession *cs, const geometry *g);
+int cam_strobe_output (camsession *cs, const char *line);
+ArvBuffer *cam_snap (camsession *cs);
+void cam_requeue (camsession *cs, ArvBuffer *buffer);
+void cam_close (camsession *cs);
+
+
+#endif
@@ -0,0 +1,455 @@
+/* daemon.c
+
+	UNIX-socket job server for acquire --daemon, and the client side of
+	it (--submit). See daemon.h for the protocol.
+
+*/
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "daemon.h"
+
+
+struct jobserver
+{
+	int listen_fd;
+	int wake[2];					/* Pipe that tells the listener to stop */
+	char path[sizeof (((struct sockaddr_un*)0)->sun_path)];
+	pthread_t listener;
+	pthread_mutex_t lock;			/* The queue and the counters */
+	pthread_cond_t more;
+	daemon_job *head, *tail;
+	int queued;
+	int running;					/* Id of the job being run, 0 for none */
+	int next_id;
+	unsigned long done, failed;
+	int shutdown;
+	time_t started;
+};
+
+typedef struct
+{
+	int fd;							/* -1 for a free slot */
+	int len;
+	char buf[DAEMON_MAX_LINE];
+} client;
+
+
+/* Answers from the listener and from the capture and writer threads
+	must not interleave within a line. Sends do not wait, so the lock is
+	never held for long: a client whose socket buffer is full has stopped
+	reading, and is disconnected rather than holding up the others. */
+
+static pthread_mutex_t send_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+
+static void send_line (int fd, const char *format, va_list args)
+{
+char line[DAEMON_MAX_LINE + 256];
+ssize_t sent;
+int n;
+
+
+	n = vsnprintf (line, sizeof (line) - 1, format, args);
+	if (n < 0) return;
+	if (n > (int)sizeof (line) - 2) n = sizeof (line) - 2;
+	line[n++] = '\n';
+
+	/* A client that went away must not take the daemon with it (SIGPIPE) */
+
+	pthread_mutex_lock (&send_lock);
+	sent = send (fd, line, n, MSG_NOSIGNAL | MSG_DONTWAIT);
+	pthread_mutex_unlock (&send_lock);
+
+	/* Shut down, not closed: the listener and the client's queued jobs
+		have copies of fd, which now see the end of the connection */
+
+	if ((sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) || (sent >= 0 && sent < n))
+	{
+		fprintf (stderr, "Daemon client does not read its answers, disconnected\n");
+		shutdown (fd, SHUT_RDWR);
+	}
+}
+
+
+static void reply (int fd, const char *format, ...)
+{
+va_list args;
+
+
+	va_start (args, format);
+	send_line (fd, format, args);
+	va_end (args);
+}
+
+
+/* One line to the client of job */
+
+void daemon_send (daemon_job *job, const char *format, ...)
+{
+va_list args;
+
+
+	va_start (args, format);
+	send_line (job->fd, format, args);
+	va_end (args);
+}
+
+
+
+/********************************************************************/
+
+
+/* A complete request line from client fd */
+
+static void request (jobserver *js, int fd, char *line)
+{
+daemon_job *job;
+size_t len;
+int ahead;
+
+
+	len = strlen (line);
+	while (len > 0 && (line[len-1] == '\r' || line[len-1] == ' ' || line[len-1] == '\t'))
+		line[--len] = 0;
+	while (*line == ' ' || *line == '\t')
+		line++;
+	if (!*line) return;
+
+	pthread_mutex_lock (&js->lock);
+	if (!strcmp (line, "status"))
+		reply (fd, "status queued=%d running=%d done=%lu failed=%lu uptime=%ld", js->queued, js->running,
+			js->done, js->failed, (long)(time (NULL) - js->started));
+	else if (!strcmp (line, "shutdown"))
+	{
+		js->shutdown = 1;
+		pthread_cond_broadcast (&js->more);
+		reply (fd, "ok shutdown after %d jobs", js->queued);
+	}
+	else if (js->shutdown)
+		reply (fd, "error 0 shutting down");
+	else if (js->queued >= DAEMON_MAX_QUEUE)
+		reply (fd, "error 0 queue full");
+	else if (!(job = calloc (1, sizeof (daemon_job))) || (job->fd = dup (fd)) < 0)
+	{
+		free (job);
+		reply (fd, "error 0 %s", strerror (errno));
+	}
+	else
+	{
+		job->id = ++js->next_id;
+		snprintf (job->line, sizeof (job->line), "%s", line);
+		if (js->tail)
+			js->tail->next = job;
+		else
+			js->head = job;
+		js->tail = job;
+		ahead = js->queued + (js->running != 0);
+		js->queued++;
+		reply (fd, "queued %d %d", job->id, ahead);
+		pthread_cond_signal (&js->more);
+	}
+	pthread_mutex_unlock (&js->lock);
+}
+
+
+/* Accept connections and read their requests, until told to stop */
+
+static void *listener (void *arg)
+{
+jobserver *js = (jobserver*)arg;
+client clients[DAEMON_MAX_CLIENTS];
+struct pollfd pfd[DAEMON_MAX_CLIENTS + 2];
+int slot[DAEMON_MAX_CLIENTS + 2];
+char *nl, *line;
+int i, n, np, fd, got;
+
+
+	for (i=0; i<DAEMON_MAX_CLIENTS; i++)
+		clients[i].fd = -1;
+
+	for (;;)
+	{
+		pfd[0].fd = js->wake[0];
+		pfd[0].events = POLLIN;
+		pfd[1].fd = js->listen_fd;
+		pfd[1].events = POLLIN;
+		np = 2;
+		for (i=0; i<DAEMON_MAX_CLIENTS; i++)
+			if (clients[i].fd >= 0)
+			{
+				pfd[np].fd = clients[i].fd;
+				pfd[np].events = POLLIN;
+				slot[np++] = i;
+			}
+
+		if (poll (pfd, np, -1) < 0)
+		{
+			if (errno == EINTR) continue;
+			break;
+		}
+		if (pfd[0].revents) break;
+
+		if (pfd[1].revents & POLLIN)
+		{
+			fd = accept (js->listen_fd, NULL, NULL);
+			for (i=0; fd >= 0 && i<DAEMON_MAX_CLIENTS && clients[i].fd >= 0; i++)
+				;
+			if (fd >= 0 && i == DAEMON_MAX_CLIENTS)
+			{
+				reply (fd, "error 0 too many connections");
+				close (fd);
+			}
+			else if (fd >= 0)
+			{
+				clients[i].fd = fd;
+				clients[i].len = 0;
+			}
+		}
+
+		for (n=2; n<np; n++)
+		{
+			if (!pfd[n].revents) continue;
+			i = slot[n];
+			got = read (clients[i].fd, clients[i].buf + clients[i].len, sizeof (clients[i].buf) - 1 - clients[i].len);
+			if (got <= 0)
+			{
+				close (clients[i].fd);			/* Queued jobs keep their own copy */
+				clients[i].fd = -1;
+				continue;
+			}
+			clients[i].len += got;
+			clients[i].buf[clients[i].len] = 0;
+
+			line = clients[i].buf;
+			while ((nl = strchr (line, '\n')) != NULL)
+			{
+				*nl = 0;
+				request (js, clients[i].fd, line);
+				line = nl + 1;
+			}
+			clients[i].len -= line - clients[i].buf;
+			memmove (clients[i].buf, line, clients[i].len);
+			if (clients[i].len == sizeof (clients[i].buf) - 1)
+			{
+				reply (clients[i].fd, "error 0 request too long");
+				clients[i].len = 0;
+			}
+		}
+	}
+
+	for (i=0; i<DAEMON_MAX_CLIENTS; i++)
+		if (clients[i].fd >= 0) close (clients[i].fd);
+
+	return NULL;
+}
+
+
+
+/********************************************************************/
+
+
+/* Listen on the socket path. A stale socket of an earlier run is replaced,
+	one that still answers is not. NULL on error. */
+
+jobserver *daemon_open (const char *path)
+{
+jobserver *js;
+struct sockaddr_un addr;
+int fd;
+
+
+	if (strlen (path) >= sizeof (addr.sun_path))
+	{
+		fprintf (stderr, "Socket path %s is too long\n", path);
+		return NULL;
+	}
+	memset (&addr, 0, sizeof (addr));
+	addr.sun_family = AF_UNIX;
+	strcpy (addr.sun_path, path);
+
+	fd = socket (AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) return NULL;
+	if (connect (fd, (struct sockaddr*)&addr, sizeof (addr)) == 0)
+	{
+		fprintf (stderr, "Another daemon is listening on %s\n", path);
+		close (fd);
+		return NULL;
+	}
+	close (fd);
+	unlink (path);
+
+	js = calloc (1, sizeof (jobserver));
+	if (!js) return NULL;
+	js->wake[0] = js->wake[1] = -1;
+	js->listen_fd = socket (AF_UNIX, SOCK_STREAM, 0);
+	if (js->listen_fd < 0
+			|| bind (js->listen_fd, (struct sockaddr*)&addr, sizeof (addr)) < 0
+			|| listen (js->listen_fd, DAEMON_MAX_CLIENTS) < 0
+			|| pipe (js->wake) < 0)
+	{
+		fprintf (stderr, "Cannot listen on %s: %s\n", path, strerror (errno));
+		if (js->listen_fd >= 0) close (js->listen_fd);
+		free (js);
+		return NULL;
+	}
+	strcpy (js->path, path);
+	js->started = time (NULL);
+	pthread_mutex_init (&js->lock, NULL);
+	pthread_cond_init (&js->more, NULL);
+
+	if (pthread_create (&js->listener, NULL, listener, js))
+	{
+		close (js->listen_fd);
+		close (js->wake[0]);
+		close (js->wake[1]);
+		unlink (path);
+		free (js);
+		return NULL;
+	}
+
+	return js;
+}
+
+
+/* The next job, waiting for one if need be. NULL once a shutdown was
+	requested and the queue is empty. */
+
+daemon_job *daemon_next_job (jobserver *js)
+{
+daemon_job *job;
+
+
+	pthread_mutex_lock (&js->lock);
+	while (!js->head && !js->shutdown)
+		pthread_cond_wait (&js->more, &js->lock);
+	job = js->head;
+	if (job)
+	{
+		js->head = job->next;
+		if (!js->head) js->tail = NULL;
+		js->queued--;
+		js->running = job->id;
+	}
+	pthread_mutex_unlock (&js->lock);
+
+	return job;
+}
+
+
+/* Report the end of job, with error NULL if it succeeded, and free it */
+
+void daemon_job_done (jobserver *js, daemon_job *job, const char *error)
+{
+	if (error)
+		daemon_send (job, "error %d %s", job->id, error);
+	else
+		daemon_send (job, "done %d", job->id);
+
+	pthread_mutex_lock (&js->lock);
+	if (error)
+		js->failed++;
+	else
+		js->done++;
+	js->running = 0;
+	pthread_mutex_unlock (&js->lock);
+
+	close (job->fd);
+	free (job);
+}
+
+
+void daemon_close (jobserver *js)
+{
+daemon_job *job;
+
+
+	if (!js) return;
+	if (write (js->wake[1], "", 1) != 1)
+		shutdown (js->listen_fd, SHUT_RDWR);	/* Wakes the listener's poll() too */
+	pthread_join (js->listener, NULL);
+
+	while ((job = js->head) != NULL)
+	{
+		js->head = job->next;
+		daemon_send (job, "error %d daemon stopped", job->id);
+		close (job->fd);
+		free (job);
+	}
+
+	close (js->listen_fd);
+	close (js->wake[0]);
+	close (js->wake[1]);
+	unlink (js->path);
+	pthread_mutex_destroy (&js->lock);
+	pthread_cond_destroy (&js->more);
+	free (js);
+}
+
+
+
+/********************************************************************/
+
+
+/* Client: send one request to the daemon at path and copy the answers to
+	stdout until it is finished. Returns 0, or -1 if it failed or the
+	daemon could not be reached. */
+
+int daemon_submit (const char *path, const char *request)
+{
+struct sockaddr_un addr;
+char line[DAEMON_MAX_LINE + 256];
+FILE *fp;
+int fd, err;
+
+
+	memset (&addr, 0, sizeof (addr));
+	addr.sun_family = AF_UNIX;
+	snprintf (addr.sun_path, sizeof (addr.sun_path), "%s", path);
+	fd = socket (AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0 || connect (fd, (struct sockaddr*)&addr, sizeof (addr)) < 0)
+	{
+		fprintf (stderr, "Cannot reach the daemon at %s: %s\n", path, strerror (errno));
+		if (fd >= 0) close (fd);
+		return -1;
+	}
+
+	snprintf (line, sizeof (line), "%s\n", request);
+	if (write (fd, line, strlen (line)) < 0)
+	{
+		close (fd);
+		return -1;
+	}
+
+	fp = fdopen (fd, "r");
+	if (!fp)
+	{
+		close (fd);
+		return -1;
+	}
+	err = -1;
+	while (fgets (line, sizeof (line), fp))
+	{
+		fputs (line, stdout);
+		fflush (stdout);
+		if (!strncmp (line, "queued ", 7) || !strncmp (line, "frame ", 6))
+			continue;
+		err = strncmp (line, "error ", 6) ? 0 : -1;
+		break;
+	}
+	fclose (fp);
+
+	return err;
+}
@@ -0,0 +1,62 @@
+#ifndef __DAEMON_H
+#define __DAEMON_H
+
+
+/* Job server for acquire --daemon: the camera and the pigpiod connection
+	stay open, and capture jobs come in over a local UNIX socket. They are
+	queued and run one after the other, in the order they arrived.
+
+	The protocol is line based text. A client sends one request per line:
+
+		capture NAME [STEP]		one frame to NAME; with a sequence step
+								(e.g. w-128/e=5000@full), lit and set up
+								as that step, otherwise LEDs off and the
+								daemon's -e, -g and -r
+		sequence SPEC [stack=FILE] [name=PREFIX]
+								a sequence as for -s, frames saved as
+								PREFIX0, PREFIX1, ... (sequence0, ...)
+		status					answered at once, not queued
+		shutdown				stop after the jobs already queued
+
+	and gets back, for a job,
+
+		queued ID AHEAD			accepted, AHEAD jobs before it
+		frame PATH METADATA		for every saved image, as it is written
+		done ID					finished
+		error ID MESSAGE		failed or refused (ID 0 if not even queued)
+
+	A connection may send several requests; their answers are interleaved
+	in job order. Closing the connection does not cancel its jobs, and
+	neither does the daemon closing it, which it does when the client
+	stops reading and its answers no longer fit the socket buffer. PATH
+	is the file written: the frame's own, or the stack or raw log it went
+	into. Paths must not contain blanks.
+*/
+
+#define DAEMON_SOCKET		"/tmp/acquire.sock"
+#define DAEMON_MAX_LINE		1024
+#define DAEMON_MAX_CLIENTS	16
+#define DAEMON_MAX_QUEUE	64
+
+
+typedef struct daemon_job
+{
+	int id;
+	int fd;						/* The client's connection, our own copy */
+	char line[DAEMON_MAX_LINE];
+	struct daemon_job *next;
+} daemon_job;
+
+typedef struct jobserver jobserver;
+
+
+jobserver *daemon_open (const char *path);
+daemon_job *daemon_next_job (jobserver *js);
+void daemon_send (daemon_job *job, const char *format, ...);
+void daemon_job_done (jobserver *js, daemon_job *job, const char *error);
+void daemon_close (jobserver *js);
+
+int daemon_submit (const char *path, const char *request);
+
+
+#endif
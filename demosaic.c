@@ -0,0 +1,627 @@
+/* demosaic.c
+
+	Bayer demosaicing into interleaved RGB, bilinear or gradient-corrected,
+	vectorized within rows and threaded over bands of rows. See demosaic.h.
+
+*/
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define DM_X86 1
+#endif
+
+#include "pixkern.h"
+#include "demosaic.h"
+#include "trace.h"
+
+
+#define DM_BAND_ROWS		32			/* Default rows per band */
+#define DM_PAD				2			/* Mirrored pixels around each row */
+
+
+demosaic_options dmopts = { DM_BILINEAR, 1, 0 };	/* Bilinear, in the writer thread */
+
+
+
+/* Bayer layouts of GenICam (PFNC and GigE Vision): the mono format with
+	the same packing and significant bits, and the pattern */
+
+static const struct
+{
+	unsigned int format;
+	unsigned int mono;
+	int pattern;
+} bayer_formats[] =
+{
+	{ 0x01080008, PX_PFNC_MONO8,			DM_GRBG },		/* BayerGR8 */
+	{ 0x01080009, PX_PFNC_MONO8,			DM_RGGB },		/* BayerRG8 */
+	{ 0x0108000a, PX_PFNC_MONO8,			DM_GBRG },		/* BayerGB8 */
+	{ 0x0108000b, PX_PFNC_MONO8,			DM_BGGR },		/* BayerBG8 */
+	{ 0x0110000c, 0x01100003,				DM_GRBG },		/* BayerGR10, as Mono10 */
+	{ 0x0110000d, 0x01100003,				DM_RGGB },		/* BayerRG10 */
+	{ 0x0110000e, 0x01100003,				DM_GBRG },		/* BayerGB10 */
+	{ 0x0110000f, 0x01100003,				DM_BGGR },		/* BayerBG10 */
+	{ 0x01100010, 0x01100005,				DM_GRBG },		/* BayerGR12, as Mono12 */
+	{ 0x01100011, 0x01100005,				DM_RGGB },		/* BayerRG12 */
+	{ 0x01100012, 0x01100005,				DM_GBRG },		/* BayerGB12 */
+	{ 0x01100013, 0x01100005,				DM_BGGR },		/* BayerBG12 */
+	{ 0x0110002e, PX_PFNC_MONO16,			DM_GRBG },		/* BayerGR16 */
+	{ 0x0110002f, PX_PFNC_MONO16,			DM_RGGB },		/* BayerRG16 */
+	{ 0x01100030, PX_PFNC_MONO16,			DM_GBRG },		/* BayerGB16 */
+	{ 0x01100031, PX_PFNC_MONO16,			DM_BGGR },		/* BayerBG16 */
+	{ 0x010c002a, PX_PFNC_MONO12PACKED,		DM_GRBG },		/* BayerGR12Packed */
+	{ 0x010c002b, PX_PFNC_MONO12PACKED,		DM_RGGB },		/* BayerRG12Packed */
+	{ 0x010c002c, PX_PFNC_MONO12PACKED,		DM_GBRG },		/* BayerGB12Packed */
+	{ 0x010c002d, PX_PFNC_MONO12PACKED,		DM_BGGR },		/* BayerBG12Packed */
+	{ 0x010a0056, PX_PFNC_MONO10P,			DM_GRBG },		/* BayerGR10p */
+	{ 0x010a0058, PX_PFNC_MONO10P,			DM_RGGB },		/* BayerRG10p */
+	{ 0x010a0054, PX_PFNC_MONO10P,			DM_GBRG },		/* BayerGB10p */
+	{ 0x010a0052, PX_PFNC_MONO10P,			DM_BGGR },		/* BayerBG10p */
+	{ 0x010c0057, PX_PFNC_MONO12P,			DM_GRBG },		/* BayerGR12p */
+	{ 0x010c0059, PX_PFNC_MONO12P,			DM_RGGB },		/* BayerRG12p */
+	{ 0x010c0055, PX_PFNC_MONO12P,			DM_GBRG },		/* BayerGB12p */
+	{ 0x010c0053, PX_PFNC_MONO12P,			DM_BGGR },		/* BayerBG12p */
+	{ 0, 0, -1 }
+};
+
+
+/* The Bayer pattern of a pixel format, or -1 if it is not a Bayer format */
+
+int dm_pattern (unsigned int pixelformat)
+{
+int i;
+
+	for (i=0; bayer_formats[i].format; i++)
+		if (bayer_formats[i].format == pixelformat) return bayer_formats[i].pattern;
+	return -1;
+}
+
+
+/* The mono format whose pixels are stored like those of pixelformat, so
+	that unpacking and bit depths need not know about colour; other
+	formats are returned as they are */
+
+unsigned int dm_mono_format (unsigned int pixelformat)
+{
+int i;
+
+	for (i=0; bayer_formats[i].format; i++)
+		if (bayer_formats[i].format == pixelformat) return bayer_formats[i].mono;
+	return pixelformat;
+}
+
+
+const char *dm_pattern_name (int pattern)
+{
+static const char *names[] = { "RGGB", "GRBG", "GBRG", "BGGR" };
+
+	return (pattern >= 0 && pattern < 4) ? names[pattern] : "mono";
+}
+
+
+/* Method names as used on the command line */
+
+static const char *dm_methods[] = { "none", "bilinear", "gradient", NULL };
+
+
+int dm_parse_method (const char *name, demosaic_options *opt)
+{
+int i;
+
+	for (i=0; dm_methods[i]; i++)
+		if (!strcmp (name, dm_methods[i]))
+		{
+			opt->method = i;
+			return 0;
+		}
+	return -1;
+}
+
+
+const char *dm_method_name (int method)
+{
+	return (method >= DM_NONE && method <= DM_GRADIENT) ? dm_methods[method] : "unknown";
+}
+
+
+
+/*********************************************************************/
+
+/* One output row from five padded input rows r[0] to r[4] (row y-2 to
+	y+2, each readable from x = -2 to width+1). Every pixel has one colour
+	of its own and needs the two others. At the colour sites of the row
+	(x & 1 == cp), "own" is the pixel itself, green the cross of its four
+	neighbours, and "other" (the colour on the diagonals) the diagonal
+	neighbours. At the green sites, green is the pixel, "own" comes from
+	the left and right neighbours and "other" from those above and below.
+
+	The gradient-corrected filters of Malvar et al., in sixteenths:
+		green at red/blue		 8 C + 4 cross - 2 far
+		other at red/blue		12 C + 4 diag - 3 far
+		own at green			10 C + 8 hor - 2 hfar - 2 diag + vfar
+		other at green			10 C + 8 ver - 2 vfar - 2 diag + hfar
+	with hor, ver the left+right and upper+lower neighbours, hfar, vfar
+	those two pixels away, cross = hor + ver and far = hfar + vfar. All
+	versions round the same way, (sum + 8) >> 4, and clamp to 0..maxval. */
+
+static inline int dm_clamp (int v, int maxval)
+{
+	return (v < 0) ? 0 : (v > maxval) ? maxval : v;
+}
+
+
+static void dm_row_scalar (unsigned short *own, unsigned short *g, unsigned short *other,
+			const unsigned short *const *r, int first, int width, int cp, int method, int maxval)
+{
+int x, c, hor, ver, diag, hfar, vfar, gv, xv, hv, vv;
+
+
+	for (x=first; x<width; x++)
+	{
+		c = r[2][x];
+		hor = r[2][x-1] + r[2][x+1];
+		ver = r[1][x] + r[3][x];
+		diag = r[1][x-1] + r[1][x+1] + r[3][x-1] + r[3][x+1];
+		if (method == DM_GRADIENT)
+		{
+			hfar = r[2][x-2] + r[2][x+2];
+			vfar = r[0][x] + r[4][x];
+			gv = (8*c + 4*(hor + ver) - 2*(hfar + vfar) + 8) >> 4;
+			xv = (12*c + 4*diag - 3*(hfar + vfar) + 8) >> 4;
+			hv = (10*c + 8*hor - 2*hfar - 2*diag + vfar + 8) >> 4;
+			vv = (10*c + 8*ver - 2*vfar - 2*diag + hfar + 8) >> 4;
+		}
+		else
+		{
+			gv = (hor + ver + 2) >> 2;
+			xv = (diag + 2) >> 2;
+			hv = (hor + 1) >> 1;
+			vv = (ver + 1) >> 1;
+		}
+		if ((x & 1) == cp)
+		{
+			own[x] = (unsigned short)c;
+			g[x] = (unsigned short)dm_clamp (gv, maxval);
+			other[x] = (unsigned short)dm_clamp (xv, maxval);
+		}
+		else
+		{
+			own[x] = (unsigned short)dm_clamp (hv, maxval);
+			g[x] = (unsigned short)c;
+			other[x] = (unsigned short)dm_clamp (vv, maxval);
+		}
+	}
+}
+
+
+#if defined(__ARM_NEON)
+
+/* 4 pixels of row r at x, widened to 32-bit lanes */
+
+static inline int32x4_t ld4 (const unsigned short *r, int x)
+{
+	return vreinterpretq_s32_u32 (vmovl_u16 (vld1_u16 (r + x)));
+}
+
+
+static inline void st4 (unsigned short *dst, int32x4_t v, int32x4_t maxv)
+{
+	v = vminq_s32 (vmaxq_s32 (v, vdupq_n_s32 (0)), maxv);
+	vst1_u16 (dst, vmovn_u32 (vreinterpretq_u32_s32 (v)));
+}
+
+
+static int dm_row_vec (unsigned short *own, unsigned short *g, unsigned short *other,
+			const unsigned short *const *r, int width, int cp, int method, int maxval)
+{
+static const uint32_t parity[2][4] = { { ~0u, 0, ~0u, 0 }, { 0, ~0u, 0, ~0u } };
+int32x4_t c, hor, ver, diag, hfar, vfar, far, gv, xv, hv, vv, maxv;
+uint32x4_t m;
+int x;
+
+
+	m = vld1q_u32 (parity[cp]);
+	maxv = vdupq_n_s32 (maxval);
+	for (x=0; x+4<=width; x+=4)
+	{
+		c = ld4 (r[2], x);
+		hor = vaddq_s32 (ld4 (r[2], x-1), ld4 (r[2], x+1));
+		ver = vaddq_s32 (ld4 (r[1], x), ld4 (r[3], x));
+		diag = vaddq_s32 (vaddq_s32 (ld4 (r[1], x-1), ld4 (r[1], x+1)),
+			vaddq_s32 (ld4 (r[3], x-1), ld4 (r[3], x+1)));
+		if (method == DM_GRADIENT)
+		{
+			hfar = vaddq_s32 (ld4 (r[2], x-2), ld4 (r[2], x+2));
+			vfar = vaddq_s32 (ld4 (r[0], x), ld4 (r[4], x));
+			far = vaddq_s32 (hfar, vfar);
+			gv = vmlsq_n_s32 (vmlaq_n_s32 (vmulq_n_s32 (c, 8), vaddq_s32 (hor, ver), 4), far, 2);
+			xv = vmlsq_n_s32 (vmlaq_n_s32 (vmulq_n_s32 (c, 12), diag, 4), far, 3);
+			hv = vmlsq_n_s32 (vmlaq_n_s32 (vmulq_n_s32 (c, 10), hor, 8), vaddq_s32 (hfar, diag), 2);
+			vv = vmlsq_n_s32 (vmlaq_n_s32 (vmulq_n_s32 (c, 10), ver, 8), vaddq_s32 (vfar, diag), 2);
+			gv = vrshrq_n_s32 (gv, 4);
+			xv = vrshrq_n_s32 (xv, 4);
+			hv = vrshrq_n_s32 (vaddq_s32 (hv, vfar), 4);
+			vv = vrshrq_n_s32 (vaddq_s32 (vv, hfar), 4);
+		}
+		else
+		{
+			gv = vrshrq_n_s32 (vaddq_s32 (hor, ver), 2);
+			xv = vrshrq_n_s32 (diag, 2);
+			hv = vrshrq_n_s32 (hor, 1);
+			vv = vrshrq_n_s32 (ver, 1);
+		}
+		st4 (own + x, vbslq_s32 (m, c, hv), maxv);
+		st4 (g + x, vbslq_s32 (m, gv, c), maxv);
+		st4 (other + x, vbslq_s32 (m, xv, vv), maxv);
+	}
+	return x;
+}
+
+#elif defined(DM_X86)
+
+/* AVX2: 8 pixels per step in 32-bit lanes */
+
+__attribute__((target("avx2")))
+static inline __m256i ld8 (const unsigned short *r, int x)
+{
+	return _mm256_cvtepu16_epi32 (_mm_loadu_si128 ((const __m128i*)(r + x)));
+}
+
+
+__attribute__((target("avx2")))
+static inline void st8 (unsigned short *dst, __m256i v, __m256i maxv)
+{
+	v = _mm256_min_epi32 (_mm256_max_epi32 (v, _mm256_setzero_si256 ()), maxv);
+	v = _mm256_permute4x64_epi64 (_mm256_packus_epi32 (v, v), 0x08);
+	_mm_storeu_si128 ((__m128i*)dst, _mm256_castsi256_si128 (v));
+}
+
+
+__attribute__((target("avx2")))
+static int dm_row_avx2 (unsigned short *own, unsigned short *g, unsigned short *other,
+			const unsigned short *const *r, int width, int cp, int method, int maxval)
+{
+__m256i c, hor, ver, diag, hfar, vfar, far, c10, d2, gv, xv, hv, vv, m, maxv, one, two, eight;
+int x;
+
+
+	m = cp ? _mm256_setr_epi32 (0, -1, 0, -1, 0, -1, 0, -1) : _mm256_setr_epi32 (-1, 0, -1, 0, -1, 0, -1, 0);
+	maxv = _mm256_set1_epi32 (maxval);
+	one = _mm256_set1_epi32 (1);
+	two = _mm256_set1_epi32 (2);
+	eight = _mm256_set1_epi32 (8);
+	for (x=0; x+8<=width; x+=8)
+	{
+		c = ld8 (r[2], x);
+		hor = _mm256_add_epi32 (ld8 (r[2], x-1), ld8 (r[2], x+1));
+		ver = _mm256_add_epi32 (ld8 (r[1], x), ld8 (r[3], x));
+		diag = _mm256_add_epi32 (_mm256_add_epi32 (ld8 (r[1], x-1), ld8 (r[1], x+1)),
+			_mm256_add_epi32 (ld8 (r[3], x-1), ld8 (r[3], x+1)));
+		if (method == DM_GRADIENT)
+		{
+			hfar = _mm256_add_epi32 (ld8 (r[2], x-2), ld8 (r[2], x+2));
+			vfar = _mm256_add_epi32 (ld8 (r[0], x), ld8 (r[4], x));
+			far = _mm256_add_epi32 (hfar, vfar);
+			c10 = _mm256_add_epi32 (_mm256_slli_epi32 (c, 3), _mm256_slli_epi32 (c, 1));
+			d2 = _mm256_slli_epi32 (diag, 1);
+			gv = _mm256_sub_epi32 (_mm256_add_epi32 (_mm256_slli_epi32 (c, 3),
+				_mm256_slli_epi32 (_mm256_add_epi32 (hor, ver), 2)), _mm256_slli_epi32 (far, 1));
+			xv = _mm256_sub_epi32 (_mm256_add_epi32 (_mm256_add_epi32 (_mm256_slli_epi32 (c, 3),
+				_mm256_slli_epi32 (c, 2)), _mm256_slli_epi32 (diag, 2)),
+				_mm256_add_epi32 (_mm256_slli_epi32 (far, 1), far));
+			hv = _mm256_sub_epi32 (_mm256_add_epi32 (_mm256_add_epi32 (c10, _mm256_slli_epi32 (hor, 3)), vfar),
+				_mm256_add_epi32 (_mm256_slli_epi32 (hfar, 1), d2));
+			vv = _mm256_sub_epi32 (_mm256_add_epi32 (_mm256_add_epi32 (c10, _mm256_slli_epi32 (ver, 3)), hfar),
+				_mm256_add_epi32 (_mm256_slli_epi32 (vfar, 1), d2));
+			gv = _mm256_srai_epi32 (_mm256_add_epi32 (gv, eight), 4);
+			xv = _mm256_srai_epi32 (_mm256_add_epi32 (xv, eight), 4);
+			hv = _mm256_srai_epi32 (_mm256_add_epi32 (hv, eight), 4);
+			vv = _mm256_srai_epi32 (_mm256_add_epi32 (vv, eight), 4);
+		}
+		else
+		{
+			gv = _mm256_srai_epi32 (_mm256_add_epi32 (_mm256_add_epi32 (hor, ver), two), 2);
+			xv = _mm256_srai_epi32 (_mm256_add_epi32 (diag, two), 2);
+			hv = _mm256_srai_epi32 (_mm256_add_epi32 (hor, one), 1);
+			vv = _mm256_srai_epi32 (_mm256_add_epi32 (ver, one), 1);
+		}
+		st8 (own + x, _mm256_blendv_epi8 (hv, c, m), maxv);
+		st8 (g + x, _mm256_blendv_epi8 (c, gv, m), maxv);
+		st8 (other + x, _mm256_blendv_epi8 (vv, xv, m), maxv);
+	}
+	return x;
+}
+
+
+/* SSE2: 4 pixels per step. SSE2 has neither 32-bit min/max nor an
+	unsigned 32-to-16 bit pack, so clamping is done with compares and the
+	pack biased by 0x8000 */
+
+static inline __m128i ld4 (const unsigned short *r, int x)
+{
+	return _mm_unpacklo_epi16 (_mm_loadl_epi64 ((const __m128i*)(r + x)), _mm_setzero_si128 ());
+}
+
+
+static inline __m128i sel4 (__m128i m, __m128i a, __m128i b)
+{
+	return _mm_or_si128 (_mm_and_si128 (m, a), _mm_andnot_si128 (m, b));
+}
+
+
+static inline void st4 (unsigned short *dst, __m128i v, __m128i maxv)
+{
+	v = _mm_and_si128 (v, _mm_cmpgt_epi32 (v, _mm_setzero_si128 ()));
+	v = sel4 (_mm_cmpgt_epi32 (v, maxv), maxv, v);
+	v = _mm_sub_epi32 (v, _mm_set1_epi32 (0x8000));
+	_mm_storel_epi64 ((__m128i*)dst, _mm_xor_si128 (_mm_packs_epi32 (v, v), _mm_set1_epi16 ((short)0x8000)));
+}
+
+
+static int dm_row_vec (unsigned short *own, unsigned short *g, unsigned short *other,
+			const unsigned short *const *r, int width, int cp, int method, int maxval)
+{
+__m128i c, hor, ver, diag, hfar, vfar, far, c10, d2, gv, xv, hv, vv, m, maxv, one, two, eight;
+int x;
+
+
+	if (__builtin_cpu_supports ("avx2"))
+		return dm_row_avx2 (own, g, other, r, width, cp, method, maxval);
+
+	m = cp ? _mm_setr_epi32 (0, -1, 0, -1) : _mm_setr_epi32 (-1, 0, -1, 0);
+	maxv = _mm_set1_epi32 (maxval);
+	one = _mm_set1_epi32 (1);
+	two = _mm_set1_epi32 (2);
+	eight = _mm_set1_epi32 (8);
+	for (x=0; x+4<=width; x+=4)
+	{
+		c = ld4 (r[2], x);
+		hor = _mm_add_epi32 (ld4 (r[2], x-1), ld4 (r[2], x+1));
+		ver = _mm_add_epi32 (ld4 (r[1], x), ld4 (r[3], x));
+		diag = _mm_add_epi32 (_mm_add_epi32 (ld4 (r[1], x-1), ld4 (r[1], x+1)),
+			_mm_add_epi32 (ld4 (r[3], x-1), ld4 (r[3], x+1)));
+		if (method == DM_GRADIENT)
+		{
+			hfar = _mm_add_epi32 (ld4 (r[2], x-2), ld4 (r[2], x+2));
+			vfar = _mm_add_epi32 (ld4 (r[0], x), ld4 (r[4], x));
+			far = _mm_add_epi32 (hfar, vfar);
+			c10 = _mm_add_epi32 (_mm_slli_epi32 (c, 3), _mm_slli_epi32 (c, 1));
+			d2 = _mm_slli_epi32 (diag, 1);
+			gv = _mm_sub_epi32 (_mm_add_epi32 (_mm_slli_epi32 (c, 3),
+				_mm_slli_epi32 (_mm_add_epi32 (hor, ver), 2)), _mm_slli_epi32 (far, 1));
+			xv = _mm_sub_epi32 (_mm_add_epi32 (_mm_add_epi32 (_mm_slli_epi32 (c, 3),
+				_mm_slli_epi32 (c, 2)), _mm_slli_epi32 (diag, 2)),
+				_mm_add_epi32 (_mm_slli_epi32 (far, 1), far));
+			hv = _mm_sub_epi32 (_mm_add_epi32 (_mm_add_epi32 (c10, _mm_slli_epi32 (hor, 3)), vfar),
+				_mm_add_epi32 (_mm_slli_epi32 (hfar, 1), d2));
+			vv = _mm_sub_epi32 (_mm_add_epi32 (_mm_add_epi32 (c10, _mm_slli_epi32 (ver, 3)), hfar),
+				_mm_add_epi32 (_mm_slli_epi32 (vfar, 1), d2));
+			gv = _mm_srai_epi32 (_mm_add_epi32 (gv, eight), 4);
+			xv = _mm_srai_epi32 (_mm_add_epi32 (xv, eight), 4);
+			hv = _mm_srai_epi32 (_mm_add_epi32 (hv, eight), 4);
+			vv = _mm_srai_epi32 (_mm_add_epi32 (vv, eight), 4);
+		}
+		else
+		{
+			gv = _mm_srai_epi32 (_mm_add_epi32 (_mm_add_epi32 (hor, ver), two), 2);
+			xv = _mm_srai_epi32 (_mm_add_epi32 (diag, two), 2);
+			hv = _mm_srai_epi32 (_mm_add_epi32 (hor, one), 1);
+			vv = _mm_srai_epi32 (_mm_add_epi32 (ver, one), 1);
+		}
+		st4 (own + x, sel4 (m, c, hv), maxv);
+		st4 (g + x, sel4 (m, gv, c), maxv);
+		st4 (other + x, sel4 (m, xv, vv), maxv);
+	}
+	return x;
+}
+
+#else
+
+static int dm_row_vec (unsigned short *own, unsigned short *g, unsigned short *other,
+			const unsigned short *const *r, int width, int cp, int method, int maxval)
+{
+	return 0;
+}
+
+#endif
+
+
+
+/*********************************************************************/
+
+/* The worker threads share one job and take bands of rows by incrementing
+	a common counter, as the strip encoders do. Each keeps the five input
+	rows around the current one, padded and widened to 16 bits, in a ring. */
+
+typedef struct
+{
+	const unsigned char *src;
+	unsigned char *dst;
+	int width, height, bps;
+	int rx, ry;					/* Column and row of the red pixels, 0 or 1 */
+	int method;
+	int maxval;
+	int band_rows, nbands;
+	atomic_int next;
+	atomic_int failed;
+} dm_job;
+
+
+/* Row y of the source, mirrored at the borders so that the colours stay
+	in place (-1 is row 1, height is height-2), into out[-2..width+1] */
+
+static void dm_pad_row (dm_job *job, int y, unsigned short *out)
+{
+const unsigned char *s8;
+int x, w;
+
+
+	w = job->width;
+	if (y < 0) y = -y;
+	if (y >= job->height) y = 2*(job->height - 1) - y;
+
+	if (job->bps == 2)
+		memcpy (out, job->src + (long)y*w*2, (long)w*2);
+	else
+	{
+		s8 = job->src + (long)y*w;
+		for (x=0; x<w; x++)
+			out[x] = s8[x];
+	}
+	out[-2] = out[2];
+	out[-1] = out[1];
+	out[w] = out[w-2];
+	out[w+1] = out[w-3];
+}
+
+
+static void dm_band (dm_job *job, int b, unsigned short *ring, unsigned short *planes)
+{
+const unsigned short *r[5];
+unsigned short *own, *g, *other, *red, *blue, *d16;
+unsigned char *d8;
+long rowlen;
+int y, y0, y1, k, x, cp, done;
+
+
+	rowlen = job->width + 2*DM_PAD;
+	y0 = b * job->band_rows;
+	y1 = (y0 + job->band_rows < job->height) ? y0 + job->band_rows : job->height;
+	own = planes;
+	g = planes + job->width;
+	other = planes + 2*job->width;
+
+	/* Slot of row y in the ring: (y - y0 + 2) % 5 */
+
+	for (y=y0-2; y<y0+2; y++)
+		dm_pad_row (job, y, ring + ((y - y0 + 2) % 5) * rowlen + DM_PAD);
+
+	for (y=y0; y<y1; y++)
+	{
+		dm_pad_row (job, y+2, ring + ((y - y0 + 4) % 5) * rowlen + DM_PAD);
+		for (k=0; k<5; k++)
+			r[k] = ring + ((y - y0 + k) % 5) * rowlen + DM_PAD;
+
+		/* A row with red has it at column rx, one with blue at 1-rx */
+
+		cp = ((y & 1) == job->ry) ? job->rx : 1 - job->rx;
+		done = dm_row_vec (own, g, other, r, job->width, cp, job->method, job->maxval);
+		dm_row_scalar (own, g, other, r, done, job->width, cp, job->method, job->maxval);
+
+		red = ((y & 1) == job->ry) ? own : other;
+		blue = ((y & 1) == job->ry) ? other : own;
+		if (job->bps == 2)
+		{
+			d16 = (unsigned short*)job->dst + (long)y*job->width*3;
+			for (x=0; x<job->width; x++)
+			{
+				d16[3*x] = red[x];
+				d16[3*x+1] = g[x];
+				d16[3*x+2] = blue[x];
+			}
+		}
+		else
+		{
+			d8 = job->dst + (long)y*job->width*3;
+			for (x=0; x<job->width; x++)
+			{
+				d8[3*x] = (unsigned char)red[x];
+				d8[3*x+1] = (unsigned char)g[x];
+				d8[3*x+2] = (unsigned char)blue[x];
+			}
+		}
+	}
+}
+
+
+static void *dm_worker (void *arg)
+{
+dm_job *job = (dm_job*)arg;
+unsigned short *ring, *planes;
+int b;
+
+
+	ring = malloc (5 * (job->width + 2*DM_PAD) * sizeof (unsigned short));
+	planes = malloc (3 * job->width * sizeof (unsigned short));
+	if (!ring || !planes)
+	{
+		atomic_store (&job->failed, 1);
+		free (ring);
+		free (planes);
+		return NULL;
+	}
+
+	while ((b = atomic_fetch_add (&job->next, 1)) < job->nbands)
+	{
+		TRACE_BEGIN (2, "band");
+		dm_band (job, b, ring, planes);
+		TRACE_END (2, "band");
+	}
+
+	free (planes);
+	free (ring);
+	return NULL;
+}
+
+
+
+/* Demosaic the width x height Bayer image src (bps 1 or 2, pattern
+	DM_RGGB ...) into dst, width x height RGB pixels of 3*bps bytes, with
+	opt->method and opt->threads. Returns 0, or -1 for other data, images
+	smaller than 3 x 3, DM_NONE or no memory. */
+
+int demosaic (void *dst, const void *src, int width, int height, int bps, int pattern,
+			const demosaic_options *opt)
+{
+dm_job job;
+pthread_t *tid;
+int i, nthreads, started;
+
+
+	if ((bps != 1 && bps != 2) || pattern < 0 || pattern > 3 || width < 3 || height < 3
+			|| (opt->method != DM_BILINEAR && opt->method != DM_GRADIENT))
+		return -1;
+
+	job.src = (const unsigned char*)src;
+	job.dst = (unsigned char*)dst;
+	job.width = width;
+	job.height = height;
+	job.bps = bps;
+	job.rx = pattern & 1;
+	job.ry = pattern >> 1;
+	job.method = opt->method;
+	job.maxval = (bps == 2) ? 65535 : 255;
+	job.band_rows = (opt->band_rows > 0) ? opt->band_rows : DM_BAND_ROWS;
+	job.nbands = (height + job.band_rows - 1) / job.band_rows;
+	atomic_init (&job.next, 0);
+	atomic_init (&job.failed, 0);
+
+	nthreads = (opt->threads > 0) ? opt->threads : 1;
+	if (nthreads > job.nbands) nthreads = job.nbands;
+	tid = malloc (nthreads * sizeof (pthread_t));
+	if (!tid) return -1;
+
+	/* The calling thread works along with the others */
+
+	started = 0;
+	for (i=1; i<nthreads; i++)
+		if (!pthread_create (&tid[started], NULL, dm_worker, &job))
+			started++;
+	dm_worker (&job);
+	for (i=0; i<started; i++)
+		pthread_join (tid[i], NULL);
+	free (tid);
+
+	/* A worker without memory has left its bands to the others, unless
+		it was the last one */
+
+	return (atomic_load (&job.failed) && atomic_load (&job.next) < job.nbands) ? -1 : 0;
+}
@@ -0,0 +1,50 @@
+#ifndef __DEMOSAIC_H
+#define __DEMOSAIC_H
+
+
+/* Bayer demosaicing: the mosaic of a colour camera, one colour per pixel,
+	into interleaved RGB for the TIFF and PNG writers. 8-bit data become
+	8-bit RGB (bps 3), 16-bit data (10, 12 or 16 significant bits)
+	16-bit RGB (bps 6).
+
+	Bilinear interpolation averages the nearest pixels of each missing
+	colour. The gradient-corrected mode (Malvar, He and Cutler, 2004) adds
+	a fraction of the local second derivative of the pixel's own colour,
+	which removes most of the colour fringes at edges, for a 5 x 5 instead
+	of a 3 x 3 neighbourhood. Rows are cut into bands that opt->threads
+	threads work on; within a row, NEON or SSE2/AVX2 compute 8 pixels at
+	a time. Borders are mirrored, keeping the pattern.
+*/
+
+#define DM_RGGB				0			/* Position of the red pixel in the top left 2 x 2 */
+#define DM_GRBG				1			/* block: bit 0 its column, bit 1 its row */
+#define DM_GBRG				2
+#define DM_BGGR				3
+
+#define dm_crop_pattern(p, x, y)	((p) ^ ((x) & 1) ^ (((y) & 1) << 1))	/* After a crop at x, y */
+
+#define DM_NONE				0			/* Bayer data are saved as they are */
+#define DM_BILINEAR			1
+#define DM_GRADIENT			2
+
+typedef struct
+{
+	int method;					/* DM_NONE, DM_BILINEAR or DM_GRADIENT */
+	int threads;				/* Threads, 1 to work in the calling thread only */
+	int band_rows;				/* Rows per band, 0 for the default */
+} demosaic_options;
+
+extern demosaic_options dmopts;	/* Used by acquire for colour cameras */
+
+
+int dm_pattern (unsigned int pixelformat);
+unsigned int dm_mono_format (unsigned int pixelformat);
+const char *dm_pattern_name (int pattern);
+int dm_parse_method (const char *name, demosaic_options *opt);
+const char *dm_method_name (int method);
+
+int demosaic (void *dst, const void *src, int width, int height, int bps, int pattern,
+			const demosaic_options *opt);
+
+
+#endif
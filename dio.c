@@ -0,0 +1,589 @@
+/* dio.c
+
+	Direct I/O writer: aligned buffers, O_DIRECT, pre-allocated files
+	and batched io_uring submissions. See dio.h.
+	io_uring is driven through its system calls; there is no liburing
+	on the Pi images.
+
+*/
+
+
+#define _GNU_SOURCE						/* O_DIRECT */
+#define _FILE_OFFSET_BITS 64			/* Stacks and raw logs outgrow 2 GB on the 32-bit Pi */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "dio.h"
+#include "trace.h"
+
+
+dio_options dioopts = { 0, 4, 2, 1 << 20 };		/* Off; 4 x 1 MB in flight, submitted in pairs */
+
+#define ALIGN_DOWN(x)	((x) & ~(uint64_t)(DIO_ALIGN - 1))
+#define ALIGN_UP(x)		ALIGN_DOWN ((x) + DIO_ALIGN - 1)
+
+struct dio_file
+{
+	int fd;
+	int direct;						/* Opened with O_DIRECT */
+	dio_options opt;
+	int err;
+
+	int ring_fd;					/* -1 for plain pwrite() */
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_map, *cq_map;
+	size_t sq_mapsize, cq_mapsize, sqes_mapsize;
+	unsigned queued;				/* Entries not submitted yet */
+	int inflight;
+
+	int nbuf;						/* depth in flight and the one being filled */
+	unsigned char **buf;
+	size_t *len;					/* Of the write in flight */
+	uint64_t *off;
+	char *busy;
+	int cur;
+	uint64_t stage_off;				/* File offset of buf[cur]; everything before is written or in flight */
+	size_t stage_len;				/* Bytes of buf[cur] filled */
+	unsigned char *bounce;			/* One block, for reads behind the buffer */
+
+	uint64_t size;					/* End of the data */
+	uint64_t pos;					/* For dio_write() and dio_seek() */
+};
+
+
+
+/********************************************************************/
+
+
+static int pwrite_all (int fd, const unsigned char *buf, size_t len, uint64_t off)
+{
+ssize_t n;
+
+
+	while (len > 0)
+	{
+		n = pwrite (fd, buf, len, (off_t)off);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) return -1;
+		buf += n;
+		len -= n;
+		off += n;
+	}
+	return 0;
+}
+
+
+static int pread_all (int fd, unsigned char *buf, size_t len, uint64_t off)
+{
+ssize_t n;
+
+
+	while (len > 0)
+	{
+		n = pread (fd, buf, len, (off_t)off);
+		if (n < 0 && errno == EINTR) continue;
+		if (n < 0) return -1;
+		if (n == 0)
+		{
+			memset (buf, 0, len);		/* Past the end; the block is new */
+			break;
+		}
+		buf += n;
+		len -= n;
+		off += n;
+	}
+	return 0;
+}
+
+
+
+/********************************************************************/
+
+
+static void ring_free (dio_file *f)
+{
+	if (f->sqes) munmap (f->sqes, f->sqes_mapsize);
+	if (f->cq_map && f->cq_map != f->sq_map) munmap (f->cq_map, f->cq_mapsize);
+	if (f->sq_map) munmap (f->sq_map, f->sq_mapsize);
+	if (f->ring_fd >= 0) close (f->ring_fd);
+	f->sqes = NULL;
+	f->sq_map = f->cq_map = NULL;
+	f->ring_fd = -1;
+}
+
+
+/* Set up a ring of at least entries entries. Returns 0, or -1 if the kernel
+	will not give us one. */
+
+static int ring_setup (dio_file *f, unsigned entries)
+{
+struct io_uring_params p;
+unsigned char *sq, *cq;
+
+
+	memset (&p, 0, sizeof (p));
+	f->ring_fd = (int)syscall (__NR_io_uring_setup, entries, &p);
+	if (f->ring_fd < 0) return -1;
+
+	f->sq_mapsize = p.sq_off.array + p.sq_entries * sizeof (unsigned);
+	f->cq_mapsize = p.cq_off.cqes + p.cq_entries * sizeof (struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		if (f->cq_mapsize > f->sq_mapsize) f->sq_mapsize = f->cq_mapsize;
+		f->cq_mapsize = f->sq_mapsize;
+	}
+	f->sqes_mapsize = p.sq_entries * sizeof (struct io_uring_sqe);
+
+	sq = mmap (NULL, f->sq_mapsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, f->ring_fd, IORING_OFF_SQ_RING);
+	f->sq_map = (sq == MAP_FAILED) ? NULL : sq;
+	cq = sq;
+	if (f->sq_map && !(p.features & IORING_FEAT_SINGLE_MMAP))
+	{
+		cq = mmap (NULL, f->cq_mapsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, f->ring_fd, IORING_OFF_CQ_RING);
+		f->cq_map = (cq == MAP_FAILED) ? NULL : cq;
+	}
+	else
+		f->cq_map = f->sq_map;
+	if (f->cq_map)
+	{
+		f->sqes = mmap (NULL, f->sqes_mapsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, f->ring_fd, IORING_OFF_SQES);
+		if (f->sqes == MAP_FAILED) f->sqes = NULL;
+	}
+	if (!f->sqes)
+	{
+		ring_free (f);
+		return -1;
+	}
+
+	f->sq_head = (unsigned*)(sq + p.sq_off.head);
+	f->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+	f->sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+	f->sq_array = (unsigned*)(sq + p.sq_off.array);
+	f->cq_head = (unsigned*)(cq + p.cq_off.head);
+	f->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+	f->cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+	f->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+
+	return 0;
+}
+
+
+/* Submit what is queued and, with wait, block until at least one write
+	has completed */
+
+static int ring_enter (dio_file *f, int wait)
+{
+int n;
+
+
+	for (;;)
+	{
+		n = (int)syscall (__NR_io_uring_enter, f->ring_fd, f->queued, wait ? 1 : 0,
+			wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+		if (n >= 0) break;
+		if (errno != EINTR && errno != EAGAIN && errno != EBUSY) return -1;
+	}
+	f->queued -= (n > (int)f->queued) ? f->queued : (unsigned)n;
+
+	return 0;
+}
+
+
+/* Collect completed writes and free their buffers. A kernel without
+	IORING_OP_WRITE fails them with EINVAL; those are written again with
+	pwrite(), and the ring is not used any more. */
+
+static void ring_reap (dio_file *f)
+{
+struct io_uring_cqe *cqe;
+unsigned head;
+int b;
+
+
+	head = *f->cq_head;
+	while (head != __atomic_load_n (f->cq_tail, __ATOMIC_ACQUIRE))
+	{
+		cqe = &f->cqes[head & *f->cq_mask];
+		b = (int)cqe->user_data;
+		if (cqe->res == -EINVAL || cqe->res == -EOPNOTSUPP)
+		{
+			f->opt.batch = -1;
+			if (pwrite_all (f->fd, f->buf[b], f->len[b], f->off[b]) < 0) f->err = -1;
+		}
+		else if (cqe->res < 0)
+		{
+			fprintf (stderr, "Direct write: %s\n", strerror (-cqe->res));
+			f->err = -1;
+		}
+		else if ((size_t)cqe->res < f->len[b]
+				&& pwrite_all (f->fd, f->buf[b] + cqe->res, f->len[b] - cqe->res, f->off[b] + cqe->res) < 0)
+			f->err = -1;
+		f->busy[b] = 0;
+		f->inflight--;
+		head++;
+	}
+	__atomic_store_n (f->cq_head, head, __ATOMIC_RELEASE);
+}
+
+
+/* Wait for all writes in flight */
+
+static void drain (dio_file *f)
+{
+	if (f->ring_fd < 0) return;
+
+	TRACE_BEGIN (1, "dio_wait");
+	while (f->inflight > 0)
+	{
+		if (ring_enter (f, 1) < 0)
+		{
+			f->err = -1;
+			break;
+		}
+		ring_reap (f);
+	}
+	TRACE_END (1, "dio_wait");
+}
+
+
+
+/********************************************************************/
+
+
+/* Write buffer b, len bytes (a multiple of the block) at off */
+
+static void write_buffer (dio_file *f, int b, size_t len, uint64_t off)
+{
+struct io_uring_sqe *sqe;
+unsigned tail, idx;
+
+
+	if (f->ring_fd < 0 || f->opt.batch < 0)
+	{
+		if (pwrite_all (f->fd, f->buf[b], len, off) < 0) f->err = -1;
+		return;
+	}
+
+	f->len[b] = len;
+	f->off[b] = off;
+	f->busy[b] = 1;
+	f->inflight++;
+
+	tail = *f->sq_tail;
+	idx = tail & *f->sq_mask;
+	sqe = &f->sqes[idx];
+	memset (sqe, 0, sizeof (*sqe));
+	sqe->opcode = IORING_OP_WRITE;
+	sqe->fd = f->fd;
+	sqe->addr = (uint64_t)(uintptr_t)f->buf[b];
+	sqe->len = (uint32_t)len;
+	sqe->off = off;
+	sqe->user_data = (uint64_t)b;
+	f->sq_array[idx] = idx;
+	__atomic_store_n (f->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	f->queued++;
+
+	if ((int)f->queued >= f->opt.batch && ring_enter (f, 0) < 0)
+		f->err = -1;
+}
+
+
+/* Send off the buffer being filled, zero-padded to its full size, and
+	move on to the next one, waiting for it if it is still in flight */
+
+static void next_buffer (dio_file *f)
+{
+	if (f->stage_len < f->opt.buffer_size)
+		memset (f->buf[f->cur] + f->stage_len, 0, f->opt.buffer_size - f->stage_len);
+	write_buffer (f, f->cur, f->opt.buffer_size, f->stage_off);
+
+	f->stage_off += f->opt.buffer_size;
+	f->stage_len = 0;
+	f->cur = (f->cur + 1) % f->nbuf;
+	if (f->busy[f->cur])
+	{
+		TRACE_BEGIN (1, "dio_wait");
+		while (f->busy[f->cur] && !f->err)
+		{
+			if (ring_enter (f, 1) < 0) f->err = -1;
+			ring_reap (f);
+		}
+		TRACE_END (1, "dio_wait");
+	}
+}
+
+
+/* Data at or after the buffer being filled. A gap before it reads back
+	as zeros. */
+
+static void stage (dio_file *f, const unsigned char *data, size_t size, uint64_t offset)
+{
+uint64_t rel;
+size_t k;
+
+
+	while (size > 0 && !f->err)
+	{
+		rel = offset - f->stage_off;
+		if (rel >= f->opt.buffer_size)
+		{
+			next_buffer (f);
+			continue;
+		}
+		if (rel > f->stage_len)
+			memset (f->buf[f->cur] + f->stage_len, 0, rel - f->stage_len);
+		k = f->opt.buffer_size - rel;
+		if (k > size) k = size;
+		memcpy (f->buf[f->cur] + rel, data, k);
+		if (rel + k > f->stage_len) f->stage_len = rel + k;
+		data += k;
+		offset += k;
+		size -= k;
+		if (f->stage_len == f->opt.buffer_size)
+			next_buffer (f);
+	}
+}
+
+
+/* Data before the buffer being filled: once the writes in flight are done,
+	a buffer at a time through a free one, reading back the blocks at the
+	ends that it only partly covers */
+
+static void patch (dio_file *f, const unsigned char *data, size_t size, uint64_t offset)
+{
+unsigned char *tmp;
+uint64_t start, stop, end, lo, hi;
+
+
+	drain (f);
+	tmp = f->buf[(f->cur + 1) % f->nbuf];
+	end = offset + size;
+	for (start = ALIGN_DOWN (offset); start < end && !f->err; start = stop)
+	{
+		stop = start + f->opt.buffer_size;
+		if (stop > ALIGN_UP (end)) stop = ALIGN_UP (end);
+		if (offset > start && pread_all (f->fd, tmp, DIO_ALIGN, start) < 0)
+			f->err = -1;
+		if (end < stop && pread_all (f->fd, tmp + (stop - start) - DIO_ALIGN, DIO_ALIGN, stop - DIO_ALIGN) < 0)
+			f->err = -1;
+		lo = (offset > start) ? offset : start;
+		hi = (end < stop) ? end : stop;
+		memcpy (tmp + (lo - start), data + (lo - offset), hi - lo);
+		if (!f->err && pwrite_all (f->fd, tmp, stop - start, start) < 0)
+			f->err = -1;
+	}
+}
+
+
+
+/********************************************************************/
+
+
+/* Create fname, or truncate it, for writing through opt (NULL for
+	dioopts). expected_bytes > 0 is allocated up front. NULL on error. */
+
+dio_file *dio_open (const char *fname, long long expected_bytes, const dio_options *opt)
+{
+dio_file *f;
+int i, err;
+
+
+	f = calloc (1, sizeof (dio_file));
+	if (!f) return NULL;
+	f->opt = opt ? *opt : dioopts;
+	if (f->opt.depth < 1) f->opt.depth = 1;
+	if (f->opt.batch < 1) f->opt.batch = 1;
+	if (f->opt.batch > f->opt.depth) f->opt.batch = f->opt.depth;
+	f->opt.buffer_size = ALIGN_UP (f->opt.buffer_size);
+	if (f->opt.buffer_size == 0) f->opt.buffer_size = DIO_ALIGN;
+	f->ring_fd = -1;
+
+	f->fd = open (fname, O_RDWR | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+	f->direct = (f->fd >= 0);
+	if (f->fd < 0 && errno == EINVAL)
+		f->fd = open (fname, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (f->fd < 0)
+	{
+		free (f);
+		return NULL;
+	}
+	if (expected_bytes > 0)
+		posix_fallocate (f->fd, 0, (off_t)ALIGN_UP ((uint64_t)expected_bytes));	/* Only a hint */
+
+	f->nbuf = f->opt.depth + 1;
+	f->buf = calloc (f->nbuf, sizeof (unsigned char*));
+	f->len = calloc (f->nbuf, sizeof (size_t));
+	f->off = calloc (f->nbuf, sizeof (uint64_t));
+	f->busy = calloc (f->nbuf, 1);
+	err = !f->buf || !f->len || !f->off || !f->busy
+		|| posix_memalign ((void**)&f->bounce, DIO_ALIGN, DIO_ALIGN);
+	for (i=0; i<f->nbuf && !err; i++)
+		err = posix_memalign ((void**)&f->buf[i], DIO_ALIGN, f->opt.buffer_size);
+	if (err)
+	{
+		f->err = -1;
+		dio_close (f);
+		return NULL;
+	}
+
+	ring_setup (f, (unsigned)f->opt.depth);		/* Without it, pwrite() */
+
+	return f;
+}
+
+
+/* Write size bytes at offset. Returns size, or -1 if this or an earlier
+	write failed. */
+
+ssize_t dio_pwrite (dio_file *f, const void *data, size_t size, uint64_t offset)
+{
+size_t k;
+
+
+	if (f->err) return -1;
+
+	if (offset < f->stage_off)
+	{
+		k = (offset + size <= f->stage_off) ? size : f->stage_off - offset;
+		patch (f, data, k, offset);
+		data = (const unsigned char*)data + k;
+		offset += k;
+		size -= k;
+	}
+	else
+		k = 0;
+	if (size > 0)
+		stage (f, data, size, offset);
+	if (offset + size > f->size)
+		f->size = offset + size;
+
+	return f->err ? -1 : (ssize_t)(k + size);
+}
+
+
+/* Write at the current position, and move it on */
+
+ssize_t dio_write (dio_file *f, const void *data, size_t size)
+{
+ssize_t n;
+
+
+	n = dio_pwrite (f, data, size, f->pos);
+	if (n > 0) f->pos += n;
+	return n;
+}
+
+
+/* Read back what was written (libtiff may). Returns the bytes read,
+	short at the end of the data, or -1. */
+
+ssize_t dio_pread (dio_file *f, void *data, size_t size, uint64_t offset)
+{
+unsigned char *dst = (unsigned char*)data;
+uint64_t block, lo, hi, end;
+
+
+	if (f->err) return -1;
+	if (offset >= f->size) return 0;
+	if (offset + size > f->size) size = f->size - offset;
+	end = offset + size;
+
+	if (offset < f->stage_off)
+	{
+		drain (f);
+		for (block = ALIGN_DOWN (offset); block < end && block < f->stage_off; block += DIO_ALIGN)
+		{
+			if (pread_all (f->fd, f->bounce, DIO_ALIGN, block) < 0)
+				return -1;
+			lo = (offset > block) ? offset : block;
+			hi = (end < block + DIO_ALIGN) ? end : block + DIO_ALIGN;
+			memcpy (dst + (lo - offset), f->bounce + (lo - block), hi - lo);
+		}
+	}
+	if (end > f->stage_off)
+	{
+		lo = (offset > f->stage_off) ? offset : f->stage_off;
+		memcpy (dst + (lo - offset), f->buf[f->cur] + (lo - f->stage_off), end - lo);
+	}
+
+	return (ssize_t)size;
+}
+
+
+uint64_t dio_seek (dio_file *f, int64_t offset, int whence)
+{
+	if (whence == SEEK_SET)
+		f->pos = offset;
+	else if (whence == SEEK_CUR)
+		f->pos += offset;
+	else if (whence == SEEK_END)
+		f->pos = f->size + offset;
+	return f->pos;
+}
+
+
+uint64_t dio_size (dio_file *f)
+{
+	return f->size;
+}
+
+
+/* Write out the rest, padded to a block, wait for everything, and cut the
+	file to the size of the data. Returns 0, or -1 if any write failed. */
+
+int dio_close (dio_file *f)
+{
+int i, err;
+
+
+	if (!f->err && f->stage_len > 0)
+	{
+		memset (f->buf[f->cur] + f->stage_len, 0, ALIGN_UP (f->stage_len) - f->stage_len);
+		write_buffer (f, f->cur, ALIGN_UP (f->stage_len), f->stage_off);
+	}
+	if (f->ring_fd >= 0)
+	{
+		if (f->queued > 0 && ring_enter (f, 0) < 0) f->err = -1;
+		drain (f);
+		ring_free (f);
+	}
+	if (f->fd >= 0)
+	{
+		if (ftruncate (f->fd, (off_t)f->size)) f->err = -1;
+		if (close (f->fd)) f->err = -1;
+	}
+
+	for (i=0; f->buf && i<f->nbuf; i++)
+		free (f->buf[i]);
+	free (f->buf);
+	free (f->len);
+	free (f->off);
+	free (f->busy);
+	free (f->bounce);
+	err = f->err;
+	free (f);
+
+	return err ? -1 : 0;
+}
+
+
+/* How the file is written, for reports */
+
+const char *dio_mode (dio_file *f)
+{
+	if (f->ring_fd >= 0 && f->opt.batch > 0)
+		return f->direct ? "io_uring, O_DIRECT" : "io_uring, page cache";
+	return f->direct ? "pwrite, O_DIRECT" : "pwrite, page cache";
+}
@@ -0,0 +1,57 @@
+#ifndef __DIO_H
+#define __DIO_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+
+/* Direct I/O writer: output files that bypass the page cache, so that a
+	long sequence does not fill memory with dirty pages and then stall in
+	close() or in the middle of a frame while they are written back.
+
+	The file is opened with O_DIRECT and allocated up front (fallocate) to
+	the size the caller expects. Data is copied into aligned buffers of
+	buffer_size bytes, and full buffers are queued on an io_uring; once
+	batch of them are queued they are submitted together, and at most
+	depth are in flight. Writes behind the buffer being filled (e.g. libtiff
+	patching a directory offset) wait for the writes in flight and go
+	through a read-modify-write of the blocks they touch. On close, the
+	last buffer is padded to a block, written, and the file cut down to
+	its real size.
+
+	Where io_uring is not available (old kernel, seccomp) the buffers are
+	written with pwrite() as they fill; where O_DIRECT is not (tmpfs), the
+	file is opened without it. The output is the same byte for byte.
+
+	A dio_file is used by one thread at a time. Plugged in under the TIFF
+	writers (libtiff client I/O), the PNM writers and the raw log when
+	dioopts.enabled is set.
+*/
+
+#define DIO_ALIGN			4096		/* Buffer, offset and length alignment for O_DIRECT */
+
+typedef struct
+{
+	int enabled;				/* Writers use dio_open() instead of stdio, libtiff or mmap */
+	int depth;					/* Buffers in flight at most */
+	int batch;					/* Buffers queued before a submission */
+	size_t buffer_size;			/* Bytes per write, a multiple of DIO_ALIGN */
+} dio_options;
+
+extern dio_options dioopts;
+
+typedef struct dio_file dio_file;
+
+
+dio_file *dio_open (const char *fname, long long expected_bytes, const dio_options *opt);
+ssize_t dio_write (dio_file *f, const void *data, size_t size);
+ssize_t dio_pwrite (dio_file *f, const void *data, size_t size, uint64_t offset);
+ssize_t dio_pread (dio_file *f, void *data, size_t size, uint64_t offset);
+uint64_t dio_seek (dio_file *f, int64_t offset, int whence);
+uint64_t dio_size (dio_file *f);
+int dio_close (dio_file *f);
+const char *dio_mode (dio_file *f);
+
+
+#endif
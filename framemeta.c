@@ -0,0 +1,135 @@
+/* framemeta.c
+
+	Per-frame acquisition metadata: defaults and a compact
+	"key=value" text form for image descriptions and logs.
+
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "acquire.h"
+#include "framemeta.h"
+
+
+
+void framemeta_init (framemeta *meta)
+{
+	memset (meta, 0, sizeof (framemeta));
+	meta->step = -1;
+	meta->led = -1;
+	meta->camera = -1;
+	geometry_init (&meta->geom);
+	geometry_init (&meta->sw);
+}
+
+
+
+void geometry_init (geometry *g)
+{
+	memset (g, 0, sizeof (geometry));
+	g->binning = 1;
+	g->decimation = 1;
+}
+
+
+/* True if g leaves an image as it is */
+
+int geometry_is_identity (const geometry *g)
+{
+	return g->width <= 0 && g->height <= 0 && g->binning <= 1 && g->decimation <= 1;
+}
+
+
+/* Change g according to a specification made of ':'-separated parts,
+	each one of
+		WxH or WxH+X+Y	region of W x H sensor pixels at X, Y
+		full			the whole sensor
+		binN			N x N binning
+		decN			keep every N-th pixel and row
+	e.g. "1024x768+512+256:bin2". Parts that are not given stay as they
+	are. Returns 0, or -1 on a syntax error (g may be changed partly). */
+
+int geometry_parse (const char *spec, geometry *g)
+{
+char part[64], *end;
+const char *p;
+size_t len;
+int w, h, x, y, n;
+
+
+	for (p=spec; *p; p+=len + (p[len] == ':'))
+	{
+		len = strcspn (p, ":");
+		if (len == 0 || len >= sizeof (part)) return -1;
+		memcpy (part, p, len);
+		part[len] = 0;
+
+		if (!strcmp (part, "full"))
+		{
+			g->x = g->y = g->width = g->height = 0;
+		}
+		else if (!strncmp (part, "bin", 3) || !strncmp (part, "dec", 3))
+		{
+			n = (int)strtol (part+3, &end, 10);
+			if (*end || n < 1) return -1;
+			if (part[0] == 'b') g->binning = n;
+			else g->decimation = n;
+		}
+		else
+		{
+			x = y = 0;
+			n = sscanf (part, "%dx%d+%d+%d", &w, &h, &x, &y);
+			if ((n != 2 && n != 4) || w < 1 || h < 1 || x < 0 || y < 0) return -1;
+			g->x = x;
+			g->y = y;
+			g->width = w;
+			g->height = h;
+		}
+	}
+
+	return 0;
+}
+
+
+
+const char *led_name (int led)
+{
+	switch (led)
+	{
+		case White: return "white";
+		case Blue: return "blue";
+		case White_and_blue: return "white+blue";
+		default: return "off";
+	}
+}
+
+
+
+/* Write the metadata as one line of space-separated key=value pairs.
+	Returns the length of the text, as snprintf() does. */
+
+int framemeta_format (const framemeta *meta, char *buf, int size)
+{
+int n;
+
+
+	n = snprintf (buf, size,
+		"step=%d led=%s duty=%d exposure=%.1f gain=%.2f timestamp=%llu systime=%llu",
+		meta->step, led_name (meta->led), meta->dutycycle, meta->exposure, meta->gain,
+		meta->timestamp, meta->systime);
+	if (meta->geom.width > 0 && n >= 0 && n < size)
+		n += snprintf (buf+n, size-n, " roi=%dx%d+%d+%d bin=%d dec=%d",
+			meta->geom.width, meta->geom.height, meta->geom.x, meta->geom.y,
+			meta->geom.binning, meta->geom.decimation);
+	if (meta->frames > 1 && n >= 0 && n < size)
+		n += snprintf (buf+n, size-n, " frames=%d scale=%g", meta->frames, meta->scale);
+	if (meta->calib && n >= 0 && n < size)
+		n += snprintf (buf+n, size-n, " calib=%u", meta->calib);
+	if (meta->camera >= 0 && n >= 0 && n < size)
+		n += snprintf (buf+n, size-n, " camera=%d", meta->camera);
+
+	return n;
+}
@@ -0,0 +1,52 @@
+#ifndef __FRAMEMETA_H
+#define __FRAMEMETA_H
+
+
+/* Image geometry: a region, and binning and decimation factors. As a
+	request (-r, per sequence step) and in the metadata, it is in sensor
+	pixels; as the software part of the work, in camera output pixels. */
+
+typedef struct
+{
+	int x, y;					/* Top left corner of the region */
+	int width, height;			/* Size of the region, 0 for everything */
+	int binning;				/* n x n pixels averaged into one, 1 for none */
+	int decimation;				/* Only every n-th pixel and row kept, 1 for none */
+} geometry;
+
+
+#define MAX_CAMERAS			8		/* Cameras of one multi-camera run */
+
+
+/* Acquisition conditions of one frame. These travel with the frame through
+	the pipeline and end up in the output files (e.g. per-page TIFF tags). */
+
+typedef struct
+{
+	int step;					/* Sequence step, -1 for a single shot */
+	int led;					/* enum led_color, -1 for LEDs off */
+	int dutycycle;				/* LED PWM duty cycle, 0-255 */
+	double exposure;			/* Exposure time in microseconds */
+	double gain;				/* Camera gain in dB */
+	unsigned long long timestamp;	/* Camera timestamp in ns */
+	unsigned long long systime;		/* Host time of arrival in ns since the epoch */
+	geometry geom;				/* As applied: region on the sensor, total binning and decimation */
+	geometry sw;				/* The part of geom that is left to software */
+	int frames;					/* Frames averaged or summed into this one, 0 for a single frame */
+	double scale;				/* With frames: saved value = scale * mean of the frames */
+	unsigned int calib;			/* Generation of the calibration store applied, 0 for none */
+	int camera;					/* Index of the camera in a multi-camera run, -1 for a single camera */
+} framemeta;
+
+
+void geometry_init (geometry *g);
+int geometry_parse (const char *spec, geometry *g);
+int geometry_is_identity (const geometry *g);
+
+
+void framemeta_init (framemeta *meta);
+const char *led_name (int led);
+int framemeta_format (const framemeta *meta, char *buf, int size);
+
+
+#endif
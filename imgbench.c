@@ -0,0 +1,2710 @@
+/*************************************************
+
+	imgbench.c
+
+	Throughput benchmarks for the image writers.
+	Frames are synthetic, but shaped like ours:
+	a smooth background with sensor noise.
+
+**************************************************/
+
+/* Usage: imgbench [-x width] [-y height] [-n repeats] [-d dir] [-i rawlog] [-k interval] test
+
+	Tests:
+	strips		tiffwrite() single strip vs. parallel strip encoding
+	codecs		compression ratio, encode and decode speed of every TIFF codec
+	pnm			16-bit PGM writer, against the former scalar version
+	png			PNG settings and parallel bands, against the former arv_save_png()
+	unpack		Mono10p/Mono12p/Mono12Packed unpacking, checked and timed
+	bin			software binning and decimation (the fallback for cameras without)
+	acc			multi-frame accumulation, checked and timed, and float TIFF output
+	calib		dark and flat correction, checked and timed, and the calibration store
+	stats		frame statistics and index maps, checked and timed
+	trace		cost of a trace point, off and on, and a trace of parallel TIFF writes
+	timelapse	residual kernels checked and timed; a series of frames (the raw log
+				-i, else synthetic) through the time-lapse archive, checked bit
+				for bit, with its size against raw and LZW TIFF
+	dio			the direct I/O writer, checked, and TIFF, PGM and raw log output
+				buffered vs. direct: time per frame, worst frame, close and sync
+	preview		pyramid levels and tone-mapped preview, checked and timed, and TIFF
+				SubIFDs read back
+	demosaic	Bayer demosaicing against a plain version, quality of both methods,
+				16-bit RGB TIFF and PNG read back, and frames/s per thread count
+	views		every writer on padded and big-endian image views, read back, with
+				the bytes copied; the registry; a crop copied vs. viewed, and
+				several formats of a frame in turn vs. side by side
+	pipeline	writer pipeline with a small buffer pool and several writers,
+				against a stand-in camera: no frame may find the pool empty
+*/
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <tiffio.h>
+#include <png.h>
+
+#include "tiffstuff.h"
+#include "pixkern.h"
+#include "accum.h"
+#include "calib.h"
+#include "stats.h"
+#include "trace.h"
+#include "rawlog.h"
+#include "tlapse.h"
+#include "dio.h"
+#include "preview.h"
+#include "demosaic.h"
+#include "imgview.h"
+#include "pipeline.h"
+
+
+int width = 2448;
+int height = 2048;
+int repeats = 5;
+char outdir[1024] = "/tmp";
+
+
+
+/* Monotonic wall clock time in seconds */
+
+double now ()
+{
+struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + 1e-9*ts.tv_nsec;
+}
+
+
+long filesize (const char *fname)
+{
+struct stat st;
+
+	if (stat (fname, &st)) return -1;
+	return (long)st.st_size;
+}
+
+
+
+/* A 12-bit frame in 16-bit words: a vignetted background, a few
+	bright "plants", and Gaussian-ish noise of a few counts. */
+
+unsigned short *make_frame16 (int w, int h)
+{
+unsigned short *img;
+int x, y, v;
+double cx, cy, r2;
+unsigned int seed = 12345;
+
+
+	img = malloc ((long)w * (long)h * sizeof (unsigned short));
+	if (!img) return NULL;
+
+	for (y=0; y<h; y++)
+		for (x=0; x<w; x++)
+		{
+			cx = (x - 0.5*w) / w;
+			cy = (y - 0.5*h) / h;
+			r2 = cx*cx + cy*cy;
+			v = (int)(1800 * (1.0 - r2));
+			if (((x/200) + (y/200)) % 3 == 0) v += 1200;
+			seed = seed*1103515245 + 12345;
+			v += (int)((seed >> 16) % 13) - 6;
+			seed = seed*1103515245 + 12345;
+			v += (int)((seed >> 16) % 13) - 6;
+			if (v < 0) v = 0;
+			if (v > 4095) v = 4095;
+			img[(long)y*w + x] = (unsigned short)v;
+		}
+
+	return img;
+}
+
+
+
+/* 8-bit version of the same scene */
+
+unsigned char *make_frame8 (int w, int h)
+{
+unsigned short *img16;
+unsigned char *img;
+long i, n;
+
+
+	img16 = make_frame16 (w, h);
+	img = malloc ((long)w * (long)h);
+	if (!img16 || !img)
+	{
+		free (img16);
+		free (img);
+		return NULL;
+	}
+
+	n = (long)w * (long)h;
+	for (i=0; i<n; i++)
+		img[i] = (unsigned char)(img16[i] >> 4);
+	free (img16);
+
+	return img;
+}
+
+
+
+/* Read all strips of a TIFF file into buf. Returns bytes read or -1 */
+
+long tiffread_all (const char *fname, char *buf, long size)
+{
+TIFF *tif;
+tmsize_t n;
+long total;
+uint32_t s, nstrips;
+
+
+	tif = TIFFOpen (fname, "r");
+	if (!tif) return -1;
+	total = 0;
+	nstrips = TIFFNumberOfStrips (tif);
+	for (s=0; s<nstrips; s++)
+	{
+		n = TIFFReadEncodedStrip (tif, s, buf + total, size - total);
+		if (n < 0)
+		{
+			total = -1;
+			break;
+		}
+		total += n;
+	}
+	TIFFClose (tif);
+
+	return total;
+}
+
+
+
+/* Write the same frame repeats times and report raw MB/s and file size */
+
+void bench_tiff (const char *label, char *img, int bps, const tiff_options *opt)
+{
+char fname[1200];
+double t0, t;
+int i;
+
+
+	snprintf (fname, sizeof (fname), "%s/imgbench.tif", outdir);
+	t0 = now ();
+	for (i=0; i<repeats; i++)
+		tiffwrite_opt (fname, img, width, height, bps, NULL, opt);
+	t = (now () - t0) / repeats;
+
+	printf ("%-28s %8.1f MB/s  %8.1f ms/frame  %10ld bytes\n", label,
+		1e-6 * bps * (double)width * height / t, 1e3 * t, filesize (fname));
+	unlink (fname);
+}
+
+
+
+void bench_strips ()
+{
+unsigned short *img;
+tiff_options opt;
+char label[64];
+int rows[] = { 16, 64, 256 };
+int ncpu, threads, r;
+
+
+	img = make_frame16 (width, height);
+	if (!img) return;
+	ncpu = (int)sysconf (_SC_NPROCESSORS_ONLN);
+	if (ncpu < 1) ncpu = 1;
+
+	printf ("LZW, %d x %d, 16 bit, %d repeats, %d cores\n", width, height, repeats, ncpu);
+
+	opt = tiffopts;
+	opt.rows_per_strip = 0;
+	opt.threads = 1;
+	bench_tiff ("single strip (libtiff)", (char*)img, 2, &opt);
+
+	for (r=0; r<3; r++)
+	{
+		opt.rows_per_strip = rows[r];
+		opt.threads = 1;
+		snprintf (label, sizeof (label), "%d rows, libtiff", rows[r]);
+		bench_tiff (label, (char*)img, 2, &opt);
+		for (threads=2; ; threads*=2)			/* 1 thread would take the libtiff path */
+		{
+			opt.threads = threads;
+			snprintf (label, sizeof (label), "%d rows, %d threads", rows[r], threads);
+			bench_tiff (label, (char*)img, 2, &opt);
+			if (threads >= ncpu) break;
+		}
+	}
+
+	free (img);
+}
+
+
+
+/* Encode and decode one frame with every compression setting that this
+	libtiff supports. Ratio is raw size / file size. */
+
+void bench_codec_frame (char *img, int bps, const char *title)
+{
+static const char *specs[] =
+{
+	"none", "lzw", "deflate:1", "deflate:6", "deflate:9",
+	"zstd:1", "zstd:3", "zstd:9", "lzma:1", "lzma:6", NULL
+};
+tiff_options opt;
+char fname[1200], label[64];
+char *back;
+long raw, fsize;
+double t0, tenc, tdec;
+int i, pred, r;
+
+
+	raw = (long)bps * width * height;
+	back = malloc (raw);
+	if (!back) return;
+	snprintf (fname, sizeof (fname), "%s/imgbench.tif", outdir);
+
+	printf ("\n%s, %d x %d, %d repeats\n", title, width, height, repeats);
+	printf ("%-24s %8s %12s %12s\n", "codec", "ratio", "enc MB/s", "dec MB/s");
+
+	for (i=0; specs[i]; i++)
+		for (pred=0; pred<2; pred++)
+		{
+			opt = tiffopts;
+			tiff_parse_compression (specs[i], &opt);
+			if (!TIFFIsCODECConfigured ((uint16_t)opt.compression)) break;
+			if (pred && opt.compression == COMPRESSION_NONE) break;
+			opt.predictor = pred ? PREDICTOR_HORIZONTAL : PREDICTOR_NONE;
+
+			t0 = now ();
+			for (r=0; r<repeats; r++)
+				tiffwrite_opt (fname, img, width, height, bps, NULL, &opt);
+			tenc = (now () - t0) / repeats;
+			fsize = filesize (fname);
+
+			t0 = now ();
+			for (r=0; r<repeats; r++)
+				tiffread_all (fname, back, raw);
+			tdec = (now () - t0) / repeats;
+
+			snprintf (label, sizeof (label), "%s%s", specs[i], pred ? " +pred" : "");
+			printf ("%-24s %8.2f %12.1f %12.1f%s\n", label, (double)raw / fsize,
+				1e-6 * raw / tenc, 1e-6 * raw / tdec,
+				memcmp (img, back, raw) ? "  MISMATCH" : "");
+		}
+
+	unlink (fname);
+	free (back);
+}
+
+
+
+void bench_codecs ()
+{
+unsigned short *img16;
+unsigned char *img8;
+
+
+	img8 = make_frame8 (width, height);
+	if (img8) bench_codec_frame ((char*)img8, 1, "8 bit");
+	free (img8);
+
+	img16 = make_frame16 (width, height);
+	if (img16) bench_codec_frame ((char*)img16, 2, "16 bit (12 bit data)");
+	free (img16);
+}
+
+
+
+/* The 16-bit PGM writer as it was: scalar max scan, then a plain fwrite
+	of the unswapped data (of only half the payload, at that). Kept here as the
+	speed baseline. */
+
+int pnm_write_16_old (char* fname, short* img, int width, int height)
+{
+short maxval;
+long l, i;
+FILE* FP;
+char hdr[256];
+
+
+	l = (long)width * (long)height;
+	maxval = 1023;
+	for (i=0; i<l; i++)
+		if (maxval < img[i]) maxval = img[i];
+
+	sprintf (hdr, "P5 %d %d %d\n", width, height, maxval);
+	FP = fopen (fname, "wb");
+	if (!FP) return -1;
+	fwrite (hdr, sizeof (char), strlen(hdr), FP);
+	fwrite (img, sizeof (char), l, FP);
+	fclose (FP);
+
+	return 0;
+}
+
+
+
+/* Read a 16-bit binary PGM back, independently of the writer. Returns 0 if
+	size and pixels match img and the maxval is max(1023, largest pixel). */
+
+int pgm16_verify (const char *fname, const unsigned short *img, int w, int h)
+{
+FILE *FP;
+unsigned char px[2];
+long i, n;
+int rw, rh, rmax, c, truemax;
+
+
+	FP = fopen (fname, "rb");
+	if (!FP) return -1;
+	if (fscanf (FP, "P5 %d %d %d", &rw, &rh, &rmax) != 3 || rw != w || rh != h)
+	{
+		fclose (FP);
+		return -1;
+	}
+	c = fgetc (FP);					/* Exactly one whitespace before the data */
+	if (c != '\n' && c != ' ') { fclose (FP); return -1; }
+
+	n = (long)w * h;
+	truemax = 1023;
+	for (i=0; i<n; i++)
+	{
+		if (fread (px, 1, 2, FP) != 2 || ((px[0] << 8) | px[1]) != img[i])
+		{
+			fclose (FP);
+			return -1;
+		}
+		if (img[i] > truemax) truemax = img[i];
+	}
+	c = fgetc (FP);
+	fclose (FP);
+
+	return (c == EOF && rmax == truemax) ? 0 : -1;
+}
+
+
+
+void bench_pnm ()
+{
+unsigned short *img, *tmp;
+char fname[1200];
+double t0, t_old, t_new, t_kern, t_scalar;
+long n, i;
+int r, ok;
+volatile unsigned short sink;
+unsigned short m;
+
+
+	img = make_frame16 (width, height);
+	n = (long)width * height;
+	tmp = malloc (n * sizeof (unsigned short));
+	if (!img || !tmp) return;
+	img[n/3] = 50000;						/* Above the signed range */
+	snprintf (fname, sizeof (fname), "%s/imgbench.pgm", outdir);
+
+	/* Correctness first: odd sizes exercise the scalar tails */
+
+	ok = 1;
+	for (i=1; i<=33 && ok; i+=4)
+	{
+		pnm_write_16 (fname, (short*)img, (int)i, 3);
+		ok = !pgm16_verify (fname, img, (int)i, 3);
+	}
+	pnm_write_16 (fname, (short*)img, width, height);
+	ok = ok && !pgm16_verify (fname, img, width, height);
+	printf ("16-bit PGM round trip: %s\n", ok ? "OK" : "FAILED");
+
+	/* The kernel alone, against the scalar max loop */
+
+	t0 = now ();
+	for (r=0; r<repeats; r++)
+	{
+		m = 0;
+		for (i=0; i<n; i++)
+			if (img[i] > m) m = img[i];
+		sink = m;
+	}
+	t_scalar = (now () - t0) / repeats;
+
+	t0 = now ();
+	for (r=0; r<repeats; r++)
+		sink = px_swap16_max (tmp, img, n);
+	t_kern = (now () - t0) / repeats;
+	(void)sink;
+
+	t0 = now ();
+	for (r=0; r<repeats; r++)
+		pnm_write_16_old (fname, (short*)img, width, height);
+	t_old = (now () - t0) / repeats;
+
+	t0 = now ();
+	for (r=0; r<repeats; r++)
+		pnm_write_16 (fname, (short*)img, width, height);
+	t_new = (now () - t0) / repeats;
+	unlink (fname);
+
+	printf ("%d x %d, %d repeats\n", width, height, repeats);
+	printf ("%-36s %8.1f MB/s\n", "scalar max scan", 2e-6 * n / t_scalar);
+	printf ("%-36s %8.1f MB/s\n", "vector max scan + byte swap", 2e-6 * n / t_kern);
+	printf ("%-36s %8.1f MB/s  %8.1f ms/frame\n", "pnm_write_16, former (half payload)", 2e-6 * n / t_old, 1e3 * t_old);
+	printf ("%-36s %8.1f MB/s  %8.1f ms/frame\n", "pnm_write_16", 2e-6 * n / t_new, 1e3 * t_new);
+
+	free (tmp);
+	free (img);
+}
+
+
+
+/* PNG writing as acquire.c's arv_save_png() did it: libpng defaults and no
+	byte swap. Its row pointers ran from height to 1 (a flipped image that
+	starts one row past the buffer); here they stop at row 0, which costs the
+	same. Kept as the speed baseline. */
+
+int png_write_old (const char *fname, char *img, int width, int height, int bps)
+{
+png_structp png_ptr;
+png_infop info_ptr;
+png_bytepp rows;
+FILE *f;
+int i;
+
+
+	f = fopen (fname, "wb");
+	if (!f) return -1;
+	png_ptr = png_create_write_struct (PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	info_ptr = png_create_info_struct (png_ptr);
+	png_init_io (png_ptr, f);
+	png_set_IHDR (png_ptr, info_ptr, width, height, 8*bps, PNG_COLOR_TYPE_GRAY,
+			PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+	png_write_info (png_ptr, info_ptr);
+	rows = (png_bytepp)png_malloc (png_ptr, height*sizeof (png_bytep));
+	for (i=0; i<height; i++)
+		rows[i] = (png_bytep)(img + (long)(height-1 - i)*width*bps);
+	png_write_image (png_ptr, rows);
+	png_write_end (png_ptr, NULL);
+	png_free (png_ptr, rows);
+	png_destroy_write_struct (&png_ptr, &info_ptr);
+	fclose (f);
+
+	return 0;
+}
+
+
+
+/* Decode a PNG with libpng into host byte order and compare it with img.
+	Returns 0 if they match. Also exercises the stitched zlib stream and
+	the chunk CRCs of the parallel writer. */
+
+int png_verify (const char *fname, const char *img, int w, int h, int bps)
+{
+png_structp png_ptr;
+png_infop info_ptr;
+png_bytepp rows;
+FILE *FP;
+long rowbytes;
+int i, err;
+unsigned short endian_test = 1;
+
+
+	FP = fopen (fname, "rb");
+	if (!FP) return -1;
+	png_ptr = png_create_read_struct (PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	info_ptr = png_ptr ? png_create_info_struct (png_ptr) : NULL;
+	if (!info_ptr || setjmp (png_jmpbuf (png_ptr)))
+	{
+		png_destroy_read_struct (&png_ptr, &info_ptr, NULL);
+		fclose (FP);
+		return -1;
+	}
+	png_init_io (png_ptr, FP);
+	png_set_benign_errors (png_ptr, 0);			/* A bad Adler-32 is only a warning otherwise */
+	png_read_png (png_ptr, info_ptr, *(unsigned char*)&endian_test ? PNG_TRANSFORM_SWAP_ENDIAN : 0, NULL);
+
+	err = 0;
+	rowbytes = (long)w * bps;
+	if ((int)png_get_image_width (png_ptr, info_ptr) != w || (int)png_get_image_height (png_ptr, info_ptr) != h
+			|| (long)png_get_rowbytes (png_ptr, info_ptr) != rowbytes)
+		err = -1;
+	rows = png_get_rows (png_ptr, info_ptr);
+	for (i=0; i<h && !err; i++)
+		if (memcmp (rows[i], img + i*rowbytes, rowbytes))
+			err = -1;
+
+	png_destroy_read_struct (&png_ptr, &info_ptr, NULL);
+	fclose (FP);
+
+	return err;
+}
+
+
+
+/* Time pngwrite_opt() and check what it wrote */
+
+void bench_png_opt (const char *label, char *img, int bps, const png_options *opt)
+{
+char fname[1200];
+double t0, t;
+int i;
+
+
+	snprintf (fname, sizeof (fname), "%s/imgbench.png", outdir);
+	t0 = now ();
+	for (i=0; i<repeats; i++)
+		pngwrite_opt (fname, img, width, height, bps, opt);
+	t = (now () - t0) / repeats;
+
+	printf ("%-32s %8.1f MB/s  %8.1f ms/frame  %10ld bytes%s\n", label,
+		1e-6 * bps * (double)width * height / t, 1e3 * t, filesize (fname),
+		png_verify (fname, img, width, height, bps) ? "  MISMATCH" : "");
+	unlink (fname);
+}
+
+
+
+void bench_png_frame (char *img, int bps, const char *title, int ncpu)
+{
+static const struct
+{
+	const char *label;
+	int level;
+	const char *strategy;
+	const char *filter;
+} settings[] =
+{
+	{ "level 6, adaptive (default)",	-1,	"default",	"adaptive" },
+	{ "level 1, adaptive",				1,	"default",	"adaptive" },
+	{ "level 1, up",					1,	"default",	"up" },
+	{ "level 1, sub",					1,	"default",	"sub" },
+	{ "level 1, paeth",					1,	"default",	"paeth" },
+	{ "level 3, up, filtered",			3,	"filtered",	"up" },
+	{ "rle, up",						1,	"rle",		"up" },
+	{ "huffman only, up",				1,	"huffman",	"up" },
+	{ "level 0, none",					0,	"default",	"none" },
+	{ NULL, 0, NULL, NULL }
+};
+png_options opt;
+char fname[1200], label[64];
+double t0, t;
+int i, threads, r;
+
+
+	printf ("\n%s, %d x %d, %d repeats, %d cores\n", title, width, height, repeats, ncpu);
+	snprintf (fname, sizeof (fname), "%s/imgbench.png", outdir);
+
+	if (bps <= 2)
+	{
+		t0 = now ();
+		for (r=0; r<repeats; r++)
+			png_write_old (fname, img, width, height, bps);
+		t = (now () - t0) / repeats;
+		printf ("%-32s %8.1f MB/s  %8.1f ms/frame  %10ld bytes\n", "former arv_save_png()",
+			1e-6 * bps * (double)width * height / t, 1e3 * t, filesize (fname));
+		unlink (fname);
+	}
+
+	for (i=0; settings[i].label; i++)
+	{
+		opt = pngopts;
+		opt.level = settings[i].level;
+		png_parse_strategy (settings[i].strategy, &opt);
+		png_parse_filter (settings[i].filter, &opt);
+		opt.threads = 1;
+		bench_png_opt (settings[i].label, img, bps, &opt);
+
+		if (i > 2) continue;					/* Bands only for the likely choices */
+		for (threads=2; ; threads*=2)			/* 1 thread would take the libpng path */
+		{
+			opt.threads = threads;
+			snprintf (label, sizeof (label), "  %d threads", threads);
+			bench_png_opt (label, img, bps, &opt);
+			if (threads >= ncpu) break;
+		}
+	}
+}
+
+
+
+void bench_png ()
+{
+unsigned short *img16;
+unsigned char *img8;
+png_options opt;
+char fname[1200];
+int ncpu, ok, w, h, bps, f;
+
+
+	ncpu = (int)sysconf (_SC_NPROCESSORS_ONLN);
+	if (ncpu < 1) ncpu = 1;
+
+	/* Correctness of the band encoder at awkward sizes: one-row bands,
+		bands smaller than the deflate window, a single band, RGB */
+
+	img16 = make_frame16 (width, height);
+	img8 = make_frame8 (width, 3*height);
+	if (!img16 || !img8) return;
+	snprintf (fname, sizeof (fname), "%s/imgbench.png", outdir);
+	ok = 1;
+	for (bps=1; bps<=3 && ok; bps++)
+		for (f=-1; f<=4 && ok; f++)
+		{
+			opt = pngopts;
+			opt.filter = f;
+			opt.threads = 3;
+			opt.band_rows = (f + 2) * 7 - 6;				/* 1, 8, 15, ... rows */
+			w = 37 + f;
+			h = 45;
+			pngwrite_opt (fname, bps == 2 ? (char*)img16 : (char*)img8, w, h, bps, &opt);
+			ok = !png_verify (fname, bps == 2 ? (char*)img16 : (char*)img8, w, h, bps);
+		}
+	opt = pngopts;
+	opt.threads = 4;
+	pngwrite_opt (fname, (char*)img16, width, height, 2, &opt);
+	ok = ok && !png_verify (fname, (char*)img16, width, height, 2);
+	unlink (fname);
+	printf ("PNG band encoder round trip: %s\n", ok ? "OK" : "FAILED");
+
+	bench_png_frame ((char*)img8, 1, "8 bit", ncpu);
+	bench_png_frame ((char*)img16, 2, "16 bit (12 bit data)", ncpu);
+
+	free (img8);
+	free (img16);
+}
+
+
+
+/* Pack n pixels the way a camera does, written from the format
+	descriptions and independently of pixkern.c */
+
+void pack_pixels (unsigned char *dst, const unsigned short *src, long n, int packing)
+{
+long i, bit;
+int bits, k;
+
+
+	if (packing == PX_PACK_MONO12PACKED)
+	{
+		memset (dst, 0, px_packed_size (packing, n));
+		for (i=0; i<n; i++)
+		{
+			if (i & 1)
+			{
+				dst[3*(i/2)+2] = (unsigned char)(src[i] >> 4);
+				dst[3*(i/2)+1] |= (unsigned char)((src[i] & 0x0f) << 4);
+			}
+			else
+			{
+				dst[3*(i/2)] = (unsigned char)(src[i] >> 4);
+				dst[3*(i/2)+1] |= (unsigned char)(src[i] & 0x0f);
+			}
+		}
+		return;
+	}
+
+	bits = (packing == PX_PACK_MONO10P) ? 10 : 12;
+	memset (dst, 0, px_packed_size (packing, n));
+	for (i=0; i<n; i++)
+		for (k=0; k<bits; k++)
+			if (src[i] & (1 << k))
+			{
+				bit = i*bits + k;
+				dst[bit >> 3] |= (unsigned char)(1 << (bit & 7));
+			}
+}
+
+
+
+/* One pixel at a time, one bit field at a time: the speed baseline */
+
+void unpack_plain (unsigned short *dst, const unsigned char *src, long n, int packing)
+{
+long i, bit;
+int bits;
+
+
+	bits = (packing == PX_PACK_MONO10P) ? 10 : 12;
+	for (i=0; i<n; i++)
+	{
+		if (packing == PX_PACK_MONO12PACKED)
+			dst[i] = (i & 1) ? (src[3*(i/2)+2] << 4) | (src[3*(i/2)+1] >> 4)
+				: (src[3*(i/2)] << 4) | (src[3*(i/2)+1] & 0x0f);
+		else
+		{
+			bit = i*bits;
+			dst[i] = (unsigned short)((src[bit/8] | (src[bit/8+1] << 8) | (src[bit/8+2] << 16)) >> (bit % 8))
+				& ((1 << bits) - 1);
+		}
+	}
+}
+
+
+
+void bench_unpack ()
+{
+static const struct
+{
+	const char *name;
+	int packing;
+	int bits;
+} layouts[] =
+{
+	{ "Mono10p", PX_PACK_MONO10P, 10 },
+	{ "Mono12p", PX_PACK_MONO12P, 12 },
+	{ "Mono12Packed", PX_PACK_MONO12PACKED, 12 },
+	{ NULL, 0, 0 }
+};
+unsigned short *img, *back, *ref;
+unsigned char *packed;
+double t0, t_plain, t_kern;
+long n, len, i;
+int l, r, ok;
+unsigned int seed = 4711;
+
+
+	n = (long)width * height;
+	img = malloc (n * sizeof (unsigned short));
+	back = malloc ((n+16) * sizeof (unsigned short));
+	ref = malloc (n * sizeof (unsigned short));
+	packed = malloc (2*n + 16);					/* Slack for unpack_plain's 3-byte reads */
+	if (!img || !back || !ref || !packed) return;
+
+	printf ("%d x %d, %d repeats\n", width, height, repeats);
+	printf ("%-16s %8s %14s %14s\n", "layout", "check", "plain MB/s", "kernel MB/s");
+
+	for (l=0; layouts[l].name; l++)
+	{
+		for (i=0; i<n; i++)
+		{
+			seed = seed*1103515245 + 12345;
+			img[i] = (unsigned short)((seed >> 8) & ((1 << layouts[l].bits) - 1));
+		}
+
+		/* Every length up to a few vectors, so that each tail is taken, and
+			a guard word that must survive */
+
+		ok = 1;
+		for (len=1; len<=80 && ok; len++)
+		{
+			pack_pixels (packed, img, len, layouts[l].packing);
+			back[len] = 0xbeef;
+			px_unpack (back, packed, len, layouts[l].packing);
+			ok = !memcmp (back, img, len * sizeof (unsigned short)) && back[len] == 0xbeef;
+		}
+		pack_pixels (packed, img, n, layouts[l].packing);
+		memset (packed + px_packed_size (layouts[l].packing, n), 0, 16);
+		px_unpack (back, packed, n, layouts[l].packing);
+		ok = ok && !memcmp (back, img, n * sizeof (unsigned short));
+
+		t0 = now ();
+		for (r=0; r<repeats; r++)
+			unpack_plain (ref, packed, n, layouts[l].packing);
+		t_plain = (now () - t0) / repeats;
+
+		t0 = now ();
+		for (r=0; r<repeats; r++)
+			px_unpack (back, packed, n, layouts[l].packing);
+		t_kern = (now () - t0) / repeats;
+		ok = ok && !memcmp (ref, img, n * sizeof (unsigned short));
+
+		printf ("%-16s %8s %14.1f %14.1f\n", layouts[l].name, ok ? "OK" : "FAILED",
+			2e-6 * n / t_plain, 2e-6 * n / t_kern);
+	}
+	printf ("(MB/s of unpacked 16-bit output)\n");
+
+	free (packed);
+	free (ref);
+	free (back);
+	free (img);
+}
+
+
+
+/* Plain n x n binning, rounded to nearest: reference and speed baseline */
+
+void bin16_plain (unsigned short *dst, const unsigned short *src, int w, int h, long stride, int n)
+{
+unsigned long sum;
+int x, y, i, j;
+
+
+	for (y=0; y<h/n; y++)
+		for (x=0; x<w/n; x++)
+		{
+			sum = 0;
+			for (j=0; j<n; j++)
+				for (i=0; i<n; i++)
+					sum += src[(long)(y*n + j)*stride + x*n + i];
+			*dst++ = (unsigned short)((sum + n*n/2) / (n*n));
+		}
+}
+
+
+
+void bench_bin ()
+{
+unsigned short *img, *out, *ref;
+double t0, t_plain, t_kern;
+long n;
+int f, r, ok, w, h;
+
+
+	n = (long)width * height;
+	img = make_frame16 (width, height);
+	out = malloc (n * sizeof (unsigned short));
+	ref = malloc (n * sizeof (unsigned short));
+	if (!img || !out || !ref) return;
+	img[0] = img[1] = img[width] = img[width+1] = 65535;	/* Sums beyond 16 bits */
+	img[2] = 65535;
+
+	/* Odd sizes and a stride wider than the region, as after a crop */
+
+	ok = 1;
+	for (f=2; f<=4 && ok; f++)
+		for (w=1; w<=41 && ok; w+=5)
+		{
+			h = 9;
+			px_bin16 (out, img + width + 3, w, h, width, f);
+			bin16_plain (ref, img + width + 3, w, h, width, f);
+			ok = !memcmp (out, ref, (w/f) * (h/f) * sizeof (unsigned short));
+		}
+	px_bin16 (out, img, width, height, width, 2);
+	bin16_plain (ref, img, width, height, width, 2);
+	ok = ok && !memcmp (out, ref, (width/2) * (height/2) * sizeof (unsigned short));
+	printf ("16-bit binning: %s\n", ok ? "OK" : "FAILED");
+	printf ("%d x %d, %d repeats\n", width, height, repeats);
+	printf ("%-20s %14s %14s\n", "", "plain MB/s", "kernel MB/s");
+
+	for (f=2; f<=4; f++)
+	{
+		t0 = now ();
+		for (r=0; r<repeats; r++)
+			bin16_plain (ref, img, width, height, width, f);
+		t_plain = (now () - t0) / repeats;
+		t0 = now ();
+		for (r=0; r<repeats; r++)
+			px_bin16 (out, img, width, height, width, f);
+		t_kern = (now () - t0) / repeats;
+		printf ("binning %d x %d        %14.1f %14.1f\n", f, f, 2e-6 * n / t_plain, 2e-6 * n / t_kern);
+	}
+
+	for (f=2; f<=4; f+=2)
+	{
+		t0 = now ();
+		for (r=0; r<repeats; r++)
+			px_decimate (out, img, width, height, width, 2, f);
+		t_kern = (now () - t0) / repeats;
+		printf ("decimation %d         %14s %14.1f\n", f, "", 2e-6 * n / t_kern);
+	}
+	printf ("(MB/s of 16-bit input)\n");
+
+	free (ref);
+	free (out);
+	free (img);
+}
+
+
+
+/* Reference accumulation and results, in plain C */
+
+void acc_plain (unsigned int *sum, const unsigned short *src, long n)
+{
+long i;
+
+	for (i=0; i<n; i++)
+		sum[i] += src[i];
+}
+
+
+void bench_acc ()
+{
+static const int counts[] = { 1, 4, 5, 16, 255 };
+unsigned short *img, *ref16;
+unsigned int *sum;
+float *fl;
+char *res, fname[1200];
+double t0, t_plain, t_kern, scale;
+accumulator acc;
+TIFF *tif;
+unsigned long long q;
+long n, i;
+int c, k, r, w, ok, ok_float, mode, bits;
+unsigned int divisor;
+
+
+	n = (long)width * height;
+	img = make_frame16 (width, height);
+	sum = malloc (n * sizeof (unsigned int));
+	ref16 = malloc (n * sizeof (unsigned short));
+	fl = malloc (width * sizeof (float));
+	if (!img || !sum || !ref16 || !fl) return;
+	memset (&acc, 0, sizeof (acc));
+	img[0] = 65535;
+
+	/* Every frame count, both modes and output formats, odd widths for the
+		vector tails. The frames differ by a shift of the test image. */
+
+	ok = ok_float = 1;
+	for (c=0; c<5; c++)
+		for (w=1; w<=width && ok; w = (w < 40 || w == width) ? w+3 : width)
+			for (mode=ACC_MEAN; mode<=ACC_SUM; mode++)
+			{
+				bits = (mode == ACC_SUM) ? 12 : 16;
+				acc_reset (&acc);
+				memset (sum, 0, w * sizeof (unsigned int));
+				for (k=0; k<counts[c]; k++)
+				{
+					acc_add (&acc, (char*)(img + k), w, 1, 2, bits);
+					acc_plain (sum, img + k, w);
+				}
+				divisor = counts[c];
+				if (mode == ACC_SUM)
+					for (divisor=1; (unsigned long long)counts[c] * ((1u << bits) - 1) / divisor > 65535; divisor*=2)
+						;
+				for (i=0; i<w; i++)
+				{
+					q = ((unsigned long long)sum[i] + divisor/2) / divisor;
+					ref16[i] = (unsigned short)(q > 65535 ? 65535 : q);
+				}
+				res = acc_result (&acc, mode, ACC_OUT_16, &scale);
+				ok = res && !memcmp (res, ref16, w * sizeof (unsigned short))
+					&& scale == (double)counts[c] / divisor;
+				free (res);
+				res = acc_result (&acc, mode, ACC_OUT_FLOAT, &scale);
+				for (i=0; res && i<w; i++)
+					if (fabs (((float*)res)[i] - (mode == ACC_SUM ? sum[i] : (double)sum[i] / counts[c])) > 1e-6 * sum[i])
+						ok_float = 0;
+				free (res);
+			}
+	printf ("Accumulation, 16-bit results: %s\n", ok ? "OK" : "FAILED");
+	printf ("Accumulation, float results: %s\n", ok_float ? "OK" : "FAILED");
+
+	/* Float TIFF: written and read back */
+
+	acc_reset (&acc);
+	for (k=0; k<3; k++)
+		acc_add (&acc, (char*)img, width, height, 2, 16);
+	acc_add (&acc, (char*)(img+1), width, height, 2, 16);
+	res = acc_result (&acc, ACC_MEAN, ACC_OUT_FLOAT, &scale);
+	snprintf (fname, sizeof (fname), "%s/imgbench_acc.tif", outdir);
+	ok = res && tiffwrite (fname, res, width, height, 4, "frames=4") == 0;
+	tif = ok ? TIFFOpen (fname, "r") : NULL;
+	ok = tif != NULL;
+	for (r=0; ok && r<height; r++)
+		ok = TIFFReadScanline (tif, fl, r, 0) == 1
+			&& !memcmp (fl, res + (long)r*width*sizeof (float), width * sizeof (float));
+	if (tif) TIFFClose (tif);
+	printf ("Float TIFF round trip: %s\n", ok ? "OK" : "FAILED");
+	free (res);
+
+	printf ("%d x %d, %d repeats\n", width, height, repeats);
+	printf ("%-24s %14s %14s\n", "", "plain MB/s", "kernel MB/s");
+	memset (sum, 0, n * sizeof (unsigned int));
+	t0 = now ();
+	for (r=0; r<repeats; r++)
+		acc_plain (sum, img, n);
+	t_plain = (now () - t0) / repeats;
+	t0 = now ();
+	for (r=0; r<repeats; r++)
+		px_acc16 (sum, img, n);
+	t_kern = (now () - t0) / repeats;
+	printf ("add 16-bit frame         %14.1f %14.1f\n", 2e-6 * n / t_plain, 2e-6 * n / t_kern);
+
+	t0 = now ();
+	for (r=0; r<repeats; r++)
+		px_acc_finish16 (ref16, sum, n, 16);
+	t_kern = (now () - t0) / repeats;
+	t0 = now ();
+	for (r=0; r<repeats; r++)
+		px_acc_finish16 (ref16, sum, n, 10);
+	t_plain = (now () - t0) / repeats;
+	printf ("mean, 16 / 10 frames     %14.1f %14.1f\n", 4e-6 * n / t_plain, 4e-6 * n / t_kern);
+	res = malloc (n * sizeof (float));
+	if (res)
+	{
+		t0 = now ();
+		for (r=0; r<repeats; r++)
+			px_acc_finish_float ((float*)res, sum, n, 0.1f);
+		t_kern = (now () - t0) / repeats;
+		printf ("mean as float            %14s %14.1f\n", "", 4e-6 * n / t_kern);
+		free (res);
+	}
+	printf ("(MB/s of 16-bit frames added, of 32-bit sums converted; the 10-frame\n"
+		" mean divides, and is shown as plain)\n");
+
+	acc_free (&acc);
+	free (fl);
+	free (ref16);
+	free (sum);
+	free (img);
+}
+
+
+
+/* Reference dark and flat correction, in plain C */
+
+void calibrate_plain (unsigned short *dst, const unsigned short *src, const unsigned short *dark,
+			const unsigned short *gain, long n)
+{
+long i, v;
+
+	for (i=0; i<n; i++)
+	{
+		v = src[i] - (dark ? dark[i] : 0);
+		if (v < 0) v = 0;
+		if (gain) v = (v * gain[i] + PX_GAIN_ONE/2) / PX_GAIN_ONE;
+		dst[i] = (v > 65535) ? 65535 : v;
+	}
+}
+
+
+void bench_calib ()
+{
+unsigned short *img, *dark, *flat, *gain, *ref, *out;
+char fname[1200];
+double t0, t_plain, t_kern;
+calib_store *cs;
+calib_map map;
+framemeta meta;
+long n, i;
+int c, r, w, ok, gen;
+
+
+	n = (long)width * height;
+	img = make_frame16 (width, height);
+	dark = malloc (n * sizeof (unsigned short));
+	flat = malloc (n * sizeof (unsigned short));
+	gain = malloc (n * sizeof (unsigned short));
+	ref = malloc (n * sizeof (unsigned short));
+	out = malloc (n * sizeof (unsigned short));
+	if (!img || !dark || !flat || !gain || !ref || !out) return;
+
+	/* A dark of a few hundred counts, some above the signal; a flat that
+		falls off by a half towards the edges, and gains up to the limit */
+
+	for (i=0; i<n; i++)
+	{
+		dark[i] = 200 + (i * 7919) % 300;
+		flat[i] = dark[i] + 30000 - 15000 * labs (i % width - width/2) / (width/2 + 1);
+		gain[i] = (i * 104729) % 65536;
+	}
+	img[0] = 65535;
+	img[1] = 0;
+
+	/* With and without dark and gain, odd widths for the vector tails */
+
+	ok = 1;
+	for (c=0; c<4; c++)
+		for (w=1; w<=width && ok; w = (w < 40 || w == width) ? w+3 : width)
+		{
+			calibrate_plain (ref, img, (c & 1) ? dark : NULL, (c & 2) ? gain : NULL, w);
+			px_calibrate16 (out, img, (c & 1) ? dark : NULL, (c & 2) ? gain : NULL, w);
+			ok = !memcmp (out, ref, w * sizeof (unsigned short));
+		}
+	printf ("Calibration kernel: %s\n", ok ? "OK" : "FAILED");
+
+	/* Store: a dark, a flat, the dark replaced; then applied to a frame */
+
+	snprintf (fname, sizeof (fname), "%s/imgbench_calib.dat", outdir);
+	unlink (fname);
+	framemeta_init (&meta);
+	meta.exposure = 20000;
+	meta.gain = 6;
+	calib_map_init (&map, CALIB_DARK, width, height, &meta);
+	ok = calib_add (fname, &map, flat) == 0;
+	meta.led = 1;
+	calib_map_init (&map, CALIB_FLAT, width, height, &meta);
+	calib_make_flat (gain, flat, dark, n);
+	ok = ok && calib_add (fname, &map, gain) == 0;
+	meta.exposure = 20050;
+	calib_map_init (&map, CALIB_DARK, width, height, &meta);
+	ok = ok && calib_add (fname, &map, dark) == 0;
+	cs = ok ? calib_open (fname) : NULL;
+	ok = cs && calib_generation (cs) == 3;
+	if (cs)
+		calib_list (cs, stdout);
+	memcpy (out, img, n * sizeof (unsigned short));
+	meta.exposure = 20000;
+	gen = ok ? calib_apply (cs, out, width, height, &meta) : 0;
+	calibrate_plain (ref, img, dark, gain, n);
+	ok = gen == 3 && !memcmp (out, ref, n * sizeof (unsigned short));
+	meta.exposure = 30000;
+	meta.led = 0;
+	ok = ok && calib_apply (cs, out, width, height, &meta) == 0;
+	calibrate_plain (ref, flat, dark, gain, n);
+	for (i=0; i<n && ok; i++)
+		ok = abs (ref[i] - ref[n/2]) <= 2;
+	calib_close (cs);
+	printf ("Calibration store and flat: %s\n", ok ? "OK" : "FAILED");
+
+	printf ("%d x %d, %d repeats\n", width, height, repeats);
+	printf ("%-24s %14s %14s\n", "", "plain MB/s", "kernel MB/s");
+	for (c=1; c<4; c++)
+	{
+		t0 = now ();
+		for (r=0; r<repeats; r++)
+			calibrate_plain (out, img, (c & 1) ? dark : NULL, (c & 2) ? gain : NULL, n);
+		t_plain = (now () - t0) / repeats;
+		t0 = now ();
+		for (r=0; r<repeats; r++)
+			px_calibrate16 (out, img, (c & 1) ? dark : NULL, (c & 2) ? gain : NULL, n);
+		t_kern = (now () - t0) / repeats;
+		printf ("%-24s %14.1f %14.1f\n", (c == 1) ? "dark" : (c == 2) ? "flat" : "dark and flat",
+			2e-6 * n / t_plain, 2e-6 * n / t_kern);
+	}
+
+	free (out);
+	free (ref);
+	free (gain);
+	free (flat);
+	free (dark);
+	free (img);
+}
+
+
+
+/* Reference moments and histogram, in plain C */
+
+void stats_plain (const unsigned short *src, long n, int shift, unsigned int *hist, px_moments *m)
+{
+long i;
+unsigned int v;
+
+	for (i=0; i<n; i++)
+	{
+		v = src[i];
+		m->sum += v;
+		m->sumsq += (unsigned long long)v * v;
+		if (v < m->min) m->min = v;
+		if (v > m->max) m->max = v;
+		hist[(v >> shift) < STATS_BINS ? v >> shift : STATS_BINS-1]++;
+	}
+}
+
+
+void bench_stats ()
+{
+static unsigned int h1[STATS_BINS], h2[STATS_BINS];
+unsigned short *img, *blue;
+char fname[1200], line[8192];
+double t0, t_plain, t_kern;
+px_moments m1, m2;
+region_stats rs;
+framemeta meta, imeta;
+stats *st;
+float *map;
+FILE *fp;
+long n, i;
+int r, w, ok, lines;
+
+
+	n = (long)width * height;
+	img = make_frame16 (width, height);
+	blue = malloc (n * sizeof (unsigned short));
+	if (!img || !blue) return;
+	img[0] = 65535;
+	img[1] = 0;
+
+	/* Odd widths for the vector tails; 12-bit bins, so that the top values
+		overflow into the last bin */
+
+	ok = 1;
+	for (w=1; w<=width && ok; w = (w < 40 || w == width) ? w+3 : width)
+	{
+		px_moments_init (&m1);
+		px_moments_init (&m2);
+		memset (h1, 0, sizeof (h1));
+		memset (h2, 0, sizeof (h2));
+		stats_plain (img, w, 4, h1, &m1);
+		px_stats16 (img, w, 4, h2, &m2);
+		ok = !memcmp (&m1, &m2, sizeof (m1)) && !memcmp (h1, h2, sizeof (h1));
+	}
+	px_moments_init (&m1);
+	px_moments_init (&m2);
+	stats_plain (img, n, 8, h1, &m1);
+	px_stats16 (img, n, 8, NULL, &m2);
+	ok = ok && !memcmp (&m1, &m2, sizeof (m1));
+	printf ("Statistics kernel: %s\n", ok ? "OK" : "FAILED");
+
+	/* A region, and an index map of a frame pair: blue is a quarter of white
+		at twice the duty cycle, so blue / white reflectance is 1/8 */
+
+	stats_region (&rs, (char*)img, width, height, 2, 16, 10, 10, 100, 50);
+	px_moments_init (&m1);
+	for (r=10; r<60; r++)
+		stats_plain (img + (long)r*width + 10, 100, 8, h1, &m1);
+	ok = rs.n == 5000 && fabs (rs.mean - m1.sum / 5000.0) < 1e-9 && rs.min == m1.min && rs.max == m1.max;
+	stats_region (&rs, (char*)img, width, height, 2, 16, 0, 7, width, 3);
+	px_moments_init (&m1);
+	stats_plain (img + 7L*width, 3L*width, 8, h1, &m1);
+	ok = ok && rs.n == 3L*width && fabs (rs.mean - (double)m1.sum / rs.n) < 1e-9 && rs.max == m1.max;
+
+	for (i=0; i<n; i++)
+		blue[i] = img[i] / 4;
+	snprintf (fname, sizeof (fname), "%s/imgbench_stats.json", outdir);
+	st = stats_open (fname, INDEX_RATIO);
+	ok = ok && st && stats_add_region (st, "100x50+10+10") == 0;
+	framemeta_init (&meta);
+	meta.exposure = 1000;
+	meta.led = 0;
+	meta.dutycycle = 64;
+	map = st ? stats_frame (st, (char*)img, width, height, 2, 16, &meta, "white", &imeta) : NULL;
+	ok = ok && !map;
+	meta.led = 1;
+	meta.dutycycle = 128;
+	map = st ? stats_frame (st, (char*)blue, width, height, 2, 16, &meta, "blue", &imeta) : NULL;
+	for (i=0; map && i<n; i++)
+		if (img[i] >= 400 && fabs (map[i] - blue[i] / 2.0 / img[i]) > 1e-6)
+			ok = 0;
+	ok = ok && map && stats_close (st) == 0;
+	free (map);
+	fp = fopen (fname, "r");
+	for (lines=0; fp && fgets (line, sizeof (line), fp); lines++)
+		;
+	if (fp) fclose (fp);
+	ok = ok && lines == 3;
+	printf ("Regions, index map and JSON output: %s\n", ok ? "OK" : "FAILED");
+
+	printf ("%d x %d, %d repeats\n", width, height, repeats);
+	printf ("%-24s %14s %14s\n", "", "plain MB/s", "kernel MB/s");
+	t0 = now ();
+	for (r=0; r<repeats; r++)
+		stats_plain (img, n, 4, h1, &m1);
+	t_plain = (now () - t0) / repeats;
+	t0 = now ();
+	for (r=0; r<repeats; r++)
+		px_stats16 (img, n, 4, h2, &m2);
+	t_kern = (now () - t0) / repeats;
+	printf ("moments and histogram    %14.1f %14.1f\n", 2e-6 * n / t_plain, 2e-6 * n / t_kern);
+	t0 = now ();
+	for (r=0; r<repeats; r++)
+		px_stats16 (img, n, 4, NULL, &m2);
+	t_kern = (now () - t0) / repeats;
+	printf ("moments only             %14s %14.1f\n", "", 2e-6 * n / t_kern);
+
+	free (blue);
+	free (img);
+}
+
+
+
+/********************************************************************/
+
+
+#define nextargi (--argc,atoi(*++argv))
+#define nextargs (--argc,*++argv)
+
+
+/********************************************************************/
+
+
+#define TRACE_BENCH_PAIRS	4096		/* Begin/end pairs per thread, well within its ring */
+
+static double trace_pair_time;
+
+
+/* Begin/end pairs in a thread of their own, so that they have a ring to
+	themselves */
+
+static void *trace_points (void *arg)
+{
+double t0;
+int i;
+
+
+	trace_thread_name ("bench");
+	t0 = now ();
+	for (i=0; i<TRACE_BENCH_PAIRS; i++)
+	{
+		TRACE_BEGIN (1, "point");
+		TRACE_END (1, "point");
+	}
+	trace_pair_time = (now () - t0) / TRACE_BENCH_PAIRS;
+	return NULL;
+}
+
+
+void bench_trace ()
+{
+unsigned short *img;
+tiff_options opt;
+pthread_t tid;
+char fname[1200], line[4096];
+const char *p;
+long begins, ends;
+double t0, t;
+FILE *fp;
+int i;
+
+
+	printf ("Trace points compiled in up to level %d\n", TRACE_LEVEL);
+
+	t0 = now ();
+	for (i=0; i<10000000; i++)
+	{
+		TRACE_BEGIN (1, "point");
+		TRACE_END (1, "point");
+	}
+	t = (now () - t0) / 10000000;
+	printf ("%-28s %8.2f ns per point\n", "tracing off", 0.5e9 * t);
+
+	trace_start ();
+	pthread_create (&tid, NULL, trace_points, NULL);
+	pthread_join (tid, NULL);
+	printf ("%-28s %8.2f ns per point\n", "tracing on", 0.5e9 * trace_pair_time);
+
+	/* A trace of what the writers do, to look at in chrome://tracing */
+
+	img = make_frame16 (width, height);
+	if (!img) return;
+	opt = tiffopts;
+	opt.rows_per_strip = 64;
+	opt.threads = 4;
+	bench_tiff ("64 rows, 4 threads, traced", (char*)img, 2, &opt);
+	opt.threads = 1;
+	bench_tiff ("64 rows, libtiff, traced", (char*)img, 2, &opt);
+	free (img);
+
+	snprintf (fname, sizeof (fname), "%s/imgbench_trace.json", outdir);
+	if (trace_write (fname) < 0)
+	{
+		printf ("Could not write %s\n", fname);
+		return;
+	}
+
+	/* Every span must have been closed */
+
+	begins = ends = 0;
+	fp = fopen (fname, "r");
+	while (fp && fgets (line, sizeof (line), fp))
+	{
+		for (p=line; (p = strstr (p, "\"ph\":\"B\"")); p++) begins++;
+		for (p=line; (p = strstr (p, "\"ph\":\"E\"")); p++) ends++;
+	}
+	if (fp) fclose (fp);
+	printf ("Trace in %s, %ld spans: %s\n", fname, begins, (TRACE_LEVEL < 1) ? "compiled out"
+		: (begins > TRACE_BENCH_PAIRS && begins == ends) ? "OK" : "FAILED");
+}
+
+
+
+/********************************************************************/
+
+
+/* Reference residuals, in plain C and the long way round */
+
+void residual_plain (unsigned short *dst, const unsigned short *src, const unsigned short *ref, long n)
+{
+long i;
+int d;
+
+	for (i=0; i<n; i++)
+	{
+		d = (int)src[i] - (int)ref[i];
+		if (d > 32767) d -= 65536;
+		if (d < -32768) d += 65536;
+		dst[i] = (unsigned short)((d >= 0) ? 2*d : -2*d - 1);
+	}
+}
+
+
+/* Frame f of the time-lapse series: from the raw log given with -i,
+	unpacked if need be, or else the synthetic scene, slowly brightening
+	and with fresh noise in every frame. Returns the pixels, which stay
+	valid until the next call, or NULL past the end. */
+
+char recording[1024];
+int key_interval = TLAPSE_KEY_INTERVAL;
+int tl_frames = 24;
+
+static rawlog *tl_log;
+static unsigned short *tl_base, *tl_buf;
+static long tl_bufsize;
+
+
+const void *tl_frame (long f, int *w, int *h, int *bps, framemeta *meta)
+{
+const void *img;
+rawlog_record rec;
+unsigned int seed;
+long i, n;
+int v, packing;
+
+
+	framemeta_init (meta);
+	if (tl_log)
+	{
+		if (f >= rawlog_count (tl_log) || !(img = rawlog_frame (tl_log, f, &rec))) return NULL;
+		rawlog_record_meta (&rec, meta);
+		*w = rec.width;
+		*h = rec.height;
+		*bps = (rec.bits_per_pixel + 7) / 8;
+		packing = px_packing (rec.pixelformat);
+		if (!packing) return img;
+
+		n = (long)rec.width * rec.height;
+		if (n > tl_bufsize)
+		{
+			free (tl_buf);
+			tl_buf = malloc (n * sizeof (unsigned short));
+			tl_bufsize = tl_buf ? n : 0;
+			if (!tl_buf) return NULL;
+		}
+		px_unpack (tl_buf, img, n, packing);
+		*bps = 2;
+		return tl_buf;
+	}
+
+	if (f >= tl_frames) return NULL;
+	n = (long)width * height;
+	seed = 4711 + f;
+	for (i=0; i<n; i++)
+	{
+		seed = seed*1103515245 + 12345;
+		v = tl_base[i] + (int)(tl_base[i] * f / 2000) + (int)((seed >> 16) % 7) - 3;
+		tl_buf[i] = (unsigned short)((v < 0) ? 0 : (v > 4095) ? 4095 : v);
+	}
+	*w = width;
+	*h = height;
+	*bps = 2;
+	meta->exposure = 1000;
+	meta->timestamp = f * 3600000000000ULL;
+	return tl_buf;
+}
+
+
+void bench_timelapse ()
+{
+unsigned short *img, *res, *ref, *chk;
+char fname[1200], tifname[1200];
+const void *frame;
+double t0, t_plain, t_kern, t_enc, t_dec, t_rand, t_lzw;
+long n, f, nf, raw, lzw, i;
+int w, h, bps, r, ok, ok_rt;
+rawlog_record rec;
+framemeta meta;
+tlapse *t;
+void *out;
+
+
+	/* The kernels, with odd lengths for the vector tails, over the whole
+		range of differences, and in place for the inverse */
+
+	n = (long)width * height;
+	img = make_frame16 (width, height);
+	res = malloc (n * sizeof (unsigned short));
+	ref = malloc (n * sizeof (unsigned short));
+	chk = malloc (n * sizeof (unsigned short));
+	if (!img || !res || !ref || !chk) return;
+	for (i=0; i<n; i++)
+		ref[i] = (unsigned short)(img[n-1-i] * ((i & 7) ? 1 : 16));
+	img[0] = 65535;
+	ref[0] = 0;
+	img[1] = 0;
+	ref[1] = 65535;
+
+	ok = 1;
+	for (w=1; w<=width && ok; w = (w < 40 || w == width) ? w+3 : width)
+	{
+		residual_plain (chk, img, ref, w);
+		px_residual16 (res, img, ref, w);
+		ok = !memcmp (res, chk, w * sizeof (unsigned short));
+		px_unresidual16 (res, res, ref, w);
+		ok = ok && !memcmp (res, img, w * sizeof (unsigned short));
+	}
+	printf ("Residual kernels: %s\n", ok ? "OK" : "FAILED");
+
+	t0 = now ();
+	for (r=0; r<repeats; r++)
+		residual_plain (res, img, ref, n);
+	t_plain = (now () - t0) / repeats;
+	t0 = now ();
+	for (r=0; r<repeats; r++)
+		px_residual16 (res, img, ref, n);
+	t_kern = (now () - t0) / repeats;
+	printf ("%-24s %14s %14s\n", "", "plain MB/s", "kernel MB/s");
+	printf ("residuals                %14.1f %14.1f\n", 2e-6 * n / t_plain, 2e-6 * n / t_kern);
+	t0 = now ();
+	for (r=0; r<repeats; r++)
+		px_unresidual16 (chk, res, ref, n);
+	t_kern = (now () - t0) / repeats;
+	printf ("inverse                  %14s %14.1f\n\n", "", 2e-6 * n / t_kern);
+	free (chk);
+	free (ref);
+	free (res);
+
+	/* The series, archived, against raw and LZW TIFF sizes */
+
+	if (recording[0])
+	{
+		tl_log = rawlog_open (recording);
+		if (!tl_log)
+		{
+			fprintf (stderr, "Cannot read the raw log %s\n", recording);
+			free (img);
+			return;
+		}
+	}
+	else
+	{
+		tl_base = img;
+		tl_buf = malloc (n * sizeof (unsigned short));
+		if (!tl_buf)
+		{
+			free (img);
+			return;
+		}
+	}
+
+	snprintf (fname, sizeof (fname), "%s/imgbench_timelapse.tl", outdir);
+	snprintf (tifname, sizeof (tifname), "%s/imgbench_timelapse.tif", outdir);
+	unlink (fname);
+	t = tlapse_create (fname, key_interval);
+	ok = t != NULL;
+	raw = lzw = 0;
+	t_enc = t_lzw = 0;
+	for (f=0; ok && (frame = tl_frame (f, &w, &h, &bps, &meta)) != NULL; f++)
+	{
+		raw += (long)w * h * bps;
+		t0 = now ();
+		ok = tlapse_append (t, frame, w, h, bps, &meta) >= 0;
+		t_enc += now () - t0;
+		t0 = now ();
+		tiffwrite (tifname, (char*)frame, w, h, bps, NULL);
+		t_lzw += now () - t0;
+		lzw += filesize (tifname);
+	}
+	nf = f;
+	ok = ok && tlapse_close (t) == 0;
+	unlink (tifname);
+
+	/* Back out in order, so that keyframes are mostly cached, and then
+		from the end backwards, for the cost of a random access */
+
+	t = ok ? tlapse_open (fname) : NULL;
+	ok = t && tlapse_count (t) == nf;
+	ok_rt = ok;
+	t_dec = 0;
+	for (f=0; ok && f<nf; f++)
+	{
+		t0 = now ();
+		out = tlapse_frame (t, f, &rec);
+		t_dec += now () - t0;
+		frame = tl_frame (f, &w, &h, &bps, &meta);
+		ok_rt = ok_rt && out && frame && rec.width == (uint32_t)w && rec.height == (uint32_t)h
+			&& !memcmp (out, frame, (long)w * h * bps);
+		free (out);
+	}
+	t0 = now ();
+	for (f=nf-1; ok && f>=0; f--)
+		free (tlapse_frame (t, f, &rec));
+	t_rand = now () - t0;
+	if (t) tlapse_close (t);
+
+	if (recording[0])
+		printf ("%s, %ld frames, keyframe every %d\n", recording, nf, key_interval);
+	else
+		printf ("%d x %d, %ld synthetic frames, keyframe every %d\n", width, height, nf, key_interval);
+	printf ("Extraction: %s\n", (ok && ok_rt) ? "OK" : "FAILED");
+	if (ok && nf > 0)
+	{
+		printf ("%-24s %14s %14s %14s\n", "", "MB", "ratio", "MB/s");
+		printf ("raw                      %14.1f %14.2f\n", 1e-6 * raw, 1.0);
+		printf ("LZW TIFF                 %14.1f %14.2f %14.1f\n", 1e-6 * lzw, (double)raw / lzw, 1e-6 * raw / t_lzw);
+		printf ("archive                  %14.1f %14.2f %14.1f\n", 1e-6 * filesize (fname),
+			(double)raw / filesize (fname), 1e-6 * raw / t_enc);
+		printf ("decode, in order         %14s %14s %14.1f\n", "", "", 1e-6 * raw / t_dec);
+		printf ("decode, backwards        %14s %14s %14.1f\n", "", "", 1e-6 * raw / t_rand);
+	}
+
+	if (tl_log) rawlog_close (tl_log);
+	tl_log = NULL;
+	free (tl_buf);
+	tl_buf = NULL;
+	tl_bufsize = 0;
+	free (img);
+}
+
+
+/********************************************************************/
+
+
+/* Direct I/O: dio.c against a copy in memory, then every writer that can
+	use it, buffered and direct */
+
+#define DIO_FRAMES			16
+#define DIO_CHECK_SIZE		(1 << 20)
+
+static const char *dio_writers[] = { "TIFF, file per frame", "TIFF stack", "PGM, file per frame", "raw log", NULL };
+
+
+/* Appends, overwrites (in the buffer and behind it), gaps and reads
+	back, through small buffers so that most of them reach the file */
+
+int dio_check (const char *fname, char *mode, size_t modesize)
+{
+dio_options opt = { 1, 2, 1, 3*DIO_ALIGN };
+unsigned char *ref, *chunk, *back;
+unsigned int seed = 4711;
+uint64_t size, off;
+long len, k, i;
+dio_file *f;
+FILE *fp;
+int ok;
+
+
+	ref = calloc (1, DIO_CHECK_SIZE);
+	chunk = malloc (DIO_CHECK_SIZE);
+	back = malloc (DIO_CHECK_SIZE);
+	f = dio_open (fname, DIO_CHECK_SIZE / 2, &opt);
+	ok = ref && chunk && back && f;
+	if (f) snprintf (mode, modesize, "%s", dio_mode (f));
+
+	size = 0;
+	for (i=0; ok && i<500; i++)
+	{
+		seed = seed*1103515245 + 12345;
+		len = 1 + (seed >> 16) % 20000;
+		switch ((seed >> 8) % 4)
+		{
+			case 0:
+			case 1:	off = size; break;
+			case 2:	off = size ? (seed >> 4) % size : 0; break;
+			default:	off = size + (seed >> 12) % 5000; break;
+		}
+		if (off + len > DIO_CHECK_SIZE) continue;
+		for (k=0; k<len; k++)
+			chunk[k] = (unsigned char)(i*31 + k*7);
+		ok = dio_pwrite (f, chunk, len, off) == len;
+		memcpy (ref + off, chunk, len);
+		if (off + len > size) size = off + len;
+
+		if (i % 10 == 0)
+		{
+			off = (seed >> 3) % size;
+			len = (long)(size - off) < 30000 ? (long)(size - off) : 30000;
+			ok = ok && dio_pread (f, back, len, off) == len && !memcmp (back, ref + off, len);
+		}
+	}
+	ok = ok && dio_size (f) == size;
+	if (f && dio_close (f)) ok = 0;
+
+	fp = fopen (fname, "rb");
+	ok = ok && fp && filesize (fname) == (long)size && fread (back, 1, size, fp) == size && !memcmp (back, ref, size);
+	if (fp) fclose (fp);
+	unlink (fname);
+	free (back);
+	free (chunk);
+	free (ref);
+
+	return ok;
+}
+
+
+/* DIO_FRAMES frames through writer w, buffered or direct. fname is set to
+	the (last) file written. The time per frame, its maximum, and the time
+	to close the file and sync() go to t[0..2]. */
+
+void dio_run (int w, int direct, unsigned short *img, char *fname, size_t size, double *t)
+{
+tiff_options opt = { COMPRESSION_NONE, 0, PREDICTOR_NONE, 0, 1 };
+long long bytes = (long long)width * height * 2;
+tiffstack *ts = NULL;
+rawlog *log = NULL;
+framemeta meta;
+double t0, dt;
+int f;
+
+
+	sync ();
+	dioopts.enabled = direct;
+	framemeta_init (&meta);
+	if (w == 1)
+	{
+		snprintf (fname, size, "%s/imgbench_dio.tif", outdir);
+		ts = tiffstack_open (fname, DIO_FRAMES * (bytes + 4096), &opt);
+	}
+	else if (w == 3)
+	{
+		snprintf (fname, size, "%s/imgbench_dio.raw", outdir);
+		log = rawlog_create (fname, DIO_FRAMES * (bytes + 4096) + (1 << 20));
+	}
+
+	t[0] = t[1] = 0;
+	for (f=0; f<DIO_FRAMES; f++)
+	{
+		t0 = now ();
+		if (w == 0)
+		{
+			snprintf (fname, size, "%s/imgbench_dio_%d.tif", outdir, f);
+			tiffwrite_opt (fname, (char*)img, width, height, 2, NULL, &opt);
+		}
+		else if (w == 1 && ts)
+			tiffstack_append (ts, (char*)img, width, height, 2, &meta);
+		else if (w == 2)
+		{
+			snprintf (fname, size, "%s/imgbench_dio_%d.pgm", outdir, f);
+			pnm_write_16 (fname, (short*)img, width, height);
+		}
+		else if (log)
+			rawlog_append (log, img, bytes, PX_PFNC_MONO16, 16, width, height, &meta);
+		dt = now () - t0;
+		t[0] += dt / DIO_FRAMES;
+		if (dt > t[1]) t[1] = dt;
+	}
+
+	t0 = now ();
+	if (ts) tiffstack_close (ts);
+	if (log) rawlog_close (log);
+	sync ();
+	t[2] = now () - t0;
+	dioopts.enabled = 0;
+}
+
+
+int same_file (const char *a, const char *b)
+{
+FILE *fa, *fb;
+char ba[65536], bb[65536];
+size_t na, nb;
+int same;
+
+
+	fa = fopen (a, "rb");
+	fb = fopen (b, "rb");
+	same = fa && fb;
+	while (same)
+	{
+		na = fread (ba, 1, sizeof (ba), fa);
+		nb = fread (bb, 1, sizeof (bb), fb);
+		same = na == nb && !memcmp (ba, bb, na);
+		if (na == 0) break;
+	}
+	if (fa) fclose (fa);
+	if (fb) fclose (fb);
+	return same;
+}
+
+
+void bench_dio ()
+{
+unsigned short *img;
+char fname[1200], refname[1300], mode[64];
+double t[2][3], mb;
+int w, d, f, same;
+
+
+	snprintf (fname, sizeof (fname), "%s/imgbench_dio.chk", outdir);
+	mode[0] = 0;
+	printf ("Direct writer: %s (%s)\n", dio_check (fname, mode, sizeof (mode)) ? "OK" : "FAILED", mode);
+
+	img = make_frame16 (width, height);
+	if (!img) return;
+	mb = 2e-6 * width * height * DIO_FRAMES;
+
+	printf ("%d frames of %d x %d, 16 bit, uncompressed, into %s\n", DIO_FRAMES, width, height, outdir);
+	printf ("%-22s %-9s %10s %10s %14s %10s\n", "", "", "ms/frame", "max ms", "close+sync ms", "MB/s");
+	for (w=0; dio_writers[w]; w++)
+	{
+		for (d=0; d<2; d++)
+		{
+			dio_run (w, d, img, fname, sizeof (fname), t[d]);
+			if (d == 0)
+			{
+				snprintf (refname, sizeof (refname), "%s.buffered", fname);
+				rename (fname, refname);
+			}
+		}
+		same = same_file (fname, refname);
+		unlink (refname);
+		for (d=0; d<2; d++)
+			printf ("%-22s %-9s %10.2f %10.2f %14.1f %10.1f%s\n", d ? "" : dio_writers[w], d ? "direct" : "buffered",
+				1e3 * t[d][0], 1e3 * t[d][1], 1e3 * t[d][2], mb / (t[d][0] * DIO_FRAMES + t[d][2]),
+				!d ? "" : same ? "   same bytes" : "   DIFFERENT");
+
+		for (f=0; f<DIO_FRAMES; f++)
+		{
+			snprintf (fname, sizeof (fname), "%s/imgbench_dio_%d.%s", outdir, f, (w == 0) ? "tif" : "pgm");
+			unlink (fname);
+		}
+		snprintf (fname, sizeof (fname), "%s/imgbench_dio.%s", outdir, (w == 1) ? "tif" : "raw");
+		unlink (fname);
+	}
+
+	free (img);
+}
+
+
+/********************************************************************/
+
+
+/* Preview pyramid: the levels against plain C box filters, the preview's
+	stretch, the SubIFDs read back with libtiff, and what it all costs and
+	saves next to the full frame */
+
+void bench_preview ()
+{
+unsigned short *img, *ref[PYRAMID_LEVELS], *row;
+char fname[1200], pname[1200];
+double t0, t_plain, t_kern, t_tone, t_tiff, t_levels;
+uint32_t tw, th;
+uint16_t count;
+toff_t *offsets, subifd[PYRAMID_LEVELS];
+unsigned char *pv;
+long n, i, ends;
+int l, r, w, h, y, ok, ok_tone, ok_tiff;
+pyramid p;
+TIFF *tif;
+
+
+	/* Odd sizes, so that every level drops a row and column somewhere */
+
+	w = width - 1;
+	h = height - 1;
+	img = make_frame16 (width, height);
+	if (!img) return;
+	ok = pyramid_build (&p, (char*)img, w, h, 2, PYRAMID_LEVELS) == 0 && p.levels == PYRAMID_LEVELS;
+	for (l=0; l<PYRAMID_LEVELS; l++)
+	{
+		ref[l] = malloc ((long)(w >> (l+1)) * (h >> (l+1)) * sizeof (unsigned short));
+		if (!ref[l]) return;
+		if (l == 0)
+			bin16_plain (ref[l], img, w, h, w, 2);
+		else
+			bin16_plain (ref[l], ref[l-1], w >> l, h >> l, w >> l, 2);
+		ok = ok && p.width[l] == (w >> (l+1)) && p.height[l] == (h >> (l+1))
+			&& !memcmp (ref[l], p.level[l], (long)p.width[l] * p.height[l] * 2);
+	}
+	printf ("Pyramid levels: %s\n", ok ? "OK" : "FAILED");
+
+	/* The preview of the 4x level: black and white reached, order kept */
+
+	n = (long)p.width[1] * p.height[1];
+	row = (unsigned short*)p.level[1];
+	pv = preview_tonemap (p.level[1], p.width[1], p.height[1], 2, PREVIEW_LOW, PREVIEW_HIGH, PREVIEW_GAMMA);
+	ok_tone = pv != NULL;
+	ends = 0;
+	for (i=0; ok_tone && i<n; i++)
+	{
+		ends += (pv[i] == 0 || pv[i] == 255);
+		if (i > 0 && ((row[i] > row[i-1] && pv[i] < pv[i-1]) || (row[i] < row[i-1] && pv[i] > pv[i-1])))
+			ok_tone = 0;
+	}
+	ok_tone = ok_tone && ends > n / 500 && ends < n / 20;
+	printf ("Tone-mapped preview: %s\n", ok_tone ? "OK" : "FAILED");
+	snprintf (pname, sizeof (pname), "%s/imgbench_preview.pgm", outdir);
+	if (pv) pnm_write_8 (pname, pv, p.width[1], p.height[1]);
+	free (pv);
+
+	/* SubIFDs, read back */
+
+	snprintf (fname, sizeof (fname), "%s/imgbench_preview.tif", outdir);
+	ok_tiff = tiffwrite_levels (fname, (char*)img, w, h, 2, "imgbench", &p) == 0;
+	tif = ok_tiff ? TIFFOpen (fname, "r") : NULL;
+	ok_tiff = tif && TIFFGetField (tif, TIFFTAG_SUBIFD, &count, &offsets) && count == PYRAMID_LEVELS;
+	if (ok_tiff) memcpy (subifd, offsets, sizeof (subifd));		/* Freed with the directory */
+	row = malloc ((long)w * sizeof (unsigned short));
+	for (l=0; ok_tiff && row && l<PYRAMID_LEVELS; l++)
+	{
+		ok_tiff = TIFFSetSubDirectory (tif, subifd[l]) && TIFFGetField (tif, TIFFTAG_IMAGEWIDTH, &tw)
+			&& TIFFGetField (tif, TIFFTAG_IMAGELENGTH, &th) && tw == (uint32_t)p.width[l] && th == (uint32_t)p.height[l];
+		for (y=0; ok_tiff && y<p.height[l]; y++)
+			ok_tiff = TIFFReadScanline (tif, row, y, 0) == 1
+				&& !memcmp (row, p.level[l] + (long)y * p.width[l] * 2, (long)p.width[l] * 2);
+	}
+	if (tif) TIFFClose (tif);
+	free (row);
+	printf ("TIFF SubIFDs: %s\n", ok_tiff ? "OK" : "FAILED");
+	pyramid_free (&p);
+
+	/* Costs */
+
+	printf ("%d x %d, %d repeats\n", width, height, repeats);
+	printf ("%-24s %14s %14s\n", "", "plain MB/s", "kernel MB/s");
+	t0 = now ();
+	for (r=0; r<repeats; r++)
+		for (l=0; l<PYRAMID_LEVELS; l++)
+			bin16_plain (ref[l], l ? ref[l-1] : img, w >> l, h >> l, w >> l, 2);
+	t_plain = (now () - t0) / repeats;
+	t0 = now ();
+	for (r=0; r<repeats; r++)
+	{
+		pyramid_build (&p, (char*)img, w, h, 2, PYRAMID_LEVELS);
+		pyramid_free (&p);
+	}
+	t_kern = (now () - t0) / repeats;
+	printf ("pyramid 2x, 4x, 8x       %14.1f %14.1f\n", 2e-6 * w * h / t_plain, 2e-6 * w * h / t_kern);
+
+	pyramid_build (&p, (char*)img, width, height, 2, PYRAMID_LEVELS);
+	t0 = now ();
+	for (r=0; r<repeats; r++)
+		free (preview_tonemap (p.level[1], p.width[1], p.height[1], 2, PREVIEW_LOW, PREVIEW_HIGH, PREVIEW_GAMMA));
+	t_tone = (now () - t0) / repeats;
+	t0 = now ();
+	for (r=0; r<repeats; r++)
+		tiffwrite (fname, (char*)img, width, height, 2, NULL);
+	t_tiff = (now () - t0) / repeats;
+	n = filesize (fname);
+	t0 = now ();
+	for (r=0; r<repeats; r++)
+		tiffwrite_levels (fname, (char*)img, width, height, 2, NULL, &p);
+	t_levels = (now () - t0) / repeats;
+	pyramid_free (&p);
+
+	printf ("%-24s %14s %14s\n", "", "ms", "kB");
+	printf ("pyramid                  %14.2f\n", 1e3 * t_kern);
+	printf ("4x preview, tone map     %14.2f %14.1f\n", 1e3 * t_tone, 1e-3 * filesize (pname));
+	printf ("TIFF (%s)              %14.2f %14.1f\n", tiff_compression_name (tiffopts.compression), 1e3 * t_tiff, 1e-3 * n);
+	printf ("TIFF with SubIFDs        %14.2f %14.1f\n", 1e3 * t_levels, 1e-3 * filesize (fname));
+
+	for (l=0; l<PYRAMID_LEVELS; l++)
+		free (ref[l]);
+	free (img);
+}
+
+
+
+/*********************************************************************/
+
+/* Demosaicing the plain way: one pixel at a time, mirrored at the borders
+	by index, with the filters of demosaic.c written out per colour */
+
+static int bayer_at (const void *src, int bps, int w, int h, int x, int y)
+{
+	if (x < 0) x = -x;
+	if (x >= w) x = 2*(w-1) - x;
+	if (y < 0) y = -y;
+	if (y >= h) y = 2*(h-1) - y;
+	if (bps == 2)
+		return ((const unsigned short*)src)[(long)y*w + x];
+	return ((const unsigned char*)src)[(long)y*w + x];
+}
+
+
+void demosaic_plain (void *dst, const void *src, int w, int h, int bps, int pattern, int method)
+{
+int x, y, k, c, hor, ver, diag, hfar, vfar, hv, vv, own, maxval, redrow, v[3];
+
+
+	maxval = (bps == 2) ? 65535 : 255;
+	for (y=0; y<h; y++)
+		for (x=0; x<w; x++)
+		{
+			c = bayer_at (src, bps, w, h, x, y);
+			hor = bayer_at (src, bps, w, h, x-1, y) + bayer_at (src, bps, w, h, x+1, y);
+			ver = bayer_at (src, bps, w, h, x, y-1) + bayer_at (src, bps, w, h, x, y+1);
+			diag = bayer_at (src, bps, w, h, x-1, y-1) + bayer_at (src, bps, w, h, x+1, y-1)
+				+ bayer_at (src, bps, w, h, x-1, y+1) + bayer_at (src, bps, w, h, x+1, y+1);
+			hfar = bayer_at (src, bps, w, h, x-2, y) + bayer_at (src, bps, w, h, x+2, y);
+			vfar = bayer_at (src, bps, w, h, x, y-2) + bayer_at (src, bps, w, h, x, y+2);
+			redrow = ((y & 1) == (pattern >> 1));
+			if ((x & 1) == (redrow ? (pattern & 1) : 1 - (pattern & 1)))
+			{
+				/* Red or blue: green on the cross, the other colour on the diagonals */
+
+				own = redrow ? 0 : 2;
+				v[own] = c;
+				if (method == DM_GRADIENT)
+				{
+					v[1] = (8*c + 4*(hor + ver) - 2*(hfar + vfar) + 8) >> 4;
+					v[2-own] = (12*c + 4*diag - 3*(hfar + vfar) + 8) >> 4;
+				}
+				else
+				{
+					v[1] = (hor + ver + 2) >> 2;
+					v[2-own] = (diag + 2) >> 2;
+				}
+			}
+			else
+			{
+				/* Green: red to the left and right in red rows, above and below in blue rows */
+
+				v[1] = c;
+				if (method == DM_GRADIENT)
+				{
+					hv = (10*c + 8*hor - 2*hfar - 2*diag + vfar + 8) >> 4;
+					vv = (10*c + 8*ver - 2*vfar - 2*diag + hfar + 8) >> 4;
+				}
+				else
+				{
+					hv = (hor + 1) >> 1;
+					vv = (ver + 1) >> 1;
+				}
+				v[0] = redrow ? hv : vv;
+				v[2] = redrow ? vv : hv;
+			}
+			for (k=0; k<3; k++)
+			{
+				if (v[k] < 0) v[k] = 0;
+				if (v[k] > maxval) v[k] = maxval;
+				if (bps == 2)
+					((unsigned short*)dst)[((long)y*w + x)*3 + k] = (unsigned short)v[k];
+				else
+					((unsigned char*)dst)[((long)y*w + x)*3 + k] = (unsigned char)v[k];
+			}
+		}
+}
+
+
+/* A 12-bit RGB scene: brightness with gradients, sharp-edged tiles and
+	fine stripes, the worst case for demosaicing, in slowly changing colour,
+	as in most images. With ramp, only a linear ramp per channel, which both
+	methods reproduce exactly. */
+
+unsigned short *make_scene_rgb16 (int w, int h, int ramp)
+{
+unsigned short *img;
+int x, y, k, v, lum;
+long i;
+
+
+	img = malloc ((long)w * h * 3 * sizeof (unsigned short));
+	if (!img) return NULL;
+
+	for (y=0; y<h; y++)
+		for (x=0; x<w; x++)
+			for (k=0; k<3; k++)
+			{
+				i = ((long)y*w + x)*3 + k;
+				if (ramp)
+				{
+					img[i] = (unsigned short)((100 + (k+1)*x + (3-k)*y) % 65536);
+					continue;
+				}
+				lum = 800 + 1200 * (x + y) / (w + h);
+				if (((x/64) + (y/48)) % 3 == 0)
+					lum += 1000;
+				if (x > w/2 && y > h/2)
+					lum += (int)(500 * sin (0.7 * x + 0.2 * y));
+				v = lum * (k == 0 ? 2*w - x : k == 1 ? 2*h - y : w + x) / (2*w);
+				img[i] = (unsigned short)(v < 0 ? 0 : v > 4095 ? 4095 : v);
+			}
+
+	return img;
+}
+
+
+/* The mosaic of an RGB image (bps 1 or 2 per channel) as a camera with
+	that pattern would see it */
+
+void make_mosaic (void *dst, const void *rgb, int w, int h, int bps, int pattern)
+{
+int x, y, k, redrow;
+long i;
+
+
+	for (y=0; y<h; y++)
+	{
+		redrow = ((y & 1) == (pattern >> 1));
+		for (x=0; x<w; x++)
+		{
+			if ((x & 1) == (redrow ? (pattern & 1) : 1 - (pattern & 1)))
+				k = redrow ? 0 : 2;
+			else
+				k = 1;
+			i = (long)y*w + x;
+			if (bps == 2)
+				((unsigned short*)dst)[i] = ((const unsigned short*)rgb)[3*i + k];
+			else
+				((unsigned char*)dst)[i] = ((const unsigned char*)rgb)[3*i + k];
+		}
+	}
+}
+
+
+/* Peak signal to noise ratio of a 16-bit RGB image against the truth, for
+	a 12-bit peak, without the outer border rows and columns */
+
+double psnr12 (const unsigned short *img, const unsigned short *truth, int w, int h, int border)
+{
+double d, sum;
+long i, n;
+int x, y, k;
+
+
+	sum = 0;
+	n = 0;
+	for (y=border; y<h-border; y++)
+		for (x=border; x<w-border; x++)
+			for (k=0; k<3; k++)
+			{
+				i = ((long)y*w + x)*3 + k;
+				d = (double)img[i] - truth[i];
+				sum += d*d;
+				n++;
+			}
+	return (sum > 0) ? 10 * log10 (4095.0 * 4095.0 * n / sum) : 99;
+}
+
+
+void bench_demosaic ()
+{
+static const int methods[] = { DM_BILINEAR, DM_GRADIENT };
+unsigned short *truth, *mosaic, *out, *ref;
+unsigned char *truth8;
+demosaic_options opt;
+png_options popt;
+tiff_options topt;
+char fname[1200];
+double t0, t, psnr[2];
+long n, i;
+int ncpu, ok, okramp, w, h, bps, p, m, threads, r, s, sw, sh;
+
+
+	ncpu = (int)sysconf (_SC_NPROCESSORS_ONLN);
+	if (ncpu < 1) ncpu = 1;
+	n = (long)width * height;
+	truth = make_scene_rgb16 (width, height, 0);
+	truth8 = malloc (n * 3);
+	mosaic = malloc (n * sizeof (unsigned short));
+	out = malloc (n * 3 * sizeof (unsigned short));
+	ref = malloc (n * 3 * sizeof (unsigned short));
+	if (!truth || !truth8 || !mosaic || !out || !ref) return;
+	for (i=0; i<n*3; i++)
+		truth8[i] = (unsigned char)(truth[i] >> 4);
+
+	/* Against the plain version: every pattern, both depths and methods,
+		odd and tiny sizes, and many small bands over several threads */
+
+	ok = 1;
+	opt.band_rows = 5;
+	for (m=0; m<2; m++)
+		for (bps=1; bps<=2; bps++)
+			for (p=0; p<4; p++)
+				for (w=3; w<=67; w+=16)
+					for (h=3; h<=23 && ok; h+=5)
+						for (threads=1; threads<=3 && ok; threads+=2)
+						{
+							opt.method = methods[m];
+							opt.threads = threads;
+							make_mosaic (mosaic, (bps == 2) ? (void*)truth : (void*)truth8, w, h, bps, p);
+							ok = demosaic (out, mosaic, w, h, bps, p, &opt) == 0;
+							demosaic_plain (ref, mosaic, w, h, bps, p, opt.method);
+							ok = ok && !memcmp (out, ref, (long)w * h * 3 * bps);
+						}
+	printf ("Demosaicing: %s\n", ok ? "OK" : "FAILED");
+
+	/* Linear ramps come out exactly, away from the mirrored borders */
+
+	free (truth);
+	truth = make_scene_rgb16 (width, height, 1);
+	okramp = truth != NULL;
+	opt.band_rows = 0;
+	opt.threads = 1;
+	for (m=0; m<2 && okramp; m++)
+	{
+		opt.method = methods[m];
+		make_mosaic (mosaic, truth, width, height, 2, DM_RGGB);
+		okramp = demosaic (out, mosaic, width, height, 2, DM_RGGB, &opt) == 0;
+		for (h=2; h<height-2 && okramp; h++)
+			okramp = !memcmp (out + ((long)h*width + 2)*3, truth + ((long)h*width + 2)*3,
+				(long)(width - 4) * 3 * sizeof (unsigned short));
+	}
+	printf ("Linear ramps: %s\n", okramp ? "OK" : "FAILED");
+
+	/* Quality on the scene */
+
+	free (truth);
+	truth = make_scene_rgb16 (width, height, 0);
+	if (!truth) return;
+	make_mosaic (mosaic, truth, width, height, 2, DM_RGGB);
+	for (m=0; m<2; m++)
+	{
+		opt.method = methods[m];
+		demosaic (out, mosaic, width, height, 2, DM_RGGB, &opt);
+		psnr[m] = psnr12 (out, truth, width, height, 2);
+	}
+	printf ("PSNR bilinear %.1f dB, gradient-corrected %.1f dB: %s\n", psnr[0], psnr[1],
+		psnr[1] > psnr[0] ? "OK" : "FAILED");
+
+	/* 16-bit RGB output, read back */
+
+	topt = tiffopts;
+	topt.predictor = PREDICTOR_HORIZONTAL;
+	topt.rows_per_strip = 64;
+	topt.threads = 4;
+	snprintf (fname, sizeof (fname), "%s/imgbench_rgb16.tif", outdir);
+	ok = tiffwrite_opt (fname, (char*)out, width, height, 6, "imgbench", &topt) == 0
+		&& tiffread_all (fname, (char*)ref, n * 6) == n * 6 && !memcmp (out, ref, n * 6);
+	topt.threads = 1;
+	ok = ok && tiffwrite_opt (fname, (char*)out, width, height, 6, "imgbench", &topt) == 0
+		&& tiffread_all (fname, (char*)ref, n * 6) == n * 6 && !memcmp (out, ref, n * 6);
+	printf ("16-bit RGB TIFF: %s\n", ok ? "OK" : "FAILED");
+	snprintf (fname, sizeof (fname), "%s/imgbench_rgb16.png", outdir);
+	popt = pngopts;
+	ok = pngwrite_opt (fname, (char*)out, width, height, 6, &popt) == 0
+		&& png_verify (fname, (char*)out, width, height, 6) == 0;
+	popt.threads = 4;
+	ok = ok && pngwrite_opt (fname, (char*)out, width, height, 6, &popt) == 0
+		&& png_verify (fname, (char*)out, width, height, 6) == 0;
+	printf ("16-bit RGB PNG: %s\n", ok ? "OK" : "FAILED");
+
+	/* Frames per second, at full size and binned 2 x 2 */
+
+	for (s=1; s<=2; s++)
+	{
+		sw = width / s;
+		sh = height / s;
+		printf ("\n%d x %d, %d repeats, %d cores, frames/s\n", sw, sh, repeats, ncpu);
+		printf ("%-20s %10s", "", "plain");
+		for (threads=1; ; threads*=2)
+		{
+			printf (" %8d th", threads);
+			if (threads >= ncpu) break;
+		}
+		printf ("\n");
+		for (bps=1; bps<=2; bps++)
+			for (m=0; m<2; m++)
+			{
+				opt.method = methods[m];
+				make_mosaic (mosaic, (bps == 2) ? (void*)truth : (void*)truth8, sw, sh, bps, DM_RGGB);
+				printf ("%2d-bit %-13s", 8*bps, dm_method_name (opt.method));
+				t0 = now ();
+				demosaic_plain (ref, mosaic, sw, sh, bps, DM_RGGB, opt.method);
+				t = now () - t0;
+				printf (" %10.1f", 1 / t);
+				for (threads=1; ; threads*=2)
+				{
+					opt.threads = threads;
+					t0 = now ();
+					for (r=0; r<repeats; r++)
+						demosaic (out, mosaic, sw, sh, bps, DM_RGGB, &opt);
+					t = (now () - t0) / repeats;
+					printf (" %11.1f", 1 / t);
+					if (threads >= ncpu) break;
+				}
+				printf ("\n");
+			}
+	}
+
+	free (ref);
+	free (out);
+	free (mosaic);
+	free (truth8);
+	free (truth);
+}
+
+
+
+/*********************************************************************/
+
+/* Does the file hold exactly size bytes of data after offset bytes? */
+
+int file_holds (const char *fname, long offset, const char *data, long size)
+{
+FILE *FP;
+char *buf;
+int ok;
+
+
+	FP = fopen (fname, "rb");
+	buf = malloc (size + 1);
+	ok = FP && buf && fseek (FP, offset, SEEK_SET) == 0 && (long)fread (buf, 1, size + 1, FP) == size
+		&& !memcmp (buf, data, size);
+	if (FP) fclose (FP);
+	free (buf);
+	return ok;
+}
+
+
+/* Every writer on a view, checked against the contiguous host-order
+	copy of its pixels. Raw files hold the view's bytes (be, if it is
+	big-endian). scratch holds the image read back. Returns 1 if all
+	match. */
+
+int views_check (const imgview *v, const char *copy, const char *be, char *scratch)
+{
+tiff_options topt;
+png_options popt;
+char fname[1200], hdr[64];
+long size;
+int ok, t;
+
+
+	size = (long)v->width * v->height * v->bps;
+	ok = 1;
+	topt = tiffopts;
+	topt.rows_per_strip = 64;
+	topt.predictor = PREDICTOR_HORIZONTAL;
+	popt = pngopts;
+	snprintf (fname, sizeof (fname), "%s/imgbench_view.tif", outdir);
+	for (t=1; t<=4; t+=3)
+	{
+		topt.threads = t;
+		popt.threads = t;
+		ok = ok && tiffwrite_view_opt (fname, v, &topt) == 0;
+		ok = ok && tiffread_all (fname, scratch, size) == size && !memcmp (scratch, copy, size);
+		snprintf (fname, sizeof (fname), "%s/imgbench_view.png", outdir);
+		ok = ok && pngwrite_view_opt (fname, v, &popt) == 0 && png_verify (fname, copy, v->width, v->height, v->bps) == 0;
+		snprintf (fname, sizeof (fname), "%s/imgbench_view.tif", outdir);
+	}
+	snprintf (fname, sizeof (fname), "%s/imgbench_view.pnm", outdir);
+	ok = ok && pnm_write_view (fname, v) == 0;
+	if (v->bps == 2)
+		ok = ok && pgm16_verify (fname, (const unsigned short*)copy, v->width, v->height) == 0;
+	else
+	{
+		snprintf (hdr, sizeof (hdr), "P5 %d %d 255\n", v->width, v->height);
+		ok = ok && file_holds (fname, (long)strlen (hdr), copy, size);
+	}
+	snprintf (fname, sizeof (fname), "%s/imgbench_view.raw", outdir);
+	ok = ok && raw_write_view (fname, v) == 0 && file_holds (fname, 0, v->big_endian ? be : copy, size);
+
+	return ok;
+}
+
+
+/* The TIFF sample format of a file, or -1 */
+
+int tiff_sampleformat (const char *fname)
+{
+TIFF *tif;
+uint16_t fmt;
+
+
+	tif = TIFFOpen (fname, "r");
+	if (!tif) return -1;
+	if (!TIFFGetFieldDefaulted (tif, TIFFTAG_SAMPLEFORMAT, &fmt)) fmt = 0;
+	TIFFClose (tif);
+	return fmt;
+}
+
+
+double time_writes (const img_writer **list, int n, const char **fnames, const imgview *v, int together)
+{
+double t0;
+int r, i;
+
+
+	t0 = now ();
+	for (r=0; r<repeats; r++)
+	{
+		if (together)
+			writers_write (list, n, fnames, v);
+		else
+			for (i=0; i<n; i++)
+				list[i]->write (fnames[i], v);
+	}
+	return (now () - t0) / repeats;
+}
+
+
+void bench_views ()
+{
+static const char *names[] = { "tiff", "png", "pnm", "raw" };
+const img_writer *list[IMG_MAX_WRITERS];
+const char *fnames[IMG_MAX_WRITERS];
+char files[IMG_MAX_WRITERS][1200], name[1200];
+unsigned short *img, *crop, *be, *becrop, *scratch;
+unsigned char *img8, *crop8;
+imgview v, vc;
+long long conv;
+double t_copy, t_view, t_seq, t_par;
+long size, y, i;
+int ok, k, n, cw, ch, x0, y0;
+
+
+	/* A crop with an odd offset and size, rows of the full width apart */
+
+	x0 = width/4 + 1;
+	y0 = height/4;
+	cw = width/2 + 1;
+	ch = height/2 + 1;
+	size = (long)cw * ch;
+	img = make_frame16 (width, height);
+	img8 = make_frame8 (width, height);
+	crop = malloc (size * 2);
+	becrop = malloc (size * 2);
+	scratch = malloc (size * 2);
+	be = malloc ((long)width * height * 2);
+	crop8 = malloc (size);
+	if (!img || !img8 || !crop || !becrop || !scratch || !be || !crop8) return;
+	img[(long)(y0 + 1) * width + x0 + 2] = 50000;
+	for (y=0; y<ch; y++)
+	{
+		memcpy (crop + y*cw, img + (y0 + y) * width + x0, cw * 2);
+		memcpy (crop8 + y*cw, img8 + (y0 + y) * width + x0, cw);
+	}
+
+	conv = atomic_load (&imgview_converted);
+	imgview_init (&v, (char*)(img + (long)y0 * width + x0), cw, ch, 2);
+	v.stride = (long)width * 2;
+	ok = views_check (&v, (char*)crop, NULL, (char*)scratch);
+	imgview_init (&v, (char*)(img8 + (long)y0 * width + x0), cw, ch, 1);
+	v.stride = width;
+	ok = ok && views_check (&v, (char*)crop8, NULL, (char*)scratch);
+	printf ("Padded rows, 8 and 16 bit: %s, %lld bytes copied\n", ok && atomic_load (&imgview_converted) == conv ? "OK" : "FAILED",
+		atomic_load (&imgview_converted) - conv);
+
+	/* Big-endian samples: only the TIFF writer needs a swapped copy, twice */
+
+	for (i=0; i<(long)width * height; i++)
+		be[i] = (unsigned short)((img[i] >> 8) | (img[i] << 8));
+	conv = atomic_load (&imgview_converted);
+	imgview_init (&v, (char*)(be + (long)y0 * width + x0), cw, ch, 2);
+	v.stride = (long)width * 2;
+	v.big_endian = 1;
+	for (y=0; y<ch; y++)
+		memcpy (becrop + y*cw, be + (y0 + y) * width + x0, cw * 2);
+	ok = views_check (&v, (char*)crop, (char*)becrop, (char*)scratch);
+	conv = atomic_load (&imgview_converted) - conv;
+	printf ("Big-endian samples: %s, %lld bytes copied (TIFF)\n", ok && conv == 2 * size * 2 ? "OK" : "FAILED", conv);
+
+	/* 16-bit TIFFs are unsigned unless the view says otherwise */
+
+	snprintf (name, sizeof (name), "%s/imgbench_view.tif", outdir);
+	imgview_init (&v, (char*)crop, cw, ch, 2);
+	ok = tiffwrite_view (name, &v) == 0 && tiff_sampleformat (name) == SAMPLEFORMAT_UINT;
+	v.is_signed = 1;
+	ok = ok && tiffwrite_view (name, &v) == 0 && tiff_sampleformat (name) == SAMPLEFORMAT_INT;
+	ok = ok && tiffwrite (name, (char*)crop, cw, ch, 2, NULL) == 0 && tiff_sampleformat (name) == SAMPLEFORMAT_UINT;
+	printf ("TIFF sample format: %s\n", ok ? "OK" : "FAILED");
+
+	/* The registry */
+
+	ok = writer_for_file ("a/b.TIFF") == writer_find ("tiff") && writer_for_file ("x.pgm") == writer_find ("pnm")
+		&& writer_for_file ("run.png/x") == NULL && writer_for_file ("x.tiffany") == NULL;
+	writer_file_name (name, sizeof (name), "a.b/run.tif", writer_find ("png"));
+	ok = ok && !strcmp (name, "a.b/run.png");
+	writer_file_name (name, sizeof (name), "a.b/run", writer_find ("raw"));
+	ok = ok && !strcmp (name, "a.b/run.raw");
+	ok = ok && writer_parse_list ("tiff,png,raw", list, IMG_MAX_WRITERS) == 3 && list[2] == writer_find ("raw");
+	ok = ok && writer_parse_list ("tiff,gif", list, IMG_MAX_WRITERS) < 0;
+	ok = ok && !writer_accepts (writer_find ("png"), 4) && writer_accepts (writer_find ("tiff"), 4);
+
+	/* All of them side by side on the padded view */
+
+	snprintf (name, sizeof (name), "%s/imgbench_views", outdir);
+	n = 0;
+	for (k=0; k<IMG_MAX_WRITERS; k++)
+	{
+		list[n] = writer_find (names[k]);
+		writer_file_name (files[n], sizeof (files[n]), name, list[n]);
+		fnames[n] = files[n];
+		n++;
+	}
+	imgview_init (&v, (char*)(img + (long)y0 * width + x0), cw, ch, 2);
+	v.stride = (long)width * 2;
+	ok = ok && writers_write (list, n, fnames, &v) == 0
+		&& tiffread_all (fnames[0], (char*)scratch, size * 2) == size * 2 && !memcmp (scratch, crop, size * 2)
+		&& png_verify (fnames[1], (char*)crop, cw, ch, 2) == 0
+		&& pgm16_verify (fnames[2], crop, cw, ch) == 0
+		&& file_holds (fnames[3], 0, (char*)crop, size * 2);
+	printf ("Writer registry: %s\n", ok ? "OK" : "FAILED");
+
+	/* Cost of a crop: copied out, then written, against the view */
+
+	printf ("\n%d x %d crop of %d x %d, 16 bit, %d repeats, ms/frame\n", cw, ch, width, height, repeats);
+	printf ("%-10s %14s %14s\n", "", "copy + write", "view");
+	imgview_init (&vc, (char*)crop, cw, ch, 2);
+	for (k=0; k<n; k++)
+	{
+		t_copy = now ();
+		for (i=0; i<repeats; i++)
+		{
+			for (y=0; y<ch; y++)
+				memcpy (crop + y*cw, img + (y0 + y) * width + x0, cw * 2);
+			list[k]->write (fnames[k], &vc);
+		}
+		t_copy = (now () - t_copy) / repeats;
+		t_view = now ();
+		for (i=0; i<repeats; i++)
+			list[k]->write (fnames[k], &v);
+		t_view = (now () - t_view) / repeats;
+		printf ("%-10s %14.2f %14.2f\n", list[k]->name, 1e3 * t_copy, 1e3 * t_view);
+	}
+
+	/* Several formats of one frame: one after another, and side by side */
+
+	t_seq = time_writes (list, n, fnames, &v, 0);
+	t_par = time_writes (list, n, fnames, &v, 1);
+	printf ("%-10s %14s %14s\n", "", "in turn", "side by side");
+	printf ("%-10s %14.2f %14.2f\n", "all four", 1e3 * t_seq, 1e3 * t_par);
+	for (k=0; k<n; k++)
+		unlink (fnames[k]);
+
+	free (crop8);
+	free (be);
+	free (scratch);
+	free (becrop);
+	free (crop);
+	free (img8);
+	free (img);
+}
+
+
+
+/********************************************************************/
+
+
+/* The writer pipeline without a camera: the "camera" takes a buffer from a
+	pool of n for every frame and the writers give it back with
+	cam_requeue(), as in acquire. An empty pool at a snap is a frame that
+	the camera would have lost. These stand in for camera.c and acquire.c. */
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static int pool_free;
+
+void cam_requeue (camsession *cs, ArvBuffer *buffer)
+{
+	pthread_mutex_lock (&pool_lock);
+	pool_free++;
+	pthread_mutex_unlock (&pool_lock);
+}
+
+void dp (int pri, char *format, ...)
+{
+}
+
+
+static void slow_save (ArvBuffer *buffer, const char *fname, const framemeta *meta)
+{
+	usleep (500 + 100 * (atoi (fname) % 7));
+}
+
+
+void bench_pipeline ()
+{
+static const int cases[][2] = { { 2, 1 }, { 3, 2 }, { 4, 3 }, { 4, 8 }, { 8, 4 } };
+static char fake[8];
+camsession cs;
+pipeline *p;
+pipe_stats stats;
+char name[32];
+int c, f, n_buffers, n_writers, lost, ok, got;
+
+
+	memset (&cs, 0, sizeof (cs));
+	printf ("%-24s %8s %8s %8s %8s\n", "buffers, writers", "frames", "saved", "stalls", "lost");
+	ok = 1;
+	for (c=0; c<(int)(sizeof (cases) / sizeof (cases[0])); c++)
+	{
+		n_buffers = cases[c][0];
+		n_writers = cases[c][1];
+		pool_free = n_buffers;
+		lost = 0;
+
+		/* As run_sequence() sets it up */
+
+		p = pipe_start (&cs, n_writers, n_buffers - 1, PIPE_BLOCK, slow_save);
+		if (!p) return;
+		for (f=0; f<repeats * 100; f++)
+		{
+			pthread_mutex_lock (&pool_lock);
+			got = pool_free > 0;
+			if (got) pool_free--;
+			pthread_mutex_unlock (&pool_lock);
+			if (!got)
+			{
+				lost++;
+				continue;
+			}
+			snprintf (name, sizeof (name), "%d", f);
+			pipe_submit (p, (ArvBuffer*)&fake[f % 8], name, NULL);
+		}
+		pipe_finish (p, &stats);
+
+		snprintf (name, sizeof (name), "%d, %d", n_buffers, n_writers);
+		printf ("%-24s %8d %8lu %8lu %8d\n", name, f, stats.written, stats.stalls, lost);
+		if (lost || stats.written != (unsigned long)f || pool_free != n_buffers)
+			ok = 0;
+	}
+	printf ("No buffer shortage with several writers: %s\n", ok ? "OK" : "FAILED");
+}
+
+
+
+void prhelp()
+{
+	fprintf (stderr, "imgbench: throughput of the image writers\n");
+	fprintf (stderr, "usage: imgbench [options] test\n");
+	fprintf (stderr, "-x                frame width, -x 2448\n");
+	fprintf (stderr, "-y                frame height, -y 2048\n");
+	fprintf (stderr, "-n                repeats per measurement, -n 5\n");
+	fprintf (stderr, "-d                directory for the output files, -d /tmp\n");
+	fprintf (stderr, "-i                raw log to take the time-lapse frames from, default synthetic\n");
+	fprintf (stderr, "-k                time-lapse keyframe interval, -k %d\n", TLAPSE_KEY_INTERVAL);
+	fprintf (stderr, "tests: strips codecs pnm png unpack bin acc calib stats trace timelapse dio preview\n");
+	fprintf (stderr, "       demosaic views pipeline\n");
+}
+
+
+
+int main (int argc, char **argv)
+{
+
+	while (--argc && **++argv=='-')
+	{
+		if (!strcmp(argv[0], "-x"))
+			width = nextargi;
+		else if (!strcmp(argv[0], "-y"))
+			height = nextargi;
+		else if (!strcmp(argv[0], "-n"))
+			repeats = nextargi;
+		else if (!strcmp(argv[0], "-d"))
+			strcpy (outdir, nextargs);
+		else if (!strcmp(argv[0], "-i"))
+			snprintf (recording, sizeof (recording), "%s", nextargs);
+		else if (!strcmp(argv[0], "-k"))
+			key_interval = nextargi;
+		else
+		{
+			prhelp();
+			return 0;
+		}
+	}
+
+	if (argc < 1)
+	{
+		prhelp();
+		return 1;
+	}
+
+	if (!strcmp(argv[0], "strips"))
+		bench_strips ();
+	else if (!strcmp(argv[0], "codecs"))
+		bench_codecs ();
+	else if (!strcmp(argv[0], "pnm"))
+		bench_pnm ();
+	else if (!strcmp(argv[0], "png"))
+		bench_png ();
+	else if (!strcmp(argv[0], "unpack"))
+		bench_unpack ();
+	else if (!strcmp(argv[0], "bin"))
+		bench_bin ();
+	else if (!strcmp(argv[0], "acc"))
+		bench_acc ();
+	else if (!strcmp(argv[0], "calib"))
+		bench_calib ();
+	else if (!strcmp(argv[0], "stats"))
+		bench_stats ();
+	else if (!strcmp(argv[0], "trace"))
+		bench_trace ();
+	else if (!strcmp(argv[0], "timelapse"))
+		bench_timelapse ();
+	else if (!strcmp(argv[0], "dio"))
+		bench_dio ();
+	else if (!strcmp(argv[0], "preview"))
+		bench_preview ();
+	else if (!strcmp(argv[0], "demosaic"))
+		bench_demosaic ();
+	else if (!strcmp(argv[0], "views"))
+		bench_views ();
+	else if (!strcmp(argv[0], "pipeline"))
+		bench_pipeline ();
+	else
+	{
+		prhelp();
+		return 1;
+	}
+
+	return 0;
+}
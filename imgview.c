@@ -0,0 +1,309 @@
+/* imgview.c
+
+	Image views and the registry of image writers. The writers themselves
+	are in tiffstuff.c, except for raw sample dumps. See imgview.h.
+
+*/
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <pthread.h>
+
+#include "imgview.h"
+#include "tiffstuff.h"
+#include "dio.h"
+
+
+atomic_llong imgview_converted;
+
+
+
+/* A view of a contiguous image in host byte order, as the writers took
+	them so far. The rest is 0. */
+
+void imgview_init (imgview *v, const char *data, int width, int height, int bps)
+{
+	memset (v, 0, sizeof (imgview));
+	v->data = data;
+	v->width = width;
+	v->height = height;
+	v->bps = bps;
+	v->stride = (long)width * bps;
+}
+
+
+/* Are the samples in host byte order? Only 16-bit samples have one. */
+
+int imgview_host_order (const imgview *v)
+{
+unsigned short endian_test = 1;
+
+	if (v->bps != 2 && v->bps != 6) return 1;
+	return !v->big_endian == (*(unsigned char*)&endian_test != 0);
+}
+
+
+const char *imgview_row (const imgview *v, int y)
+{
+	return v->data + (long)y * v->stride;
+}
+
+
+/* The pixels of v as one contiguous array in host byte order, for code
+	that takes nothing else. That is v->data itself if it already is; else
+	a copy, which is also returned in *owned for the caller to free.
+	NULL if there is no memory. */
+
+const char *imgview_pixels (const imgview *v, char **owned)
+{
+char *out, *dst;
+const char *src;
+long rowbytes, i;
+int y, swap;
+
+
+	*owned = NULL;
+	rowbytes = (long)v->width * v->bps;
+	swap = !imgview_host_order (v);
+	if (v->stride == rowbytes && !swap) return v->data;
+
+	out = malloc (rowbytes * v->height > 0 ? rowbytes * v->height : 1);
+	if (!out) return NULL;
+	for (y=0; y<v->height; y++)
+	{
+		src = imgview_row (v, y);
+		dst = out + (long)y * rowbytes;
+		if (swap)
+			for (i=0; i+1<rowbytes; i+=2)
+			{
+				dst[i] = src[i+1];
+				dst[i+1] = src[i];
+			}
+		else
+			memcpy (dst, src, rowbytes);
+	}
+	atomic_fetch_add (&imgview_converted, rowbytes * v->height);
+
+	*owned = out;
+	return out;
+}
+
+
+
+/*********************************************************************/
+
+/* The samples of v as they are, rows without their padding, no header.
+	The reader must know size, pixel type and byte order, e.g. from the
+	frame log. Returns 0 or -1. */
+
+int raw_write_view (const char *fname, const imgview *v)
+{
+dio_file *df;
+FILE *FP;
+long rowbytes;
+int y, err;
+
+
+	rowbytes = (long)v->width * v->bps;
+	err = 0;
+	if (dioopts.enabled)
+	{
+		df = dio_open (fname, (long long)rowbytes * v->height, NULL);
+		if (!df) return -1;
+		if (v->stride == rowbytes)
+			err = dio_write (df, v->data, rowbytes * v->height) < 0;
+		else
+			for (y=0; y<v->height && !err; y++)
+				err = dio_write (df, imgview_row (v, y), rowbytes) < 0;
+		if (dio_close (df)) err = 1;
+		return err ? -1 : 0;
+	}
+
+	FP = fopen (fname, "wb");
+	if (!FP) return -1;
+	if (v->stride == rowbytes)
+		err = fwrite (v->data, 1, rowbytes * v->height, FP) != (size_t)(rowbytes * v->height);
+	else
+		for (y=0; y<v->height && !err; y++)
+			err = fwrite (imgview_row (v, y), 1, rowbytes, FP) != (size_t)rowbytes;
+	if (fclose (FP)) err = 1;
+
+	return err ? -1 : 0;
+}
+
+
+
+/*********************************************************************/
+
+/* The writers by name and extension */
+
+#define BPS_GRAY_RGB	((1 << 1) | (1 << 2) | (1 << 3) | (1 << 6))
+
+static const img_writer img_writers[] =
+{
+	{ "tiff",	".tif",	".tiff",		tiffwrite_view,		BPS_GRAY_RGB | (1 << 4) },
+	{ "png",	".png",	"",				pngwrite_view,		BPS_GRAY_RGB },
+	{ "pnm",	".pnm",	".pgm .ppm",	pnm_write_view,		BPS_GRAY_RGB },
+	{ "raw",	".raw",	"",				raw_write_view,		BPS_GRAY_RGB | (1 << 4) },
+	{ NULL, NULL, NULL, NULL, 0 }
+};
+
+
+const img_writer *writer_find (const char *name)
+{
+int i;
+
+	for (i=0; img_writers[i].name; i++)
+		if (!strcasecmp (name, img_writers[i].name))
+			return &img_writers[i];
+	return NULL;
+}
+
+
+/* Is ext (with the dot) one of w's extensions? */
+
+static int writer_has_ext (const img_writer *w, const char *ext)
+{
+const char *e;
+size_t len;
+
+
+	if (!strcasecmp (w->ext, ext)) return 1;
+	len = strlen (ext);
+	for (e=w->alt_ext; (e = strchr (e, '.')) != NULL; e++)
+		if (!strncasecmp (e, ext, len) && (e[len] == 0 || e[len] == ' '))
+			return 1;
+	return 0;
+}
+
+
+static const char *file_ext (const char *fname)
+{
+const char *dot, *slash;
+
+	dot = strrchr (fname, '.');
+	slash = strrchr (fname, '/');
+	return (!dot || (slash && dot < slash)) ? NULL : dot;
+}
+
+
+/* The writer for a file name's extension, or NULL */
+
+const img_writer *writer_for_file (const char *fname)
+{
+const char *ext;
+int i;
+
+
+	ext = file_ext (fname);
+	if (!ext) return NULL;
+	for (i=0; img_writers[i].name; i++)
+		if (writer_has_ext (&img_writers[i], ext))
+			return &img_writers[i];
+	return NULL;
+}
+
+
+/* Writers from a comma-separated list of names, e.g. "tiff,png", into
+	list. Returns how many, or -1 for an unknown name or too many. */
+
+int writer_parse_list (const char *spec, const img_writer **list, int max)
+{
+char name[32];
+const char *comma;
+size_t len;
+int n;
+
+
+	for (n=0; *spec; n++)
+	{
+		comma = strchr (spec, ',');
+		len = comma ? (size_t)(comma - spec) : strlen (spec);
+		if (n >= max || len >= sizeof (name)) return -1;
+		memcpy (name, spec, len);
+		name[len] = 0;
+		if (!(list[n] = writer_find (name))) return -1;
+		spec += comma ? len + 1 : len;
+	}
+	return n;
+}
+
+
+int writer_accepts (const img_writer *w, int bps)
+{
+	return bps > 0 && bps < 31 && (w->bps_mask & (1 << bps));
+}
+
+
+/* fname as a file of w: as it is if its extension is one of w's, else
+	with w's extension instead of its own */
+
+void writer_file_name (char *out, int size, const char *fname, const img_writer *w)
+{
+const char *ext;
+
+
+	ext = file_ext (fname);
+	if (ext && writer_has_ext (w, ext))
+		snprintf (out, size, "%s", fname);
+	else
+		snprintf (out, size, "%.*s%s", ext ? (int)(ext - fname) : (int)strlen (fname), fname, w->ext);
+}
+
+
+
+/* Several writers on one view at the same time: list[i] writes fnames[i],
+	the first in the calling thread, the others in threads of their own.
+	Returns 0, or -1 if any of them failed. */
+
+typedef struct
+{
+	const img_writer *w;
+	const char *fname;
+	const imgview *v;
+	int err;
+} writer_job;
+
+
+static void *writer_thread (void *arg)
+{
+writer_job *job = (writer_job*)arg;
+
+	job->err = writer_accepts (job->w, job->v->bps) ? job->w->write (job->fname, job->v) : -1;
+	return NULL;
+}
+
+
+int writers_write (const img_writer **list, int n, const char **fnames, const imgview *v)
+{
+writer_job jobs[IMG_MAX_WRITERS];
+pthread_t tid[IMG_MAX_WRITERS];
+int i, started[IMG_MAX_WRITERS], err;
+
+
+	if (n > IMG_MAX_WRITERS) return -1;
+	for (i=0; i<n; i++)
+	{
+		jobs[i].w = list[i];
+		jobs[i].fname = fnames[i];
+		jobs[i].v = v;
+		jobs[i].err = 0;
+		started[i] = (i > 0) && !pthread_create (&tid[i], NULL, writer_thread, &jobs[i]);
+		if (i > 0 && !started[i])
+			writer_thread (&jobs[i]);
+	}
+	if (n > 0)
+		writer_thread (&jobs[0]);
+
+	err = 0;
+	for (i=0; i<n; i++)
+	{
+		if (started[i])
+			pthread_join (tid[i], NULL);
+		if (jobs[i].err < 0) err = -1;
+	}
+	return err;
+}
@@ -0,0 +1,74 @@
+#ifndef __IMGVIEW_H
+#define __IMGVIEW_H
+
+#include <stdatomic.h>
+
+#include "framemeta.h"
+#include "preview.h"
+
+
+/* A frame as the image writers see it: where its pixels are and how they
+	are laid out, without owning them. Rows may be padded (stride), 16-bit
+	samples may be either byte order, and the writers take the view as it
+	is, e.g. straight from the memory of an ArvBuffer. A writer converts
+	only what its format needs: PNG and PNM take big-endian samples as they
+	are, little-endian ones are swapped by the encoders row by row; TIFF
+	is written in host order and swaps a copy only for big-endian views.
+	What the writers do not do themselves, imgview_pixels() does, and
+	imgview_converted counts the bytes that had to be copied for it.
+
+	bps is the writers' pixel type: 1 (8-bit gray), 2 (16-bit gray), 3
+	(8-bit RGB), 4 (32-bit float) or 6 (16-bit RGB). Samples are unsigned
+	unless is_signed is set, which the TIFF writer records.
+
+	The writer registry maps format names and file name extensions to the
+	writers. writers_write() runs several of them on the same view at the
+	same time, one thread each; the view is only read.
+*/
+
+typedef struct
+{
+	const char *data;			/* First pixel of the top row */
+	int width;
+	int height;
+	long stride;				/* Bytes from one row to the next, at least width * bps */
+	int bps;					/* 1, 2, 3, 4 or 6, as for tiffwrite() */
+	int bits;					/* Significant bits per sample, 0 for all */
+	int is_signed;				/* Signed integer samples */
+	int big_endian;				/* 16-bit samples MSB first, else in host order */
+	const char *comment;		/* TIFF image description, may be NULL */
+	const framemeta *meta;		/* May be NULL */
+	const pyramid *levels;		/* SubIFDs of a TIFF, may be NULL */
+} imgview;
+
+
+void imgview_init (imgview *v, const char *data, int width, int height, int bps);
+int imgview_host_order (const imgview *v);
+const char *imgview_row (const imgview *v, int y);
+const char *imgview_pixels (const imgview *v, char **owned);
+
+extern atomic_llong imgview_converted;		/* Bytes copied by imgview_pixels() so far */
+
+
+typedef struct
+{
+	const char *name;			/* As on the command line */
+	const char *ext;			/* Extension of new files */
+	const char *alt_ext;		/* Others it is known by, separated by spaces */
+	int (*write) (const char *fname, const imgview *v);
+	int bps_mask;				/* Bit bps set for each pixel type the format can hold */
+} img_writer;
+
+#define IMG_MAX_WRITERS		4
+
+const img_writer *writer_find (const char *name);
+const img_writer *writer_for_file (const char *fname);
+int writer_parse_list (const char *spec, const img_writer **list, int max);
+int writer_accepts (const img_writer *w, int bps);
+void writer_file_name (char *out, int size, const char *fname, const img_writer *w);
+int writers_write (const img_writer **list, int n, const char **fnames, const imgview *v);
+
+int raw_write_view (const char *fname, const imgview *v);
+
+
+#endif
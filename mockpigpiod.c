@@ -0,0 +1,363 @@
+/*************************************************
+
+	mockpigpiod.c
+
+	A stand-in for pigpiod, for testing sequences
+	without a Raspberry Pi. It speaks enough of the
+	pigpiod socket protocol for pigpiod_if2 clients
+	(modes, levels, PWM, waves) and logs every pin
+	change with a microsecond timestamp.
+
+**************************************************/
+
+/* Usage: mockpigpiod [-p port] [-o logfile]
+
+	Log lines, one per event:
+		tick gpio level			level change (gpio_write, or simulated wave)
+		tick gpio pwm duty		PWM duty cycle set
+		tick gpio mode m		gpio mode set
+		tick wave id			wave transmission started
+	tick counts microseconds since the mock was started. Wave pulses
+	are not played out in real time; their transitions are logged with
+	the ticks at which pigpiod would make them.
+*/
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+
+/* pigpiod command numbers (pigpio.h) */
+
+#define CMD_MODES		0
+#define CMD_WRITE		4
+#define CMD_PWM			5
+#define CMD_PFS			7
+#define CMD_TICK		16
+#define CMD_WVCLR		27
+#define CMD_WVAG		28
+#define CMD_WVAS		29
+#define CMD_WVBSY		32
+#define CMD_WVHLT		33
+#define CMD_TRIG		37
+#define CMD_WVCRE		49
+#define CMD_WVDEL		50
+#define CMD_WVTX		51
+#define CMD_WVTXR		52
+#define CMD_WVTXM		100
+#define CMD_WVCHA		93
+#define CMD_NOIB		99
+
+#define MAX_CLIENTS		16
+#define MAX_PULSES		12000
+#define MAX_WAVES		250
+
+
+typedef struct
+{
+	uint32_t gpioOn;
+	uint32_t gpioOff;
+	uint32_t usDelay;
+} pulse;
+
+typedef struct
+{
+	int n;
+	pulse *p;
+} wave;
+
+
+FILE *logfp;
+struct timespec t0;
+pulse pending[MAX_PULSES];		/* Added, not yet made into a wave */
+int n_pending;
+wave waves[MAX_WAVES];
+
+
+
+uint32_t tick ()
+{
+struct timespec t;
+
+
+	clock_gettime (CLOCK_MONOTONIC, &t);
+	return (uint32_t)((t.tv_sec - t0.tv_sec) * 1000000LL + (t.tv_nsec - t0.tv_nsec) / 1000);
+}
+
+
+
+/* wave_add_generic: pulses are merged into what is pending, as pigpiod
+	does for a single stream */
+
+int add_pulses (const unsigned char *ext, uint32_t len)
+{
+uint32_t n, i;
+
+
+	n = len / sizeof (pulse);
+	if (n_pending + n > MAX_PULSES) return -36;		/* PI_TOO_MANY_PULSES */
+	for (i=0; i<n; i++)
+		memcpy (&pending[n_pending++], ext + i*sizeof (pulse), sizeof (pulse));
+	return n_pending;
+}
+
+
+int create_wave ()
+{
+int id;
+
+
+	for (id=0; id<MAX_WAVES; id++)
+		if (!waves[id].p) break;
+	if (id == MAX_WAVES) return -67;				/* PI_NO_WAVEFORM_ID */
+	if (n_pending == 0) return -69;					/* PI_EMPTY_WAVEFORM */
+
+	waves[id].p = malloc (n_pending * sizeof (pulse));
+	if (!waves[id].p) return -67;
+	memcpy (waves[id].p, pending, n_pending * sizeof (pulse));
+	waves[id].n = n_pending;
+	n_pending = 0;
+	return id;
+}
+
+
+void delete_wave (int id)
+{
+	if (id < 0 || id >= MAX_WAVES) return;
+	free (waves[id].p);
+	waves[id].p = NULL;
+	waves[id].n = 0;
+}
+
+
+/* Log the transitions of wave id as if it started now */
+
+int send_wave (int id)
+{
+uint32_t t, bit;
+int i, g;
+
+
+	if (id < 0 || id >= MAX_WAVES || !waves[id].p) return -66;	/* PI_BAD_WAVE_ID */
+
+	t = tick ();
+	fprintf (logfp, "%u wave %d\n", t, id);
+	for (i=0; i<waves[id].n; i++)
+	{
+		for (g=0; g<32; g++)
+		{
+			bit = 1u << g;
+			if (waves[id].p[i].gpioOn & bit) fprintf (logfp, "%u %d 1\n", t, g);
+			if (waves[id].p[i].gpioOff & bit) fprintf (logfp, "%u %d 0\n", t, g);
+		}
+		t += waves[id].p[i].usDelay;
+	}
+	fflush (logfp);
+	return 0;
+}
+
+
+
+/* Execute one command. ext holds p3 bytes of extension, if any. */
+
+int32_t command (uint32_t cmd, uint32_t p1, uint32_t p2, const unsigned char *ext, uint32_t extlen)
+{
+int i;
+
+
+	switch (cmd)
+	{
+		case CMD_MODES:
+			fprintf (logfp, "%u %u mode %u\n", tick (), p1, p2);
+			break;
+		case CMD_WRITE:
+			fprintf (logfp, "%u %u %u\n", tick (), p1, p2 ? 1 : 0);
+			break;
+		case CMD_PWM:
+			fprintf (logfp, "%u %u pwm %u\n", tick (), p1, p2);
+			break;
+		case CMD_PFS:
+			return (int32_t)p2;
+		case CMD_TICK:
+			return (int32_t)tick ();
+		case CMD_WVCLR:
+			n_pending = 0;
+			for (i=0; i<MAX_WAVES; i++)
+				delete_wave (i);
+			return 0;
+		case CMD_WVAG:
+			return add_pulses (ext, extlen);
+		case CMD_WVCRE:
+			return create_wave ();
+		case CMD_WVDEL:
+			delete_wave ((int)p1);
+			return 0;
+		case CMD_WVTX:
+		case CMD_WVTXR:
+		case CMD_WVTXM:
+			return send_wave ((int)p1);
+		case CMD_WVBSY:								/* Waves are over as soon as they are logged */
+		case CMD_WVHLT:
+			return 0;
+		case CMD_NOIB:								/* Notification handle; no reports are ever sent */
+			return 0;
+		default:
+			return 0;
+	}
+	fflush (logfp);
+	return 0;
+}
+
+
+/* Commands that are followed by p3 bytes of extension */
+
+int has_ext (uint32_t cmd)
+{
+	return cmd == CMD_WVAG || cmd == CMD_WVAS || cmd == CMD_TRIG || cmd == CMD_WVCHA;
+}
+
+
+
+/* Serve one command from a client. Returns -1 when the client is gone. */
+
+int serve (int fd)
+{
+uint32_t msg[4];
+unsigned char *ext = NULL;
+int32_t res;
+size_t got;
+ssize_t r;
+
+
+	r = recv (fd, msg, sizeof (msg), MSG_WAITALL);
+	if (r != sizeof (msg)) return -1;
+
+	if (has_ext (msg[0]) && msg[3] > 0)
+	{
+		ext = malloc (msg[3]);
+		if (!ext) return -1;
+		for (got=0; got<msg[3]; got+=r)
+		{
+			r = recv (fd, ext + got, msg[3] - got, 0);
+			if (r <= 0)
+			{
+				free (ext);
+				return -1;
+			}
+		}
+	}
+
+	res = command (msg[0], msg[1], msg[2], ext, ext ? msg[3] : 0);
+	free (ext);
+	msg[3] = (uint32_t)res;
+	if (send (fd, msg, sizeof (msg), 0) != sizeof (msg)) return -1;
+
+	return 0;
+}
+
+
+
+/********************************************************************/
+
+
+#define nextargi (--argc,atoi(*++argv))
+#define nextargs (--argc,*++argv)
+
+
+void prhelp()
+{
+	fprintf (stderr, "mockpigpiod: pigpiod stand-in that logs pin changes\n");
+	fprintf (stderr, "Usage: mockpigpiod [-p port] [-o logfile]\n");
+	fprintf (stderr, "-p     TCP port, default 8888 (PIGPIO_PORT for the clients)\n");
+	fprintf (stderr, "-o     log to this file instead of stdout\n");
+}
+
+
+
+int main (int argc, char **argv)
+{
+struct pollfd fds[MAX_CLIENTS+1];
+struct sockaddr_in addr;
+int port = 8888;
+int i, n, lfd, fd, one = 1;
+
+
+	logfp = stdout;
+	while (--argc && **++argv=='-')
+	{
+		if (!strcmp(argv[0], "-p"))
+			port = nextargi;
+		else if (!strcmp(argv[0], "-o"))
+		{
+			logfp = fopen (nextargs, "w");
+			if (!logfp)
+			{
+				perror (argv[0]);
+				return 1;
+			}
+		}
+		else
+		{
+			prhelp();
+			return 0;
+		}
+	}
+
+	clock_gettime (CLOCK_MONOTONIC, &t0);
+
+	lfd = socket (AF_INET, SOCK_STREAM, 0);
+	setsockopt (lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof (one));
+	memset (&addr, 0, sizeof (addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons (port);
+	addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+	if (lfd < 0 || bind (lfd, (struct sockaddr*)&addr, sizeof (addr)) || listen (lfd, 4))
+	{
+		perror ("mockpigpiod");
+		return 1;
+	}
+	fprintf (stderr, "mockpigpiod listening on port %d\n", port);
+
+	fds[0].fd = lfd;
+	fds[0].events = POLLIN;
+	n = 1;
+
+	for (;;)
+	{
+		if (poll (fds, n, -1) < 0) break;
+
+		for (i=n-1; i>0; i--)
+			if (fds[i].revents && serve (fds[i].fd) < 0)
+			{
+				close (fds[i].fd);
+				fds[i] = fds[--n];
+			}
+
+		if (fds[0].revents & POLLIN)
+		{
+			fd = accept (lfd, NULL, NULL);
+			if (fd < 0) continue;
+			if (n > MAX_CLIENTS)
+			{
+				close (fd);
+				continue;
+			}
+			setsockopt (fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof (one));
+			fds[n].fd = fd;
+			fds[n].events = POLLIN;
+			fds[n].revents = 0;
+			n++;
+		}
+	}
+
+	return 0;
+}
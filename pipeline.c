@@ -0,0 +1,337 @@
+/*************************************************
+
+	pipeline.c
+
+	Producer/consumer pipeline between the camera
+	stream and the file writers. Frames travel
+	through a bounded multi-producer/multi-consumer
+	ring (D. Vyukov's sequence-number design), so
+	that neither side takes a lock to pass a frame.
+	Semaphores are only used to put idle threads to
+	sleep.
+
+**************************************************/
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <time.h>
+#include <arv.h>
+
+#include "acquire.h"
+#include "camera.h"
+#include "pipeline.h"
+#include "trace.h"
+
+
+typedef struct
+{
+	ArvBuffer *buffer;			/* NULL tells a writer thread to quit */
+	char fname[1024];
+	framemeta meta;
+} frame_job;
+
+typedef struct
+{
+	atomic_size_t seq;
+	frame_job job;
+} ring_cell;
+
+struct pipeline
+{
+	ring_cell *cells;
+	size_t mask;				/* Ring size minus one, ring size is a power of two */
+	atomic_size_t head;			/* Next slot to enqueue */
+	atomic_size_t tail;			/* Next slot to dequeue */
+
+	sem_t items;				/* Frames waiting in the ring */
+	sem_t slots;				/* Frames that may still be handed over: one is taken
+									   per frame and given back once its buffer is back
+									   in the stream, so queued and saving frames count */
+
+	camsession *cs;
+	pipe_savefunc save;
+	int policy;
+	int n_writers;
+	pthread_t *writers;
+
+	atomic_ulong written;		/* Updated by the writers, the rest only by the producer */
+	atomic_int depth;
+	pipe_stats stats;
+};
+
+
+
+/*********************************************************************/
+
+/* The ring itself. Each cell carries a sequence number that tells whether
+	it is free for the producer at position pos (seq == pos) or holds data
+	for the consumer at position pos (seq == pos+1). Both return 0 on success
+	and -1 if the ring is full or empty, respectively.
+*/
+
+static int ring_enqueue (pipeline *p, const frame_job *job)
+{
+ring_cell *cell;
+size_t pos, seq;
+intptr_t dif;
+
+
+	pos = atomic_load_explicit (&p->head, memory_order_relaxed);
+	for (;;)
+	{
+		cell = &p->cells[pos & p->mask];
+		seq = atomic_load_explicit (&cell->seq, memory_order_acquire);
+		dif = (intptr_t)seq - (intptr_t)pos;
+		if (dif == 0)
+		{
+			if (atomic_compare_exchange_weak_explicit (&p->head, &pos, pos+1,
+					memory_order_relaxed, memory_order_relaxed))
+				break;
+		}
+		else if (dif < 0)
+			return -1;
+		else
+			pos = atomic_load_explicit (&p->head, memory_order_relaxed);
+	}
+
+	cell->job = *job;
+	atomic_store_explicit (&cell->seq, pos+1, memory_order_release);
+	return 0;
+}
+
+
+static int ring_dequeue (pipeline *p, frame_job *job)
+{
+ring_cell *cell;
+size_t pos, seq;
+intptr_t dif;
+
+
+	pos = atomic_load_explicit (&p->tail, memory_order_relaxed);
+	for (;;)
+	{
+		cell = &p->cells[pos & p->mask];
+		seq = atomic_load_explicit (&cell->seq, memory_order_acquire);
+		dif = (intptr_t)seq - (intptr_t)(pos+1);
+		if (dif == 0)
+		{
+			if (atomic_compare_exchange_weak_explicit (&p->tail, &pos, pos+1,
+					memory_order_relaxed, memory_order_relaxed))
+				break;
+		}
+		else if (dif < 0)
+			return -1;
+		else
+			pos = atomic_load_explicit (&p->tail, memory_order_relaxed);
+	}
+
+	*job = cell->job;
+	atomic_store_explicit (&cell->seq, pos + p->mask + 1, memory_order_release);
+	return 0;
+}
+
+
+
+/*********************************************************************/
+
+
+static double elapsed (struct timespec *t0, struct timespec *t1)
+{
+	return (t1->tv_sec - t0->tv_sec) + 1e-9*(t1->tv_nsec - t0->tv_nsec);
+}
+
+
+
+/* Writer thread: take frames from the ring, save them, give the buffer
+	back to the camera stream. A job without buffer ends the thread. */
+
+static void *writer_thread (void *arg)
+{
+pipeline *p = (pipeline*)arg;
+frame_job job;
+
+
+	trace_thread_name ("writer");
+	for (;;)
+	{
+		sem_wait (&p->items);
+		while (ring_dequeue (p, &job) < 0)		/* Cannot fail for long, we hold an item */
+			;
+		atomic_fetch_sub (&p->depth, 1);
+
+		if (!job.buffer)
+		{
+			sem_post (&p->slots);
+			break;
+		}
+
+		p->save (job.buffer, job.fname, &job.meta);
+		cam_requeue (p->cs, job.buffer);
+		atomic_fetch_add (&p->written, 1);
+		sem_post (&p->slots);
+	}
+
+	return NULL;
+}
+
+
+
+/* Start n_writers writer threads behind a ring of (at least) depth slots.
+	Frames are saved with save() and then returned to the stream of cs.
+	At most depth frames are in the pipeline at a time, whether queued or
+	being saved, since a slot is only freed once the frame's buffer is
+	back in the stream. So a pool of depth + 1 buffers, one for the frame
+	being captured, never runs dry, however many writers there are.
+*/
+
+pipeline *pipe_start (camsession *cs, int n_writers, int depth, int policy, pipe_savefunc save)
+{
+pipeline *p;
+size_t size, i;
+int n;
+
+
+	if (n_writers < 1) n_writers = 1;
+	if (depth < 1) depth = 1;
+	for (size=1; size < (size_t)depth; size <<= 1)
+		;
+
+	p = calloc (1, sizeof (pipeline));
+	if (!p) return NULL;
+	p->cells = calloc (size, sizeof (ring_cell));
+	p->writers = calloc (n_writers, sizeof (pthread_t));
+	if (!p->cells || !p->writers)
+	{
+		free (p->cells); free (p->writers); free (p);
+		return NULL;
+	}
+
+	p->mask = size-1;
+	for (i=0; i<size; i++)
+		atomic_init (&p->cells[i].seq, i);
+	atomic_init (&p->head, 0);
+	atomic_init (&p->tail, 0);
+	atomic_init (&p->written, 0);
+	atomic_init (&p->depth, 0);
+	sem_init (&p->items, 0, 0);
+	sem_init (&p->slots, 0, (unsigned)depth);
+
+	p->cs = cs;
+	p->save = save;
+	p->policy = policy;
+
+	for (n=0; n<n_writers; n++)
+	{
+		if (pthread_create (&p->writers[n], NULL, writer_thread, p))
+		{
+			dp (0, "Could not start writer thread %d\n", n);
+			break;
+		}
+	}
+	p->n_writers = n;
+	if (n == 0)
+	{
+		pipe_finish (p, NULL);
+		return NULL;
+	}
+
+	dp (2, "Pipeline started with %d writer(s) and %d slots\n", n, depth);
+	return p;
+}
+
+
+
+/* Hand a frame and its metadata (may be NULL) to the writers. Returns 0
+	if it was queued and 1 if the ring was full and the frame was dropped
+	(PIPE_DROP policy only). A dropped buffer goes straight back to the
+	camera stream. A NULL buffer is a stop request for one writer thread
+	and is never dropped.
+*/
+
+int pipe_submit (pipeline *p, ArvBuffer *buffer, const char *fname, const framemeta *meta)
+{
+frame_job job;
+struct timespec t0, t1;
+int d;
+
+
+	if (sem_trywait (&p->slots) < 0)
+	{
+		if (buffer && p->policy == PIPE_DROP)
+		{
+			p->stats.submitted++;
+			p->stats.dropped++;
+			dp (1, "Pipeline full, frame %s dropped\n", fname);
+			cam_requeue (p->cs, buffer);
+			return 1;
+		}
+		clock_gettime (CLOCK_MONOTONIC, &t0);
+		sem_wait (&p->slots);
+		clock_gettime (CLOCK_MONOTONIC, &t1);
+		if (buffer)
+		{
+			p->stats.stalls++;
+			p->stats.stall_time += elapsed (&t0, &t1);
+		}
+	}
+
+	job.buffer = buffer;
+	if (meta)
+		job.meta = *meta;
+	else
+		framemeta_init (&job.meta);
+	job.fname[0] = 0;
+	if (fname)
+	{
+		strncpy (job.fname, fname, sizeof (job.fname)-1);
+		job.fname[sizeof (job.fname)-1] = 0;
+	}
+
+	while (ring_enqueue (p, &job) < 0)		/* Cannot fail for long, we hold a slot */
+		;
+	d = atomic_fetch_add (&p->depth, 1) + 1;
+	if (d > p->stats.max_depth) p->stats.max_depth = d;
+	TRACE_COUNTER (1, "queue", d);
+	sem_post (&p->items);
+
+	if (buffer) p->stats.submitted++;
+	return 0;
+}
+
+
+
+void pipe_get_stats (pipeline *p, pipe_stats *stats)
+{
+	*stats = p->stats;
+	stats->written = atomic_load (&p->written);
+}
+
+
+
+/* Wait until all queued frames are written, stop the writer threads and
+	free the pipeline. The final statistics go to stats (if not NULL). */
+
+void pipe_finish (pipeline *p, pipe_stats *stats)
+{
+int n;
+
+
+	for (n=0; n<p->n_writers; n++)
+		pipe_submit (p, NULL, NULL, NULL);
+	for (n=0; n<p->n_writers; n++)
+		pthread_join (p->writers[n], NULL);
+
+	if (stats) pipe_get_stats (p, stats);
+
+	sem_destroy (&p->items);
+	sem_destroy (&p->slots);
+	free (p->cells);
+	free (p->writers);
+	free (p);
+}
@@ -0,0 +1,44 @@
+#ifndef __PIPELINE_H
+#define __PIPELINE_H
+
+#include <arv.h>
+
+#include "camera.h"
+#include "framemeta.h"
+
+
+/* Acquisition -> encode/write pipeline. The acquisition thread hands
+	filled stream buffers to a bounded lock-free ring, from which a number
+	of writer threads take them, save them, and push them back to the
+	camera stream. When the pipeline holds as many frames as it has slots,
+	queued or being saved, the producer either waits (PIPE_BLOCK) or gives
+	the frame back unsaved (PIPE_DROP). Both cases are counted, so that a
+	slow disk shows up in the statistics.
+*/
+
+#define PIPE_BLOCK		0
+#define PIPE_DROP		1
+
+
+typedef void (*pipe_savefunc)(ArvBuffer *buffer, const char *fname, const framemeta *meta);
+
+typedef struct
+{
+	unsigned long submitted;	/* Frames handed to pipe_submit() */
+	unsigned long written;		/* Frames saved by the writer threads */
+	unsigned long dropped;		/* Frames discarded because the ring was full */
+	unsigned long stalls;		/* Times the producer had to wait for a free slot */
+	double stall_time;			/* Total producer waiting time in seconds */
+	int max_depth;				/* Highest ring occupancy seen */
+} pipe_stats;
+
+typedef struct pipeline pipeline;
+
+
+pipeline *pipe_start (camsession *cs, int n_writers, int depth, int policy, pipe_savefunc save);
+int pipe_submit (pipeline *p, ArvBuffer *buffer, const char *fname, const framemeta *meta);
+void pipe_get_stats (pipeline *p, pipe_stats *stats);
+void pipe_finish (pipeline *p, pipe_stats *stats);
+
+
+#endif
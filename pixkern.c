@@ -0,0 +1,1219 @@
+/* pixkern.c
+
+	Vectorized per-pixel kernels. Each kernel has a scalar version,
+	which is also used for the tail of the data that does not fill a
+	whole vector, and one vector version per instruction set. AVX2 is
+	selected at run time, so the binary still runs on older x86 CPUs.
+
+*/
+
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define PX_X86 1
+#endif
+
+#include "pixkern.h"
+
+
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define PX_BIG_ENDIAN 1
+#endif
+
+
+
+/*********************************************************************/
+
+/* Byte-swap n 16-bit samples from src to dst (big-endian output on our
+	little-endian hosts) and return the largest sample value, in one pass.
+	dst and src may be the same. */
+
+static unsigned short swap16_max_scalar (unsigned short *dst, const unsigned short *src, long n,
+			unsigned short maxval)
+{
+long i;
+unsigned short v;
+
+
+	for (i=0; i<n; i++)
+	{
+		v = src[i];
+		if (v > maxval) maxval = v;
+#ifdef PX_BIG_ENDIAN
+		dst[i] = v;
+#else
+		dst[i] = (unsigned short)((v << 8) | (v >> 8));
+#endif
+	}
+	return maxval;
+}
+
+
+#if defined(__ARM_NEON) && !defined(PX_BIG_ENDIAN)
+
+static unsigned short swap16_max_vec (unsigned short *dst, const unsigned short *src, long n)
+{
+uint16x8_t v, vmax;
+long i;
+
+
+	vmax = vdupq_n_u16 (0);
+	for (i=0; i+8<=n; i+=8)
+	{
+		v = vld1q_u16 (src+i);
+		vmax = vmaxq_u16 (vmax, v);
+		vst1q_u16 (dst+i, vreinterpretq_u16_u8 (vrev16q_u8 (vreinterpretq_u8_u16 (v))));
+	}
+#if defined(__aarch64__)
+	return swap16_max_scalar (dst+i, src+i, n-i, vmaxvq_u16 (vmax));
+#else
+	{
+		uint16x4_t m = vpmax_u16 (vget_low_u16 (vmax), vget_high_u16 (vmax));
+		m = vpmax_u16 (m, m);
+		m = vpmax_u16 (m, m);
+		return swap16_max_scalar (dst+i, src+i, n-i, vget_lane_u16 (m, 0));
+	}
+#endif
+}
+
+#elif defined(PX_X86)
+
+/* SSE2 has no unsigned 16-bit max, so the values are biased by 0x8000
+	and compared as signed numbers */
+
+static unsigned short hmax_epi16_biased (__m128i vmax)
+{
+unsigned short lanes[8], m;
+int k;
+
+	_mm_storeu_si128 ((__m128i*)lanes, vmax);
+	m = 0;
+	for (k=0; k<8; k++)
+		if ((unsigned short)(lanes[k] ^ 0x8000) > m) m = (unsigned short)(lanes[k] ^ 0x8000);
+	return m;
+}
+
+
+__attribute__((target("avx2")))
+static unsigned short swap16_max_avx2 (unsigned short *dst, const unsigned short *src, long n)
+{
+__m256i v, vmax;
+unsigned short lanes[16], m;
+long i;
+int k;
+
+
+	vmax = _mm256_setzero_si256 ();
+	for (i=0; i+16<=n; i+=16)
+	{
+		v = _mm256_loadu_si256 ((const __m256i*)(src+i));
+		vmax = _mm256_max_epu16 (vmax, v);
+		_mm256_storeu_si256 ((__m256i*)(dst+i),
+			_mm256_or_si256 (_mm256_slli_epi16 (v, 8), _mm256_srli_epi16 (v, 8)));
+	}
+	_mm256_storeu_si256 ((__m256i*)lanes, vmax);
+	m = 0;
+	for (k=0; k<16; k++)
+		if (lanes[k] > m) m = lanes[k];
+
+	return swap16_max_scalar (dst+i, src+i, n-i, m);
+}
+
+
+static unsigned short swap16_max_vec (unsigned short *dst, const unsigned short *src, long n)
+{
+__m128i v, vmax, bias;
+long i;
+
+
+	if (__builtin_cpu_supports ("avx2"))
+		return swap16_max_avx2 (dst, src, n);
+
+	bias = _mm_set1_epi16 ((short)0x8000);
+	vmax = _mm_set1_epi16 ((short)0x8000);			/* Biased zero */
+	for (i=0; i+8<=n; i+=8)
+	{
+		v = _mm_loadu_si128 ((const __m128i*)(src+i));
+		vmax = _mm_max_epi16 (vmax, _mm_xor_si128 (v, bias));
+		_mm_storeu_si128 ((__m128i*)(dst+i), _mm_or_si128 (_mm_slli_epi16 (v, 8), _mm_srli_epi16 (v, 8)));
+	}
+
+	return swap16_max_scalar (dst+i, src+i, n-i, hmax_epi16_biased (vmax));
+}
+
+#else
+
+static unsigned short swap16_max_vec (unsigned short *dst, const unsigned short *src, long n)
+{
+	return swap16_max_scalar (dst, src, n, 0);
+}
+
+#endif
+
+
+unsigned short px_swap16_max (unsigned short *dst, const unsigned short *src, long n)
+{
+	return swap16_max_vec (dst, src, n);
+}
+
+
+
+/*********************************************************************/
+
+/* Unpacking of 10- and 12-bit mono formats into 16-bit words (values
+	0-1023 or 0-4095). The vector versions shuffle the bytes of two or
+	four neighbouring pixels into each 16-bit lane and then shift and
+	mask per lane; they read up to 16 bytes at a time and leave the last
+	pixels of the frame to the scalar code. */
+
+int px_packing (unsigned int pixelformat)
+{
+	switch (pixelformat)
+	{
+		case PX_PFNC_MONO10P:		return PX_PACK_MONO10P;
+		case PX_PFNC_MONO12P:		return PX_PACK_MONO12P;
+		case PX_PFNC_MONO12PACKED:	return PX_PACK_MONO12PACKED;
+	}
+	return PX_PACK_NONE;
+}
+
+
+/* Bytes taken by n pixels */
+
+long px_packed_size (int packing, long n)
+{
+	switch (packing)
+	{
+		case PX_PACK_MONO10P:		return (n*10 + 7) / 8;
+		case PX_PACK_MONO12P:
+		case PX_PACK_MONO12PACKED:	return (n*12 + 7) / 8;
+	}
+	return 2*n;
+}
+
+
+/* Mono10p and Mono12p: the bits of all pixels in one little-endian
+	stream. Every pixel fits into the two bytes that hold its first bit. */
+
+static void unpack_lsb_scalar (unsigned short *dst, const unsigned char *src, long first, long n, int bits)
+{
+unsigned int mask;
+long i, bit;
+
+
+	mask = (1u << bits) - 1;
+	for (i=first; i<n; i++)
+	{
+		bit = i * bits;
+		dst[i] = (unsigned short)(((src[bit >> 3] | (src[(bit >> 3) + 1] << 8)) >> (bit & 7)) & mask);
+	}
+}
+
+
+static void unpack12packed_scalar (unsigned short *dst, const unsigned char *src, long first, long n)
+{
+const unsigned char *p;
+long i;
+
+
+	for (i=first; i<n; i++)
+	{
+		p = src + 3*(i >> 1);
+		if (i & 1)
+			dst[i] = (unsigned short)((p[2] << 4) | (p[1] >> 4));
+		else
+			dst[i] = (unsigned short)((p[0] << 4) | (p[1] & 0x0f));
+	}
+}
+
+
+#if defined(__ARM_NEON) && !defined(PX_BIG_ENDIAN)
+
+/* The 12-bit layouts come in 3-byte groups, which vld3 splits into
+	lanes of first, middle and last bytes */
+
+static long unpack12_vec (unsigned short *dst, const unsigned char *src, long n, int gige)
+{
+uint8x8x3_t b;
+uint16x8x2_t px;
+uint8x8_t lo, hi;
+long i;
+
+
+	for (i=0; i+16<=n; i+=16)
+	{
+		b = vld3_u8 (src + 3*(i >> 1));
+		lo = vand_u8 (b.val[1], vdup_n_u8 (0x0f));
+		hi = vshr_n_u8 (b.val[1], 4);
+		if (gige)
+		{
+			px.val[0] = vorrq_u16 (vshlq_n_u16 (vmovl_u8 (b.val[0]), 4), vmovl_u8 (lo));
+			px.val[1] = vorrq_u16 (vshlq_n_u16 (vmovl_u8 (b.val[2]), 4), vmovl_u8 (hi));
+		}
+		else
+		{
+			px.val[0] = vorrq_u16 (vmovl_u8 (b.val[0]), vshlq_n_u16 (vmovl_u8 (lo), 8));
+			px.val[1] = vorrq_u16 (vmovl_u8 (hi), vshlq_n_u16 (vmovl_u8 (b.val[2]), 4));
+		}
+		vst2q_u16 (dst+i, px);
+	}
+	return i;
+}
+
+
+static long unpack10p_vec (unsigned short *dst, const unsigned char *src, long n)
+{
+static const uint8_t idx_lo[8] = { 0, 1, 1, 2, 2, 3, 3, 4 };
+static const uint8_t idx_hi[8] = { 5, 6, 6, 7, 7, 8, 8, 9 };
+static const int16_t shifts[8] = { 0, -2, -4, -6, 0, -2, -4, -6 };
+uint8x8x2_t t;
+uint8x8_t ilo, ihi;
+int16x8_t sh;
+uint16x8_t w, mask;
+uint8x16_t v;
+long i;
+
+
+	ilo = vld1_u8 (idx_lo);
+	ihi = vld1_u8 (idx_hi);
+	sh = vld1q_s16 (shifts);
+	mask = vdupq_n_u16 (0x03ff);
+	for (i=0; i+16<=n; i+=8)
+	{
+		v = vld1q_u8 (src + 5*(i >> 2));
+		t.val[0] = vget_low_u8 (v);
+		t.val[1] = vget_high_u8 (v);
+		w = vreinterpretq_u16_u8 (vcombine_u8 (vtbl2_u8 (t, ilo), vtbl2_u8 (t, ihi)));
+		vst1q_u16 (dst+i, vandq_u16 (vshlq_u16 (w, sh), mask));
+	}
+	return i;
+}
+
+#elif defined(PX_X86)
+
+/* x86 needs SSSE3 for the byte shuffle; that is checked at run time.
+	Each lane receives the two bytes holding one pixel. */
+
+__attribute__((target("ssse3")))
+static long unpack12_vec (unsigned short *dst, const unsigned char *src, long n, int gige)
+{
+__m128i shuf, keep, shifted, w;
+long i;
+
+
+	if (gige)
+	{
+		shuf = _mm_setr_epi8 (1, 0, 1, 2, 4, 3, 4, 5, 7, 6, 7, 8, 10, 9, 10, 11);
+		keep = _mm_setr_epi16 (0x000f, 0, 0x000f, 0, 0x000f, 0, 0x000f, 0);
+		shifted = _mm_setr_epi16 (0x0ff0, -1, 0x0ff0, -1, 0x0ff0, -1, 0x0ff0, -1);
+	}
+	else
+	{
+		shuf = _mm_setr_epi8 (0, 1, 1, 2, 3, 4, 4, 5, 6, 7, 7, 8, 9, 10, 10, 11);
+		keep = _mm_setr_epi16 (0x0fff, 0, 0x0fff, 0, 0x0fff, 0, 0x0fff, 0);
+		shifted = _mm_setr_epi16 (0, -1, 0, -1, 0, -1, 0, -1);
+	}
+
+	for (i=0; i+16<=n; i+=8)
+	{
+		w = _mm_shuffle_epi8 (_mm_loadu_si128 ((const __m128i*)(src + 3*(i >> 1))), shuf);
+		_mm_storeu_si128 ((__m128i*)(dst+i), _mm_or_si128 (_mm_and_si128 (w, keep),
+			_mm_and_si128 (_mm_srli_epi16 (w, 4), shifted)));
+	}
+	return i;
+}
+
+
+/* SSE has no per-lane shift; shifting left by a multiplication and then
+	right by 6 for all lanes does the same and drops the unwanted bits */
+
+__attribute__((target("ssse3")))
+static long unpack10p_vec (unsigned short *dst, const unsigned char *src, long n)
+{
+__m128i shuf, mul, w;
+long i;
+
+
+	shuf = _mm_setr_epi8 (0, 1, 1, 2, 2, 3, 3, 4, 5, 6, 6, 7, 7, 8, 8, 9);
+	mul = _mm_setr_epi16 (64, 16, 4, 1, 64, 16, 4, 1);
+	for (i=0; i+16<=n; i+=8)
+	{
+		w = _mm_shuffle_epi8 (_mm_loadu_si128 ((const __m128i*)(src + 5*(i >> 2))), shuf);
+		_mm_storeu_si128 ((__m128i*)(dst+i), _mm_srli_epi16 (_mm_mullo_epi16 (w, mul), 6));
+	}
+	return i;
+}
+
+#endif
+
+
+/* Unpack n pixels of the given layout from src into dst */
+
+void px_unpack (unsigned short *dst, const void *src, long n, int packing)
+{
+const unsigned char *s = (const unsigned char*)src;
+long done = 0;
+
+
+#if (defined(__ARM_NEON) && !defined(PX_BIG_ENDIAN)) || defined(PX_X86)
+#if defined(PX_X86)
+	if (__builtin_cpu_supports ("ssse3"))
+#endif
+	{
+		if (packing == PX_PACK_MONO10P)
+			done = unpack10p_vec (dst, s, n);
+		else if (packing == PX_PACK_MONO12P || packing == PX_PACK_MONO12PACKED)
+			done = unpack12_vec (dst, s, n, packing == PX_PACK_MONO12PACKED);
+	}
+#endif
+
+	switch (packing)
+	{
+		case PX_PACK_MONO10P:
+			unpack_lsb_scalar (dst, s, done, n, 10);
+			break;
+		case PX_PACK_MONO12P:
+			unpack_lsb_scalar (dst, s, done, n, 12);
+			break;
+		case PX_PACK_MONO12PACKED:
+			unpack12packed_scalar (dst, s, done, n);
+			break;
+		default:
+			memcpy (dst, s, 2*n);
+			break;
+	}
+}
+
+
+
+/*********************************************************************/
+
+/* Binning averages n x n pixels, rounded to nearest. The 2 x 2 case of
+	16-bit data, by far the most common one, is vectorized: pairs of
+	neighbours are added into 32-bit lanes, so that full 16-bit values
+	cannot overflow. */
+
+static void bin16_row_scalar (unsigned short *dst, const unsigned short *src, long stride,
+			int first, int ow, int n)
+{
+unsigned long sum;
+int x, i, j;
+
+
+	for (x=first; x<ow; x++)
+	{
+		sum = 0;
+		for (j=0; j<n; j++)
+			for (i=0; i<n; i++)
+				sum += src[j*stride + x*n + i];
+		dst[x] = (unsigned short)((sum + n*n/2) / (n*n));
+	}
+}
+
+
+#if defined(__ARM_NEON)
+
+static int bin2x2_16_vec (unsigned short *dst, const unsigned short *a, const unsigned short *b, int ow)
+{
+uint32x4_t s0, s1;
+int x;
+
+
+	for (x=0; x+8<=ow; x+=8)
+	{
+		s0 = vaddq_u32 (vpaddlq_u16 (vld1q_u16 (a + 2*x)), vpaddlq_u16 (vld1q_u16 (b + 2*x)));
+		s1 = vaddq_u32 (vpaddlq_u16 (vld1q_u16 (a + 2*x + 8)), vpaddlq_u16 (vld1q_u16 (b + 2*x + 8)));
+		vst1q_u16 (dst + x, vcombine_u16 (vrshrn_n_u32 (s0, 2), vrshrn_n_u32 (s1, 2)));
+	}
+	return x;
+}
+
+#elif defined(PX_X86)
+
+/* Four 32-bit sums of 2 x 2 pixels from 8 pixels of each row */
+
+static __m128i sum2x2_epi32 (__m128i a, __m128i b)
+{
+__m128i lo = _mm_set1_epi32 (0xffff);
+
+	return _mm_add_epi32 (_mm_add_epi32 (_mm_and_si128 (a, lo), _mm_srli_epi32 (a, 16)),
+		_mm_add_epi32 (_mm_and_si128 (b, lo), _mm_srli_epi32 (b, 16)));
+}
+
+
+static int bin2x2_16_vec (unsigned short *dst, const unsigned short *a, const unsigned short *b, int ow)
+{
+__m128i s0, s1, round, bias32, bias16;
+int x;
+
+
+	round = _mm_set1_epi32 (2);
+	bias32 = _mm_set1_epi32 (0x8000);				/* packs_epi32 saturates signed */
+	bias16 = _mm_set1_epi16 ((short)0x8000);
+	for (x=0; x+8<=ow; x+=8)
+	{
+		s0 = sum2x2_epi32 (_mm_loadu_si128 ((const __m128i*)(a + 2*x)), _mm_loadu_si128 ((const __m128i*)(b + 2*x)));
+		s1 = sum2x2_epi32 (_mm_loadu_si128 ((const __m128i*)(a + 2*x + 8)), _mm_loadu_si128 ((const __m128i*)(b + 2*x + 8)));
+		s0 = _mm_sub_epi32 (_mm_srli_epi32 (_mm_add_epi32 (s0, round), 2), bias32);
+		s1 = _mm_sub_epi32 (_mm_srli_epi32 (_mm_add_epi32 (s1, round), 2), bias32);
+		_mm_storeu_si128 ((__m128i*)(dst + x), _mm_xor_si128 (_mm_packs_epi32 (s0, s1), bias16));
+	}
+	return x;
+}
+
+#else
+
+static int bin2x2_16_vec (unsigned short *dst, const unsigned short *a, const unsigned short *b, int ow)
+{
+	return 0;
+}
+
+#endif
+
+
+void px_bin16 (unsigned short *dst, const unsigned short *src, int width, int height, long stride, int n)
+{
+const unsigned short *row;
+int ow, oh, y, done;
+
+
+	ow = width / n;
+	oh = height / n;
+	for (y=0; y<oh; y++)
+	{
+		row = src + (long)y*n*stride;
+		done = (n == 2) ? bin2x2_16_vec (dst, row, row + stride, ow) : 0;
+		bin16_row_scalar (dst, row, stride, done, ow, n);
+		dst += ow;
+	}
+}
+
+
+void px_bin8 (unsigned char *dst, const unsigned char *src, int width, int height, long stride, int n)
+{
+const unsigned char *row;
+unsigned long sum;
+int ow, oh, x, y, i, j;
+
+
+	ow = width / n;
+	oh = height / n;
+	for (y=0; y<oh; y++)
+	{
+		row = src + (long)y*n*stride;
+		for (x=0; x<ow; x++)
+		{
+			sum = 0;
+			for (j=0; j<n; j++)
+				for (i=0; i<n; i++)
+					sum += row[j*stride + x*n + i];
+			*dst++ = (unsigned char)((sum + n*n/2) / (n*n));
+		}
+	}
+}
+
+
+/* Decimation is a strided copy and bound by memory, not arithmetic */
+
+void px_decimate (void *dst, const void *src, int width, int height, long stride, int bps, int n)
+{
+const unsigned char *s8;
+const unsigned short *s16;
+unsigned char *d8 = (unsigned char*)dst;
+unsigned short *d16 = (unsigned short*)dst;
+int ow, oh, x, y;
+
+
+	ow = width / n;
+	oh = height / n;
+	for (y=0; y<oh; y++)
+	{
+		if (bps == 2)
+		{
+			s16 = (const unsigned short*)src + (long)y*n*stride;
+			for (x=0; x<ow; x++)
+				*d16++ = s16[x*n];
+		}
+		else
+		{
+			s8 = (const unsigned char*)src + (long)y*n*stride*bps;
+			for (x=0; x<ow; x++)
+			{
+				memcpy (d8, s8 + (long)x*n*bps, bps);
+				d8 += bps;
+			}
+		}
+	}
+}
+
+
+
+/*********************************************************************/
+
+/* Frame accumulation: 8 or 16-bit frames are added into 32-bit sums, and
+	the sums are turned into a 16-bit (rounded quotient) or float result.
+	65536 16-bit frames fit into the sums. */
+
+static void acc16_scalar (unsigned int *acc, const unsigned short *src, long i, long n)
+{
+	for (; i<n; i++)
+		acc[i] += src[i];
+}
+
+
+static void acc8_scalar (unsigned int *acc, const unsigned char *src, long i, long n)
+{
+	for (; i<n; i++)
+		acc[i] += src[i];
+}
+
+
+#if defined(__ARM_NEON)
+
+static long acc16_vec (unsigned int *acc, const unsigned short *src, long n)
+{
+uint16x8_t v;
+long i;
+
+
+	for (i=0; i+8<=n; i+=8)
+	{
+		v = vld1q_u16 (src + i);
+		vst1q_u32 (acc + i, vaddw_u16 (vld1q_u32 (acc + i), vget_low_u16 (v)));
+		vst1q_u32 (acc + i + 4, vaddw_u16 (vld1q_u32 (acc + i + 4), vget_high_u16 (v)));
+	}
+	return i;
+}
+
+
+static long acc8_vec (unsigned int *acc, const unsigned char *src, long n)
+{
+uint16x8_t v;
+long i;
+
+
+	for (i=0; i+8<=n; i+=8)
+	{
+		v = vmovl_u8 (vld1_u8 (src + i));
+		vst1q_u32 (acc + i, vaddw_u16 (vld1q_u32 (acc + i), vget_low_u16 (v)));
+		vst1q_u32 (acc + i + 4, vaddw_u16 (vld1q_u32 (acc + i + 4), vget_high_u16 (v)));
+	}
+	return i;
+}
+
+
+static long finish16_shift_vec (unsigned short *dst, const unsigned int *acc, long n, int shift)
+{
+uint32x4_t a, b, round;
+int32x4_t sh;
+long i;
+
+
+	round = vdupq_n_u32 (shift ? 1u << (shift-1) : 0);
+	sh = vdupq_n_s32 (-shift);
+	for (i=0; i+8<=n; i+=8)
+	{
+		a = vshlq_u32 (vaddq_u32 (vld1q_u32 (acc + i), round), sh);
+		b = vshlq_u32 (vaddq_u32 (vld1q_u32 (acc + i + 4), round), sh);
+		vst1q_u16 (dst + i, vcombine_u16 (vqmovn_u32 (a), vqmovn_u32 (b)));
+	}
+	return i;
+}
+
+
+static long finish_float_vec (float *dst, const unsigned int *acc, long n, float factor)
+{
+float32x4_t f;
+long i;
+
+
+	f = vdupq_n_f32 (factor);
+	for (i=0; i+4<=n; i+=4)
+		vst1q_f32 (dst + i, vmulq_f32 (vcvtq_f32_u32 (vld1q_u32 (acc + i)), f));
+	return i;
+}
+
+#elif defined(PX_X86)
+
+static long acc16_vec (unsigned int *acc, const unsigned short *src, long n)
+{
+__m128i v, zero;
+long i;
+
+
+	zero = _mm_setzero_si128 ();
+	for (i=0; i+8<=n; i+=8)
+	{
+		v = _mm_loadu_si128 ((const __m128i*)(src + i));
+		_mm_storeu_si128 ((__m128i*)(acc + i),
+			_mm_add_epi32 (_mm_loadu_si128 ((const __m128i*)(acc + i)), _mm_unpacklo_epi16 (v, zero)));
+		_mm_storeu_si128 ((__m128i*)(acc + i + 4),
+			_mm_add_epi32 (_mm_loadu_si128 ((const __m128i*)(acc + i + 4)), _mm_unpackhi_epi16 (v, zero)));
+	}
+	return i;
+}
+
+
+static long acc8_vec (unsigned int *acc, const unsigned char *src, long n)
+{
+__m128i v, w, zero;
+long i;
+
+
+	zero = _mm_setzero_si128 ();
+	for (i=0; i+16<=n; i+=16)
+	{
+		v = _mm_loadu_si128 ((const __m128i*)(src + i));
+		w = _mm_unpacklo_epi8 (v, zero);
+		_mm_storeu_si128 ((__m128i*)(acc + i),
+			_mm_add_epi32 (_mm_loadu_si128 ((const __m128i*)(acc + i)), _mm_unpacklo_epi16 (w, zero)));
+		_mm_storeu_si128 ((__m128i*)(acc + i + 4),
+			_mm_add_epi32 (_mm_loadu_si128 ((const __m128i*)(acc + i + 4)), _mm_unpackhi_epi16 (w, zero)));
+		w = _mm_unpackhi_epi8 (v, zero);
+		_mm_storeu_si128 ((__m128i*)(acc + i + 8),
+			_mm_add_epi32 (_mm_loadu_si128 ((const __m128i*)(acc + i + 8)), _mm_unpacklo_epi16 (w, zero)));
+		_mm_storeu_si128 ((__m128i*)(acc + i + 12),
+			_mm_add_epi32 (_mm_loadu_si128 ((const __m128i*)(acc + i + 12)), _mm_unpackhi_epi16 (w, zero)));
+	}
+	return i;
+}
+
+
+/* Saturation to 16 bits with SSE2's signed pack, as in bin2x2_16_vec.
+	Sums of 2^31 and more (only possible without a shift) are left to the
+	scalar code. */
+
+static long finish16_shift_vec (unsigned short *dst, const unsigned int *acc, long n, int shift)
+{
+__m128i a, b, round, bias32, bias16;
+__m128i sh;
+long i;
+
+
+	if (shift == 0) return 0;
+	round = _mm_set1_epi32 (1 << (shift-1));
+	sh = _mm_cvtsi32_si128 (shift);
+	bias32 = _mm_set1_epi32 (0x8000);
+	bias16 = _mm_set1_epi16 ((short)0x8000);
+	for (i=0; i+8<=n; i+=8)
+	{
+		a = _mm_srl_epi32 (_mm_add_epi32 (_mm_loadu_si128 ((const __m128i*)(acc + i)), round), sh);
+		b = _mm_srl_epi32 (_mm_add_epi32 (_mm_loadu_si128 ((const __m128i*)(acc + i + 4)), round), sh);
+		a = _mm_sub_epi32 (a, bias32);
+		b = _mm_sub_epi32 (b, bias32);
+		_mm_storeu_si128 ((__m128i*)(dst + i), _mm_xor_si128 (_mm_packs_epi32 (a, b), bias16));
+	}
+	return i;
+}
+
+
+/* cvtepi32_ps is signed: sums up to 2^31, i.e. 32768 16-bit frames */
+
+static long finish_float_vec (float *dst, const unsigned int *acc, long n, float factor)
+{
+__m128 f;
+long i;
+
+
+	f = _mm_set1_ps (factor);
+	for (i=0; i+4<=n; i+=4)
+		_mm_storeu_ps (dst + i, _mm_mul_ps (_mm_cvtepi32_ps (_mm_loadu_si128 ((const __m128i*)(acc + i))), f));
+	return i;
+}
+
+#else
+
+static long acc16_vec (unsigned int *acc, const unsigned short *src, long n) { return 0; }
+static long acc8_vec (unsigned int *acc, const unsigned char *src, long n) { return 0; }
+static long finish16_shift_vec (unsigned short *dst, const unsigned int *acc, long n, int shift) { return 0; }
+static long finish_float_vec (float *dst, const unsigned int *acc, long n, float factor) { return 0; }
+
+#endif
+
+
+void px_acc16 (unsigned int *acc, const unsigned short *src, long n)
+{
+	acc16_scalar (acc, src, acc16_vec (acc, src, n), n);
+}
+
+
+void px_acc8 (unsigned int *acc, const unsigned char *src, long n)
+{
+	acc8_scalar (acc, src, acc8_vec (acc, src, n), n);
+}
+
+
+/* dst = acc / divisor, rounded and limited to 65535. Powers of two are
+	shifts and vectorized; other divisors take the scalar division. */
+
+void px_acc_finish16 (unsigned short *dst, const unsigned int *acc, long n, unsigned int divisor)
+{
+unsigned long long q;
+long i;
+int shift;
+
+
+	if (divisor == 0) divisor = 1;
+	i = 0;
+	if (!(divisor & (divisor - 1)))
+	{
+		shift = __builtin_ctz (divisor);
+		i = finish16_shift_vec (dst, acc, n, shift);
+	}
+	for (; i<n; i++)
+	{
+		q = ((unsigned long long)acc[i] + divisor/2) / divisor;
+		dst[i] = (unsigned short)(q > 65535 ? 65535 : q);
+	}
+}
+
+
+/* dst = acc * factor */
+
+void px_acc_finish_float (float *dst, const unsigned int *acc, long n, float factor)
+{
+long i;
+
+
+	for (i=finish_float_vec (dst, acc, n, factor); i<n; i++)
+		dst[i] = (float)acc[i] * factor;
+}
+
+
+
+/*********************************************************************/
+
+/* Dark and flat correction: dst = (src - dark) * gain, with the difference
+	clipped at 0, gain in units of 1/PX_GAIN_ONE, the result rounded and
+	limited to 65535. dark or gain may be NULL. dst may be src. */
+
+static void calibrate16_scalar (unsigned short *dst, const unsigned short *src, const unsigned short *dark,
+			const unsigned short *gain, long i, long n)
+{
+unsigned int v;
+
+
+	for (; i<n; i++)
+	{
+		v = src[i];
+		if (dark) v = (v > dark[i]) ? v - dark[i] : 0;
+		if (gain)
+		{
+			v = (v * gain[i] + (PX_GAIN_ONE >> 1)) >> PX_GAIN_SHIFT;
+			if (v > 65535) v = 65535;
+		}
+		dst[i] = (unsigned short)v;
+	}
+}
+
+
+#if defined(__ARM_NEON)
+
+static long calibrate16_vec (unsigned short *dst, const unsigned short *src, const unsigned short *dark,
+			const unsigned short *gain, long n)
+{
+uint16x8_t v, g;
+long i;
+
+
+	for (i=0; i+8<=n; i+=8)
+	{
+		v = vld1q_u16 (src + i);
+		if (dark) v = vqsubq_u16 (v, vld1q_u16 (dark + i));
+		if (gain)
+		{
+			g = vld1q_u16 (gain + i);
+			v = vcombine_u16 (vqrshrn_n_u32 (vmull_u16 (vget_low_u16 (v), vget_low_u16 (g)), PX_GAIN_SHIFT),
+				vqrshrn_n_u32 (vmull_u16 (vget_high_u16 (v), vget_high_u16 (g)), PX_GAIN_SHIFT));
+		}
+		vst1q_u16 (dst + i, v);
+	}
+	return i;
+}
+
+#elif defined(PX_X86)
+
+/* The 32-bit products are put together from mullo/mulhi; the largest,
+	65535 * 65535 plus rounding, still fits unsigned 32 bits. */
+
+static long calibrate16_vec (unsigned short *dst, const unsigned short *src, const unsigned short *dark,
+			const unsigned short *gain, long n)
+{
+__m128i v, g, lo, hi, p0, p1, round, bias32, bias16;
+long i;
+
+
+	round = _mm_set1_epi32 (PX_GAIN_ONE >> 1);
+	bias32 = _mm_set1_epi32 (0x8000);
+	bias16 = _mm_set1_epi16 ((short)0x8000);
+	for (i=0; i+8<=n; i+=8)
+	{
+		v = _mm_loadu_si128 ((const __m128i*)(src + i));
+		if (dark) v = _mm_subs_epu16 (v, _mm_loadu_si128 ((const __m128i*)(dark + i)));
+		if (gain)
+		{
+			g = _mm_loadu_si128 ((const __m128i*)(gain + i));
+			lo = _mm_mullo_epi16 (v, g);
+			hi = _mm_mulhi_epu16 (v, g);
+			p0 = _mm_srli_epi32 (_mm_add_epi32 (_mm_unpacklo_epi16 (lo, hi), round), PX_GAIN_SHIFT);
+			p1 = _mm_srli_epi32 (_mm_add_epi32 (_mm_unpackhi_epi16 (lo, hi), round), PX_GAIN_SHIFT);
+			v = _mm_xor_si128 (_mm_packs_epi32 (_mm_sub_epi32 (p0, bias32), _mm_sub_epi32 (p1, bias32)), bias16);
+		}
+		_mm_storeu_si128 ((__m128i*)(dst + i), v);
+	}
+	return i;
+}
+
+#else
+
+static long calibrate16_vec (unsigned short *dst, const unsigned short *src, const unsigned short *dark,
+			const unsigned short *gain, long n)
+{
+	return 0;
+}
+
+#endif
+
+
+void px_calibrate16 (unsigned short *dst, const unsigned short *src, const unsigned short *dark,
+			const unsigned short *gain, long n)
+{
+	calibrate16_scalar (dst, src, dark, gain, calibrate16_vec (dst, src, dark, gain, n), n);
+}
+
+
+
+/*********************************************************************/
+
+/* Frame statistics: sum, sum of squares, minimum and maximum of n pixels,
+	added to what is in m, and (if hist is not NULL) a histogram of
+	value >> shift, with everything above the range in the last bin. The
+	moments are taken with vector code, the histogram right after from the
+	same block while it is still in the cache, so the pixels are read from
+	memory once. */
+
+#define PX_STATS_BLOCK		2048		/* Also keeps the 32-bit vector sums from overflowing */
+
+
+static void stats16_scalar (const unsigned short *src, long i, long n, px_moments *m)
+{
+unsigned int v;
+
+
+	for (; i<n; i++)
+	{
+		v = src[i];
+		m->sum += v;
+		m->sumsq += (unsigned long long)v * v;
+		if (v < m->min) m->min = v;
+		if (v > m->max) m->max = v;
+	}
+}
+
+
+#if defined(__ARM_NEON)
+
+static long stats16_vec (const unsigned short *src, long n, px_moments *m)
+{
+uint32x4_t sum;
+uint64x2_t sq;
+uint16x8_t v, lo, hi;
+unsigned short t[8];
+long i;
+int k;
+
+
+	if (n < 8) return 0;
+	sum = vdupq_n_u32 (0);
+	sq = vdupq_n_u64 (0);
+	lo = vdupq_n_u16 (0xffff);
+	hi = vdupq_n_u16 (0);
+	for (i=0; i+8<=n; i+=8)
+	{
+		v = vld1q_u16 (src + i);
+		sum = vpadalq_u16 (sum, v);
+		sq = vpadalq_u32 (sq, vmull_u16 (vget_low_u16 (v), vget_low_u16 (v)));
+		sq = vpadalq_u32 (sq, vmull_u16 (vget_high_u16 (v), vget_high_u16 (v)));
+		lo = vminq_u16 (lo, v);
+		hi = vmaxq_u16 (hi, v);
+	}
+
+	m->sum += (unsigned long long)vgetq_lane_u32 (sum, 0) + vgetq_lane_u32 (sum, 1)
+		+ vgetq_lane_u32 (sum, 2) + vgetq_lane_u32 (sum, 3);
+	m->sumsq += vgetq_lane_u64 (sq, 0) + vgetq_lane_u64 (sq, 1);
+	vst1q_u16 (t, lo);
+	for (k=0; k<8; k++)
+		if (t[k] < m->min) m->min = t[k];
+	vst1q_u16 (t, hi);
+	for (k=0; k<8; k++)
+		if (t[k] > m->max) m->max = t[k];
+	return i;
+}
+
+#elif defined(PX_X86)
+
+/* SSE2 has no unsigned 16-bit min/max: the values are offset by 0x8000
+	and compared signed */
+
+static long stats16_vec (const unsigned short *src, long n, px_moments *m)
+{
+__m128i v, v0, v1, sum, sq, lo, hi, bias, zero;
+unsigned long long s[2];
+unsigned int w[4];
+short t[8];
+long i;
+int k;
+
+
+	if (n < 8) return 0;
+	zero = _mm_setzero_si128 ();
+	bias = _mm_set1_epi16 ((short)0x8000);
+	sum = sq = zero;
+	lo = _mm_set1_epi16 (0x7fff);
+	hi = _mm_set1_epi16 ((short)0x8000);
+	for (i=0; i+8<=n; i+=8)
+	{
+		v = _mm_loadu_si128 ((const __m128i*)(src + i));
+		v0 = _mm_unpacklo_epi16 (v, zero);
+		v1 = _mm_unpackhi_epi16 (v, zero);
+		sum = _mm_add_epi32 (sum, _mm_add_epi32 (v0, v1));
+		sq = _mm_add_epi64 (sq, _mm_add_epi64 (_mm_mul_epu32 (v0, v0), _mm_mul_epu32 (v1, v1)));
+		v0 = _mm_srli_epi64 (v0, 32);
+		v1 = _mm_srli_epi64 (v1, 32);
+		sq = _mm_add_epi64 (sq, _mm_add_epi64 (_mm_mul_epu32 (v0, v0), _mm_mul_epu32 (v1, v1)));
+		v = _mm_xor_si128 (v, bias);
+		lo = _mm_min_epi16 (lo, v);
+		hi = _mm_max_epi16 (hi, v);
+	}
+
+	_mm_storeu_si128 ((__m128i*)w, sum);
+	m->sum += (unsigned long long)w[0] + w[1] + w[2] + w[3];
+	_mm_storeu_si128 ((__m128i*)s, sq);
+	m->sumsq += s[0] + s[1];
+	_mm_storeu_si128 ((__m128i*)t, _mm_xor_si128 (lo, bias));
+	for (k=0; k<8; k++)
+		if ((unsigned short)t[k] < m->min) m->min = (unsigned short)t[k];
+	_mm_storeu_si128 ((__m128i*)t, _mm_xor_si128 (hi, bias));
+	for (k=0; k<8; k++)
+		if ((unsigned short)t[k] > m->max) m->max = (unsigned short)t[k];
+	return i;
+}
+
+#else
+
+static long stats16_vec (const unsigned short *src, long n, px_moments *m)
+{
+	return 0;
+}
+
+#endif
+
+
+/* Neighbouring pixels mostly fall into the same bin; counting them into
+	four histograms in turn keeps the increments from waiting on each other */
+
+static void hist16 (unsigned int h[4][PX_HIST_BINS], const unsigned short *src, long n, int shift)
+{
+unsigned int v0, v1, v2, v3;
+long i;
+
+
+	for (i=0; i+4<=n; i+=4)
+	{
+		v0 = src[i] >> shift;
+		v1 = src[i+1] >> shift;
+		v2 = src[i+2] >> shift;
+		v3 = src[i+3] >> shift;
+		h[0][v0 < PX_HIST_BINS ? v0 : PX_HIST_BINS-1]++;
+		h[1][v1 < PX_HIST_BINS ? v1 : PX_HIST_BINS-1]++;
+		h[2][v2 < PX_HIST_BINS ? v2 : PX_HIST_BINS-1]++;
+		h[3][v3 < PX_HIST_BINS ? v3 : PX_HIST_BINS-1]++;
+	}
+	for (; i<n; i++)
+	{
+		v0 = src[i] >> shift;
+		h[0][v0 < PX_HIST_BINS ? v0 : PX_HIST_BINS-1]++;
+	}
+}
+
+
+void px_stats16 (const unsigned short *src, long n, int shift, unsigned int *hist, px_moments *m)
+{
+unsigned int h[4][PX_HIST_BINS];
+long b, k;
+int i;
+
+
+	if (hist)
+		memset (h, 0, sizeof (h));
+	for (b=0; b<n; b+=PX_STATS_BLOCK)
+	{
+		k = (n - b < PX_STATS_BLOCK) ? n - b : PX_STATS_BLOCK;
+		stats16_scalar (src + b, stats16_vec (src + b, k, m), k, m);
+		if (hist)
+			hist16 (h, src + b, k, shift);
+	}
+	if (hist)
+		for (i=0; i<PX_HIST_BINS; i++)
+			hist[i] += h[0][i] + h[1][i] + h[2][i] + h[3][i];
+}
+
+
+void px_stats8 (const unsigned char *src, long n, unsigned int *hist, px_moments *m)
+{
+unsigned long long sum, sumsq;
+unsigned int v;
+long i;
+
+
+	sum = sumsq = 0;
+	for (i=0; i<n; i++)
+	{
+		v = src[i];
+		sum += v;
+		sumsq += v * v;
+		if (v < m->min) m->min = v;
+		if (v > m->max) m->max = v;
+		if (hist) hist[v]++;
+	}
+	m->sum += sum;
+	m->sumsq += sumsq;
+}
+
+
+
+/*********************************************************************/
+
+/* Residuals for lossless coding: dst = zigzag (src - ref), the difference
+	taken modulo 2^16 and folded so that small differences of either sign
+	become small numbers (0, -1, 1, -2, ... to 0, 1, 2, 3, ...). The inverse
+	adds the unfolded residual back to ref, so ref + residual gives src
+	bit for bit whatever the values. */
+
+static void residual16_scalar (unsigned short *dst, const unsigned short *src, const unsigned short *ref,
+			long i, long n)
+{
+short d;
+
+
+	for (; i<n; i++)
+	{
+		d = (short)(src[i] - ref[i]);
+		dst[i] = (unsigned short)(((unsigned)d << 1) ^ (unsigned)(d >> 15));	/* No shift of a negative value */
+	}
+}
+
+
+static void unresidual16_scalar (unsigned short *dst, const unsigned short *res, const unsigned short *ref,
+			long i, long n)
+{
+unsigned short z;
+
+
+	for (; i<n; i++)
+	{
+		z = res[i];
+		dst[i] = (unsigned short)(ref[i] + ((z >> 1) ^ -(z & 1)));
+	}
+}
+
+
+#if defined(__ARM_NEON)
+
+static long residual16_vec (unsigned short *dst, const unsigned short *src, const unsigned short *ref, long n)
+{
+int16x8_t d;
+long i;
+
+
+	for (i=0; i+8<=n; i+=8)
+	{
+		d = vreinterpretq_s16_u16 (vsubq_u16 (vld1q_u16 (src + i), vld1q_u16 (ref + i)));
+		vst1q_u16 (dst + i, vreinterpretq_u16_s16 (veorq_s16 (vshlq_n_s16 (d, 1), vshrq_n_s16 (d, 15))));
+	}
+	return i;
+}
+
+
+static long unresidual16_vec (unsigned short *dst, const unsigned short *res, const unsigned short *ref, long n)
+{
+uint16x8_t z, one;
+long i;
+
+
+	one = vdupq_n_u16 (1);
+	for (i=0; i+8<=n; i+=8)
+	{
+		z = vld1q_u16 (res + i);
+		z = veorq_u16 (vshrq_n_u16 (z, 1),
+			vreinterpretq_u16_s16 (vnegq_s16 (vreinterpretq_s16_u16 (vandq_u16 (z, one)))));
+		vst1q_u16 (dst + i, vaddq_u16 (vld1q_u16 (ref + i), z));
+	}
+	return i;
+}
+
+#elif defined(PX_X86)
+
+static long residual16_vec (unsigned short *dst, const unsigned short *src, const unsigned short *ref, long n)
+{
+__m128i d;
+long i;
+
+
+	for (i=0; i+8<=n; i+=8)
+	{
+		d = _mm_sub_epi16 (_mm_loadu_si128 ((const __m128i*)(src + i)), _mm_loadu_si128 ((const __m128i*)(ref + i)));
+		_mm_storeu_si128 ((__m128i*)(dst + i), _mm_xor_si128 (_mm_slli_epi16 (d, 1), _mm_srai_epi16 (d, 15)));
+	}
+	return i;
+}
+
+
+static long unresidual16_vec (unsigned short *dst, const unsigned short *res, const unsigned short *ref, long n)
+{
+__m128i z, one, zero;
+long i;
+
+
+	one = _mm_set1_epi16 (1);
+	zero = _mm_setzero_si128 ();
+	for (i=0; i+8<=n; i+=8)
+	{
+		z = _mm_loadu_si128 ((const __m128i*)(res + i));
+		z = _mm_xor_si128 (_mm_srli_epi16 (z, 1), _mm_sub_epi16 (zero, _mm_and_si128 (z, one)));
+		_mm_storeu_si128 ((__m128i*)(dst + i), _mm_add_epi16 (_mm_loadu_si128 ((const __m128i*)(ref + i)), z));
+	}
+	return i;
+}
+
+#else
+
+static long residual16_vec (unsigned short *dst, const unsigned short *src, const unsigned short *ref, long n)
+{
+	return 0;
+}
+
+
+static long unresidual16_vec (unsigned short *dst, const unsigned short *res, const unsigned short *ref, long n)
+{
+	return 0;
+}
+
+#endif
+
+
+void px_residual16 (unsigned short *dst, const unsigned short *src, const unsigned short *ref, long n)
+{
+	residual16_scalar (dst, src, ref, residual16_vec (dst, src, ref, n), n);
+}
+
+
+void px_unresidual16 (unsigned short *dst, const unsigned short *res, const unsigned short *ref, long n)
+{
+	unresidual16_scalar (dst, res, ref, unresidual16_vec (dst, res, ref, n), n);
+}
@@ -0,0 +1,84 @@
+#ifndef __PIXKERN_H
+#define __PIXKERN_H
+
+#include <stddef.h>
+
+
+/* Pixel kernels: simple per-pixel loops over whole frames, vectorized with
+	NEON on the Pi and SSE2/AVX2 on x86. Every kernel has a plain C fallback
+	that gives identical results. */
+
+unsigned short px_swap16_max (unsigned short *dst, const unsigned short *src, long n);
+
+
+/* Packed monochrome layouts. The GenICam codes are repeated here so that
+	tools without Aravis (rawconv) can tell them apart. */
+
+#define PX_PFNC_MONO8			0x01080001
+#define PX_PFNC_MONO16			0x01100007
+#define PX_PFNC_MONO10P			0x010a0046		/* 4 pixels in 5 bytes, LSB first */
+#define PX_PFNC_MONO12P			0x010c0047		/* 2 pixels in 3 bytes, LSB first */
+#define PX_PFNC_MONO12PACKED	0x010c0006		/* GigE Vision: 2 high bytes, low nibbles shared */
+
+#define PX_PACK_NONE			0
+#define PX_PACK_MONO10P			1
+#define PX_PACK_MONO12P			2
+#define PX_PACK_MONO12PACKED	3
+
+int px_packing (unsigned int pixelformat);
+long px_packed_size (int packing, long n);
+void px_unpack (unsigned short *dst, const void *src, long n, int packing);
+
+
+/* Software binning and decimation of a width x height image whose rows are
+	stride pixels apart. The result has (width/n) x (height/n) pixels. */
+
+void px_bin16 (unsigned short *dst, const unsigned short *src, int width, int height, long stride, int n);
+void px_bin8 (unsigned char *dst, const unsigned char *src, int width, int height, long stride, int n);
+void px_decimate (void *dst, const void *src, int width, int height, long stride, int bps, int n);
+
+
+/* Frame accumulation into 32-bit sums, and the sums as 16-bit quotients
+	or scaled floats */
+
+void px_acc16 (unsigned int *acc, const unsigned short *src, long n);
+void px_acc8 (unsigned int *acc, const unsigned char *src, long n);
+void px_acc_finish16 (unsigned short *dst, const unsigned int *acc, long n, unsigned int divisor);
+void px_acc_finish_float (float *dst, const unsigned int *acc, long n, float factor);
+
+
+/* Dark and flat correction, dst = (src - dark) * gain / PX_GAIN_ONE */
+
+#define PX_GAIN_SHIFT			14
+#define PX_GAIN_ONE				(1 << PX_GAIN_SHIFT)		/* Gains up to 4 */
+
+void px_calibrate16 (unsigned short *dst, const unsigned short *src, const unsigned short *dark,
+			const unsigned short *gain, long n);
+
+
+/* Moments and histogram of a frame or region, for stats.c. Start with
+	px_moments_init(). */
+
+#define PX_HIST_BINS			256
+
+typedef struct
+{
+	unsigned long long sum;
+	unsigned long long sumsq;
+	unsigned int min, max;
+} px_moments;
+
+#define px_moments_init(m)		((m)->sum = (m)->sumsq = 0, (m)->min = ~0u, (m)->max = 0)
+
+void px_stats16 (const unsigned short *src, long n, int shift, unsigned int *hist, px_moments *m);
+void px_stats8 (const unsigned char *src, long n, unsigned int *hist, px_moments *m);
+
+
+/* Zigzag-folded differences to a reference frame, for the time-lapse
+	archive, and their inverse. dst may be res. */
+
+void px_residual16 (unsigned short *dst, const unsigned short *src, const unsigned short *ref, long n);
+void px_unresidual16 (unsigned short *dst, const unsigned short *res, const unsigned short *ref, long n);
+
+
+#endif
@@ -0,0 +1,404 @@
+/* pngfast.c
+
+	Multi-threaded PNG writer. Deflate only looks back 32 kB, so a
+	PNG's single zlib stream can be produced in independent pieces:
+	every band of rows is deflated on its own, seeded with the data
+	that precedes it, and ended with a sync flush (the last one with
+	a final block). The pieces are simply concatenated; the Adler-32
+	checksums of the bands are combined at the end.
+
+*/
+
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <zlib.h>
+
+#include "tiffstuff.h"
+#include "pngfast.h"
+#include "trace.h"
+
+
+#define PNG_WINDOW		32768
+
+/* PNG row filter types (PNG specification, section 9) */
+
+#define FILT_NONE		0
+#define FILT_SUB		1
+#define FILT_UP			2
+#define FILT_AVG		3
+#define FILT_PAETH		4
+
+
+
+/*********************************************************************/
+
+/* Apply filter type ft to one row. cur and prev (NULL for the first row
+	of the image) are big-endian sample bytes, n bytes long, bpp bytes per
+	pixel. out receives the filter type byte and the n filtered bytes. */
+
+static void filter_row (unsigned char *out, const unsigned char *cur, const unsigned char *prev,
+			long n, int bpp, int ft)
+{
+long i;
+int a, b, c, p, pa, pb, pc;
+
+
+	out[0] = (unsigned char)ft;
+	out++;
+
+	switch (ft)
+	{
+		case FILT_SUB:
+			for (i=0; i<n; i++)
+				out[i] = (unsigned char)(cur[i] - (i >= bpp ? cur[i-bpp] : 0));
+			break;
+
+		case FILT_UP:
+			for (i=0; i<n; i++)
+				out[i] = (unsigned char)(cur[i] - (prev ? prev[i] : 0));
+			break;
+
+		case FILT_AVG:
+			for (i=0; i<n; i++)
+			{
+				a = (i >= bpp) ? cur[i-bpp] : 0;
+				b = prev ? prev[i] : 0;
+				out[i] = (unsigned char)(cur[i] - ((a + b) >> 1));
+			}
+			break;
+
+		case FILT_PAETH:
+			for (i=0; i<n; i++)
+			{
+				a = (i >= bpp) ? cur[i-bpp] : 0;
+				b = prev ? prev[i] : 0;
+				c = (prev && i >= bpp) ? prev[i-bpp] : 0;
+				p = a + b - c;
+				pa = abs (p - a);
+				pb = abs (p - b);
+				pc = abs (p - c);
+				out[i] = (unsigned char)(cur[i] - ((pa <= pb && pa <= pc) ? a : (pb <= pc) ? b : c));
+			}
+			break;
+
+		default:
+			memcpy (out, cur, n);
+			break;
+	}
+}
+
+
+/* Adaptive filtering: try all five filters and keep the one with the
+	smallest sum of absolute (signed) differences, as libpng does. */
+
+static void filter_row_adaptive (unsigned char *out, unsigned char *trial, const unsigned char *cur,
+			const unsigned char *prev, long n, int bpp)
+{
+unsigned long sum, best;
+long i;
+int ft;
+
+
+	best = (unsigned long)-1;
+	for (ft=FILT_NONE; ft<=FILT_PAETH; ft++)
+	{
+		filter_row (trial, cur, prev, n, bpp, ft);
+		sum = 0;
+		for (i=1; i<=n; i++)
+			sum += abs ((signed char)trial[i]);
+		if (sum < best)
+		{
+			best = sum;
+			memcpy (out, trial, n+1);
+		}
+	}
+}
+
+
+/* Row y of the image (rows stride bytes apart) as PNG sample bytes: 16-bit
+	samples MSB first, so swapped unless they already are */
+
+static void png_row (unsigned char *dst, const char *img, long stride, long rowbytes, int swap, int y)
+{
+const unsigned char *src;
+long i;
+
+
+	src = (const unsigned char*)img + (long)y*stride;
+	if (swap)
+		for (i=0; i+1<rowbytes; i+=2)
+		{
+			dst[i] = src[i+1];
+			dst[i+1] = src[i];
+		}
+	else
+		memcpy (dst, src, rowbytes);
+}
+
+
+
+/*********************************************************************/
+
+
+typedef struct
+{
+	unsigned char *data;		/* Raw deflate data of the band */
+	long size;					/* -1 on error or if no worker got to it */
+	uLong adler;				/* Adler-32 of the band's filtered rows */
+	long length;				/* Filtered bytes in the band */
+} png_band;
+
+typedef struct
+{
+	const char *img;
+	int width, height, bps;
+	long rowbytes;
+	long stride;
+	int swap;					/* 16-bit samples in little-endian order */
+	int band_rows;
+	int nbands;
+	const png_options *opt;
+	png_band *bands;
+	atomic_int next;
+} png_job;
+
+
+/* Filter and deflate one band. Rows before the band, as many as are needed
+	to fill the deflate window, are filtered too and used as dictionary. */
+
+static void encode_band (png_job *job, int b, unsigned char *rowbuf)
+{
+png_band *band = &job->bands[b];
+unsigned char *filt, *cur, *prev, *trial, *t;
+long fsize, dictlen, outsize;
+int r0, r1, d0, y, ft;
+z_stream zs;
+
+
+	band->size = -1;
+	r0 = b * job->band_rows;
+	r1 = r0 + job->band_rows;
+	if (r1 > job->height) r1 = job->height;
+	fsize = job->rowbytes + 1;
+	d0 = r0 - (int)((PNG_WINDOW + fsize - 1) / fsize);
+	if (d0 < 0) d0 = 0;
+
+	filt = malloc ((long)(r1 - d0) * fsize);
+	if (!filt) return;
+	cur = rowbuf;
+	prev = rowbuf + job->rowbytes;
+	trial = rowbuf + 2*job->rowbytes;
+	ft = job->opt->filter;
+
+	if (d0 > 0) png_row (prev, job->img, job->stride, job->rowbytes, job->swap, d0-1);
+	for (y=d0; y<r1; y++)
+	{
+		png_row (cur, job->img, job->stride, job->rowbytes, job->swap, y);
+		if (ft < 0)
+			filter_row_adaptive (filt + (long)(y-d0)*fsize, trial, cur, y ? prev : NULL, job->rowbytes, job->bps);
+		else
+			filter_row (filt + (long)(y-d0)*fsize, cur, y ? prev : NULL, job->rowbytes, job->bps, ft);
+		t = prev; prev = cur; cur = t;
+	}
+
+	band->length = (long)(r1 - r0) * fsize;
+	band->adler = adler32 (adler32 (0L, Z_NULL, 0), filt + (long)(r0-d0)*fsize, (uInt)band->length);
+
+	memset (&zs, 0, sizeof (zs));
+	if (deflateInit2 (&zs, job->opt->level, Z_DEFLATED, -15, 8, job->opt->strategy) != Z_OK)
+	{
+		free (filt);
+		return;
+	}
+	dictlen = (long)(r0 - d0) * fsize;
+	if (dictlen > PNG_WINDOW) dictlen = PNG_WINDOW;
+	if (dictlen > 0)
+		deflateSetDictionary (&zs, filt + (long)(r0-d0)*fsize - dictlen, (uInt)dictlen);
+
+	outsize = (long)deflateBound (&zs, (uLong)band->length) + 64;	/* Room for the sync flush marker */
+	band->data = malloc (outsize);
+	if (band->data)
+	{
+		zs.next_in = filt + (long)(r0-d0)*fsize;
+		zs.avail_in = (uInt)band->length;
+		zs.next_out = band->data;
+		zs.avail_out = (uInt)outsize;
+		if (deflate (&zs, (b == job->nbands-1) ? Z_FINISH : Z_SYNC_FLUSH) != Z_STREAM_ERROR
+				&& zs.avail_in == 0)
+			band->size = outsize - zs.avail_out;
+	}
+	deflateEnd (&zs);
+	free (filt);
+}
+
+
+static void *band_worker (void *arg)
+{
+png_job *job = (png_job*)arg;
+unsigned char *rowbuf;
+int b;
+
+
+	rowbuf = malloc (3*job->rowbytes + 1);
+	if (!rowbuf) return NULL;
+	while ((b = atomic_fetch_add (&job->next, 1)) < job->nbands)
+	{
+		TRACE_BEGIN (2, "png_band");
+		encode_band (job, b, rowbuf);
+		TRACE_END (2, "png_band");
+	}
+	free (rowbuf);
+
+	return NULL;
+}
+
+
+
+/*********************************************************************/
+
+
+static void put32 (unsigned char *p, uLong v)
+{
+	p[0] = (unsigned char)(v >> 24);
+	p[1] = (unsigned char)(v >> 16);
+	p[2] = (unsigned char)(v >> 8);
+	p[3] = (unsigned char)v;
+}
+
+
+/* Write one chunk, made of up to two data pieces (so that the zlib header
+	and trailer need not be copied into the band data) */
+
+static int write_chunk (FILE *FP, const char *type, const unsigned char *d1, long n1,
+			const unsigned char *d2, long n2)
+{
+unsigned char hdr[8], crcbuf[4];
+uLong crc;
+
+
+	put32 (hdr, (uLong)(n1 + n2));
+	memcpy (hdr+4, type, 4);
+	crc = crc32 (0L, (const Bytef*)type, 4);
+	if (n1) crc = crc32 (crc, d1, (uInt)n1);
+	if (n2) crc = crc32 (crc, d2, (uInt)n2);
+	put32 (crcbuf, crc);
+
+	if (fwrite (hdr, 1, 8, FP) != 8) return -1;
+	if (n1 && fwrite (d1, 1, n1, FP) != (size_t)n1) return -1;
+	if (n2 && fwrite (d2, 1, n2, FP) != (size_t)n2) return -1;
+	if (fwrite (crcbuf, 1, 4, FP) != 4) return -1;
+	return 0;
+}
+
+
+
+/* Write the image of v (bps 1, 2, 3 or 6, as for tiffwrite) as PNG with
+	opt->threads threads. Returns 0 or -1. */
+
+int png_parallel_write (const char *fname, const imgview *v, const png_options *opt)
+{
+static const unsigned char signature[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+static const unsigned char zlib_header[2] = { 0x78, 0x9c };
+unsigned char ihdr[13], trailer[4];
+png_job job;
+pthread_t *tid;
+FILE *FP;
+uLong adler;
+int i, nthreads, started, err, width, height, bps;
+unsigned short endian_test = 1;
+
+
+	width = v->width;
+	height = v->height;
+	bps = v->bps;
+	if (bps != 1 && bps != 2 && bps != 3 && bps != 6) return -1;
+
+	nthreads = (opt->threads > 0) ? opt->threads : 1;
+	job.img = v->data;
+	job.width = width;
+	job.height = height;
+	job.bps = bps;
+	job.rowbytes = (long)width * bps;
+	job.stride = v->stride;
+	job.swap = (bps == 2 || bps == 6) && !v->big_endian && *(unsigned char*)&endian_test;
+	job.opt = opt;
+	job.band_rows = opt->band_rows;
+	if (job.band_rows <= 0)
+		job.band_rows = (height + 2*nthreads - 1) / (2*nthreads);	/* Two bands per thread balance well */
+	if (job.band_rows < 1) job.band_rows = 1;
+	job.nbands = (height + job.band_rows - 1) / job.band_rows;
+	atomic_init (&job.next, 0);
+	job.bands = calloc (job.nbands, sizeof (png_band));
+	tid = malloc (nthreads * sizeof (pthread_t));
+	if (!job.bands || !tid)
+	{
+		free (job.bands);
+		free (tid);
+		return -1;
+	}
+	for (i=0; i<job.nbands; i++)
+		job.bands[i].size = -1;
+
+	TRACE_BEGIN (1, "encode");
+	started = 0;
+	for (i=1; i<nthreads && i<job.nbands; i++)
+		if (!pthread_create (&tid[started], NULL, band_worker, &job))
+			started++;
+	band_worker (&job);
+	for (i=0; i<started; i++)
+		pthread_join (tid[i], NULL);
+	free (tid);
+	TRACE_END (1, "encode");
+
+	err = 0;
+	adler = adler32 (0L, Z_NULL, 0);
+	for (i=0; i<job.nbands; i++)
+	{
+		if (job.bands[i].size < 0)
+			err = -1;
+		else
+			adler = adler32_combine (adler, job.bands[i].adler, job.bands[i].length);
+	}
+
+	TRACE_BEGIN (1, "write");
+	FP = err ? NULL : fopen (fname, "wb");
+	if (!FP) err = -1;
+
+	if (!err)
+	{
+		put32 (ihdr, (uLong)width);
+		put32 (ihdr+4, (uLong)height);
+		ihdr[8] = (bps == 2 || bps == 6) ? 16 : 8;	/* Bit depth */
+		ihdr[9] = (bps >= 3) ? 2 : 0;				/* Color type: RGB or gray */
+		ihdr[10] = 0;								/* Deflate */
+		ihdr[11] = 0;								/* Adaptive filtering */
+		ihdr[12] = 0;								/* No interlace */
+		put32 (trailer, adler);
+
+		if (fwrite (signature, 1, 8, FP) != 8
+				|| write_chunk (FP, "IHDR", ihdr, 13, NULL, 0))
+			err = -1;
+		for (i=0; i<job.nbands && !err; i++)
+		{
+			if (i == 0)
+				err = write_chunk (FP, "IDAT", zlib_header, 2, job.bands[i].data, job.bands[i].size);
+			else
+				err = write_chunk (FP, "IDAT", job.bands[i].data, job.bands[i].size, NULL, 0);
+		}
+		if (!err) err = write_chunk (FP, "IDAT", trailer, 4, NULL, 0);
+		if (!err) err = write_chunk (FP, "IEND", NULL, 0, NULL, 0);
+		if (fclose (FP)) err = -1;
+	}
+	TRACE_END (1, "write");
+
+	for (i=0; i<job.nbands; i++)
+		free (job.bands[i].data);
+	free (job.bands);
+
+	return err;
+}
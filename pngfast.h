@@ -0,0 +1,16 @@
+#ifndef __PNGFAST_H
+#define __PNGFAST_H
+
+#include "tiffstuff.h"
+
+
+/* Parallel PNG encoder. The image is cut into bands of rows, each band is
+	filtered and deflated by its own thread (primed with the previous 32 kB
+	as dictionary, as pigz does), and the bands are written as consecutive
+	IDAT chunks of one zlib stream. The file is assembled here, not by libpng.
+*/
+
+int png_parallel_write (const char *fname, const imgview *v, const png_options *opt);
+
+
+#endif
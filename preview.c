@@ -0,0 +1,174 @@
+/* preview.c
+
+	Reduced-resolution pyramid and tone-mapped 8-bit previews of saved
+	frames, with the binning and histogram kernels of pixkern.c.
+	See preview.h.
+
+*/
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "pixkern.h"
+#include "preview.h"
+
+
+
+/* Up to levels levels of img (bps 1 or 2), each half the size of the one
+	before, as long as they are at least a pixel. Returns 0, or -1 for
+	other data or no memory, with p empty. */
+
+int pyramid_build (pyramid *p, const char *img, int width, int height, int bps, int levels)
+{
+const char *src;
+int i, w, h;
+
+
+	memset (p, 0, sizeof (pyramid));
+	if (bps != 1 && bps != 2) return -1;
+	if (levels > PYRAMID_LEVELS) levels = PYRAMID_LEVELS;
+
+	p->bps = bps;
+	src = img;
+	w = width;
+	h = height;
+	for (i=0; i<levels && w >= 2 && h >= 2; i++)
+	{
+		p->level[i] = malloc ((long)(w/2) * (h/2) * bps);
+		if (!p->level[i])
+		{
+			pyramid_free (p);
+			return -1;
+		}
+		if (bps == 2)
+			px_bin16 ((unsigned short*)p->level[i], (const unsigned short*)src, w, h, w, 2);
+		else
+			px_bin8 ((unsigned char*)p->level[i], (const unsigned char*)src, w, h, w, 2);
+		w /= 2;
+		h /= 2;
+		p->width[i] = w;
+		p->height[i] = h;
+		p->levels = i+1;
+		src = p->level[i];
+	}
+
+	return 0;
+}
+
+
+void pyramid_free (pyramid *p)
+{
+int i;
+
+
+	for (i=0; i<PYRAMID_LEVELS; i++)
+		free (p->level[i]);
+	memset (p, 0, sizeof (pyramid));
+}
+
+
+
+/* Value below which a fraction q of the n pixels in hist lie, interpolated
+	within the bin */
+
+static double percentile (const unsigned int *hist, long n, double q, int shift)
+{
+double target, cum;
+int k;
+
+
+	target = q * n;
+	cum = 0;
+	for (k=0; k<PX_HIST_BINS-1 && cum + hist[k] < target; k++)
+		cum += hist[k];
+
+	return (k + (hist[k] ? (target - cum) / hist[k] : 0)) * (1 << shift);
+}
+
+
+/* 8-bit version of img (bps 1 or 2) for display: the low to the high
+	percentile stretched to 0 to 255, with gamma. The histogram bins are
+	fitted to the largest value, so that 10- and 12-bit data in 16-bit
+	words get their full resolution. Returns a new array, or NULL. */
+
+unsigned char *preview_tonemap (const char *img, int width, int height, int bps, double low, double high, double gamma)
+{
+unsigned int hist[PX_HIST_BINS];
+unsigned char *out, *lut;
+const unsigned short *src16;
+double lo, hi, v;
+px_moments m;
+long n, i;
+int shift;
+
+
+	if (bps != 1 && bps != 2) return NULL;
+	n = (long)width * height;
+	out = malloc (n > 0 ? n : 1);
+	if (!out) return NULL;
+	if (n == 0) return out;
+
+	memset (hist, 0, sizeof (hist));
+	px_moments_init (&m);
+	shift = 0;
+	src16 = (const unsigned short*)img;
+	if (bps == 2)
+	{
+		px_stats16 (src16, n, 0, NULL, &m);
+		while ((m.max >> shift) >= PX_HIST_BINS)
+			shift++;
+		px_moments_init (&m);
+		px_stats16 (src16, n, shift, hist, &m);
+	}
+	else
+		px_stats8 ((const unsigned char*)img, n, hist, &m);
+
+	lo = percentile (hist, n, low, shift);
+	hi = percentile (hist, n, high, shift);
+	if (hi < lo + 1) hi = lo + 1;
+
+	/* Only the values that occur need a table entry */
+
+	lut = malloc (m.max + 1);
+	if (!lut)
+	{
+		free (out);
+		return NULL;
+	}
+	for (i=0; i<=(long)m.max; i++)
+	{
+		v = (i - lo) / (hi - lo);
+		v = (v <= 0) ? 0 : (v >= 1) ? 1 : pow (v, 1 / gamma);
+		lut[i] = (unsigned char)(255 * v + 0.5);
+	}
+
+	if (bps == 2)
+		for (i=0; i<n; i++)
+			out[i] = lut[src16[i]];
+	else
+		for (i=0; i<n; i++)
+			out[i] = lut[((const unsigned char*)img)[i]];
+	free (lut);
+
+	return out;
+}
+
+
+/* The preview's file name for a frame saved as fname: its extension, if
+	it has one, replaced by _preview and ext */
+
+void preview_name (char *out, int size, const char *fname, const char *ext)
+{
+const char *dot, *slash;
+
+
+	dot = strrchr (fname, '.');
+	slash = strrchr (fname, '/');
+	if (!dot || (slash && dot < slash))
+		snprintf (out, size, "%s_preview%s", fname, ext);
+	else
+		snprintf (out, size, "%.*s_preview%s", (int)(dot - fname), fname, ext);
+}
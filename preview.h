@@ -0,0 +1,35 @@
+#ifndef __PREVIEW_H
+#define __PREVIEW_H
+
+
+/* Quick looks at a run without copying full frames off the Pi: a pyramid
+	of 2x, 4x and 8x reductions of a frame, each level the 2 x 2 box average
+	of the one before (px_bin16(), px_bin8()), and an 8-bit preview of one
+	level, tone-mapped for display. The preview stretches the low to the
+	high percentile of the level's histogram to black to white, with a
+	display gamma. Both are made from the pixels as they are saved; the
+	levels can also go into the TIFF as SubIFDs (tiffwrite_levels()).
+*/
+
+#define PYRAMID_LEVELS		3			/* 2x, 4x, 8x */
+#define PREVIEW_LOW			0.005		/* Percentile that becomes black */
+#define PREVIEW_HIGH		0.995		/* and white */
+#define PREVIEW_GAMMA		2.2
+
+typedef struct
+{
+	int levels;							/* Levels made, up to PYRAMID_LEVELS */
+	int bps;							/* 1 or 2, as the frame */
+	int width[PYRAMID_LEVELS];
+	int height[PYRAMID_LEVELS];
+	char *level[PYRAMID_LEVELS];		/* level[0] is 2x */
+} pyramid;
+
+
+int pyramid_build (pyramid *p, const char *img, int width, int height, int bps, int levels);
+void pyramid_free (pyramid *p);
+unsigned char *preview_tonemap (const char *img, int width, int height, int bps, double low, double high, double gamma);
+void preview_name (char *out, int size, const char *fname, const char *ext);
+
+
+#endif
@@ -0,0 +1,279 @@
+/*************************************************
+
+	rawconv.c
+
+	Convert frames from a raw frame log (see
+	rawlog.h) or a time-lapse archive (tlapse.h)
+	to TIFF, PNG, PNM or raw files with the
+	writers of imgview.h, or list its contents.
+
+**************************************************/
+
+/* Usage: rawconv [-f tiff|png|pnm|raw[,...]] [-o prefix] [-c calibfile] [-m method] [-j threads] [-l]
+			logfile [first [last]]
+
+	Frames first to last (default: all) are written as prefix00000.tif etc.,
+	in each of the formats given to -f, side by side.
+	Frames are written from the log's memory where they need no unpacking,
+	calibration or demosaicing.
+	Frames of a time-lapse archive are decoded exactly as they were taken;
+	any one costs at most the decoding of its keyframe as well.
+	Packed Mono10p/Mono12p/Mono12Packed frames are unpacked to 16 bits.
+	-c corrects 16-bit frames with the darks and flats of a calibration
+	store (see calib.h), unless they were calibrated during capture.
+	Bayer frames of colour cameras are demosaiced to RGB after that, with
+	-m bilinear (default), gradient or none, and -j threads.
+	-l only lists the frames and their metadata (and the store's maps).
+*/
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "framemeta.h"
+#include "rawlog.h"
+#include "tlapse.h"
+#include "imgview.h"
+#include "tiffstuff.h"
+#include "pixkern.h"
+#include "calib.h"
+#include "demosaic.h"
+
+
+calib_store *calib = NULL;
+
+
+
+/* Write one frame as fnames[i] with writers[i], all at the same time.
+	Packed 10/12-bit frames are unpacked to 16 bits first, then calibrated,
+	then demosaiced if they are Bayer data. Returns 0 or -1. */
+
+int convert_frame (const char **fnames, const img_writer **writers, int nwriters, char *img,
+			const rawlog_record *rec)
+{
+framemeta meta;
+unsigned short *unpacked = NULL;
+char *rgb = NULL;
+char desc[512];
+imgview v;
+long n;
+int bps, packing, pattern, err;
+
+
+	rawlog_record_meta (rec, &meta);
+	n = (long)rec->width * rec->height;
+	if (rec->bits_per_pixel % 8)
+	{
+		packing = px_packing (dm_mono_format (rec->pixelformat));
+		if (packing == PX_PACK_NONE || (uint64_t)px_packed_size (packing, n) > rec->payload_size)
+		{
+			fprintf (stderr, "%s: unknown packed %u-bit format 0x%08x\n", fnames[0], rec->bits_per_pixel,
+				rec->pixelformat);
+			return -1;
+		}
+		unpacked = malloc (n * sizeof (unsigned short));
+		if (!unpacked) return -1;
+		px_unpack (unpacked, img, n, packing);
+		img = (char*)unpacked;
+		bps = 2;
+	}
+	else
+		bps = rec->bits_per_pixel / 8;
+
+	/* The log is mapped PROT_READ | PROT_WRITE but MAP_PRIVATE, from a file
+		opened read-only, so the file would not change. Calibrating in place
+		would still turn each frame's pages into private copies that stay
+		until the log is closed, so calibrate a copy of the frame */
+
+	if (calib && bps == 2 && !meta.calib)
+	{
+		if (!unpacked)
+		{
+			unpacked = malloc (n * sizeof (unsigned short));
+			if (!unpacked) return -1;
+			memcpy (unpacked, img, n * sizeof (unsigned short));
+			img = (char*)unpacked;
+		}
+		meta.calib = calib_apply (calib, unpacked, rec->width, rec->height, &meta);
+	}
+
+	pattern = dm_pattern (rec->pixelformat);
+	if (pattern >= 0 && dmopts.method != DM_NONE)
+	{
+		rgb = malloc (n * 3 * bps);
+		if (!rgb || demosaic (rgb, img, rec->width, rec->height, bps, pattern, &dmopts) < 0)
+		{
+			free (rgb);
+			free (unpacked);
+			return -1;
+		}
+		img = rgb;
+		bps *= 3;
+	}
+
+	imgview_init (&v, img, rec->width, rec->height, bps);
+	framemeta_format (&meta, desc, sizeof (desc));
+	v.comment = desc;
+	v.meta = &meta;
+	err = writers_write (writers, nwriters, fnames, &v);
+
+	free (rgb);
+	free (unpacked);
+	return err;
+}
+
+
+
+/********************************************************************/
+
+
+#define nextargi (--argc,atoi(*++argv))
+#define nextargs (--argc,*++argv)
+
+
+void prhelp()
+{
+	fprintf (stderr, "rawconv: convert frames from a raw frame log or time-lapse archive\n");
+	fprintf (stderr, "usage: rawconv [options] logfile [first [last]]\n");
+	fprintf (stderr, "-f                output formats tiff (default), png, pnm or raw, -f tiff,png\n");
+	fprintf (stderr, "-o                output file name prefix, -o frame\n");
+	fprintf (stderr, "-c                correct frames with a calibration store, -c cal.dat\n");
+	fprintf (stderr, "-m                demosaic Bayer frames bilinear (default), gradient or none\n");
+	fprintf (stderr, "-j                demosaic with N threads, -j 4\n");
+	fprintf (stderr, "-l                list the frames, do not convert\n");
+}
+
+
+
+int main (int argc, char **argv)
+{
+rawlog *log;
+tlapse *archive;
+rawlog_record rec;
+framemeta meta;
+const void *img;
+void *decoded;
+const img_writer *writers[IMG_MAX_WRITERS];
+const char *fnames[IMG_MAX_WRITERS];
+char prefix[1024], names[IMG_MAX_WRITERS][1100], desc[512];
+long i, first, last, n;
+int list, nwriters, k, err;
+
+
+	writers[0] = writer_find ("tiff");
+	nwriters = 1;
+	strcpy (prefix, "frame");
+	list = 0;
+
+	while (--argc && **++argv=='-')
+	{
+		if (!strcmp(argv[0], "-f"))
+		{
+			nwriters = writer_parse_list (nextargs, writers, IMG_MAX_WRITERS);
+			if (nwriters <= 0)
+			{
+				fprintf (stderr, "Unknown format in %s\n", argv[0]);
+				return 1;
+			}
+		}
+		else if (!strcmp(argv[0], "-o"))
+			strcpy (prefix, nextargs);
+		else if (!strcmp(argv[0], "-c"))
+		{
+			calib = calib_open (nextargs);
+			if (!calib)
+			{
+				fprintf (stderr, "Cannot open calibration store %s\n", argv[0]);
+				return 1;
+			}
+		}
+		else if (!strcmp(argv[0], "-m"))
+		{
+			if (dm_parse_method (nextargs, &dmopts) < 0)
+			{
+				fprintf (stderr, "Unknown demosaic method %s\n", argv[0]);
+				return 1;
+			}
+		}
+		else if (!strcmp(argv[0], "-j"))
+			dmopts.threads = nextargi;
+		else if (!strcmp(argv[0], "-l"))
+			list = 1;
+		else
+		{
+			prhelp();
+			return 0;
+		}
+	}
+
+	if (argc < 1)
+	{
+		prhelp();
+		return 1;
+	}
+	log = NULL;
+	archive = tlapse_open (argv[0]);
+	if (!archive && !(log = rawlog_open (argv[0])))
+	{
+		fprintf (stderr, "Cannot open %s\n", argv[0]);
+		return 1;
+	}
+
+	if (list && calib)
+		calib_list (calib, stdout);
+
+	n = archive ? tlapse_count (archive) : rawlog_count (log);
+	first = (argc > 1) ? atol (argv[1]) : 0;
+	last = (argc > 2) ? atol (argv[2]) : n-1;
+	if (last >= n) last = n-1;
+
+	err = 0;
+	for (i=first; i<=last; i++)
+	{
+		decoded = NULL;
+		if (archive)
+			img = decoded = tlapse_frame (archive, i, &rec);
+		else
+			img = rawlog_frame (log, i, &rec);
+		if (!img)
+		{
+			fprintf (stderr, "Frame %ld is missing or incomplete\n", i);
+			err = 1;
+			continue;
+		}
+
+		if (list)
+		{
+			rawlog_record_meta (&rec, &meta);
+			framemeta_format (&meta, desc, sizeof (desc));
+			printf ("%ld %ux%u %u bit format 0x%08x %s", i, rec.width, rec.height,
+				rec.bits_per_pixel, rec.pixelformat, desc);
+			if (archive)
+				printf (" key=%ld", tlapse_ref (archive, i));
+			printf ("\n");
+			free (decoded);
+			continue;
+		}
+
+		for (k=0; k<nwriters; k++)
+		{
+			snprintf (names[k], sizeof (names[k]), "%s%05ld%s", prefix, i, writers[k]->ext);
+			fnames[k] = names[k];
+		}
+		if (convert_frame (fnames, writers, nwriters, (char*)img, &rec) < 0)
+		{
+			fprintf (stderr, "Could not write %s\n", fnames[0]);
+			err = 1;
+		}
+		free (decoded);
+	}
+
+	if (archive)
+		tlapse_close (archive);
+	else
+		rawlog_close (log);
+	calib_close (calib);
+
+	return err;
+}
@@ -0,0 +1,389 @@
+/* rawlog.c
+
+	Append-only, memory-mapped raw frame log. Capture only copies
+	the camera payload into the pre-allocated file; any encoding
+	is done later and elsewhere (see rawconv.c).
+	With dioopts.enabled, the log is written through dio.c instead
+	of the mapping, and only header and index are kept in memory.
+
+*/
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "framemeta.h"
+#include "rawlog.h"
+#include "dio.h"
+#include "trace.h"
+
+
+#define RAWLOG_MIN_FRAME	65536			/* Smallest frame we plan the index for */
+
+struct rawlog
+{
+	int fd;
+	int writable;
+	unsigned char *map;
+	size_t mapsize;
+	rawlog_header *hdr;
+	uint64_t *index;
+	dio_file *dio;					/* Direct I/O; map then only holds header and index */
+	pthread_mutex_t lock;			/* Only held to reserve space, or for all of a direct append */
+};
+
+
+#define ALIGN_UP(x)		(((x) + RAWLOG_ALIGN - 1) & ~(uint64_t)(RAWLOG_ALIGN - 1))
+
+
+
+/* Create a log of capacity bytes. The whole file is allocated up front
+	(fallocate), so that appends never extend the file, then mapped.
+	Written directly, the header and the index stay in memory and go to
+	the file on close; until then, rawlog_open() finds the frames by
+	walking the records. */
+
+rawlog *rawlog_create (const char *fname, unsigned long long capacity)
+{
+rawlog *log;
+uint64_t max_frames, index_offset, data_offset;
+int err;
+
+
+	log = calloc (1, sizeof (rawlog));
+	if (!log) return NULL;
+
+	max_frames = capacity / RAWLOG_MIN_FRAME + 16;
+	index_offset = ALIGN_UP (sizeof (rawlog_header));
+	data_offset = ALIGN_UP (index_offset + max_frames*sizeof (uint64_t));
+	if (capacity < data_offset + RAWLOG_MIN_FRAME)
+	{
+		fprintf (stderr, "Raw log: capacity of %llu bytes is too small\n", capacity);
+		free (log);
+		return NULL;
+	}
+
+	if (dioopts.enabled)
+	{
+		log->fd = -1;
+		log->dio = dio_open (fname, (long long)capacity, NULL);
+		log->mapsize = (size_t)data_offset;
+		log->map = log->dio ? calloc (1, log->mapsize) : NULL;
+		if (!log->map)
+		{
+			if (log->dio) dio_close (log->dio);
+			free (log);
+			return NULL;
+		}
+	}
+	else
+	{
+		log->fd = open (fname, O_RDWR | O_CREAT | O_TRUNC, 0644);
+		if (log->fd < 0)
+		{
+			free (log);
+			return NULL;
+		}
+
+		err = posix_fallocate (log->fd, 0, (off_t)capacity);
+		if (err)
+		{
+			fprintf (stderr, "Raw log: cannot allocate %llu bytes: %s\n", capacity, strerror (err));
+			close (log->fd);
+			free (log);
+			return NULL;
+		}
+
+		log->mapsize = (size_t)capacity;
+		log->map = mmap (NULL, log->mapsize, PROT_READ | PROT_WRITE, MAP_SHARED, log->fd, 0);
+		if (log->map == MAP_FAILED)
+		{
+			fprintf (stderr, "Raw log: cannot map %llu bytes\n", capacity);
+			close (log->fd);
+			free (log);
+			return NULL;
+		}
+	}
+
+	log->writable = 1;
+	log->hdr = (rawlog_header*)log->map;
+	memcpy (log->hdr->magic, RAWLOG_MAGIC, 8);
+	log->hdr->version = RAWLOG_VERSION;
+	log->hdr->header_size = sizeof (rawlog_header);
+	log->hdr->capacity = capacity;
+	log->hdr->max_frames = max_frames;
+	log->hdr->index_offset = index_offset;
+	log->hdr->data_offset = data_offset;
+	log->hdr->nframes = 0;
+	log->hdr->used = log->hdr->data_offset;
+	log->index = (uint64_t*)(log->map + log->hdr->index_offset);
+	pthread_mutex_init (&log->lock, NULL);
+
+	if (log->dio && dio_pwrite (log->dio, log->map, log->mapsize, 0) < 0)
+	{
+		rawlog_close (log);
+		return NULL;
+	}
+
+	return log;
+}
+
+
+
+/* Set up a record for a frame of size bytes with metadata meta (may be
+	NULL). Also used by the time-lapse archive. */
+
+void rawlog_fill_record (rawlog_record *rec, uint32_t pixelformat, int bits_per_pixel, int width, int height,
+			size_t size, const framemeta *meta)
+{
+	memset (rec, 0, sizeof (rawlog_record));
+	rec->magic = RAWLOG_RECMAGIC;
+	rec->pixelformat = pixelformat;
+	rec->bits_per_pixel = bits_per_pixel;
+	rec->width = width;
+	rec->height = height;
+	rec->payload_size = size;
+	rec->step = -1;
+	rec->led = -1;
+	if (meta)
+	{
+		rec->step = meta->step;
+		rec->led = meta->led;
+		rec->dutycycle = meta->dutycycle;
+		rec->exposure = meta->exposure;
+		rec->gain = meta->gain;
+		rec->timestamp = meta->timestamp;
+		rec->systime = meta->systime;
+		rec->roi_x = meta->geom.x;
+		rec->roi_y = meta->geom.y;
+		rec->roi_width = meta->geom.width;
+		rec->roi_height = meta->geom.height;
+		rec->binning = meta->geom.binning;
+		rec->decimation = meta->geom.decimation;
+		rec->frames = meta->frames;
+		rec->scale = (float)meta->scale;
+		rec->calib = meta->calib;
+		rec->camera = meta->camera + 1;
+	}
+}
+
+
+/* And the other way round: the metadata of a record */
+
+void rawlog_record_meta (const rawlog_record *rec, framemeta *meta)
+{
+	framemeta_init (meta);
+	meta->step = rec->step;
+	meta->led = rec->led;
+	meta->dutycycle = rec->dutycycle;
+	meta->exposure = rec->exposure;
+	meta->gain = rec->gain;
+	meta->timestamp = rec->timestamp;
+	meta->systime = rec->systime;
+	if (rec->binning > 0)
+	{
+		meta->geom.x = rec->roi_x;
+		meta->geom.y = rec->roi_y;
+		meta->geom.width = rec->roi_width;
+		meta->geom.height = rec->roi_height;
+		meta->geom.binning = rec->binning;
+		meta->geom.decimation = rec->decimation;
+	}
+	meta->frames = rec->frames;
+	meta->scale = rec->scale;
+	meta->camera = rec->camera - 1;
+	meta->calib = rec->calib;
+}
+
+
+
+/* Append one frame. Space is reserved under the lock, the copy runs
+	without it, so that several writer threads can append at the same time.
+	The index entry is set last; a reader treats frames with index 0 as
+	missing. Written directly, the lock is held throughout, as the records
+	must reach dio.c in file order. Returns the frame number, or -1 if the
+	log is full or the write failed. */
+
+int rawlog_append (rawlog *log, const void *data, size_t size, uint32_t pixelformat,
+			int bits_per_pixel, int width, int height, const framemeta *meta)
+{
+static const unsigned char zeros[RAWLOG_ALIGN];
+rawlog_record *rec, local;
+uint64_t offset, end, n;
+int err;
+
+
+	pthread_mutex_lock (&log->lock);
+	offset = log->hdr->used;
+	n = log->hdr->nframes;
+	if (n >= log->hdr->max_frames
+			|| offset + sizeof (rawlog_record) + size > log->hdr->capacity)
+	{
+		pthread_mutex_unlock (&log->lock);
+		return -1;
+	}
+	end = offset + sizeof (rawlog_record) + size;
+	log->hdr->used = ALIGN_UP (end);
+	if (log->hdr->used > log->hdr->capacity) log->hdr->used = log->hdr->capacity;
+	log->hdr->nframes = n+1;
+
+	if (log->dio)
+	{
+		rawlog_fill_record (&local, pixelformat, bits_per_pixel, width, height, size, meta);
+		TRACE_BEGIN (1, "rawlog");
+		err = dio_pwrite (log->dio, &local, sizeof (local), offset) < 0
+			|| dio_pwrite (log->dio, data, size, offset + sizeof (local)) < 0
+			|| dio_pwrite (log->dio, zeros, log->hdr->used - end, end) < 0;
+		TRACE_END (1, "rawlog");
+		if (err)
+			log->hdr->nframes = n;			/* Nothing more will fit behind it */
+		else
+			log->index[n] = offset;
+		pthread_mutex_unlock (&log->lock);
+		return err ? -1 : (int)n;
+	}
+	pthread_mutex_unlock (&log->lock);
+
+	rec = (rawlog_record*)(log->map + offset);
+	rawlog_fill_record (rec, pixelformat, bits_per_pixel, width, height, size, meta);
+	TRACE_BEGIN (1, "rawlog");
+	memcpy (rec+1, data, size);
+	TRACE_END (1, "rawlog");
+
+	__atomic_store_n (&log->index[n], offset, __ATOMIC_RELEASE);
+
+	return (int)n;
+}
+
+
+
+/* Open an existing log for reading. The mapping is private and writable,
+	because some encoders (e.g. libtiff's predictor) work in place on the
+	data they are given; such changes never reach the file. */
+
+rawlog *rawlog_open (const char *fname)
+{
+const rawlog_record *r;
+rawlog *log;
+struct stat st;
+uint64_t offset;
+
+
+	log = calloc (1, sizeof (rawlog));
+	if (!log) return NULL;
+
+	log->fd = open (fname, O_RDONLY);
+	if (log->fd < 0 || fstat (log->fd, &st) || (size_t)st.st_size < sizeof (rawlog_header))
+		goto fail;
+
+	log->mapsize = (size_t)st.st_size;
+	log->map = mmap (NULL, log->mapsize, PROT_READ | PROT_WRITE, MAP_PRIVATE, log->fd, 0);
+	if (log->map == MAP_FAILED)
+		goto fail;
+
+	log->hdr = (rawlog_header*)log->map;
+	if (memcmp (log->hdr->magic, RAWLOG_MAGIC, 8) || log->hdr->version != RAWLOG_VERSION
+			|| log->hdr->data_offset > log->mapsize)
+	{
+		fprintf (stderr, "Raw log: %s is not a raw frame log\n", fname);
+		munmap (log->map, log->mapsize);
+		goto fail;
+	}
+	log->index = (uint64_t*)(log->map + log->hdr->index_offset);
+
+	/* A directly written log that was not closed has no index yet; the
+		records follow each other, so walk them */
+
+	if (log->hdr->nframes == 0)
+		for (offset = log->hdr->data_offset;
+				log->hdr->nframes < log->hdr->max_frames && offset + sizeof (rawlog_record) <= log->mapsize;
+				offset = ALIGN_UP (offset + sizeof (rawlog_record) + r->payload_size))
+		{
+			r = (const rawlog_record*)(log->map + offset);
+			if (r->magic != RAWLOG_RECMAGIC || offset + sizeof (rawlog_record) + r->payload_size > log->mapsize)
+				break;
+			log->index[log->hdr->nframes++] = offset;
+		}
+
+	return log;
+
+fail:
+	if (log->fd >= 0) close (log->fd);
+	free (log);
+	return NULL;
+}
+
+
+
+long rawlog_count (rawlog *log)
+{
+	return (long)log->hdr->nframes;
+}
+
+
+
+/* Random access to frame i: one index lookup. Returns a pointer to the
+	payload in the mapped file and copies the record to rec, or NULL if the
+	frame does not exist or was never completed. */
+
+const void *rawlog_frame (rawlog *log, long i, rawlog_record *rec)
+{
+uint64_t offset;
+const rawlog_record *r;
+
+
+	if (i < 0 || (uint64_t)i >= log->hdr->nframes) return NULL;
+	offset = log->index[i];
+	if (offset == 0 || offset + sizeof (rawlog_record) > log->mapsize) return NULL;
+
+	r = (const rawlog_record*)(log->map + offset);
+	if (r->magic != RAWLOG_RECMAGIC || offset + sizeof (rawlog_record) + r->payload_size > log->mapsize)
+		return NULL;
+	if (rec) *rec = *r;
+
+	return r+1;
+}
+
+
+
+/* Close the log. A log that was written is cut down to its used size. */
+
+void rawlog_close (rawlog *log)
+{
+uint64_t used;
+
+
+	if (log->dio)
+	{
+		log->hdr->capacity = log->hdr->used;
+		if (dio_pwrite (log->dio, log->map, log->mapsize, 0) < 0 || dio_close (log->dio) < 0)
+			fprintf (stderr, "Raw log: write failed\n");
+		pthread_mutex_destroy (&log->lock);
+		free (log->map);
+		free (log);
+		return;
+	}
+
+	if (log->writable)
+	{
+		used = log->hdr->used;
+		log->hdr->capacity = used;
+		msync (log->map, log->mapsize, MS_SYNC);
+		munmap (log->map, log->mapsize);
+		if (ftruncate (log->fd, (off_t)used))
+			fprintf (stderr, "Raw log: could not release unused space\n");
+		pthread_mutex_destroy (&log->lock);
+	}
+	else
+		munmap (log->map, log->mapsize);
+
+	close (log->fd);
+	free (log);
+}
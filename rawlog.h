@@ -0,0 +1,88 @@
+#ifndef __RAWLOG_H
+#define __RAWLOG_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "framemeta.h"
+
+
+/* Raw frame log: an append-only container for unencoded frames.
+	The file is allocated in full when it is created and memory-mapped, so
+	that an append is a memcpy. Layout:
+
+	header		fixed size, see rawlog_header
+	index		max_frames 64-bit offsets, 0 while a frame is incomplete
+	records		per frame: a rawlog_record followed by the payload,
+				each record aligned to RAWLOG_ALIGN bytes
+
+	All numbers are in host (little-endian on the Pi and on x86) byte order.
+	With dioopts.enabled (dio.h), the log is written through O_DIRECT
+	instead of the mapping, and header and index only reach the file on
+	close; rawlog_open() recovers a log that was not closed from its
+	records.
+*/
+
+#define RAWLOG_MAGIC		"GHRAWLG1"
+#define RAWLOG_VERSION		1
+#define RAWLOG_ALIGN		64
+#define RAWLOG_RECMAGIC		0x454d5246			/* "FRME" */
+
+typedef struct
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t header_size;
+	uint64_t capacity;			/* File size as allocated */
+	uint64_t max_frames;		/* Index entries */
+	uint64_t index_offset;
+	uint64_t data_offset;
+	uint64_t nframes;			/* Frames appended (some may still be incomplete) */
+	uint64_t used;				/* End of the last record */
+	uint64_t reserved[8];
+} rawlog_header;
+
+typedef struct
+{
+	uint32_t magic;				/* RAWLOG_RECMAGIC */
+	uint32_t pixelformat;		/* Aravis/GenICam pixel format code */
+	uint32_t bits_per_pixel;
+	uint32_t width;
+	uint32_t height;
+	uint32_t calib;				/* See framemeta.calib; 0 for raw sensor data */
+	uint64_t payload_size;		/* Bytes following this record */
+	int32_t step;
+	int32_t led;
+	int32_t dutycycle;
+	int32_t camera;				/* framemeta.camera + 1, 0 for a single camera */
+	double exposure;
+	double gain;
+	uint64_t timestamp;
+	uint64_t systime;
+	int32_t roi_x;				/* Region on the sensor, roi_width 0 if unknown */
+	int32_t roi_y;
+	int32_t roi_width;
+	int32_t roi_height;
+	int32_t binning;			/* 0 in logs written before these were added */
+	int32_t decimation;
+	int32_t frames;				/* Frames accumulated into this one, 0 for a single frame */
+	float scale;				/* See framemeta.scale */
+} rawlog_record;
+
+typedef struct rawlog rawlog;
+
+
+rawlog *rawlog_create (const char *fname, unsigned long long capacity);
+int rawlog_append (rawlog *log, const void *data, size_t size, uint32_t pixelformat,
+			int bits_per_pixel, int width, int height, const framemeta *meta);
+rawlog *rawlog_open (const char *fname);
+long rawlog_count (rawlog *log);
+const void *rawlog_frame (rawlog *log, long i, rawlog_record *rec);
+void rawlog_close (rawlog *log);
+
+void rawlog_fill_record (rawlog_record *rec, uint32_t pixelformat, int bits_per_pixel, int width, int height,
+			size_t size, const framemeta *meta);
+void rawlog_record_meta (const rawlog_record *rec, framemeta *meta);
+
+
+#endif
@@ -0,0 +1,194 @@
+/* rice.c
+
+	Adaptive Rice coder for the residuals of the time-lapse archive,
+	see rice.h. Scalar, but with a 64-bit bit buffer on both sides and
+	count-leading-zeros for the unary part, so that a value costs a few
+	instructions.
+
+*/
+
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "rice.h"
+
+
+typedef struct
+{
+	unsigned char *out;
+	size_t pos, size;				/* pos goes on counting past size */
+	uint64_t acc;					/* Pending bits, right-aligned */
+	int n;							/* Number of them */
+} bitwriter;
+
+typedef struct
+{
+	const unsigned char *in;
+	size_t pos, size;
+	size_t over;					/* Zero bytes read past the end */
+	uint64_t w;						/* Next bits, left-aligned */
+	int n;							/* Number of valid ones */
+} bitreader;
+
+
+/* Append the low bits (at most 32) of val */
+
+static inline void put_bits (bitwriter *bw, uint32_t val, int bits)
+{
+	bw->acc = (bw->acc << bits) | val;
+	bw->n += bits;
+	while (bw->n >= 8)
+	{
+		bw->n -= 8;
+		if (bw->pos < bw->size)
+			bw->out[bw->pos] = (unsigned char)(bw->acc >> bw->n);
+		bw->pos++;
+	}
+}
+
+
+static inline void refill (bitreader *br)
+{
+	while (br->n <= 56)
+	{
+		if (br->pos < br->size)
+			br->w |= (uint64_t)br->in[br->pos++] << (56 - br->n);
+		else
+			br->over++;
+		br->n += 8;
+	}
+}
+
+
+/* Take bits (1 to 32) bits off the front, after a refill() */
+
+static inline uint32_t get_bits (bitreader *br, int bits)
+{
+uint32_t v;
+
+
+	v = (uint32_t)(br->w >> (64 - bits));
+	br->w <<= bits;
+	br->n -= bits;
+	return v;
+}
+
+
+/* The parameter for a block with this sum: about log2 of the mean */
+
+static inline int block_k (uint32_t sum)
+{
+uint32_t mean;
+int k;
+
+
+	mean = sum / RICE_BLOCK;
+	for (k=0; k<16 && (mean >> k) > 0; k++)
+		;
+	return k;
+}
+
+
+
+/* Code n values into out (size bytes). Returns the number of bytes
+	written, or 0 if they did not fit. */
+
+size_t rice_encode (unsigned char *out, size_t size, const unsigned short *v, long n)
+{
+bitwriter bw;
+uint32_t sum, q;
+long b, i, end;
+int k;
+
+
+	bw.out = out;
+	bw.pos = 0;
+	bw.size = size;
+	bw.acc = 0;
+	bw.n = 0;
+
+	for (b=0; b<n; b+=RICE_BLOCK)
+	{
+		end = (b + RICE_BLOCK < n) ? b + RICE_BLOCK : n;
+		sum = 0;
+		for (i=b; i<end; i++)
+			sum += v[i];
+		if (sum == 0)
+		{
+			put_bits (&bw, RICE_ZERO, 5);
+			continue;
+		}
+		k = block_k (sum);
+		put_bits (&bw, k, 5);
+		for (i=b; i<end; i++)
+		{
+			q = v[i] >> k;
+			if (q >= RICE_ESCAPE)
+			{
+				put_bits (&bw, 0, RICE_ESCAPE);
+				put_bits (&bw, v[i], 16);
+			}
+			else
+			{
+				put_bits (&bw, 1, q + 1);
+				if (k) put_bits (&bw, v[i] & ((1u << k) - 1), k);
+			}
+		}
+		if (bw.pos > size) return 0;
+	}
+	if (bw.n > 0)
+		put_bits (&bw, 0, 8 - bw.n);
+
+	return (bw.pos > size) ? 0 : bw.pos;
+}
+
+
+/* Decode n values from in (size bytes). Returns 0, or -1 if the data
+	ran out or is not valid. */
+
+int rice_decode (unsigned short *v, long n, const unsigned char *in, size_t size)
+{
+bitreader br;
+uint32_t q;
+long b, i, end;
+int k;
+
+
+	br.in = in;
+	br.pos = 0;
+	br.size = size;
+	br.over = 0;
+	br.w = 0;
+	br.n = 0;
+
+	for (b=0; b<n; b+=RICE_BLOCK)
+	{
+		end = (b + RICE_BLOCK < n) ? b + RICE_BLOCK : n;
+		refill (&br);
+		k = get_bits (&br, 5);
+		if (k == RICE_ZERO)
+		{
+			memset (v + b, 0, (end - b) * sizeof (unsigned short));
+			continue;
+		}
+		if (k > 16) return -1;
+		for (i=b; i<end; i++)
+		{
+			refill (&br);
+			q = br.w ? __builtin_clzll (br.w) : 64;
+			if (q >= RICE_ESCAPE)
+			{
+				get_bits (&br, RICE_ESCAPE);
+				v[i] = get_bits (&br, 16);
+				continue;
+			}
+			get_bits (&br, q + 1);
+			v[i] = (unsigned short)((q << k) | (k ? get_bits (&br, k) : 0));
+		}
+		if (br.over * 8 > (size_t)br.n) return -1;		/* Used bits that were not there */
+	}
+
+	return 0;
+}
@@ -0,0 +1,28 @@
+#ifndef __RICE_H
+#define __RICE_H
+
+#include <stddef.h>
+
+
+/* Adaptive Rice coding of 16-bit values that are mostly small, such as the
+	zigzag residuals of px_residual16(). Values go in blocks of RICE_BLOCK,
+	each with its own parameter k (5 bits: 0-16, or RICE_ZERO for a block of
+	zeros). A value v is coded as v >> k in unary (that many 0 bits and a 1)
+	followed by the k low bits of v; a quotient of RICE_ESCAPE or more is
+	sent as RICE_ESCAPE 0 bits and v in 16 bits. Bits are packed MSB first.
+*/
+
+#define RICE_BLOCK			32
+#define RICE_ZERO			31
+#define RICE_ESCAPE			24
+
+/* Worst case: every value escaped, plus the block headers */
+
+#define rice_bound(n)		((size_t)(n) * 5 + ((size_t)(n) / RICE_BLOCK + 1) + 8)
+
+
+size_t rice_encode (unsigned char *out, size_t size, const unsigned short *v, long n);
+int rice_decode (unsigned short *v, long n, const unsigned char *in, size_t size);
+
+
+#endif
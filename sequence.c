@@ -0,0 +1,489 @@
+/* sequence.c
+
+	Sequence compiler and scheduler. The text of -s is parsed once into
+	a schedule of unrolled steps with deadlines; a dedicated thread,
+	SCHED_FIFO if allowed, then sleeps to each deadline with
+	clock_nanosleep (TIMER_ABSTIME) and executes the step. Timing is
+	recorded for every step and summed up per step of the text.
+
+*/
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "acquire.h"
+#include "framemeta.h"
+#include "sequence.h"
+#include "accum.h"
+#include "trace.h"
+
+
+
+/*********************************************************************/
+
+/* The compiler. Loops are unrolled by parsing their body again for every
+	pass; steps are told apart by where they are in the text. */
+
+typedef struct
+{
+	const char *p;					/* Parse position */
+	const seq_entry *defaults;		/* Settings of steps that do not have their own */
+	seq_entry *entries;
+	int n;
+	long items;						/* Parsed so far, to stop loops without steps */
+	const char **src_at;			/* Text position of each step of the text */
+	int n_src;
+	int after_previous;				/* Timing of the next entry */
+	long long offset;
+} seq_parser;
+
+
+static int parse_list (seq_parser *ps, int depth);
+
+
+static int fail (seq_parser *ps, const char *msg)
+{
+	dp (0, "Sequence: %s at \"%.24s\"\n", msg, ps->p);
+	return -1;
+}
+
+
+static int number (seq_parser *ps, double *v)
+{
+char *end;
+
+
+	*v = strtod (ps->p, &end);
+	if (end == ps->p || *v < 0) return fail (ps, "number expected");
+	ps->p = end;
+	return 0;
+}
+
+
+static int src_index (seq_parser *ps, const char *at)
+{
+int i;
+
+
+	for (i=0; i<ps->n_src; i++)
+		if (ps->src_at[i] == at) return i;
+	ps->src_at[ps->n_src] = at;
+	return ps->n_src++;
+}
+
+
+
+/* led-duty{/option}{@geometry} */
+
+static int parse_step (seq_parser *ps)
+{
+const char *start = ps->p, *end;
+seq_entry e;
+char buf[128], key;
+double v, period, count;
+size_t len;
+int i;
+
+
+	e = *ps->defaults;
+	if (!strncmp (ps->p, "bw", 2) || !strncmp (ps->p, "wb", 2))
+	{
+		e.led = White_and_blue;
+		ps->p += 2;
+	}
+	else if (*ps->p == 'b' || *ps->p == 'w')
+	{
+		e.led = (*ps->p == 'b') ? Blue : White;
+		ps->p++;
+	}
+	else
+		return fail (ps, "w, b or bw expected");
+
+	if (*ps->p != '-' && *ps->p != ',')
+		return fail (ps, "duty cycle expected");
+	ps->p++;
+	if (!isdigit ((unsigned char)*ps->p))
+		return fail (ps, "duty cycle expected");
+	if (strtod (ps->p, NULL) > 255)
+		return fail (ps, "duty cycle above 255");
+	number (ps, &v);
+	e.dutycycle = (int)v;
+
+	count = 1;
+	period = 0;
+
+	for (;;)
+	{
+		if (*ps->p == '/')
+		{
+			key = ps->p[1];
+			if (!strchr ("eganp", key) || !key || ps->p[2] != '=')
+				return fail (ps, "option expected (e=, g=, a=, n= or p=)");
+			ps->p += 3;
+			if (key == 'e' && !strncmp (ps->p, "auto", 4))
+			{
+				e.exposure = SEQ_AUTO_EXPOSURE;
+				ps->p += 4;
+				continue;
+			}
+			if (number (ps, &v) < 0) return -1;
+			switch (key)
+			{
+				case 'e': e.exposure = v; break;
+				case 'g': e.gain = v; break;
+				case 'a': e.frames = (v <= ACC_MAX_FRAMES) ? (int)v : 0; break;
+				case 'n': count = v; break;
+				case 'p': period = v; break;
+			}
+		}
+		else if (*ps->p == '@')
+		{
+			ps->p++;
+			len = strcspn (ps->p, ",-)/");
+			if (len >= sizeof (buf))
+				return fail (ps, "geometry too long");
+			memcpy (buf, ps->p, len);
+			buf[len] = '\0';
+			if (geometry_parse (buf, &e.geom) < 0)
+				return fail (ps, "bad geometry");
+			ps->p += len;
+		}
+		else
+			break;
+	}
+
+	/* Checks that would otherwise only fail halfway through a run */
+
+	end = ps->p;
+	ps->p = start;
+	if (e.exposure <= 0 && e.exposure != SEQ_AUTO_EXPOSURE)
+		return fail (ps, "exposure must be positive");
+	if (e.frames < 1 || e.frames > ACC_MAX_FRAMES)
+		return fail (ps, "frame count out of range");
+	if (ps->n + count > SEQ_MAX_STEPS)
+		return fail (ps, "too many steps");
+	if (count < 1 || count != (int)count)
+		return fail (ps, "repeat count must be a whole number of at least 1");
+	if (period > 0 && e.exposure > 0 && period * 1000.0 < e.exposure * e.frames)
+		return fail (ps, "period shorter than the exposure");
+
+	ps->p = end;
+	e.src = src_index (ps, start);
+	for (i=0; i<(int)count; i++)
+	{
+		e.after_previous = ps->after_previous;
+		e.offset = ps->offset;
+		ps->entries[ps->n++] = e;
+		if (period > 0)
+		{
+			ps->after_previous = 0;
+			ps->offset += (long long)(period * 1e6);
+		}
+		else
+		{
+			ps->after_previous = 1;
+			ps->offset = 0;
+		}
+	}
+
+	return 0;
+}
+
+
+/* step, wait=ms or count*(sequence) */
+
+static int parse_item (seq_parser *ps, int depth)
+{
+const char *body;
+double v;
+int i, count;
+
+
+	if (++ps->items > SEQ_MAX_ITEMS)
+		return fail (ps, "too long when unrolled");
+
+	if (!strncmp (ps->p, "wait=", 5))
+	{
+		ps->p += 5;
+		if (number (ps, &v) < 0) return -1;
+		ps->offset += (long long)(v * 1e6);
+		return 0;
+	}
+
+	if (!isdigit ((unsigned char)*ps->p))
+		return parse_step (ps);
+
+	if (number (ps, &v) < 0) return -1;
+	if (v > SEQ_MAX_ITEMS)
+		return fail (ps, "loop count too large");
+	count = (int)v;
+	if (count < 1 || count != v)
+		return fail (ps, "loop count must be a whole number of at least 1");
+	if (ps->p[0] != '*' || ps->p[1] != '(')
+		return fail (ps, "*( expected");
+	if (depth >= SEQ_MAX_DEPTH)
+		return fail (ps, "loops nested too deeply");
+
+	body = ps->p + 2;
+	for (i=0; i<count; i++)
+	{
+		ps->p = body;
+		if (parse_list (ps, depth+1) < 0) return -1;
+		if (*ps->p != ')')
+			return fail (ps, ") expected");
+	}
+	ps->p++;
+
+	return 0;
+}
+
+
+static int parse_list (seq_parser *ps, int depth)
+{
+	if (parse_item (ps, depth) < 0) return -1;
+	while (*ps->p == ',' || *ps->p == '-')
+	{
+		ps->p++;
+		if (parse_item (ps, depth) < 0) return -1;
+	}
+	return 0;
+}
+
+
+
+/* Compile spec into s. Steps take geometry, exposure, gain and frame count
+	from defaults unless they have their own. Errors are reported with their
+	position. Returns 0 or -1. */
+
+int seq_compile (const char *spec, const seq_entry *defaults, seq_schedule *s)
+{
+seq_parser ps;
+int err;
+
+
+	memset (s, 0, sizeof (seq_schedule));
+	memset (&ps, 0, sizeof (ps));
+	ps.p = spec;
+	ps.defaults = defaults;
+	ps.after_previous = 1;
+	ps.entries = malloc (SEQ_MAX_STEPS * sizeof (seq_entry));
+	ps.src_at = malloc ((strlen (spec) + 1) * sizeof (char*));
+	if (!ps.entries || !ps.src_at)
+	{
+		free (ps.entries);
+		free (ps.src_at);
+		return -1;
+	}
+
+	err = parse_list (&ps, 0);
+	if (!err && *ps.p)
+		err = fail (&ps, "unexpected text");
+	if (!err && ps.n == 0)
+		err = fail (&ps, "no steps");
+	free (ps.src_at);
+	if (err)
+	{
+		free (ps.entries);
+		return -1;
+	}
+
+	s->n = ps.n;
+	s->n_src = ps.n_src;
+	s->entries = realloc (ps.entries, ps.n * sizeof (seq_entry));
+	if (!s->entries) s->entries = ps.entries;
+	dp (1, "Sequence: %d steps of %d in the text\n", s->n, s->n_src);
+
+	return 0;
+}
+
+
+void seq_free (seq_schedule *s)
+{
+	free (s->entries);
+	s->entries = NULL;
+	s->n = 0;
+}
+
+
+
+/*********************************************************************/
+
+/* The scheduler */
+
+typedef struct
+{
+	const seq_schedule *s;
+	seq_step_fn fn;
+	void *ctx;
+	seq_report *rep;
+} seq_job;
+
+
+static long long now_ns ()
+{
+struct timespec t;
+
+
+	clock_gettime (CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+
+static void sleep_until (long long t)
+{
+struct timespec ts;
+
+
+	ts.tv_sec = t / 1000000000LL;
+	ts.tv_nsec = t % 1000000000LL;
+	while (clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+		;
+}
+
+
+static void account (seq_stepstats *st, long long late, long long dur, int missed, int failed)
+{
+	st->n++;
+	st->missed += missed;
+	st->failed += failed;
+	st->late_sum += late;
+	if (late > st->late_max) st->late_max = late;
+	st->dur_sum += dur;
+	if (dur > st->dur_max) st->dur_max = dur;
+}
+
+
+static void *seq_thread (void *arg)
+{
+seq_job *job = (seq_job*)arg;
+const seq_entry *e;
+long long t0, base, prev_end, deadline, start, end, now;
+int i, missed, failed;
+
+
+	trace_thread_name ("sequence");
+	t0 = now_ns ();
+	base = prev_end = t0;
+	for (i=0; i<job->s->n; i++)
+	{
+		e = &job->s->entries[i];
+		if (e->after_previous) base = prev_end;
+		deadline = base + e->offset;
+
+		/* A step that simply follows the previous one has no deadline to miss */
+
+		now = now_ns ();
+		missed = (now > deadline) && !(e->after_previous && e->offset == 0);
+		if (now < deadline)
+			sleep_until (deadline);
+		if (missed)
+			TRACE_INSTANT (1, "missed", i);
+
+		start = now_ns ();
+		failed = job->fn (job->ctx, e, i) < 0;
+		end = now_ns ();
+
+		account (&job->rep->all, start - deadline, end - start, missed, failed);
+		account (&job->rep->src[e->src], start - deadline, end - start, missed, failed);
+		prev_end = end;
+	}
+	job->rep->elapsed = now_ns () - t0;
+
+	return NULL;
+}
+
+
+
+/* Run schedule s, calling fn for every step, in a thread with SCHED_FIFO
+	priority (0 for none). If real-time scheduling is not permitted, the
+	thread runs at normal priority. Timing goes to rep, which is to be
+	released with seq_report_free(). Returns 0 or -1. */
+
+int seq_run (const seq_schedule *s, seq_step_fn fn, void *ctx, int priority, seq_report *rep)
+{
+struct sched_param param;
+pthread_attr_t attr;
+pthread_t tid;
+seq_job job;
+int err;
+
+
+	memset (rep, 0, sizeof (seq_report));
+	rep->n_src = s->n_src;
+	rep->src = calloc (s->n_src, sizeof (seq_stepstats));
+	if (!rep->src) return -1;
+	job.s = s;
+	job.fn = fn;
+	job.ctx = ctx;
+	job.rep = rep;
+
+	err = -1;
+	if (priority > 0)
+	{
+		pthread_attr_init (&attr);
+		pthread_attr_setinheritsched (&attr, PTHREAD_EXPLICIT_SCHED);
+		pthread_attr_setschedpolicy (&attr, SCHED_FIFO);
+		param.sched_priority = priority;
+		pthread_attr_setschedparam (&attr, &param);
+		err = pthread_create (&tid, &attr, seq_thread, &job);
+		pthread_attr_destroy (&attr);
+		if (err)
+			dp (0, "Sequence: no real-time priority (%s), timing may suffer\n", strerror (err));
+		else
+			rep->realtime = 1;
+	}
+	if (err && (err = pthread_create (&tid, NULL, seq_thread, &job)))
+	{
+		dp (0, "Sequence: cannot start the sequence thread\n");
+		return -1;
+	}
+
+	pthread_join (tid, NULL);
+
+	return 0;
+}
+
+
+
+/* Per step of the text: how often it ran, deadlines missed, failures,
+	start lateness and duration */
+
+void seq_report_print (const seq_report *rep)
+{
+const seq_stepstats *st;
+int i;
+
+
+	dp (0, "Sequence: %d steps in %.3f s (%s), %d deadlines missed, %d steps failed\n",
+		rep->all.n, rep->elapsed * 1e-9, rep->realtime ? "SCHED_FIFO" : "normal priority",
+		rep->all.missed, rep->all.failed);
+	if (!rep->all.n) return;
+
+	dp (0, " step   runs missed failed   late mean/max (us)   duration mean/max (ms)\n");
+	for (i=0; i<=rep->n_src; i++)
+	{
+		st = (i < rep->n_src) ? &rep->src[i] : &rep->all;
+		if (!st->n) continue;
+		if (i < rep->n_src)
+			dp (0, " %4d", i);
+		else
+			dp (0, "  all");
+		dp (0, " %6d %6d %6d %10.1f %9.1f %11.3f %10.3f\n", st->n, st->missed, st->failed,
+			st->late_sum * 1e-3 / st->n, st->late_max * 1e-3,
+			st->dur_sum * 1e-6 / st->n, st->dur_max * 1e-6);
+	}
+}
+
+
+void seq_report_free (seq_report *rep)
+{
+	free (rep->src);
+	rep->src = NULL;
+}
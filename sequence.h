@@ -0,0 +1,92 @@
+#ifndef __SEQUENCE_H
+#define __SEQUENCE_H
+
+#include "framemeta.h"
+
+
+/* Sequences (-s) are compiled into a flat, immutable schedule before the
+	camera is touched, and then run by a thread of their own that sleeps
+	to absolute deadlines.
+
+	sequence	item { (',' | '-') item }
+	item		step | 'wait=' ms | count '*(' sequence ')'
+	step		led (',' | '-') duty { '/' option | '@' geometry }
+	led			'w', 'b' or 'bw'
+	duty		PWM duty cycle, 0-255
+	option		'e=' exposure in microseconds, or 'auto' (see autoexp.h)
+				'g=' gain in dB
+				'a=' frames accumulated into the step's image (see accum.h)
+				'n=' how often the step is repeated
+				'p=' period in ms: the next step starts this long after
+					 this one started. Without it, the next step starts
+					 as soon as this one is done.
+	geometry	as for -r, see geometry_parse()
+
+	For example  w-128/e=20000/p=100,3*(b-64/n=2/p=50,wait=200),bw-255@full
+	The former format, b,128-w,64 or b-128,w-64, is a subset.
+*/
+
+#define SEQ_MAX_STEPS		100000		/* After loops and repeats are unrolled */
+#define SEQ_MAX_ITEMS		1000000		/* Steps, waits and loop passes while unrolling */
+#define SEQ_MAX_DEPTH		8			/* Nesting of loops */
+#define SEQ_RT_PRIORITY		50			/* SCHED_FIFO priority of the sequence thread */
+#define SEQ_AUTO_EXPOSURE	-1.0		/* Exposure to be found before the run */
+
+
+typedef struct
+{
+	int src;					/* Which step of the text this came from */
+	int led;					/* enum led_color */
+	int dutycycle;
+	double exposure;			/* Microseconds, or SEQ_AUTO_EXPOSURE */
+	double gain;				/* dB */
+	int frames;					/* Frames accumulated into one image, 1 for none */
+	geometry geom;
+	int after_previous;			/* Deadline counts from the end of the previous step ... */
+	long long offset;			/* ... (or from the last such point) plus this, in ns */
+} seq_entry;
+
+typedef struct
+{
+	int n;
+	int n_src;					/* Steps in the text */
+	seq_entry *entries;
+} seq_schedule;
+
+
+/* Timing of one step of the text over all its executions. Lateness is how
+	much later than its deadline a step started; a step missed its deadline
+	when the previous one was still running at that time. */
+
+typedef struct
+{
+	int n;
+	int missed;
+	int failed;
+	long long late_sum, late_max;		/* ns */
+	long long dur_sum, dur_max;			/* ns */
+} seq_stepstats;
+
+typedef struct
+{
+	int realtime;				/* Ran with SCHED_FIFO */
+	long long elapsed;			/* ns, whole run */
+	seq_stepstats all;
+	int n_src;
+	seq_stepstats *src;
+} seq_report;
+
+
+/* Executes entry e, the index-th of the schedule. Returns 0 or -1. */
+
+typedef int (*seq_step_fn) (void *ctx, const seq_entry *e, int index);
+
+
+int seq_compile (const char *spec, const seq_entry *defaults, seq_schedule *s);
+void seq_free (seq_schedule *s);
+int seq_run (const seq_schedule *s, seq_step_fn fn, void *ctx, int priority, seq_report *rep);
+void seq_report_print (const seq_report *rep);
+void seq_report_free (seq_report *rep);
+
+
+#endif
@@ -0,0 +1,374 @@
+/* stats.c
+
+	Streaming frame statistics and white/blue index maps, with the
+	moment and histogram kernels of pixkern.c. See stats.h.
+
+*/
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "framemeta.h"
+#include "pixkern.h"
+#include "stats.h"
+
+
+#define LED_WHITE			0			/* enum led_color, see acquire.h */
+#define LED_BLUE			1
+
+typedef struct
+{
+	char *img;						/* Copy of the pixels, NULL if nothing is held */
+	int width, height, bps;
+	framemeta meta;
+} held_frame;
+
+struct stats
+{
+	FILE *fp;
+	int format;
+	int index_mode;
+	int n_regions;
+	geometry regions[STATS_MAX_REGIONS];
+	pthread_mutex_t lock;			/* Output and held frames; writer threads share this */
+	held_frame held[MAX_CAMERAS][2];	/* The last white and blue frame not yet paired, per camera */
+};
+
+
+static const char *index_names[] = { "none", "ratio", "ndi" };
+
+
+
+int stats_parse_index (const char *name)
+{
+int i;
+
+
+	for (i=INDEX_RATIO; i<=INDEX_NDI; i++)
+		if (!strcmp (name, index_names[i]))
+			return i;
+	return -1;
+}
+
+
+
+const char *stats_index_name (stats *st)
+{
+	return index_names[st->index_mode];
+}
+
+
+
+/* Start writing statistics to fname, as JSON lines if it ends in .json,
+	otherwise as CSV. NULL if the file cannot be created. */
+
+stats *stats_open (const char *fname, int index_mode)
+{
+stats *st;
+size_t len;
+
+
+	st = calloc (1, sizeof (stats));
+	if (!st) return NULL;
+	st->fp = fopen (fname, "w");
+	if (!st->fp)
+	{
+		free (st);
+		return NULL;
+	}
+	len = strlen (fname);
+	st->format = (len > 5 && !strcmp (fname + len - 5, ".json")) ? STATS_JSON : STATS_CSV;
+	st->index_mode = index_mode;
+	pthread_mutex_init (&st->lock, NULL);
+
+	if (st->format == STATS_CSV)
+		fprintf (st->fp, "name,step,led,duty,exposure,gain,timestamp,region,n,mean,var,min,max,hist\n");
+
+	return st;
+}
+
+
+/* A region in saved-image pixels, as for -r (binning and decimation are
+	ignored). The whole image is always the first region. Returns 0 or -1. */
+
+int stats_add_region (stats *st, const char *spec)
+{
+geometry g;
+
+
+	if (st->n_regions >= STATS_MAX_REGIONS || geometry_parse (spec, &g) < 0 || g.width <= 0)
+		return -1;
+	st->regions[st->n_regions++] = g;
+	return 0;
+}
+
+
+
+/* Statistics of the w x h region at x, y of an 8, 16-bit or float image.
+	The region is clipped to the image; bits is the significant bits of
+	integer samples and sets the histogram bin width. */
+
+void stats_region (region_stats *rs, const char *img, int width, int height, int bps, int bits,
+			int x, int y, int w, int h)
+{
+px_moments m;
+const float *f;
+double sum, sumsq, v;
+long i;
+int r;
+
+
+	memset (rs, 0, sizeof (region_stats));
+	if (x < 0) x = 0;
+	if (y < 0) y = 0;
+	if (x >= width || y >= height) return;
+	if (w <= 0 || x + w > width) w = width - x;
+	if (h <= 0 || y + h > height) h = height - y;
+	rs->x = x;
+	rs->y = y;
+	rs->width = w;
+	rs->height = h;
+	rs->n = (long)w * h;
+	rs->shift = (bps == 2 && bits > 8) ? bits - 8 : 0;
+
+	if (bps == 4)
+	{
+		sum = sumsq = 0;
+		rs->min = rs->max = ((const float*)img)[(long)y*width + x];
+		for (r=y; r<y+h; r++)
+		{
+			f = (const float*)img + (long)r*width + x;
+			for (i=0; i<w; i++)
+			{
+				v = f[i];
+				sum += v;
+				sumsq += v * v;
+				if (v < rs->min) rs->min = v;
+				if (v > rs->max) rs->max = v;
+			}
+		}
+	}
+	else
+	{
+		px_moments_init (&m);
+		if (x == 0 && w == width)				/* Whole rows: one run */
+		{
+			img += (long)y * width * bps;
+			w *= h;
+			y = 0;
+			h = 1;
+		}
+		for (r=y; r<y+h; r++)
+			if (bps == 2)
+				px_stats16 ((const unsigned short*)img + (long)r*width + x, w, rs->shift, rs->hist, &m);
+			else
+				px_stats8 ((const unsigned char*)img + (long)r*width + x, w, rs->hist, &m);
+		sum = (double)m.sum;
+		sumsq = (double)m.sumsq;
+		rs->min = m.min;
+		rs->max = m.max;
+	}
+
+	rs->mean = sum / rs->n;
+	rs->var = sumsq / rs->n - rs->mean * rs->mean;
+	if (rs->var < 0) rs->var = 0;
+}
+
+
+
+/********************************************************************/
+
+
+/* One CSV row per region, or one JSON object for all of them. Called
+	with the lock held. */
+
+static void write_results (stats *st, const char *name, const framemeta *meta, const char *label,
+			const region_stats *rs, int n, int with_hist)
+{
+int k, i;
+
+
+	if (st->format == STATS_JSON)
+	{
+		fprintf (st->fp, "{\"name\":\"%s\",\"step\":%d,\"%s\":\"%s\",\"duty\":%d,\"exposure\":%g,\"gain\":%g,"
+			"\"timestamp\":%llu,\"regions\":[", name, meta->step, with_hist ? "led" : "index", label,
+			meta->dutycycle, meta->exposure, meta->gain, meta->timestamp);
+		for (k=0; k<n; k++)
+		{
+			fprintf (st->fp, "%s{\"region\":\"%dx%d+%d+%d\",\"n\":%ld,\"mean\":%.6g,\"var\":%.6g,\"min\":%g,\"max\":%g",
+				k ? "," : "", rs[k].width, rs[k].height, rs[k].x, rs[k].y, rs[k].n, rs[k].mean, rs[k].var,
+				rs[k].min, rs[k].max);
+			if (with_hist)
+			{
+				fprintf (st->fp, ",\"shift\":%d,\"hist\":[", rs[k].shift);
+				for (i=0; i<STATS_BINS; i++)
+					fprintf (st->fp, i ? ",%u" : "%u", rs[k].hist[i]);
+				fputc (']', st->fp);
+			}
+			fputc ('}', st->fp);
+		}
+		fprintf (st->fp, "]}\n");
+	}
+	else
+		for (k=0; k<n; k++)
+		{
+			fprintf (st->fp, "%s,%d,%s,%d,%g,%g,%llu,%dx%d+%d+%d,%ld,%.6g,%.6g,%g,%g,", name, meta->step, label,
+				meta->dutycycle, meta->exposure, meta->gain, meta->timestamp, rs[k].width, rs[k].height,
+				rs[k].x, rs[k].y, rs[k].n, rs[k].mean, rs[k].var, rs[k].min, rs[k].max);
+			for (i=0; with_hist && i<STATS_BINS; i++)
+				fprintf (st->fp, i ? " %u" : "%u", rs[k].hist[i]);
+			fputc ('\n', st->fp);
+		}
+	fflush (st->fp);
+}
+
+
+/* Statistics of all regions of an image, written out */
+
+static void image_results (stats *st, const char *img, int width, int height, int bps, int bits,
+			const framemeta *meta, const char *name, const char *label)
+{
+region_stats *rs;
+int k;
+
+
+	rs = malloc ((st->n_regions + 1) * sizeof (region_stats));
+	if (!rs) return;
+	stats_region (&rs[0], img, width, height, bps, bits, 0, 0, width, height);
+	for (k=0; k<st->n_regions; k++)
+		stats_region (&rs[k+1], img, width, height, bps, bits, st->regions[k].x, st->regions[k].y,
+			st->regions[k].width, st->regions[k].height);
+
+	pthread_mutex_lock (&st->lock);
+	write_results (st, name, meta, label, rs, st->n_regions + 1, bps != 4);
+	pthread_mutex_unlock (&st->lock);
+	free (rs);
+}
+
+
+
+/* Reflectance factor of a frame: 1 / (exposure * duty cycle / 255) */
+
+static double reflectance (const framemeta *meta)
+{
+	if (meta->exposure <= 0 || meta->dutycycle <= 0) return 1;
+	return 255.0 / (meta->exposure * meta->dutycycle);
+}
+
+
+static float *index_map (int mode, const held_frame *white, const held_frame *blue)
+{
+float *map;
+double fw, fb, w, b;
+long n, i;
+
+
+	n = (long)white->width * white->height;
+	map = malloc (n * sizeof (float));
+	if (!map) return NULL;
+	fw = reflectance (&white->meta);
+	fb = reflectance (&blue->meta);
+
+	for (i=0; i<n; i++)
+	{
+		if (white->bps == 2)
+		{
+			w = fw * ((const unsigned short*)white->img)[i];
+			b = fb * ((const unsigned short*)blue->img)[i];
+		}
+		else
+		{
+			w = fw * ((const unsigned char*)white->img)[i];
+			b = fb * ((const unsigned char*)blue->img)[i];
+		}
+		if (mode == INDEX_RATIO)
+			map[i] = (w > 0) ? (float)(b / w) : 0;
+		else
+			map[i] = (w + b > 0) ? (float)((w - b) / (w + b)) : 0;
+	}
+
+	return map;
+}
+
+
+
+/* Take the statistics of one saved image and write them out. With an index
+	mode, a white or blue frame is also held until a frame of the other
+	colour and the same size comes from the same camera; the index map of
+	the two is then returned (for the caller to save as name_ratio or
+	name_ndi, see stats_index_name(), and free), with its metadata, those
+	of the later frame, in *index_meta. Otherwise NULL. Thread safe. */
+
+float *stats_frame (stats *st, const char *img, int width, int height, int bps, int bits,
+			const framemeta *meta, const char *name, framemeta *index_meta)
+{
+held_frame self, other, *held;
+char mapname[1100];
+float *map;
+int c;
+
+
+	if (bps != 1 && bps != 2 && bps != 4) return NULL;
+	image_results (st, img, width, height, bps, bits, meta, name, led_name (meta->led));
+
+	if (!st->index_mode || bps == 4 || (meta->led != LED_WHITE && meta->led != LED_BLUE))
+		return NULL;
+
+	self.img = (char*)img;
+	self.width = width;
+	self.height = height;
+	self.bps = bps;
+	self.meta = *meta;
+	c = meta->led;
+	held = st->held[(meta->camera > 0 && meta->camera < MAX_CAMERAS) ? meta->camera : 0];
+
+	pthread_mutex_lock (&st->lock);
+	other = held[1-c];
+	if (other.img && other.width == width && other.height == height && other.bps == bps)
+		held[1-c].img = NULL;
+	else
+	{
+		other.img = NULL;
+		free (held[c].img);
+		held[c] = self;
+		held[c].img = malloc ((long)width * height * bps);
+		if (held[c].img)
+			memcpy (held[c].img, img, (long)width * height * bps);
+	}
+	pthread_mutex_unlock (&st->lock);
+	if (!other.img) return NULL;
+
+	map = (c == LED_WHITE) ? index_map (st->index_mode, &self, &other) : index_map (st->index_mode, &other, &self);
+	free (other.img);
+	if (!map) return NULL;
+
+	*index_meta = *meta;
+	index_meta->led = -1;
+	index_meta->dutycycle = 0;
+	snprintf (mapname, sizeof (mapname), "%s_%s", name, index_names[st->index_mode]);
+	image_results (st, (char*)map, width, height, 4, 0, index_meta, mapname, index_names[st->index_mode]);
+
+	return map;
+}
+
+
+
+int stats_close (stats *st)
+{
+int i, err;
+
+
+	if (!st) return 0;
+	for (i=0; i<MAX_CAMERAS; i++)
+	{
+		free (st->held[i][0].img);
+		free (st->held[i][1].img);
+	}
+	err = fclose (st->fp);
+	pthread_mutex_destroy (&st->lock);
+	free (st);
+	return err ? -1 : 0;
+}
@@ -0,0 +1,58 @@
+#ifndef __STATS_H
+#define __STATS_H
+
+#include "framemeta.h"
+#include "pixkern.h"
+
+
+/* Streaming frame statistics (--stats): per frame, and per region of
+	interest within it, the mean, variance, minimum, maximum and a histogram,
+	taken in one pass over the pixels as they are saved. With an index mode,
+	each white frame and the next blue one (or the other way round) are also
+	combined into a float map, e.g. blue / white reflectance.
+
+	Results go to a CSV file (one row per frame and region) or, if the name
+	ends in .json, to JSON lines (one object per frame). Regions are in the
+	pixels of the saved image, i.e. after binning and cropping.
+
+	Reflectance here is value / (exposure * duty cycle / 255), so that
+	frames taken at different settings can be compared.
+*/
+
+#define STATS_BINS			PX_HIST_BINS
+#define STATS_MAX_REGIONS	16
+
+#define STATS_CSV			0
+#define STATS_JSON			1
+
+#define INDEX_NONE			0
+#define INDEX_RATIO			1			/* blue / white */
+#define INDEX_NDI			2			/* (white - blue) / (white + blue) */
+
+
+typedef struct
+{
+	int x, y, width, height;		/* As used, i.e. clipped to the image */
+	long n;
+	double mean, var;
+	double min, max;
+	int shift;						/* Histogram bin i holds values from i << shift */
+	unsigned int hist[STATS_BINS];	/* Not for index maps */
+} region_stats;
+
+typedef struct stats stats;
+
+
+stats *stats_open (const char *fname, int index_mode);
+int stats_add_region (stats *st, const char *spec);
+float *stats_frame (stats *st, const char *img, int width, int height, int bps, int bits,
+			const framemeta *meta, const char *name, framemeta *index_meta);
+int stats_close (stats *st);
+int stats_parse_index (const char *name);
+const char *stats_index_name (stats *st);
+
+void stats_region (region_stats *rs, const char *img, int width, int height, int bps, int bits,
+			int x, int y, int w, int h);
+
+
+#endif
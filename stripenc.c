@@ -0,0 +1,386 @@
+/* stripenc.c
+
+	Parallel strip compression for tiffwrite(). The image is cut into
+	strips of a fixed number of rows, and a few worker threads compress
+	the strips independently. libtiff only gets to write the finished
+	strips (TIFFWriteRawStrip), so the codecs are implemented here (LZW)
+	or called directly (deflate, via zlib), following the TIFF 6.0
+	specification and libtiff's conventions where the specification
+	leaves a choice.
+
+*/
+
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <zlib.h>
+#include <tiffio.h>
+
+#include "tiffstuff.h"
+#include "stripenc.h"
+#include "trace.h"
+
+
+
+/*********************************************************************/
+
+/* TIFF LZW. Codes are 9 to 12 bits wide and packed MSB first. Every strip
+	starts with a Clear code and ends with EOI. The code width grows one code
+	early ("early change"), and the table is reset when it is about to
+	overflow, exactly as libtiff's own encoder does it, so that every TIFF
+	reader that handles libtiff output decodes these strips as well.
+*/
+
+#define LZW_CLEAR		256
+#define LZW_EOI			257
+#define LZW_FIRST		258
+#define LZW_MAXCODE(n)	((1L<<(n))-1)
+#define LZW_BITS_MIN	9
+#define LZW_BITS_MAX	12
+#define LZW_HSIZE		9001			/* Prime, about twice the table size */
+
+typedef struct
+{
+	unsigned char *op, *oplimit;		/* Output position and end of output buffer */
+	unsigned long nextdata;				/* Bit accumulator */
+	int nextbits;						/* Valid bits in the accumulator */
+	int nbits;							/* Current code width */
+	int32_t hkey[LZW_HSIZE];			/* Hash table: (byte << 12 | prefix code) -> code */
+	uint16_t hcode[LZW_HSIZE];
+} lzw_state;
+
+
+static void lzw_put (lzw_state *s, int code)
+{
+	s->nextdata = (s->nextdata << s->nbits) | code;
+	s->nextbits += s->nbits;
+	while (s->nextbits >= 8)
+	{
+		if (s->op < s->oplimit) *s->op = (unsigned char)(s->nextdata >> (s->nextbits-8));
+		s->op++;
+		s->nextbits -= 8;
+	}
+	s->nextdata &= (1UL << s->nextbits) - 1;
+}
+
+
+/* Compress n bytes from in into out (room for outsize bytes). Returns the
+	compressed size, or -1 if it did not fit. */
+
+static long lzw_encode (lzw_state *s, const unsigned char *in, long n, unsigned char *out, long outsize)
+{
+long i, maxcode;
+int32_t key;
+int ent, c, free_ent;
+unsigned h, disp;
+
+
+	s->op = out;
+	s->oplimit = out + outsize;
+	s->nextdata = 0;
+	s->nextbits = 0;
+	s->nbits = LZW_BITS_MIN;
+	maxcode = LZW_MAXCODE (LZW_BITS_MIN);
+	free_ent = LZW_FIRST;
+	memset (s->hkey, 0xff, sizeof (s->hkey));
+
+	lzw_put (s, LZW_CLEAR);
+
+	if (n > 0)
+	{
+		ent = in[0];
+		for (i=1; i<n; i++)
+		{
+			c = in[i];
+			key = ((int32_t)c << LZW_BITS_MAX) | ent;
+
+			/* Look for the string ent+c in the table (open addressing, double hashing) */
+
+			h = (unsigned)(((unsigned)c << 5) ^ (unsigned)ent) % LZW_HSIZE;
+			disp = (h == 0) ? 1 : LZW_HSIZE - h;
+			while (s->hkey[h] >= 0 && s->hkey[h] != key)
+				h = (h >= disp) ? h - disp : h + LZW_HSIZE - disp;
+			if (s->hkey[h] == key)
+			{
+				ent = s->hcode[h];
+				continue;
+			}
+
+			/* Not found: emit the prefix, make a new table entry */
+
+			lzw_put (s, ent);
+			ent = c;
+			s->hkey[h] = key;
+			s->hcode[h] = free_ent++;
+			if (free_ent == LZW_MAXCODE (LZW_BITS_MAX) - 1)
+			{
+				memset (s->hkey, 0xff, sizeof (s->hkey));
+				lzw_put (s, LZW_CLEAR);
+				free_ent = LZW_FIRST;
+				s->nbits = LZW_BITS_MIN;
+				maxcode = LZW_MAXCODE (LZW_BITS_MIN);
+			}
+			else if (free_ent > maxcode)
+			{
+				s->nbits++;
+				maxcode = LZW_MAXCODE (s->nbits);
+			}
+		}
+
+		/* Last pending string. The decoder adds a table entry for it,
+			so the code width may change before EOI */
+
+		lzw_put (s, ent);
+		free_ent++;
+		if (free_ent == LZW_MAXCODE (LZW_BITS_MAX) - 1)
+		{
+			lzw_put (s, LZW_CLEAR);
+			s->nbits = LZW_BITS_MIN;
+		}
+		else if (free_ent > maxcode)
+			s->nbits++;
+	}
+
+	lzw_put (s, LZW_EOI);
+	if (s->nextbits > 0)
+	{
+		if (s->op < s->oplimit) *s->op = (unsigned char)(s->nextdata << (8 - s->nextbits));
+		s->op++;
+	}
+
+	if (s->op > s->oplimit) return -1;
+	return (long)(s->op - out);
+}
+
+
+
+/*********************************************************************/
+
+/* Horizontal differencing (TIFF predictor 2): every sample is replaced by
+	its difference to the same channel of the previous pixel in the row.
+	16-bit samples are differenced as native-order words, which is what
+	libtiff does before it would swap bytes. */
+
+static void hor_diff (unsigned char *row, int width, int bps)
+{
+unsigned short *w;
+int i, n, k;
+
+
+	if (bps == 2 || bps == 6)
+	{
+		w = (unsigned short*)row;
+		k = bps / 2;							/* bps 6 is three 16-bit channels */
+		for (i=width*k-1; i>=k; i--)
+			w[i] = (unsigned short)(w[i] - w[i-k]);
+	}
+	else
+	{
+		n = width * bps;						/* bps 3 is three 8-bit channels */
+		for (i=n-1; i>=bps; i--)
+			row[i] = (unsigned char)(row[i] - row[i-bps]);
+	}
+}
+
+
+
+/*********************************************************************/
+
+/* The worker threads share one job description and pick strips by
+	incrementing a common counter, so that fast threads take over more strips */
+
+typedef struct
+{
+	const unsigned char *img;
+	int width;
+	int bps;
+	long rowbytes;
+	long stride;
+	int height;
+	int rows_per_strip;
+	int nstrips;
+	int compression;
+	int level;
+	int predictor;
+	encstrip *strips;
+	atomic_int next;
+} strip_job;
+
+
+/* Compress n bytes of src into one strip. Returns the strip size or -1 */
+
+static long encode_one (strip_job *job, lzw_state *s, const unsigned char *src, long n, encstrip *strip)
+{
+long outsize;
+uLongf zsize;
+
+
+	if (job->compression == COMPRESSION_LZW)
+		outsize = n + n/2 + 16;		/* At most 12 bits per input byte, plus Clear/EOI codes and padding */
+	else if (job->compression == COMPRESSION_ADOBE_DEFLATE)
+		outsize = (long)compressBound ((uLong)n);
+	else
+		outsize = n;
+
+	strip->data = malloc (outsize > 0 ? outsize : 1);
+	if (!strip->data) return -1;
+
+	if (job->compression == COMPRESSION_LZW)
+		return lzw_encode (s, src, n, strip->data, outsize);
+
+	if (job->compression == COMPRESSION_ADOBE_DEFLATE)
+	{
+		zsize = (uLongf)outsize;
+		if (compress2 (strip->data, &zsize, src, (uLong)n,
+				job->level > 0 ? job->level : Z_DEFAULT_COMPRESSION) != Z_OK)
+			return -1;
+		return (long)zsize;
+	}
+
+	memcpy (strip->data, src, n);
+	return n;
+}
+
+
+static void *strip_worker (void *arg)
+{
+strip_job *job = (strip_job*)arg;
+lzw_state *s;
+unsigned char *tmp;
+const unsigned char *src;
+long n, r;
+int i, rows;
+
+
+	s = malloc (sizeof (lzw_state));
+	tmp = NULL;
+	if (job->predictor == PREDICTOR_HORIZONTAL || job->stride != job->rowbytes)
+		tmp = malloc (job->rows_per_strip * job->rowbytes);
+	if (!s || ((job->predictor == PREDICTOR_HORIZONTAL || job->stride != job->rowbytes) && !tmp))
+	{
+		free (s);
+		free (tmp);
+		return NULL;
+	}
+
+	while ((i = atomic_fetch_add (&job->next, 1)) < job->nstrips)
+	{
+		rows = job->height - i*job->rows_per_strip;
+		if (rows > job->rows_per_strip) rows = job->rows_per_strip;
+		n = rows * job->rowbytes;
+		src = job->img + (long)i*job->rows_per_strip*job->stride;
+
+		/* The predictor works on a copy, the caller's image stays untouched.
+			Padded rows are gathered into the copy as well. */
+
+		TRACE_BEGIN (2, "strip");
+		if (tmp)
+		{
+			if (job->stride == job->rowbytes)
+				memcpy (tmp, src, n);
+			else
+				for (r=0; r<rows; r++)
+					memcpy (tmp + r*job->rowbytes, src + r*job->stride, job->rowbytes);
+			if (job->predictor == PREDICTOR_HORIZONTAL)
+				for (r=0; r<rows; r++)
+					hor_diff (tmp + r*job->rowbytes, job->width, job->bps);
+			src = tmp;
+		}
+
+		job->strips[i].size = encode_one (job, s, src, n, &job->strips[i]);
+		TRACE_END (2, "strip");
+	}
+
+	free (tmp);
+	free (s);
+	return NULL;
+}
+
+
+
+/* Can strips with this compression scheme be produced here? */
+
+int strips_supported (int compression)
+{
+	return compression == COMPRESSION_LZW
+		|| compression == COMPRESSION_ADOBE_DEFLATE
+		|| compression == COMPRESSION_NONE;
+}
+
+
+
+/* Cut the image (width x height pixels of bps bytes, rows stride bytes
+	apart) into strips of opt->rows_per_strip rows and compress them with
+	opt->threads threads, applying opt->predictor and opt->level. Returns
+	an array of *nstrips strips, or NULL on failure. The caller releases
+	it with strips_free().
+*/
+
+encstrip *strips_encode (const char *img, int width, int height, long stride, int bps, int compression,
+			const tiff_options *opt, int *nstrips)
+{
+strip_job job;
+pthread_t *tid;
+int i, nthreads, started;
+
+
+	job.img = (const unsigned char*)img;
+	job.width = width;
+	job.bps = bps;
+	job.rowbytes = (long)width * bps;
+	job.stride = stride;
+	job.height = height;
+	job.compression = compression;
+	job.level = opt->level;
+	job.predictor = (compression == COMPRESSION_NONE) ? PREDICTOR_NONE : opt->predictor;
+	job.rows_per_strip = (opt->rows_per_strip > 0 && opt->rows_per_strip < height) ? opt->rows_per_strip : height;
+	job.nstrips = (height + job.rows_per_strip - 1) / job.rows_per_strip;
+	atomic_init (&job.next, 0);
+	job.strips = calloc (job.nstrips, sizeof (encstrip));
+	if (!job.strips) return NULL;
+
+	nthreads = (opt->threads > 0) ? opt->threads : 1;
+	if (nthreads > job.nstrips) nthreads = job.nstrips;
+	tid = malloc (nthreads * sizeof (pthread_t));
+	if (!tid)
+	{
+		free (job.strips);
+		return NULL;
+	}
+
+	/* The calling thread works along with the others */
+
+	started = 0;
+	for (i=1; i<nthreads; i++)
+		if (!pthread_create (&tid[started], NULL, strip_worker, &job))
+			started++;
+	strip_worker (&job);
+	for (i=0; i<started; i++)
+		pthread_join (tid[i], NULL);
+	free (tid);
+
+	for (i=0; i<job.nstrips; i++)
+		if (!job.strips[i].data || job.strips[i].size < 0)
+		{
+			strips_free (job.strips, job.nstrips);
+			return NULL;
+		}
+
+	*nstrips = job.nstrips;
+	return job.strips;
+}
+
+
+
+void strips_free (encstrip *strips, int nstrips)
+{
+int i;
+
+	for (i=0; i<nstrips; i++)
+		free (strips[i].data);
+	free (strips);
+}
@@ -0,0 +1,25 @@
+#ifndef __STRIPENC_H
+#define __STRIPENC_H
+
+#include "tiffstuff.h"
+
+
+/* Compressed TIFF strips, produced outside of libtiff so that several
+	strips can be compressed at the same time. The result is written with
+	TIFFWriteRawStrip() in strip order.
+*/
+
+typedef struct
+{
+	unsigned char *data;
+	long size;					/* Compressed bytes in data, -1 on error */
+} encstrip;
+
+
+int strips_supported (int compression);
+encstrip *strips_encode (const char *img, int width, int height, long stride, int bps, int compression,
+			const tiff_options *opt, int *nstrips);
+void strips_free (encstrip *strips, int nstrips);
+
+
+#endif
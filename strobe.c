@@ -0,0 +1,232 @@
+/* strobe.c
+
+	Switching the LEDs for sequence steps: steadily by PWM around the
+	capture, gated by the camera's exposure signal, or as a pigpio wave
+	that also triggers the camera. See strobe.h.
+
+*/
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pigpiod_if2.h>
+
+#include "acquire.h"
+#include "framemeta.h"
+#include "strobe.h"
+#include "trace.h"
+
+
+
+/* The GPIO bit mask of the LEDs of one colour setting */
+
+static unsigned led_mask (int led)
+{
+	switch (led)
+	{
+		case White: return 1u << WHITE_LED_PIN;
+		case Blue: return 1u << BLUE_LED_PIN;
+		case White_and_blue: return (1u << WHITE_LED_PIN) | (1u << BLUE_LED_PIN);
+	}
+	return 0;
+}
+
+
+/* Set the PWM duty cycle of one LED, unless it is set already */
+
+static void set_duty (strobe *st, unsigned pin, int *current, int dutycycle)
+{
+	if (*current == dutycycle) return;
+	if (set_PWM_dutycycle (st->pi, pin, dutycycle) < 0)
+		dp (0, "Could not set the duty cycle of GPIO %u\n", pin);
+	*current = dutycycle;
+}
+
+
+
+/* Prepare the LED (and, for waves, trigger) pins. Returns 0 or -1. */
+
+int strobe_open (strobe *st, int pi, int mode, unsigned trigger_pin, unsigned lead)
+{
+	memset (st, 0, sizeof (strobe));
+	st->pi = pi;
+	st->mode = mode;
+	st->trigger_pin = trigger_pin;
+	st->lead = (lead < 10) ? 10 : lead;			/* Shorter trigger pulses may go unseen */
+	st->duty_white = -1;
+	st->duty_blue = -1;
+
+	if (set_mode (pi, WHITE_LED_PIN, PI_OUTPUT) < 0 || set_mode (pi, BLUE_LED_PIN, PI_OUTPUT) < 0)
+		return -1;
+
+	if (mode == STROBE_WAVE)
+	{
+		/* Waves and PWM cannot share a pin: plain outputs, all low */
+
+		if (set_mode (pi, trigger_pin, PI_OUTPUT) < 0)
+			return -1;
+		gpio_write (pi, trigger_pin, 0);
+		gpio_write (pi, WHITE_LED_PIN, 0);
+		gpio_write (pi, BLUE_LED_PIN, 0);
+		wave_clear (pi);
+	}
+	else
+	{
+		set_PWM_frequency (pi, WHITE_LED_PIN, STROBE_PWM_FREQ);
+		set_PWM_frequency (pi, BLUE_LED_PIN, STROBE_PWM_FREQ);
+		set_duty (st, WHITE_LED_PIN, &st->duty_white, 0);
+		set_duty (st, BLUE_LED_PIN, &st->duty_blue, 0);
+	}
+
+	return 0;
+}
+
+
+
+/* The wave for one step: trigger high for lead microseconds, then the LEDs
+	on for their share of the exposure. Made on first use and kept. */
+
+static int step_wave (strobe *st, int led, int dutycycle, unsigned exposure)
+{
+gpioPulse_t pulses[3];
+unsigned ontime, trig, leds;
+int i, n, id;
+
+
+	for (i=0; i<st->n_waves; i++)
+		if (st->waves[i].led == led && st->waves[i].dutycycle == dutycycle
+				&& st->waves[i].exposure == exposure)
+			return st->waves[i].id;
+
+	if (st->n_waves == STROBE_MAX_WAVES)		/* Start over rather than exhaust pigpio */
+	{
+		wave_clear (st->pi);
+		st->n_waves = 0;
+	}
+
+	trig = 1u << st->trigger_pin;
+	leds = led_mask (led);
+	if (dutycycle < 0) dutycycle = 0;
+	if (dutycycle > 255) dutycycle = 255;
+	ontime = (unsigned)((unsigned long long)exposure * dutycycle / 255);
+
+	n = 0;
+	pulses[n].gpioOn = trig;
+	pulses[n].gpioOff = 0;
+	pulses[n++].usDelay = st->lead;
+	if (leds && ontime)
+	{
+		pulses[n].gpioOn = leds;
+		pulses[n].gpioOff = trig;
+		pulses[n++].usDelay = ontime;
+		pulses[n].gpioOn = 0;
+		pulses[n].gpioOff = leds;
+		pulses[n++].usDelay = 0;
+	}
+	else
+	{
+		pulses[n].gpioOn = 0;
+		pulses[n].gpioOff = trig;
+		pulses[n++].usDelay = 0;
+	}
+
+	if (wave_add_generic (st->pi, n, pulses) < 0)
+		return -1;
+	id = wave_create (st->pi);
+	if (id < 0)
+		return -1;
+
+	st->waves[st->n_waves].led = led;
+	st->waves[st->n_waves].dutycycle = dutycycle;
+	st->waves[st->n_waves].exposure = exposure;
+	st->waves[st->n_waves].id = id;
+	st->n_waves++;
+	dp (2, "Wave %d: LEDs %s for %u of %u us\n", id, led_name (led), ontime, exposure);
+
+	return id;
+}
+
+
+
+/* Light the LEDs for the next frame. For STROBE_WAVE this also triggers the
+	camera, so the frame must then only be waited for. exposure is in
+	microseconds. Returns 0 or -1. */
+
+int strobe_on (strobe *st, int led, int dutycycle, double exposure)
+{
+int id, err;
+
+
+	TRACE_BEGIN (1, "led_on");
+	err = -1;
+	switch (st->mode)
+	{
+		case STROBE_WAVE:
+			id = step_wave (st, led, dutycycle, (unsigned)exposure);
+			if (id < 0 || wave_send_once (st->pi, id) < 0)
+				dp (0, "Could not send the strobe wave\n");
+			else
+				err = 0;
+			break;
+
+		case STROBE_CAMERA:
+		case STROBE_STEADY:
+			set_duty (st, WHITE_LED_PIN, &st->duty_white, (led == White || led == White_and_blue) ? dutycycle : 0);
+			set_duty (st, BLUE_LED_PIN, &st->duty_blue, (led == Blue || led == White_and_blue) ? dutycycle : 0);
+			st->lit = 1;
+			err = 0;
+			break;
+	}
+	TRACE_END (1, "led_on");
+
+	return err;
+}
+
+
+
+/* After the frame has arrived. Only STROBE_STEADY has to do anything. */
+
+int strobe_off (strobe *st)
+{
+	if (st->mode != STROBE_STEADY || !st->lit)
+		return 0;
+	TRACE_BEGIN (1, "led_off");
+	set_duty (st, WHITE_LED_PIN, &st->duty_white, 0);
+	set_duty (st, BLUE_LED_PIN, &st->duty_blue, 0);
+	st->lit = 0;
+	TRACE_END (1, "led_off");
+	return 0;
+}
+
+
+
+/* LEDs off, waves released */
+
+void strobe_close (strobe *st)
+{
+	if (st->mode == STROBE_WAVE)
+	{
+		wave_tx_stop (st->pi);
+		wave_clear (st->pi);
+		gpio_write (st->pi, WHITE_LED_PIN, 0);
+		gpio_write (st->pi, BLUE_LED_PIN, 0);
+		gpio_write (st->pi, st->trigger_pin, 0);
+	}
+	else
+	{
+		set_duty (st, WHITE_LED_PIN, &st->duty_white, 0);
+		set_duty (st, BLUE_LED_PIN, &st->duty_blue, 0);
+	}
+	st->n_waves = 0;
+}
+
+
+
+int strobe_parse_mode (const char *name)
+{
+	if (!strcmp (name, "steady")) return STROBE_STEADY;
+	if (!strcmp (name, "camera")) return STROBE_CAMERA;
+	if (!strcmp (name, "wave")) return STROBE_WAVE;
+	return -1;
+}
@@ -0,0 +1,57 @@
+#ifndef __STROBE_H
+#define __STROBE_H
+
+
+/* LED control for sequence steps, through pigpiod.
+
+	STROBE_STEADY	PWM on before the frame is taken and off after it has
+					arrived (the LEDs are lit through trigger, readout and
+					transfer).
+	STROBE_CAMERA	The camera's ExposureActive output gates the LED drivers
+					in hardware. The PWM duty cycle is only sent when it
+					changes; the LEDs light during the exposure alone.
+	STROBE_WAVE		A pigpio wave raises the camera's trigger line and switches
+					the LEDs on for the exposure window only, timed by the
+					Pi's DMA. The light dose is set by the on-time,
+					exposure * dutycycle / 255, instead of by PWM. The waves
+					are made once per LED, duty cycle and exposure, so a step
+					costs one socket command.
+*/
+
+#define STROBE_STEADY		0
+#define STROBE_CAMERA		1
+#define STROBE_WAVE			2
+
+#define STROBE_TRIGGER_PIN	18			/* GPIO wired to the camera's trigger input */
+#define STROBE_LEAD			20			/* Microseconds from trigger edge to exposure start */
+#define STROBE_MAX_WAVES	32
+#define STROBE_PWM_FREQ		8000
+
+
+typedef struct
+{
+	int pi;						/* pigpiod connection */
+	int mode;
+	unsigned trigger_pin;
+	unsigned lead;
+	int duty_white;				/* Duty cycles set now, -1 if unknown */
+	int duty_blue;
+	int lit;					/* STROBE_STEADY: LEDs to switch off after the frame */
+	int n_waves;
+	struct
+	{
+		int led, dutycycle;
+		unsigned exposure;
+		int id;
+	} waves[STROBE_MAX_WAVES];
+} strobe;
+
+
+int strobe_open (strobe *st, int pi, int mode, unsigned trigger_pin, unsigned lead);
+int strobe_on (strobe *st, int led, int dutycycle, double exposure);
+int strobe_off (strobe *st);
+void strobe_close (strobe *st);
+int strobe_parse_mode (const char *name);
+
+
+#endif
@@ -1,7 +1,7 @@
 /* tiffstuff.c 
 
 	Functions to write an image data array to a TIFF file
-	Free bonus offer! Also includes PGM/PBM export.
+	Free bonus offer! Also includes PGM/PBM and PNG export.
 
 */
 
@@ -9,50 +9,250 @@
 
 
 #include <tiffio.h>
+#include <png.h>
+#include <zlib.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
 
 #include "tiffstuff.h"
+#include "stripenc.h"
+#include "pixkern.h"
+#include "pngfast.h"
+#include "dio.h"
+#include "trace.h"
+
+
+static int tiff_put_image (TIFF *tif, const imgview *v, const tiff_options *opt);
+static int tiff_put_levels (TIFF *tif, const pyramid *levels, const tiff_options *opt);
+
+
+tiff_options tiffopts = { COMPRESSION_LZW, 0, PREDICTOR_NONE, 0, 1 };	/* Single LZW strip, libtiff encoder */
 
 
 
 /*********************************************************************/
 
+/* libtiff client I/O on a dio_file, for dioopts.enabled */
+
+static tmsize_t tiff_dio_read (thandle_t h, void *buf, tmsize_t size)
+{
+dio_file *f = (dio_file*)h;
+ssize_t n;
+
+	n = dio_pread (f, buf, (size_t)size, dio_seek (f, 0, SEEK_CUR));
+	if (n > 0) dio_seek (f, n, SEEK_CUR);
+	return (tmsize_t)n;
+}
+
+static tmsize_t tiff_dio_write (thandle_t h, void *buf, tmsize_t size)
+{
+	return (tmsize_t)dio_write ((dio_file*)h, buf, (size_t)size);
+}
+
+static toff_t tiff_dio_seek (thandle_t h, toff_t off, int whence)
+{
+	return (toff_t)dio_seek ((dio_file*)h, (int64_t)off, whence);
+}
+
+static int tiff_dio_close (thandle_t h)
+{
+	return dio_close ((dio_file*)h);
+}
+
+static toff_t tiff_dio_size (thandle_t h)
+{
+	return (toff_t)dio_size ((dio_file*)h);
+}
+
+static int tiff_dio_map (thandle_t h, void **base, toff_t *size)
+{
+	return 0;
+}
+
+static void tiff_dio_unmap (thandle_t h, void *base, toff_t size)
+{
+}
 
 
-/* Write data to a TIFF file. Data is used "blindly", i.e., as a sequence of bytes.
-	This is straightforward for 8-bit images, but the caller must ensure that
-	16-bit images originate from a short or unsigned short buffer with MSB first.
+/* TIFFOpen() for writing, or the same through dio.c. expected_bytes is
+	allocated up front if > 0. */
+
+static TIFF *tiff_open (const char *fname, const char *mode, long long expected_bytes)
+{
+dio_file *f;
+TIFF *tif;
+
+
+	if (!dioopts.enabled)
+		return TIFFOpen (fname, mode);
+
+	f = dio_open (fname, expected_bytes, NULL);
+	if (!f) return NULL;
+	tif = TIFFClientOpen (fname, mode, (thandle_t)f, tiff_dio_read, tiff_dio_write, tiff_dio_seek,
+		tiff_dio_close, tiff_dio_size, tiff_dio_map, tiff_dio_unmap);
+	if (!tif) dio_close (f);
+
+	return tif;
+}
+
+
+
+/* TIFFClose(), which returns nothing, for a file that was written: 0, or
+	-1 if the last data, the directory or the close itself failed. With
+	dio.c that is where a failed O_DIRECT write shows. */
+
+static int tiff_close (TIFF *tif)
+{
+TIFFCloseProc closeproc;
+thandle_t handle;
+int err;
+
+
+	err = TIFFFlush (tif) ? 0 : -1;
+	closeproc = TIFFGetCloseProc (tif);
+	handle = TIFFClientdata (tif);
+	TIFFCleanup (tif);
+	if (closeproc (handle)) err = -1;
+
+	return err;
+}
+
+
+
+/*********************************************************************/
+
+
+
+/* Write data to a TIFF file. 16-bit samples are taken in host byte order,
+	as libtiff writes them, i.e. as a short or unsigned short buffer.
 	For RGB images, the color bytes are interlaced in the order R - G - B - R - G - ...
 
 	In addition to the buffer, the image dimensions width x height need to be provided
 	(in pixels, not in bytes, meaning, the total number of bytes is bps*width*height)
-	The parameter bps specifies the image type (1, 2, or 3 for 8-bit, 16-bit, and RGB,
-	respecvtively).
+	The parameter bps specifies the image type (1, 2, 3 or 4 for 8-bit, 16-bit, RGB
+	and 32-bit float, respecvtively; 6 for RGB with 16-bit channels).
 	The comment string is optional. A NULL pointer may be passed.
+	tiffwrite() uses the strip layout in the global tiffopts, tiffwrite_opt()
+	takes it as an argument. With dioopts.enabled, the file is written
+	through dio.c, bypassing the page cache.
+	Integer samples are tagged unsigned (SAMPLEFORMAT_UINT). tiffwrite_view()
+	and tiffwrite_view_opt() take an image view (imgview.h) instead, which
+	may have padded rows, signed samples (tagged SAMPLEFORMAT_INT) and
+	pyramid levels; padded rows are written as they are, and only a
+	big-endian view is swapped, into a copy.
 */
 
 
 int tiffwrite (const char* fname, char* img, int width, int height, int bps, char* comment)
+{
+	return tiffwrite_opt (fname, img, width, height, bps, comment, &tiffopts);
+}
+
+
+
+int tiffwrite_opt (const char* fname, char* img, int width, int height, int bps, char* comment,
+			const tiff_options *opt)
+{
+imgview v;
+
+
+	imgview_init (&v, img, width, height, bps);
+	v.comment = comment;
+	return tiffwrite_view_opt (fname, &v, opt);
+}
+
+
+/* tiffwrite() with the reduced-resolution levels of a pyramid (may be
+	NULL or empty) as SubIFDs of the image, for viewers that can show
+	them instead of the full frame */
+
+int tiffwrite_levels (const char* fname, char* img, int width, int height, int bps, char* comment,
+			const pyramid *levels)
+{
+imgview v;
+
+
+	imgview_init (&v, img, width, height, bps);
+	v.comment = comment;
+	v.levels = levels;
+	return tiffwrite_view_opt (fname, &v, &tiffopts);
+}
+
+
+int tiffwrite_view (const char *fname, const imgview *v)
+{
+	return tiffwrite_view_opt (fname, v, &tiffopts);
+}
+
+
+int tiffwrite_view_opt (const char *fname, const imgview *v, const tiff_options *opt)
 {
 TIFF *tif;
-long numbytes;
-float tiff_dpi = 600.0;
+long long size;
+int err, levels;
 
 
-	tif = TIFFOpen(fname, "w");
+	levels = v->levels && v->levels->levels > 0;
+	size = (long long)v->width * v->height * v->bps;
+	tif = tiff_open (fname, "w", (levels ? size * 4 / 3 : size) + 4096);
 	if (!tif) return -1;
 
+	err = tiff_put_image (tif, v, opt);
+	if (!err && levels)
+		err = tiff_put_levels (tif, v->levels, opt);
+
+	if (tiff_close (tif)) err = -1;
+
+	return err;
+}
+
+
+
+/* Tags and image data of one image (directory) of an open TIFF file.
+	Shared by tiffwrite_opt() and the stack writer. Padded rows are taken
+	as they are; big-endian samples are swapped into a copy, as libtiff
+	writes host order. Returns 0 or -1. */
+
+static int tiff_put_image (TIFF *tif, const imgview *v, const tiff_options *opt)
+{
+long rowbytes, stride;
+float tiff_dpi = 600.0;
+tiff_options local;
+encstrip *strips;
+const char *img, *comment;
+char *owned, *strip;
+int i, r, n, nstrips, rows, compression, width, height, bps, err;
+
+
+	err = 0;
+	width = v->width;
+	height = v->height;
+	bps = v->bps;
+	comment = v->comment;
+
 	/* Let's start with some general tags */
 
 	TIFFSetField(tif, TIFFTAG_IMAGEWIDTH, width);
 	TIFFSetField(tif, TIFFTAG_IMAGELENGTH, height);
 	//TIFFSetField(tif, TIFFTAG_IMAGEDEPTH, depth);			/* Optional: Can save multi-slice images */
 
-	/* Compression. By default, use LZW */
+	/* Compression. By default, use LZW. Fall back to it if libtiff was built
+		without the requested codec */
 
-	TIFFSetField(tif, TIFFTAG_COMPRESSION, COMPRESSION_LZW);
+	compression = opt->compression;
+	if (!TIFFIsCODECConfigured ((uint16_t)compression))
+	{
+		fprintf (stderr, "TIFF write warning: %s compression not available, using LZW\n",
+					tiff_compression_name (compression));
+		compression = COMPRESSION_LZW;
+	}
+	TIFFSetField(tif, TIFFTAG_COMPRESSION, compression);
 
 	if (comment && strlen(comment) > (size_t) 0) 
 		TIFFSetField(tif, TIFFTAG_IMAGEDESCRIPTION, comment);
@@ -75,12 +275,11 @@ float tiff_dpi = 600.0;
     	TIFFSetField(tif, TIFFTAG_BITSPERSAMPLE,  8);
     	TIFFSetField(tif, TIFFTAG_PHOTOMETRIC,    PHOTOMETRIC_MINISBLACK);
 	}
-	else if (bps==2)			/* Signed short */
+	else if (bps==2)			/* 16-bit, unsigned as the camera delivers them unless the view says otherwise */
 	{
 		TIFFSetField(tif, TIFFTAG_SAMPLESPERPIXEL, 1);
     	TIFFSetField(tif, TIFFTAG_BITSPERSAMPLE,  16);
     	TIFFSetField(tif, TIFFTAG_PHOTOMETRIC,    PHOTOMETRIC_MINISBLACK);
-		TIFFSetField(tif, TIFFTAG_SAMPLEFORMAT,   SAMPLEFORMAT_INT); /* Signed! */
 	}
 	else if (bps==3)			/* RGB, 8-bit channels */
 	{
@@ -88,21 +287,319 @@ float tiff_dpi = 600.0;
 		TIFFSetField(tif, TIFFTAG_BITSPERSAMPLE,  8);
 		TIFFSetField(tif, TIFFTAG_PHOTOMETRIC,    PHOTOMETRIC_RGB);
 	}
+	else if (bps==6)			/* RGB, 16-bit channels, e.g. demosaiced 12-bit frames */
+	{
+		TIFFSetField(tif, TIFFTAG_SAMPLESPERPIXEL, 3);
+		TIFFSetField(tif, TIFFTAG_BITSPERSAMPLE,  16);
+		TIFFSetField(tif, TIFFTAG_PHOTOMETRIC,    PHOTOMETRIC_RGB);
+	}
+	else if (bps==4)			/* 32-bit float, e.g. averaged frames */
+	{
+		TIFFSetField(tif, TIFFTAG_SAMPLESPERPIXEL, 1);
+		TIFFSetField(tif, TIFFTAG_BITSPERSAMPLE,  32);
+		TIFFSetField(tif, TIFFTAG_PHOTOMETRIC,    PHOTOMETRIC_MINISBLACK);
+		TIFFSetField(tif, TIFFTAG_SAMPLEFORMAT,   SAMPLEFORMAT_IEEEFP);
+	}
 	else						/* Please make sure this does not happen :-(     */
 	{
-		TIFFClose (tif);
 		return -1;
 	}
+	if (bps != 4)
+		TIFFSetField(tif, TIFFTAG_SAMPLEFORMAT, v->is_signed ? SAMPLEFORMAT_INT : SAMPLEFORMAT_UINT);
+
+	/* Codec parameters. These must follow the compression and sample tags.
+		Horizontal differencing of floats does not pay, so they get none. */
+
+	if (bps == 4 && opt->predictor != PREDICTOR_NONE)
+	{
+		local = *opt;
+		local.predictor = PREDICTOR_NONE;
+		opt = &local;
+	}
+	if (compression != COMPRESSION_NONE && opt->predictor == PREDICTOR_HORIZONTAL)
+		TIFFSetField(tif, TIFFTAG_PREDICTOR, PREDICTOR_HORIZONTAL);
+	if (opt->level > 0)
+	{
+		if (compression == COMPRESSION_ADOBE_DEFLATE)
+			TIFFSetField(tif, TIFFTAG_ZIPQUALITY, opt->level);
+		else if (compression == COMPRESSION_ZSTD)
+			TIFFSetField(tif, TIFFTAG_ZSTD_LEVEL, opt->level);
+		else if (compression == COMPRESSION_LZMA)
+			TIFFSetField(tif, TIFFTAG_LZMAPRESET, opt->level);
+	}
 
 	/* Actually write image data, this is the last step */
 
-	numbytes = (long)bps * (long)width * (long)height;
-	TIFFSetField(tif, TIFFTAG_ROWSPERSTRIP, height);
-   	TIFFWriteEncodedStrip (tif, 0, img, numbytes);
+	rowbytes = (long)bps * (long)width;
+	rows = (opt->rows_per_strip > 0 && opt->rows_per_strip < height) ? opt->rows_per_strip : height;
+	img = v->data;
+	stride = v->stride;
+	owned = NULL;
+	if (!imgview_host_order (v))
+	{
+		img = imgview_pixels (v, &owned);
+		if (!img) return -1;
+		stride = rowbytes;
+	}
+
+	if (opt->threads > 1 && rows < height && strips_supported (compression))
+	{
+		/* Parallel mode: compress all strips first, then hand them to libtiff in order */
+
+		TRACE_BEGIN (1, "encode");
+		strips = strips_encode (img, width, height, stride, bps, compression, opt, &nstrips);
+		TRACE_END (1, "encode");
+		free (owned);
+		if (!strips) return -1;
+		TRACE_BEGIN (1, "write");
+		TIFFSetField(tif, TIFFTAG_ROWSPERSTRIP, rows);
+		for (i=0; i<nstrips && !err; i++)
+			err = TIFFWriteRawStrip (tif, i, strips[i].data, strips[i].size) < 0;
+		TRACE_END (1, "write");
+		strips_free (strips, nstrips);
+	}
+	else
+	{
+		/* libtiff encodes and writes each strip in one call. It takes
+			strips without padding, so padded rows are gathered a strip
+			at a time. */
+
+		strip = NULL;
+		if (stride != rowbytes && !(strip = malloc (rows * rowbytes)))
+		{
+			free (owned);
+			return -1;
+		}
+		TRACE_BEGIN (1, "encode_write");
+		TIFFSetField(tif, TIFFTAG_ROWSPERSTRIP, rows);
+		for (i=0; i*rows < height && !err; i++)
+		{
+			n = (height - i*rows < rows) ? height - i*rows : rows;
+			if (strip)
+				for (r=0; r<n; r++)
+					memcpy (strip + r*rowbytes, img + (long)(i*rows + r)*stride, rowbytes);
+			err = TIFFWriteEncodedStrip (tif, i, strip ? strip : (char*)img + (long)i*rows*stride, n * rowbytes) < 0;
+		}
+		TRACE_END (1, "encode_write");
+		free (strip);
+		free (owned);
+	}
+
+	return err ? -1 : 0;
+}
 
-	TIFFClose(tif);
 
-	return 0;
+
+/* The levels of a pyramid as the SubIFDs of the image just put into tif,
+	which is written here. libtiff makes the next levels->levels directories
+	the SubIFDs and then goes on with the main chain. */
+
+static int tiff_put_levels (TIFF *tif, const pyramid *levels, const tiff_options *opt)
+{
+toff_t offsets[PYRAMID_LEVELS];
+imgview v;
+int i;
+
+
+	memset (offsets, 0, sizeof (offsets));
+	TIFFSetField (tif, TIFFTAG_SUBIFD, (uint16_t)levels->levels, offsets);
+	if (!TIFFWriteDirectory (tif)) return -1;
+
+	TRACE_BEGIN (1, "levels");
+	for (i=0; i<levels->levels; i++)
+	{
+		TIFFSetField (tif, TIFFTAG_SUBFILETYPE, FILETYPE_REDUCEDIMAGE);
+		imgview_init (&v, levels->level[i], levels->width[i], levels->height[i], levels->bps);
+		if (tiff_put_image (tif, &v, opt) < 0 || !TIFFWriteDirectory (tif))
+			break;
+	}
+	TRACE_END (1, "levels");
+
+	return (i < levels->levels) ? -1 : 0;
+}
+
+
+
+/*********************************************************************/
+
+/* Multi-page stack: all frames of a sequence go into one TIFF file, one
+	directory (page) per frame, written as the frames arrive. Each page
+	carries the frame's acquisition conditions in its image description,
+	its arrival time as DateTime, and its page number.
+	Classic TIFF cannot address more than 4 GB, so the stack is opened as
+	BigTIFF if the caller expects more data than that, or does not know
+	(expected_bytes < 0). Appends from several threads are serialized; the
+	page order is the order of the calls.
+*/
+
+#define TIFF_CLASSIC_LIMIT	0xF0000000LL		/* Leave room for the directories */
+
+struct tiffstack
+{
+	TIFF *tif;
+	int pages;
+	tiff_options opt;
+	pthread_mutex_t lock;
+};
+
+
+tiffstack *tiffstack_open (const char *fname, long long expected_bytes, const tiff_options *opt)
+{
+tiffstack *ts;
+int bigtiff;
+
+
+	ts = calloc (1, sizeof (tiffstack));
+	if (!ts) return NULL;
+
+	bigtiff = (expected_bytes < 0 || expected_bytes > TIFF_CLASSIC_LIMIT);
+	ts->tif = tiff_open (fname, bigtiff ? "w8" : "w", expected_bytes);
+	if (!ts->tif)
+	{
+		free (ts);
+		return NULL;
+	}
+	ts->opt = *opt;
+	pthread_mutex_init (&ts->lock, NULL);
+
+	return ts;
+}
+
+
+int tiffstack_append (tiffstack *ts, char *img, int width, int height, int bps, const framemeta *meta)
+{
+	return tiffstack_append_levels (ts, img, width, height, bps, meta, NULL);
+}
+
+
+/* The same, with the levels of a pyramid (may be NULL) as SubIFDs of the page */
+
+int tiffstack_append_levels (tiffstack *ts, char *img, int width, int height, int bps, const framemeta *meta,
+			const pyramid *levels)
+{
+imgview v;
+
+
+	imgview_init (&v, img, width, height, bps);
+	v.meta = meta;
+	v.levels = levels;
+	return tiffstack_append_view (ts, &v);
+}
+
+
+/* A view as the next page, with v->meta and v->levels. The page's
+	description is made from v->meta; v->comment is not used. */
+
+int tiffstack_append_view (tiffstack *ts, const imgview *v)
+{
+const framemeta *meta;
+const pyramid *levels;
+char desc[512], datetime[32];
+imgview page;
+struct tm tm;
+time_t t;
+int err;
+
+
+	meta = v->meta;
+	levels = v->levels;
+	pthread_mutex_lock (&ts->lock);
+
+	TIFFSetField (ts->tif, TIFFTAG_SUBFILETYPE, FILETYPE_PAGE);
+	TIFFSetField (ts->tif, TIFFTAG_PAGENUMBER, ts->pages, 0);	/* Total unknown while writing */
+	desc[0] = 0;
+	if (meta)
+	{
+		framemeta_format (meta, desc, sizeof (desc));
+		t = (time_t)(meta->systime / 1000000000ULL);
+		localtime_r (&t, &tm);
+		strftime (datetime, sizeof (datetime), "%Y:%m:%d %H:%M:%S", &tm);
+		TIFFSetField (ts->tif, TIFFTAG_DATETIME, datetime);
+	}
+
+	page = *v;
+	page.comment = desc;
+	err = tiff_put_image (ts->tif, &page, &ts->opt);
+	if (!err && levels && levels->levels > 0)
+		err = tiff_put_levels (ts->tif, levels, &ts->opt);
+	else if (!err && !TIFFWriteDirectory (ts->tif))
+		err = -1;
+	if (!err) ts->pages++;
+
+	pthread_mutex_unlock (&ts->lock);
+
+	return err;
+}
+
+
+/* Close the stack. Returns the number of pages written, or -1 if the end
+	of the file could not be written. */
+
+int tiffstack_close (tiffstack *ts)
+{
+int pages;
+
+
+	pages = ts->pages;
+	if (tiff_close (ts->tif)) pages = -1;
+	pthread_mutex_destroy (&ts->lock);
+	free (ts);
+
+	return pages;
+}
+
+
+
+/* Compression names as used on the command line */
+
+static const struct
+{
+	const char *name;
+	int compression;
+} tiff_codecs[] =
+{
+	{ "none",		COMPRESSION_NONE },
+	{ "lzw",		COMPRESSION_LZW },
+	{ "deflate",	COMPRESSION_ADOBE_DEFLATE },
+	{ "zstd",		COMPRESSION_ZSTD },
+	{ "lzma",		COMPRESSION_LZMA },
+	{ NULL, 0 }
+};
+
+
+const char *tiff_compression_name (int compression)
+{
+int i;
+
+	for (i=0; tiff_codecs[i].name; i++)
+		if (tiff_codecs[i].compression == compression) return tiff_codecs[i].name;
+	return "unknown";
+}
+
+
+/* Set opt->compression and opt->level from a string of the form "name" or
+	"name:level", e.g. "deflate:6". Returns 0 on success and -1 if the name
+	is unknown; in that case, opt is not changed. */
+
+int tiff_parse_compression (const char *spec, tiff_options *opt)
+{
+const char *colon;
+size_t len;
+int i;
+
+
+	colon = strchr (spec, ':');
+	len = colon ? (size_t)(colon - spec) : strlen (spec);
+
+	for (i=0; tiff_codecs[i].name; i++)
+		if (strlen (tiff_codecs[i].name) == len && !strncmp (spec, tiff_codecs[i].name, len))
+		{
+			opt->compression = tiff_codecs[i].compression;
+			opt->level = colon ? atoi (colon+1) : 0;
+			return 0;
+		}
+
+	return -1;
 }
 
 
@@ -125,32 +622,91 @@ float tiff_dpi = 600.0;
 
 
 
-int pnm_write_8 (char* fname, unsigned char* img, int width, int height)
+/* Header and rows (rowbytes each, stride apart) of a PNM file. Through
+	dio.c for dioopts.enabled; else contiguous rows go out with header in
+	a single writev(), padded ones row by row through stdio. */
+
+static int pnm_put (const char *fname, const char *hdr, const char *data, long stride, long rowbytes, int height)
 {
-int errcode;
-long numelems,l;
-FILE* FP;
-char hdr[256];
+dio_file *f;
+FILE *FP;
+struct iovec iov[2];
+size_t total, done;
+ssize_t n;
+int y, fd, err;
 
-	sprintf (hdr, "P5 %d %d %d\n", width, height, 255);
 
-	errcode=0;
-	l = (long)width * (long)height;
-	
-	FP = fopen (fname, "wb");
-	if (!FP) return -1;
-	
-	numelems = fwrite (hdr, sizeof (char), strlen(hdr), FP);
-	
-	numelems = fwrite (img, sizeof (char), l, FP);
-	if (numelems!=l) 
+	err = 0;
+	if (dioopts.enabled)
 	{
-		fprintf (stderr, "PNM write warning: Fewer elements written than file size\n");
-		errcode=-1;
+		f = dio_open (fname, (long long)(strlen (hdr) + rowbytes * height), NULL);
+		if (!f) return -1;
+		err = dio_write (f, hdr, strlen (hdr)) < 0;
+		if (stride == rowbytes)
+			err = err || dio_write (f, data, rowbytes * height) < 0;
+		else
+			for (y=0; y<height && !err; y++)
+				err = dio_write (f, data + (long)y*stride, rowbytes) < 0;
+		if (dio_close (f)) err = 1;
 	}
-	fclose (FP);
+	else if (stride != rowbytes)
+	{
+		FP = fopen (fname, "wb");
+		if (!FP) return -1;
+		err = fwrite (hdr, 1, strlen (hdr), FP) != strlen (hdr);
+		for (y=0; y<height && !err; y++)
+			err = fwrite (data + (long)y*stride, 1, rowbytes, FP) != (size_t)rowbytes;
+		if (fclose (FP)) err = 1;
+	}
+	else
+	{
+		fd = open (fname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0) return -1;
+
+		iov[0].iov_base = (char*)hdr;
+		iov[0].iov_len = strlen (hdr);
+		iov[1].iov_base = (char*)data;
+		iov[1].iov_len = rowbytes * height;
+		total = iov[0].iov_len + iov[1].iov_len;
+
+		/* writev may return early (signals, full pipes); continue where it stopped */
+
+		for (done=0; done<total && !err; done+=n)
+		{
+			n = writev (fd, iov, 2);
+			if (n <= 0)
+			{
+				err = 1;
+				break;
+			}
+			if ((size_t)n >= iov[0].iov_len)
+			{
+				iov[1].iov_base = (char*)iov[1].iov_base + (n - iov[0].iov_len);
+				iov[1].iov_len -= n - iov[0].iov_len;
+				iov[0].iov_len = 0;
+			}
+			else
+			{
+				iov[0].iov_base = (char*)iov[0].iov_base + n;
+				iov[0].iov_len -= n;
+			}
+		}
+		if (close (fd)) err = 1;
+	}
+	if (err)
+		fprintf (stderr, "PNM write warning: Fewer elements written than file size\n");
 
-	return errcode;
+	return err ? -1 : 0;
+}
+
+
+
+int pnm_write_8 (char* fname, unsigned char* img, int width, int height)
+{
+imgview v;
+
+	imgview_init (&v, (char*)img, width, height, 1);
+	return pnm_write_view (fname, &v);
 }
 
 
@@ -158,76 +714,258 @@ char hdr[256];
 	and we enforce the 16-bit by making the max value larger than 255 if it is not
 	-- otherwise, the PGM import filters would automatically interpret the data
 	as 8-bit, which leads to incorrect read results.
+	Samples are unsigned. PGM stores them MSB first, so the data are byte-swapped
+	into a scratch buffer in the same (vectorized) pass that finds the max value,
+	and header and payload go out with a single writev().
 */
 
 int pnm_write_16 (char* fname, short* img, int width, int height)
 {
-int errcode;
-short maxval;
-long numelems,l,i;
-FILE* FP;
-char hdr[256];
+imgview v;
 
-	errcode=0;
-	l = (long)width * (long)height;
-	maxval = 1023;			/* Guarantee 16-bit interpretation and pretend a minimum of 10-bit data */
+	imgview_init (&v, (char*)img, width, height, 2);
+	return pnm_write_view (fname, &v);
+}
 
-	for (i=0; i<l; i++)
-		if (maxval < img[i]) maxval = img[i];
 
-	sprintf (hdr, "P5 %d %d %d\n", width, height, maxval);
+/* To have the same capabilities as tiff write, also provide PNM RGB. Logically,
+	this is no longer a pGm, and it has therefore a different header.
+*/
+
+int pnm_write_rgb (char* fname, unsigned char* img, int width, int height)
+{
+imgview v;
+
+	imgview_init (&v, (char*)img, width, height, 3);
+	return pnm_write_view (fname, &v);
+}
 
-	FP = fopen (fname, "wb");
-	if (!FP) return -1;
 
-	numelems = fwrite (hdr, sizeof (char), strlen(hdr), FP);
+/* Any view as PGM (bps 1, 2) or PPM (bps 3, 6). 16-bit samples that are
+	not MSB first yet are swapped into a scratch buffer, as above; views
+	that are (big-endian) only need their max value found, and go out as
+	they are, padded rows included. */
 
-	numelems = fwrite (img, sizeof (char), l, FP);
-	if (numelems!=l) 
+int pnm_write_view (const char *fname, const imgview *v)
+{
+unsigned short maxval, *be;
+const unsigned char *row;
+const char *data;
+long rowbytes, stride, i;
+int y, err;
+char hdr[256];
+unsigned short endian_test = 1;
+
+
+	if (v->bps != 1 && v->bps != 2 && v->bps != 3 && v->bps != 6) return -1;
+	rowbytes = (long)v->width * v->bps;
+	data = v->data;
+	stride = v->stride;
+	be = NULL;
+	maxval = 255;
+
+	if (v->bps == 2 || v->bps == 6)
 	{
-		fprintf (stderr, "PNM write warning: Fewer elements written than file size\n");
-		errcode=-1;
+		if (v->big_endian || !*(unsigned char*)&endian_test)
+		{
+			maxval = 0;
+			for (y=0; y<v->height; y++)
+				for (row=(const unsigned char*)imgview_row (v, y), i=0; i+1<rowbytes; i+=2)
+					if (((row[i] << 8) | row[i+1]) > maxval)
+						maxval = (unsigned short)((row[i] << 8) | row[i+1]);
+		}
+		else
+		{
+			be = malloc (rowbytes * v->height > 0 ? rowbytes * v->height : 1);
+			if (!be) return -1;
+			if (stride == rowbytes)
+				maxval = px_swap16_max (be, (const unsigned short*)data, rowbytes / 2 * v->height);
+			else
+				for (y=0, maxval=0; y<v->height; y++)
+				{
+					i = px_swap16_max (be + y*rowbytes/2, (const unsigned short*)imgview_row (v, y), rowbytes / 2);
+					if (i > maxval) maxval = (unsigned short)i;
+				}
+			data = (const char*)be;
+			stride = rowbytes;
+		}
+		if (maxval < 1023) maxval = 1023;		/* Guarantee 16-bit interpretation and pretend a minimum of 10-bit data */
 	}
-	fclose (FP);
 
-	return errcode;
+	sprintf (hdr, "P%c %d %d %d\n", (v->bps == 1 || v->bps == 2) ? '5' : '6', v->width, v->height, maxval);
+	err = pnm_put (fname, hdr, data, stride, rowbytes, v->height);
+	free (be);
+
+	return err;
 }
 
 
-/* To have the same capabilities as tiff write, also provide PNM RGB. Logically,
-	this is no longer a pGm, and it has therefore a different header.
-*/
 
-int pnm_write_rgb (char* fname, unsigned char* img, int width, int height)
+
+
+/************************************************************************************
+
+	PNG. Same data conventions as tiffwrite(): bps 1, 2, 3 or 6 for 8-bit gray,
+	16-bit gray (host byte order, PNG wants MSB first and gets it via
+	png_set_swap), 8-bit RGB and 16-bit RGB. Rows are stored top to bottom.
+	pngwrite_view() takes padded rows and big-endian samples as they are.
+
+************************************************************************************/
+
+
+png_options pngopts = { Z_DEFAULT_COMPRESSION, Z_DEFAULT_STRATEGY, -1, 1, 0 };	/* libpng's defaults */
+
+
+int pngwrite (const char* fname, char* img, int width, int height, int bps)
 {
-int errcode;
-long numelems,l;
-FILE* FP;
-char hdr[256];
+	return pngwrite_opt (fname, img, width, height, bps, &pngopts);
+}
 
-	sprintf (hdr, "P6 %d %d %d\n", width, height, 255);
 
-	errcode=0;
-	l = (long)width * (long)height * 3;			/* 3 bytes per pixel */
-	
+
+int pngwrite_opt (const char* fname, char* img, int width, int height, int bps, const png_options *opt)
+{
+imgview v;
+
+	imgview_init (&v, img, width, height, bps);
+	return pngwrite_view_opt (fname, &v, opt);
+}
+
+
+int pngwrite_view (const char *fname, const imgview *v)
+{
+	return pngwrite_view_opt (fname, v, &pngopts);
+}
+
+
+int pngwrite_view_opt (const char *fname, const imgview *v, const png_options *opt)
+{
+static const int filter_flags[] = { PNG_FILTER_NONE, PNG_FILTER_SUB, PNG_FILTER_UP,
+			PNG_FILTER_AVG, PNG_FILTER_PAETH };
+png_structp png_ptr;
+png_infop info_ptr;
+png_bytepp rows;
+FILE *FP;
+int i, bit_depth, color_type, width, height, bps;
+unsigned short endian_test = 1;
+
+
+	width = v->width;
+	height = v->height;
+	bps = v->bps;
+	if (bps == 1)		{ bit_depth = 8;  color_type = PNG_COLOR_TYPE_GRAY; }
+	else if (bps == 2)	{ bit_depth = 16; color_type = PNG_COLOR_TYPE_GRAY; }
+	else if (bps == 3)	{ bit_depth = 8;  color_type = PNG_COLOR_TYPE_RGB; }
+	else if (bps == 6)	{ bit_depth = 16; color_type = PNG_COLOR_TYPE_RGB; }
+	else return -1;
+
+	if (opt->threads > 1)
+		return png_parallel_write (fname, v, opt);
+
 	FP = fopen (fname, "wb");
 	if (!FP) return -1;
-	
-	numelems = fwrite (hdr, sizeof (char), strlen(hdr), FP);
-	
-	numelems = fwrite (img, sizeof (char), l, FP);
-	if (numelems!=l) 
+
+	png_ptr = png_create_write_struct (PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	info_ptr = png_ptr ? png_create_info_struct (png_ptr) : NULL;
+	rows = malloc (height * sizeof (png_bytep));
+	if (!png_ptr || !info_ptr || !rows)
 	{
-		fprintf (stderr, "PNM write warning: Fewer elements written than file size\n");
-		errcode=-1;
+		png_destroy_write_struct (&png_ptr, &info_ptr);
+		free (rows);
+		fclose (FP);
+		return -1;
+	}
+	if (setjmp (png_jmpbuf (png_ptr)))			/* libpng reports errors by longjmp */
+	{
+		png_destroy_write_struct (&png_ptr, &info_ptr);
+		free (rows);
+		fclose (FP);
+		return -1;
 	}
-	fclose (FP);
 
-	return errcode;
+	png_init_io (png_ptr, FP);
+	png_set_compression_level (png_ptr, opt->level);
+	png_set_compression_strategy (png_ptr, opt->strategy);
+	png_set_compression_buffer_size (png_ptr, 256*1024);	/* Fewer, larger IDAT chunks */
+	if (opt->filter >= 0 && opt->filter <= 4)
+		png_set_filter (png_ptr, PNG_FILTER_TYPE_BASE, filter_flags[opt->filter]);
+	else
+		png_set_filter (png_ptr, PNG_FILTER_TYPE_BASE, PNG_ALL_FILTERS);
+
+	png_set_IHDR (png_ptr, info_ptr, width, height, bit_depth, color_type,
+			PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+	png_write_info (png_ptr, info_ptr);
+	if (bit_depth == 16 && !v->big_endian && *(unsigned char*)&endian_test)
+		png_set_swap (png_ptr);
+
+	for (i=0; i<height; i++)
+		rows[i] = (png_bytep)imgview_row (v, i);
+	TRACE_BEGIN (1, "encode_write");
+	png_write_image (png_ptr, rows);
+	png_write_end (png_ptr, NULL);
+	TRACE_END (1, "encode_write");
+
+	png_destroy_write_struct (&png_ptr, &info_ptr);
+	free (rows);
+	if (fclose (FP)) return -1;
+
+	return 0;
 }
 
 
 
+/* Row filter and zlib strategy names as used on the command line.
+	Both return 0, or -1 if the name is unknown (opt is then unchanged). */
+
+static const char *png_filter_names[] = { "none", "sub", "up", "avg", "paeth", NULL };
+
+int png_parse_filter (const char *name, png_options *opt)
+{
+int i;
+
+	if (!strcmp (name, "adaptive"))
+	{
+		opt->filter = -1;
+		return 0;
+	}
+	for (i=0; png_filter_names[i]; i++)
+		if (!strcmp (name, png_filter_names[i]))
+		{
+			opt->filter = i;
+			return 0;
+		}
+	return -1;
+}
+
+
+static const struct
+{
+	const char *name;
+	int strategy;
+} png_strategies[] =
+{
+	{ "default",	Z_DEFAULT_STRATEGY },
+	{ "filtered",	Z_FILTERED },
+	{ "huffman",	Z_HUFFMAN_ONLY },
+	{ "rle",		Z_RLE },
+	{ "fixed",		Z_FIXED },
+	{ NULL, 0 }
+};
+
+int png_parse_strategy (const char *name, png_options *opt)
+{
+int i;
+
+	for (i=0; png_strategies[i].name; i++)
+		if (!strcmp (name, png_strategies[i].name))
+		{
+			opt->strategy = png_strategies[i].strategy;
+			return 0;
+		}
+	return -1;
+}
+
+
 
 
 /*******************************************************************************/
@@ -4,13 +4,77 @@
 #ifndef __TIFFSTUFF_H
 #define __TIFFSTUFF_H
 
+#include "framemeta.h"
+#include "preview.h"
+#include "imgview.h"
+
+
+/* How tiffwrite() lays out and compresses the image data. With the defaults
+	(LZW, no predictor, rows_per_strip = 0, threads = 1) the whole image is one
+	strip, encoded by libtiff. With rows_per_strip > 0 and threads > 1, the strips
+	are compressed in parallel (LZW, deflate and no compression only).
+*/
+
+typedef struct
+{
+	int compression;			/* COMPRESSION_NONE, _LZW, _ADOBE_DEFLATE, _ZSTD or _LZMA */
+	int level;					/* Codec effort (deflate 1-9, zstd 1-22, lzma 0-9), 0 for the default */
+	int predictor;				/* PREDICTOR_NONE or PREDICTOR_HORIZONTAL */
+	int rows_per_strip;			/* Rows per strip, 0 for a single strip */
+	int threads;				/* Compression threads, 1 for libtiff's own encoder */
+} tiff_options;
+
+extern tiff_options tiffopts;	/* Used by tiffwrite() */
 
 
 int tiffwrite (const char* fname, char* img, int width, int height, int bps, char* comment);
+int tiffwrite_opt (const char* fname, char* img, int width, int height, int bps, char* comment,
+			const tiff_options *opt);
+int tiffwrite_levels (const char* fname, char* img, int width, int height, int bps, char* comment,
+			const pyramid *levels);
+int tiffwrite_view (const char *fname, const imgview *v);
+int tiffwrite_view_opt (const char *fname, const imgview *v, const tiff_options *opt);
+int tiff_parse_compression (const char *spec, tiff_options *opt);
+const char *tiff_compression_name (int compression);
+
+typedef struct tiffstack tiffstack;
+
+tiffstack *tiffstack_open (const char *fname, long long expected_bytes, const tiff_options *opt);
+int tiffstack_append (tiffstack *ts, char *img, int width, int height, int bps, const framemeta *meta);
+int tiffstack_append_levels (tiffstack *ts, char *img, int width, int height, int bps, const framemeta *meta,
+			const pyramid *levels);
+int tiffstack_append_view (tiffstack *ts, const imgview *v);
+int tiffstack_close (tiffstack *ts);
 
 int pnm_write_8 (char* fname, unsigned char* img, int width, int height);
 int pnm_write_16 (char* fname, short* img, int width, int height);
 int pnm_write_rgb (char* fname, unsigned char* img, int width, int height);
+int pnm_write_view (const char *fname, const imgview *v);
+
+
+/* How pngwrite() compresses. The defaults are libpng's (zlib level 6, adaptive
+	filtering). With threads > 1, bands of rows are deflated in parallel and the
+	file is assembled by pngfast.c instead of libpng.
+*/
+
+typedef struct
+{
+	int level;					/* zlib level 0-9, -1 for zlib's default (6) */
+	int strategy;				/* Z_DEFAULT_STRATEGY, Z_FILTERED, Z_HUFFMAN_ONLY, Z_RLE or Z_FIXED */
+	int filter;					/* Row filter 0-4 (none, sub, up, avg, paeth), -1 for adaptive */
+	int threads;				/* Compression threads, 1 for libpng */
+	int band_rows;				/* Rows per band with threads > 1, 0 for two bands per thread */
+} png_options;
+
+extern png_options pngopts;		/* Used by pngwrite() */
+
+
+int pngwrite (const char* fname, char* img, int width, int height, int bps);
+int pngwrite_opt (const char* fname, char* img, int width, int height, int bps, const png_options *opt);
+int pngwrite_view (const char *fname, const imgview *v);
+int pngwrite_view_opt (const char *fname, const imgview *v, const png_options *opt);
+int png_parse_filter (const char *name, png_options *opt);
+int png_parse_strategy (const char *name, png_options *opt);
 
 
 #endif
@@ -0,0 +1,98 @@
+/* timing.c
+
+	Per-stage latency samples for the benchmark. See timing.h.
+
+*/
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "timing.h"
+
+
+static float *samples[TM_STAGES];		/* Microseconds, NULL while disabled */
+static unsigned int count[TM_STAGES];
+
+static const char *stage_names[TM_STAGES] =
+	{ "discover", "open", "configure", "acquire", "save", "led", "step" };
+
+
+
+const char *timing_stage_name (int stage)
+{
+	return (stage >= 0 && stage < TM_STAGES) ? stage_names[stage] : "unknown";
+}
+
+
+
+/* Allocate the sample arrays. Returns 0 or -1. */
+
+int timing_enable (void)
+{
+int k;
+
+
+	for (k=0; k<TM_STAGES; k++)
+	{
+		if (!samples[k])
+			samples[k] = malloc (TIMING_MAX_SAMPLES * sizeof (float));
+		if (!samples[k]) return -1;
+	}
+	return 0;
+}
+
+
+
+/* Start of a stage, in seconds, or 0 if timing is off */
+
+double timing_start (void)
+{
+struct timespec ts;
+
+
+	if (!samples[0]) return 0;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+
+/* End of a stage started at t0. Thread safe: writer threads time their
+	saves while the capture thread times the rest. */
+
+void timing_stop (int stage, double t0)
+{
+unsigned int k;
+
+
+	if (t0 == 0 || stage < 0 || stage >= TM_STAGES) return;
+	k = __atomic_fetch_add (&count[stage], 1, __ATOMIC_RELAXED);
+	if (k < TIMING_MAX_SAMPLES)
+		samples[stage][k] = (float)((timing_start () - t0) * 1e6);
+}
+
+
+
+/* Append all samples to fname. Returns 0 or -1. */
+
+int timing_write (const char *fname)
+{
+FILE *fp;
+unsigned int k, n;
+int s;
+
+
+	if (!samples[0]) return 0;
+	fp = fopen (fname, "a");
+	if (!fp) return -1;
+
+	for (s=0; s<TM_STAGES; s++)
+	{
+		n = (count[s] < TIMING_MAX_SAMPLES) ? count[s] : TIMING_MAX_SAMPLES;
+		for (k=0; k<n; k++)
+			fprintf (fp, "%s %.1f\n", stage_names[s], samples[s][k]);
+	}
+
+	return fclose (fp) ? -1 : 0;
+}
@@ -0,0 +1,41 @@
+#ifndef __TIMING_H
+#define __TIMING_H
+
+
+/* Per-stage latency samples for the end-to-end benchmark (--timing, and
+	make bench). While timing is enabled, every stage of a capture adds its
+	duration; at the end of the run all samples are appended to a file, one
+	line "stage microseconds" each, and bench.sh reduces them to
+	percentiles. When it is not enabled, timing_start() returns 0 and
+	timing_stop() nothing else, so the calls can stay in place.
+
+	Stages:
+		discover	finding and connecting to the camera (arv_camera_new)
+		open		pixel format, trigger, stream and buffers
+		configure	geometry, exposure and gain of a frame or step
+		acquire		trigger to frame in the buffer (cam_snap)
+		save		unpack, calibrate, encode and write one frame
+		led			one strobe_on() or strobe_off(), a pigpiod round trip
+		step		a whole sequence step
+*/
+
+#define TM_DISCOVER			0
+#define TM_OPEN				1
+#define TM_CONFIGURE		2
+#define TM_ACQUIRE			3
+#define TM_SAVE				4
+#define TM_LED				5
+#define TM_STEP				6
+#define TM_STAGES			7
+
+#define TIMING_MAX_SAMPLES	65536		/* Per stage; later ones are counted but not kept */
+
+
+int timing_enable (void);
+double timing_start (void);
+void timing_stop (int stage, double t0);
+int timing_write (const char *fname);
+const char *timing_stage_name (int stage);
+
+
+#endif
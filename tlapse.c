@@ -0,0 +1,597 @@
+/* tlapse.c
+
+	Time-lapse archive of keyframes and Rice-coded residuals, see
+	tlapse.h. Frames are coded under the archive's lock, in the order
+	in which they come.
+
+*/
+
+
+#define _FILE_OFFSET_BITS 64			/* Archives outgrow 2 GB on the 32-bit Pi */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "framemeta.h"
+#include "rawlog.h"
+#include "pixkern.h"
+#include "rice.h"
+#include "tlapse.h"
+#include "trace.h"
+
+
+typedef struct
+{
+	unsigned short *pix;			/* 16 bits per pixel, also for 8-bit frames; NULL for none */
+	long frame;
+	int width, height, bps;
+	uint64_t coded_size;
+	long since;						/* Frames coded against it so far */
+} keyframe;
+
+struct tlapse
+{
+	int fd;
+	int writable;
+	tlapse_header hdr;
+	tlapse_index *index;
+	long n, cap;
+	uint64_t end;					/* Where the next record goes */
+	pthread_mutex_t lock;
+	keyframe keys[MAX_CAMERAS];		/* Writing: the latest keyframe per camera. Reading: [0] is the last one decoded */
+	unsigned short *wide, *res;		/* Scratch for one frame */
+	unsigned char *code;
+	long scratch;					/* Pixels the scratch buffers have room for */
+};
+
+
+static const unsigned short black = 0;		/* Reference of a keyframe's first pixel */
+
+
+
+static int write_all (int fd, const void *buf, size_t size, uint64_t offset)
+{
+ssize_t n;
+
+
+	while (size > 0)
+	{
+		n = pwrite (fd, buf, size, (off_t)offset);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) return -1;
+		buf = (const char*)buf + n;
+		size -= n;
+		offset += n;
+	}
+	return 0;
+}
+
+
+static int read_all (int fd, void *buf, size_t size, uint64_t offset)
+{
+ssize_t n;
+
+
+	while (size > 0)
+	{
+		n = pread (fd, buf, size, (off_t)offset);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) return -1;
+		buf = (char*)buf + n;
+		size -= n;
+		offset += n;
+	}
+	return 0;
+}
+
+
+static int grow_scratch (tlapse *t, long n)
+{
+	if (n <= t->scratch) return 0;
+	free (t->wide);
+	free (t->res);
+	free (t->code);
+	t->wide = malloc (n * sizeof (unsigned short));
+	t->res = malloc (n * sizeof (unsigned short));
+	t->code = malloc (rice_bound (n));
+	if (!t->wide || !t->res || !t->code)
+	{
+		t->scratch = 0;
+		return -1;
+	}
+	t->scratch = n;
+	return 0;
+}
+
+
+static int add_index (tlapse *t, uint64_t offset, uint64_t ref)
+{
+tlapse_index *index;
+
+
+	if (t->n == t->cap)
+	{
+		index = realloc (t->index, (t->cap ? 2 * t->cap : 1024) * sizeof (tlapse_index));
+		if (!index) return -1;
+		t->index = index;
+		t->cap = t->cap ? 2 * t->cap : 1024;
+	}
+	t->index[t->n].offset = offset;
+	t->index[t->n].ref = ref;
+	t->n++;
+	return 0;
+}
+
+
+
+/********************************************************************/
+
+
+/* The residuals of a keyframe: each row against the one above, the first
+	row pixel to pixel */
+
+static void key_residuals (unsigned short *res, const unsigned short *src, int width, long n)
+{
+	px_residual16 (res, src, &black, 1);
+	px_residual16 (res + 1, src + 1, src, width - 1);
+	px_residual16 (res + width, src + width, src, n - width);
+}
+
+
+/* And back, in place */
+
+static void key_restore (unsigned short *pix, int width, long n)
+{
+long i;
+
+
+	px_unresidual16 (pix, pix, &black, 1);
+	for (i=1; i<width; i++)
+		px_unresidual16 (pix + i, pix + i, pix + i - 1, 1);
+	for (i=width; i<n; i+=width)
+		px_unresidual16 (pix + i, pix + i, pix + i - width, width);
+}
+
+
+/* The camera slot of a frame */
+
+static int key_slot (int camera)
+{
+	return (camera > 0 && camera < MAX_CAMERAS) ? camera : 0;
+}
+
+
+/* Read record i and decode its pixels (16 bits each) against key, which
+	must be given for a residual frame. NULL on error. */
+
+static unsigned short *decode (tlapse *t, long i, tlapse_record *rec, const keyframe *key)
+{
+unsigned short *pix;
+long n;
+int bps;
+
+
+	if (read_all (t->fd, rec, sizeof (tlapse_record), t->index[i].offset) < 0
+			|| rec->magic != TLAPSE_RECMAGIC || rec->ref != t->index[i].ref)
+		return NULL;
+	bps = rec->frame.bits_per_pixel / 8;
+	n = (long)rec->frame.width * rec->frame.height;
+	if (n <= 0 || (bps != 1 && bps != 2) || rec->coded_size > rice_bound (n))
+		return NULL;
+	if (rec->ref != (uint64_t)i && (!key || key->width != (int)rec->frame.width
+			|| key->height != (int)rec->frame.height || key->bps != bps))
+		return NULL;
+
+	pix = malloc (n * sizeof (unsigned short));
+	if (!pix || grow_scratch (t, n) < 0
+			|| read_all (t->fd, t->code, rec->coded_size, t->index[i].offset + sizeof (tlapse_record)) < 0
+			|| rice_decode (pix, n, t->code, rec->coded_size) < 0)
+	{
+		free (pix);
+		return NULL;
+	}
+	if (rec->ref == (uint64_t)i)
+		key_restore (pix, rec->frame.width, n);
+	else
+		px_unresidual16 (pix, pix, key->pix, n);
+
+	return pix;
+}
+
+
+/* Frame i, decoding (and caching) its keyframe first if need be */
+
+static unsigned short *load (tlapse *t, long i, tlapse_record *rec)
+{
+tlapse_record keyrec;
+keyframe *k;
+long ref;
+
+
+	ref = (long)t->index[i].ref;
+	if (ref == i)
+		return decode (t, i, rec, NULL);
+	if (ref > i || (long)t->index[ref].ref != ref)
+		return NULL;
+
+	k = &t->keys[0];
+	if (!k->pix || k->frame != ref)
+	{
+		free (k->pix);
+		k->pix = decode (t, ref, &keyrec, NULL);
+		if (!k->pix) return NULL;
+		k->frame = ref;
+		k->width = keyrec.frame.width;
+		k->height = keyrec.frame.height;
+		k->bps = keyrec.frame.bits_per_pixel / 8;
+	}
+	return decode (t, i, rec, k);
+}
+
+
+
+/********************************************************************/
+
+
+/* The index: as written on close, else rebuilt from the records. Sets the
+	end of the data. Returns 0 or -1. */
+
+static int load_index (tlapse *t, uint64_t filesize)
+{
+tlapse_record rec;
+uint64_t off;
+long i;
+
+
+	if (t->hdr.index_offset && t->hdr.index_offset + t->hdr.nframes * sizeof (tlapse_index) <= filesize)
+	{
+		t->index = malloc ((t->hdr.nframes + 1) * sizeof (tlapse_index));
+		if (!t->index) return -1;
+		t->n = t->cap = t->hdr.nframes;
+		if (read_all (t->fd, t->index, t->n * sizeof (tlapse_index), t->hdr.index_offset) < 0)
+			return -1;
+		t->end = t->hdr.index_offset;
+	}
+	else
+	{
+		off = t->hdr.header_size;
+		while (off + sizeof (tlapse_record) <= filesize
+				&& read_all (t->fd, &rec, sizeof (rec), off) == 0
+				&& rec.magic == TLAPSE_RECMAGIC && rec.ref <= (uint64_t)t->n
+				&& off + sizeof (rec) + rec.coded_size <= filesize)
+		{
+			if (add_index (t, off, rec.ref) < 0) return -1;
+			off += sizeof (rec) + rec.coded_size;
+		}
+		t->end = off;
+		if (t->n)
+			fprintf (stderr, "Time-lapse archive was not closed, %ld frames recovered\n", t->n);
+	}
+
+	for (i=0; i<t->n; i++)
+		if (t->index[i].ref > (uint64_t)i)
+			return -1;
+	return 0;
+}
+
+
+/* Appending to an archive: the latest keyframe of every camera, going
+	back until all cameras of the last key_interval frames have theirs */
+
+static void reload_keys (tlapse *t)
+{
+tlapse_record rec;
+keyframe *k;
+long i, count[MAX_CAMERAS];
+int c, seen[MAX_CAMERAS], done[MAX_CAMERAS], pending;
+
+
+	memset (count, 0, sizeof (count));
+	memset (seen, 0, sizeof (seen));
+	memset (done, 0, sizeof (done));
+	pending = 0;
+	for (i=t->n-1; i>=0; i--)
+	{
+		if (read_all (t->fd, &rec, sizeof (rec), t->index[i].offset) < 0)
+			break;
+		c = key_slot (rec.frame.camera - 1);
+		if (!seen[c]) pending++;
+		seen[c] = 1;
+		if (!done[c])
+		{
+			count[c]++;
+			if (t->index[i].ref == (uint64_t)i)
+			{
+				k = &t->keys[c];
+				k->pix = decode (t, i, &rec, NULL);
+				k->frame = i;
+				k->width = rec.frame.width;
+				k->height = rec.frame.height;
+				k->bps = rec.frame.bits_per_pixel / 8;
+				k->coded_size = rec.coded_size;
+				k->since = count[c] - 1;
+				done[c] = 1;
+				pending--;
+			}
+		}
+		if (!pending && t->n - i >= (long)t->hdr.key_interval)
+			break;
+	}
+}
+
+
+
+/********************************************************************/
+
+
+/* Create the archive fname, or open it for appending if it exists. A new
+	keyframe is taken every key_interval frames of a camera (0 for
+	TLAPSE_KEY_INTERVAL, or what an existing archive used). NULL on error. */
+
+tlapse *tlapse_create (const char *fname, int key_interval)
+{
+tlapse *t;
+struct stat st;
+int i;
+
+
+	t = calloc (1, sizeof (tlapse));
+	if (!t) return NULL;
+
+	t->fd = open (fname, O_RDWR | O_CREAT, 0644);
+	if (t->fd < 0 || fstat (t->fd, &st))
+		goto fail;
+
+	if (st.st_size == 0)
+	{
+		memcpy (t->hdr.magic, TLAPSE_MAGIC, 8);
+		t->hdr.version = TLAPSE_VERSION;
+		t->hdr.header_size = sizeof (tlapse_header);
+		t->hdr.key_interval = TLAPSE_KEY_INTERVAL;
+		t->end = sizeof (tlapse_header);
+	}
+	else if (read_all (t->fd, &t->hdr, sizeof (tlapse_header), 0) < 0
+			|| memcmp (t->hdr.magic, TLAPSE_MAGIC, 8) || t->hdr.version != TLAPSE_VERSION
+			|| load_index (t, (uint64_t)st.st_size) < 0)
+	{
+		fprintf (stderr, "Time-lapse archive: cannot append to %s\n", fname);
+		goto fail;
+	}
+	if (key_interval > 0)
+		t->hdr.key_interval = key_interval;
+	reload_keys (t);
+
+	/* The old index goes; until close, readers find the frames by walking them */
+
+	t->hdr.index_offset = 0;
+	t->hdr.nframes = 0;
+	if (write_all (t->fd, &t->hdr, sizeof (tlapse_header), 0) < 0 || ftruncate (t->fd, (off_t)t->end) < 0)
+		goto fail;
+
+	t->writable = 1;
+	pthread_mutex_init (&t->lock, NULL);
+	return t;
+
+fail:
+	if (t->fd >= 0) close (t->fd);
+	for (i=0; i<MAX_CAMERAS; i++)
+		free (t->keys[i].pix);
+	free (t->index);
+	free (t->wide);
+	free (t->res);
+	free (t->code);
+	free (t);
+	return NULL;
+}
+
+
+/* Add a frame of bps 1 or 2. Returns its frame number, or -1 on error. */
+
+int tlapse_append (tlapse *t, const void *img, int width, int height, int bps, const framemeta *meta)
+{
+tlapse_record rec;
+const unsigned short *src;
+keyframe *k;
+size_t size;
+long n, i;
+int key, err;
+
+
+	n = (long)width * height;
+	if (n <= 0 || (bps != 1 && bps != 2)) return -1;
+
+	pthread_mutex_lock (&t->lock);
+	TRACE_BEGIN (1, "timelapse");
+	err = grow_scratch (t, n);
+	if (err == 0 && bps == 1)
+	{
+		for (i=0; i<n; i++)
+			t->wide[i] = ((const unsigned char*)img)[i];
+		src = t->wide;
+	}
+	else
+		src = (const unsigned short*)img;
+
+	k = &t->keys[key_slot (meta ? meta->camera : -1)];
+	key = !k->pix || k->width != width || k->height != height || k->bps != bps
+		|| k->since + 1 >= (long)t->hdr.key_interval;
+	size = 0;
+	if (err == 0 && !key)
+	{
+		px_residual16 (t->res, src, k->pix, n);
+		size = rice_encode (t->code, rice_bound (n), t->res, n);
+		key = (size == 0 || size > k->coded_size);
+	}
+	if (err == 0 && key)
+	{
+		key_residuals (t->res, src, width, n);
+		size = rice_encode (t->code, rice_bound (n), t->res, n);
+		err = (size == 0) ? -1 : 0;
+	}
+
+	if (err == 0)
+	{
+		memset (&rec, 0, sizeof (rec));
+		rec.magic = TLAPSE_RECMAGIC;
+		rec.ref = key ? (uint64_t)t->n : (uint64_t)k->frame;
+		rec.coded_size = size;
+		rawlog_fill_record (&rec.frame, (bps == 1) ? PX_PFNC_MONO8 : PX_PFNC_MONO16, 8*bps, width, height,
+			(size_t)n * bps, meta);
+		err = write_all (t->fd, &rec, sizeof (rec), t->end);
+		if (err == 0)
+			err = write_all (t->fd, t->code, size, t->end + sizeof (rec));
+		if (err == 0)
+			err = add_index (t, t->end, rec.ref);
+	}
+
+	if (err == 0 && key)
+	{
+		if (!k->pix || k->width != width || k->height != height)
+		{
+			free (k->pix);
+			k->pix = malloc (n * sizeof (unsigned short));
+		}
+		if (k->pix)
+			memcpy (k->pix, src, n * sizeof (unsigned short));
+		k->frame = t->n - 1;
+		k->width = width;
+		k->height = height;
+		k->bps = bps;
+		k->coded_size = size;
+		k->since = 0;
+	}
+	else if (err == 0)
+		k->since++;
+	if (err == 0)
+		t->end += sizeof (rec) + size;
+	TRACE_END (1, "timelapse");
+	pthread_mutex_unlock (&t->lock);
+
+	return err ? -1 : (int)(t->n - 1);
+}
+
+
+
+/********************************************************************/
+
+
+/* Open an archive for reading. NULL (quietly, so that callers can try
+	other formats) if fname is not one. */
+
+tlapse *tlapse_open (const char *fname)
+{
+tlapse *t;
+struct stat st;
+
+
+	t = calloc (1, sizeof (tlapse));
+	if (!t) return NULL;
+
+	t->fd = open (fname, O_RDONLY);
+	if (t->fd < 0 || fstat (t->fd, &st)
+			|| read_all (t->fd, &t->hdr, sizeof (tlapse_header), 0) < 0
+			|| memcmp (t->hdr.magic, TLAPSE_MAGIC, 8))
+		goto fail;
+	if (t->hdr.version != TLAPSE_VERSION || load_index (t, (uint64_t)st.st_size) < 0)
+	{
+		fprintf (stderr, "Time-lapse archive: cannot read %s\n", fname);
+		goto fail;
+	}
+	pthread_mutex_init (&t->lock, NULL);
+	return t;
+
+fail:
+	if (t->fd >= 0) close (t->fd);
+	free (t->index);
+	free (t);
+	return NULL;
+}
+
+
+long tlapse_count (tlapse *t)
+{
+	return t->n;
+}
+
+
+/* The keyframe of frame i (i itself for a keyframe), -1 if there is no i */
+
+long tlapse_ref (tlapse *t, long i)
+{
+	return (i >= 0 && i < t->n) ? (long)t->index[i].ref : -1;
+}
+
+
+/* Decode frame i, exactly as it was appended. Returns the pixels (free()
+	them) with the size and metadata in *rec, or NULL on error. */
+
+void *tlapse_frame (tlapse *t, long i, rawlog_record *rec)
+{
+tlapse_record tr;
+unsigned short *pix;
+unsigned char *img;
+long n, k;
+
+
+	if (i < 0 || i >= t->n) return NULL;
+
+	pthread_mutex_lock (&t->lock);
+	pix = load (t, i, &tr);
+	pthread_mutex_unlock (&t->lock);
+	if (!pix) return NULL;
+
+	*rec = tr.frame;
+	if (tr.frame.bits_per_pixel == 16)
+		return pix;
+
+	n = (long)tr.frame.width * tr.frame.height;
+	img = malloc (n);
+	if (img)
+		for (k=0; k<n; k++)
+			img[k] = (unsigned char)pix[k];
+	free (pix);
+	return img;
+}
+
+
+/* Close the archive; one that was written gets its index. Returns 0 or -1. */
+
+int tlapse_close (tlapse *t)
+{
+int i, err;
+
+
+	if (!t) return 0;
+
+	err = 0;
+	if (t->writable)
+	{
+		err = write_all (t->fd, t->index, t->n * sizeof (tlapse_index), t->end);
+		if (err == 0)
+		{
+			t->hdr.nframes = t->n;
+			t->hdr.index_offset = t->end;
+			err = write_all (t->fd, &t->hdr, sizeof (tlapse_header), 0);
+		}
+	}
+	if (close (t->fd) < 0)
+		err = -1;
+
+	for (i=0; i<MAX_CAMERAS; i++)
+		free (t->keys[i].pix);
+	free (t->index);
+	free (t->wide);
+	free (t->res);
+	free (t->code);
+	pthread_mutex_destroy (&t->lock);
+	free (t);
+
+	return err ? -1 : 0;
+}
@@ -0,0 +1,78 @@
+#ifndef __TLAPSE_H
+#define __TLAPSE_H
+
+#include <stdint.h>
+
+#include "framemeta.h"
+#include "rawlog.h"
+
+
+/* Time-lapse archive: long series of nearly identical frames of the same
+	scene (the trays, day after day), stored losslessly as keyframes and
+	residuals. A keyframe is coded on its own, each row as the difference
+	to the row above; any other frame as the difference to the latest
+	keyframe of its camera. Differences are zigzag-folded (px_residual16())
+	and Rice coded (rice.h). A camera gets a new keyframe every key_interval
+	of its frames, when the frame size changes, and when a residual frame
+	would come out larger than its keyframe (the scene changed).
+
+	Runs append to an existing archive, and its last keyframes are decoded
+	when it is opened, so that one acquire per time-lapse shot still saves
+	residuals. Any frame is decoded from its own record and at most that of
+	its keyframe, found through the index. Layout:
+
+	header		tlapse_header
+	records		per frame a tlapse_record and the coded residuals
+	index		nframes tlapse_index entries, written on close
+
+	While the archive is open for writing, index_offset is 0; if the writer
+	did not get to close it, the next open rebuilds the index from the
+	records. 8- and 16-bit monochrome frames, host byte order as for the
+	raw log.
+*/
+
+#define TLAPSE_MAGIC		"GHTLAPS1"
+#define TLAPSE_VERSION		1
+#define TLAPSE_RECMAGIC		0x53504c54			/* "TLPS" */
+#define TLAPSE_KEY_INTERVAL	50
+
+typedef struct
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t header_size;
+	uint64_t nframes;			/* Entries in the index */
+	uint64_t index_offset;		/* 0 while the archive is open for writing */
+	uint32_t key_interval;
+	uint32_t reserved1;
+	uint64_t reserved[4];
+} tlapse_header;
+
+typedef struct
+{
+	uint32_t magic;				/* TLAPSE_RECMAGIC */
+	uint32_t reserved1;
+	uint64_t ref;				/* Frame number of the keyframe, its own for a keyframe */
+	uint64_t coded_size;		/* Bytes of Rice code following this record */
+	rawlog_record frame;		/* Size, format and metadata of the frame as decoded */
+} tlapse_record;
+
+typedef struct
+{
+	uint64_t offset;			/* Of the tlapse_record */
+	uint64_t ref;
+} tlapse_index;
+
+typedef struct tlapse tlapse;
+
+
+tlapse *tlapse_create (const char *fname, int key_interval);
+int tlapse_append (tlapse *t, const void *img, int width, int height, int bps, const framemeta *meta);
+tlapse *tlapse_open (const char *fname);
+long tlapse_count (tlapse *t);
+long tlapse_ref (tlapse *t, long i);
+void *tlapse_frame (tlapse *t, long i, rawlog_record *rec);
+int tlapse_close (tlapse *t);
+
+
+#endif
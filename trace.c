@@ -0,0 +1,230 @@
+/* trace.c
+
+	Per-thread event rings and the Chrome trace exporter. See trace.h.
+
+*/
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+
+#include "trace.h"
+
+
+typedef struct
+{
+	uint64_t ts;					/* ns, CLOCK_MONOTONIC_RAW */
+	const char *name;
+	int32_t arg;
+	int32_t tid;					/* A ring's owners change, see thread_ring() */
+	char phase;						/* Chrome's ph: B, E, i, C, or M for a thread name */
+} trace_rec;
+
+typedef struct trace_ring
+{
+	struct trace_ring *next;		/* All rings, also of threads that have ended */
+	int tid;						/* Of the owner, or the last one */
+	const char *name;
+	int busy;						/* Owned by a running thread; under rings_lock */
+	uint64_t head;					/* Events ever recorded; only the owner writes it */
+	trace_rec ev[TRACE_RING_EVENTS];
+} trace_ring;
+
+
+int trace_on = 0;
+
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static trace_ring *rings = NULL;
+static __thread trace_ring *my_ring = NULL;
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+static uint64_t t_start;
+
+
+
+static uint64_t now_ns (void)
+{
+struct timespec ts;
+
+
+	clock_gettime (CLOCK_MONOTONIC_RAW, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+
+/* A thread that ends gives its ring back. Its events stay until they are
+	overwritten by those of the thread that takes the ring over next. */
+
+static void ring_release (void *arg)
+{
+trace_ring *r = (trace_ring*)arg;
+
+
+	pthread_mutex_lock (&rings_lock);
+	r->busy = 0;
+	pthread_mutex_unlock (&rings_lock);
+}
+
+
+static void ring_key_create (void)
+{
+	pthread_key_create (&ring_key, ring_release);
+}
+
+
+/* The calling thread's ring, on its first event: one that a thread which
+	has ended gave back, else a new one. The encoder and writer threads of
+	each frame are short-lived, so rings are only made for as many threads
+	as run at the same time. NULL if out of memory. */
+
+static trace_ring *thread_ring (void)
+{
+trace_ring *r;
+
+
+	if (my_ring) return my_ring;
+	pthread_once (&ring_key_once, ring_key_create);
+
+	pthread_mutex_lock (&rings_lock);
+	for (r=rings; r && r->busy; r=r->next)
+		;
+	if (!r)
+	{
+		r = malloc (sizeof (trace_ring));
+		if (!r)
+		{
+			pthread_mutex_unlock (&rings_lock);
+			return NULL;
+		}
+		r->head = 0;
+		r->next = rings;
+		rings = r;
+	}
+	r->busy = 1;
+	r->tid = (int)syscall (SYS_gettid);
+	r->name = NULL;
+	pthread_mutex_unlock (&rings_lock);
+
+	pthread_setspecific (ring_key, r);
+	my_ring = r;
+	return r;
+}
+
+
+
+void trace_start (void)
+{
+	t_start = now_ns ();
+	trace_on = 1;
+	trace_thread_name ("main");
+}
+
+
+/* Record an event in the calling thread's ring. Use the TRACE_ macros,
+	which skip this when tracing is off or compiled out. */
+
+void trace_event (char phase, const char *name, int32_t arg)
+{
+trace_ring *r;
+trace_rec *e;
+
+
+	r = thread_ring ();
+	if (!r) return;
+	e = &r->ev[r->head & (TRACE_RING_EVENTS - 1)];
+	e->ts = now_ns ();
+	e->name = name;
+	e->arg = arg;
+	e->tid = r->tid;
+	e->phase = phase;
+	__atomic_store_n (&r->head, r->head + 1, __ATOMIC_RELEASE);
+}
+
+
+/* Name the calling thread in the trace, e.g. "writer". The name is also
+	recorded as an event, for when another thread owns the ring by the time
+	it is written out. */
+
+void trace_thread_name (const char *name)
+{
+trace_ring *r;
+
+
+	if (!trace_on) return;
+	r = thread_ring ();
+	if (!r) return;
+	r->name = name;
+	trace_event ('M', name, 0);
+}
+
+
+
+/* Write all rings to fname as Chrome trace JSON, timestamps in microseconds
+	from trace_start(). Returns 0 or -1. */
+
+int trace_write (const char *fname)
+{
+trace_ring *r;
+trace_rec *e;
+uint64_t head, first, k, lost;
+FILE *fp;
+int pid, sep;
+
+
+	if (!trace_on) return 0;
+	fp = fopen (fname, "w");
+	if (!fp) return -1;
+
+	pid = (int)getpid ();
+	lost = 0;
+	sep = 0;
+	fprintf (fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+
+	pthread_mutex_lock (&rings_lock);
+	for (r=rings; r; r=r->next)
+	{
+		if (r->name)
+		{
+			fprintf (fp, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+				sep ? ",\n" : "", pid, r->tid, r->name);
+			sep = 1;
+		}
+
+		head = __atomic_load_n (&r->head, __ATOMIC_ACQUIRE);
+		first = (head > TRACE_RING_EVENTS) ? head - TRACE_RING_EVENTS : 0;
+		lost += first;
+		for (k=first; k<head; k++)
+		{
+			e = &r->ev[k & (TRACE_RING_EVENTS - 1)];
+			if (e->phase == 'M')
+			{
+				if (e->tid != r->tid || !r->name)
+					fprintf (fp, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+						sep ? ",\n" : "", pid, e->tid, e->name);
+				sep = 1;
+				continue;
+			}
+			fprintf (fp, "%s{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":%d,\"tid\":%d",
+				sep ? ",\n" : "", e->name, e->phase, (e->ts - t_start) * 1e-3, pid, e->tid);
+			if (e->phase == 'i')
+				fprintf (fp, ",\"s\":\"t\",\"args\":{\"v\":%d}", e->arg);
+			else if (e->phase == 'C')
+				fprintf (fp, ",\"args\":{\"%s\":%d}", e->name, e->arg);
+			fputc ('}', fp);
+			sep = 1;
+		}
+	}
+	pthread_mutex_unlock (&rings_lock);
+
+	fprintf (fp, "\n]}\n");
+	if (lost)
+		fprintf (stderr, "Trace: %llu early events overwritten, see TRACE_RING_EVENTS\n", (unsigned long long)lost);
+
+	return fclose (fp) ? -1 : 0;
+}
@@ -0,0 +1,53 @@
+#ifndef __TRACE_H
+#define __TRACE_H
+
+#include <stdint.h>
+
+
+/* Structured tracing (--trace): begin/end spans and instant or counter
+	events, timestamped with CLOCK_MONOTONIC_RAW and kept as binary records
+	in a ring per thread, written out as Chrome trace JSON at the end of the
+	run (chrome://tracing or ui.perfetto.dev).
+
+	Trace points have a level. Those above TRACE_LEVEL (compile with
+	-DTRACE_LEVEL=n) are removed by the compiler; the others cost one test
+	of trace_on while tracing is off.
+		1	per frame: acquire, save, encode, write, LED switching, steps
+		2	within a frame: TIFF strips, PNG bands, calibration, statistics
+
+	Each thread only ever writes its own ring, so recording takes no lock.
+	A full ring overwrites its oldest events. The ring of a thread that has
+	ended is taken over by the next new thread, so that the encoder and
+	writer threads started for each frame need no more rings than run at a
+	time; its events remain until they are overwritten. Names must be
+	string literals (or otherwise live as long as the program), only the
+	pointer is kept.
+	trace_write() is meant for the end of a run, when the threads that
+	record have stopped or are idle.
+*/
+
+#ifndef TRACE_LEVEL
+#define TRACE_LEVEL			1
+#endif
+
+#define TRACE_RING_EVENTS	65536		/* Per thread, a power of two */
+
+extern int trace_on;
+
+
+#define TRACE_EVENT(level, ph, name, arg) \
+	do { if ((level) <= TRACE_LEVEL && trace_on) trace_event (ph, name, arg); } while (0)
+
+#define TRACE_BEGIN(level, name)			TRACE_EVENT (level, 'B', name, 0)
+#define TRACE_END(level, name)				TRACE_EVENT (level, 'E', name, 0)
+#define TRACE_INSTANT(level, name, arg)		TRACE_EVENT (level, 'i', name, arg)
+#define TRACE_COUNTER(level, name, value)	TRACE_EVENT (level, 'C', name, value)
+
+
+void trace_start (void);
+void trace_event (char phase, const char *name, int32_t arg);
+void trace_thread_name (const char *name);
+int trace_write (const char *fname);
+
+
+#endif